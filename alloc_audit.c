@@ -0,0 +1,88 @@
+#include <execinfo.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "alloc_audit.h"
+
+#define ALLOC_AUDIT_MAX_FRAMES 32
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pBlock, size_t size);
+void __real_free(void* pBlock);
+
+static atomic_bool s_isArmed = false;
+static atomic_ulong s_numAllocations = 0;
+static atomic_ulong s_numFrees = 0;
+// Where the first heap operation while armed came from.
+static atomic_flag s_hasFirstBacktrace = ATOMIC_FLAG_INIT;
+static void* s_firstBacktrace[ALLOC_AUDIT_MAX_FRAMES];
+static int s_numFirstFrames = 0;
+
+static void recordOperation(atomic_ulong* pCount)
+{
+    if (!atomic_load_explicit(&s_isArmed, memory_order_relaxed)) {
+        return;
+    }
+    atomic_fetch_add_explicit(pCount, 1, memory_order_relaxed);
+    if (!atomic_flag_test_and_set(&s_hasFirstBacktrace)) {
+        s_numFirstFrames = backtrace(s_firstBacktrace, ALLOC_AUDIT_MAX_FRAMES);
+    }
+}
+
+void* __wrap_malloc(size_t size)
+{
+    recordOperation(&s_numAllocations);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    recordOperation(&s_numAllocations);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pBlock, size_t size)
+{
+    recordOperation(&s_numAllocations);
+    return __real_realloc(pBlock, size);
+}
+
+void __wrap_free(void* pBlock)
+{
+    if (pBlock != NULL) {
+        recordOperation(&s_numFrees);
+    }
+    __real_free(pBlock);
+}
+
+void AllocAudit_arm()
+{
+    // The first backtrace loads the unwinder, which allocates, so get that out of
+    // the way now.
+    void* frames[1];
+    backtrace(frames, 1);
+    atomic_store(&s_isArmed, true);
+}
+
+void AllocAudit_disarm()
+{
+    atomic_store(&s_isArmed, false);
+}
+
+unsigned long AllocAudit_report()
+{
+    unsigned long numAllocations = atomic_load(&s_numAllocations);
+    unsigned long numFrees = atomic_load(&s_numFrees);
+    fprintf(stderr, "Allocation audit: %lu allocations and %lu frees after warm-up\n",
+            numAllocations, numFrees);
+    if (s_numFirstFrames > 0) {
+        fputs("The first one came from:\n", stderr);
+        fflush(stderr);
+        backtrace_symbols_fd(s_firstBacktrace, s_numFirstFrames, STDERR_FILENO);
+    }
+    return numAllocations + numFrees;
+}
@@ -0,0 +1,24 @@
+#ifndef _ALLOC_AUDIT_H
+#define _ALLOC_AUDIT_H
+
+/*
+ * Counts the heap operations made while armed, to check that the message pipeline
+ * doesn't touch the heap once it has warmed up.
+ *
+ * Only linked into the audit build (`make audit`), which links with
+ * -Wl,--wrap=malloc and the like so that the calls our own code makes to malloc,
+ * calloc, realloc and free come here first. Calls made inside libc, such as for
+ * stdio buffers, aren't wrapped.
+ */
+
+void AllocAudit_arm();
+
+void AllocAudit_disarm();
+
+/*
+ * Prints how many heap operations there were while armed, and where the first one
+ * came from. Returns that count.
+ */
+unsigned long AllocAudit_report();
+
+#endif // _ALLOC_AUDIT_H
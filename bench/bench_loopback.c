@@ -0,0 +1,746 @@
+/*
+ * Loopback load generator for the whole message pipeline.
+ *
+ * Runs two-chat talking to itself on one socket over 127.0.0.1, with UDP unless
+ * --shm=auto is given. A generator thread types timestamped lines into the keyboard
+ * reader through a pipe on stdin, and a collector thread reads what the screen
+ * printer writes to stdout through another pipe, recording when each line arrives.
+ * Prints throughput, latency percentiles and the drop rate as one JSON object on the
+ * last line (and appends it to out=FILE if given).
+ *
+ * usage: ./bench_loopback [count=N] [size=N] [rate=N] [port=N] [netem=SETTINGS] [out=FILE]
+ *                         [-- two-chat options]
+ *   count  lines to send (default: 100000)
+ *   size   bytes per line with its newline, at least 40 (default: 256)
+ *   rate   lines per second, 0 for as fast as possible (default: 0)
+ *   port   UDP port to use on 127.0.0.1 (default: 45000)
+ *   netem  impairments separated by commas, e.g. netem=loss=1,delay-ms=20. The
+ *          messages then go through the netem-proxy forwarder on port+1.
+ * Anything after "--" is parsed like the two-chat options, e.g. --rate-bytes=10m.
+ * The keyboard reader sends what each read of stdin returns as one message, so a
+ * message can hold several lines, and with --gso a long one arrives as several
+ * datagrams. A line counts as received when it comes out of the printer whole.
+ * With --jsonl, the lines are typed as send commands and read back out of the message
+ * events. With --tui, stdin and stdout are a pseudo-terminal whose screen can't be
+ * read back, so only the number of lines the UI received is reported, without
+ * latencies.
+ *
+ * Built as bench_loopback_audit by `make audit`, it also counts every malloc and free
+ * made by the pipeline after the first WARM_UP_MESSAGES lines, and fails if there
+ * were any.
+ */
+#define _XOPEN_SOURCE 700
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common.h"
+#include "../keyboard_reader.h"
+#include "../screen_printer.h"
+#include "../message_sender.h"
+#include "../message_listener.h"
+#include "../options.h"
+#include "../netem.h"
+#include "../trace.h"
+#include "../resolver.h"
+#include "../timer_wheel.h"
+#include "../keepalive.h"
+#include "../tui.h"
+#include "../jsonl.h"
+#ifdef ALLOC_AUDIT
+#include "../alloc_audit.h"
+#endif
+
+// Sequence number and send time, both as 16 hex digits followed by a space.
+#define PAYLOAD_HEADER_LEN 34
+#define MIN_MESSAGE_SIZE 40
+// How long to wait for lines still in flight before typing the termination line.
+#define DRAIN_TIME_NS 200000000ULL
+#define MAX_PASSTHROUGH_ARGS 64
+// Lines typed before the allocation audit starts counting, or a tenth of them if
+// that is fewer.
+#define WARM_UP_MESSAGES 1000
+// How often the collector checks whether the pipeline has shut down.
+#define COLLECT_POLL_INTERVAL_MS 100
+// A line typed with --jsonl is the payload line in a send command.
+#define JSONL_SEND_PREFIX "{\"cmd\":\"send\",\"text\":\""
+#define JSONL_SEND_SUFFIX "\\n\"}\n"
+
+typedef enum {
+    OUTPUT_PLAIN,
+    OUTPUT_JSONL,
+    OUTPUT_TUI
+} OutputMode;
+
+/*
+ * Gathers a stream of text into lines.
+ */
+typedef struct LineSplitter_s LineSplitter;
+struct LineSplitter_s {
+    char* pLine;
+    // Not counting the \0 character ending the line.
+    size_t capacity;
+    size_t length;
+};
+
+static unsigned long s_numToSend = 100000;
+static size_t s_sizeOfMessage = 256;
+static unsigned long s_messagesPerSec = 0;
+static in_port_t s_port = 45000;
+static const char* s_pOutPath = NULL;
+static const char* s_pNetemSettings = NULL;
+static NetemConfig s_netemConfig;
+static unsigned long s_numWarmUpMessages = WARM_UP_MESSAGES;
+static OutputMode s_outputMode = OUTPUT_PLAIN;
+
+// The write end of stdin, the read end of stdout, and the stdin and stdout the
+// program was started with, which the results go to.
+static int s_inputFd = -1;
+static int s_outputFd = -1;
+static int s_savedStdinFd = -1;
+static int s_resultFd = -1;
+static atomic_bool s_isPipelineDone = false;
+
+// Written by the generator thread.
+static char s_line[sizeof(JSONL_SEND_PREFIX) + MSG_MAX_LEN + sizeof(JSONL_SEND_SUFFIX)];
+static size_t s_lineLength = 0;
+static size_t s_payloadOffset = 0;
+static unsigned long s_numGenerated = 0;
+static uint64_t s_firstSendNs = 0;
+static uint64_t s_lastSendNs = 0;
+
+// Written by the collector thread.
+static char s_readBuffer[64 * 1024];
+static char s_outputLineBuffer[JSONL_MAX_LINE_LEN + 1];
+static LineSplitter s_outputLines = {s_outputLineBuffer, JSONL_MAX_LINE_LEN, 0};
+static char s_textLineBuffer[LISTENER_MAX_TEXT_LEN + 1];
+static LineSplitter s_textLines = {s_textLineBuffer, LISTENER_MAX_TEXT_LEN, 0};
+static size_t s_numLeaveMatched = 0;
+static uint64_t s_lastReadNs = 0;
+static uint64_t* s_pLatenciesNs = NULL;
+static unsigned char* s_pIsReceived = NULL;
+static unsigned long s_numReceived = 0;
+static unsigned long s_numLatencies = 0;
+static unsigned long s_numDuplicates = 0;
+static unsigned long s_numMalformed = 0;
+static uint64_t s_lastReceiveNs = 0;
+
+static void sleepUntil(uint64_t releaseNs)
+{
+    struct timespec releaseTime = {
+        .tv_sec = (time_t) (releaseNs / 1000000000ULL),
+        .tv_nsec = (long) (releaseNs % 1000000000ULL)
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &releaseTime, NULL);
+}
+
+static bool writeAll(int fd, const char* pText, size_t length)
+{
+    while (length > 0) {
+        ssize_t numWritten = write(fd, pText, length);
+        if (numWritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        pText += numWritten;
+        length -= (size_t) numWritten;
+    }
+    return true;
+}
+
+/*
+ * Fills s_line with a line of s_sizeOfMessage bytes as it is typed in the output
+ * mode, leaving the header to be written for each one.
+ */
+static void prepareLine()
+{
+    size_t length = 0;
+    if (s_outputMode == OUTPUT_JSONL) {
+        length = strlen(JSONL_SEND_PREFIX);
+        memcpy(s_line, JSONL_SEND_PREFIX, length);
+    }
+    s_payloadOffset = length;
+    memset(s_line + length, 'x', s_sizeOfMessage - 1);
+    length += s_sizeOfMessage - 1;
+    if (s_outputMode == OUTPUT_JSONL) {
+        memcpy(s_line + length, JSONL_SEND_SUFFIX, strlen(JSONL_SEND_SUFFIX));
+        length += strlen(JSONL_SEND_SUFFIX);
+    } else {
+        // The terminal UI takes the enter key, not a newline.
+        s_line[length++] = s_outputMode == OUTPUT_TUI ? '\r' : '\n';
+    }
+    s_lineLength = length;
+}
+
+/*
+ * Types the lines into the keyboard reader at the rate, then the termination line
+ * once the last ones have had time to arrive.
+ */
+static void* runGenerator(void* stub)
+{
+    while (s_numGenerated < s_numToSend) {
+#ifdef ALLOC_AUDIT
+        if (s_numGenerated == s_numWarmUpMessages) {
+            AllocAudit_arm();
+        }
+#endif
+        if (s_messagesPerSec > 0 && s_numGenerated > 0) {
+            sleepUntil(s_firstSendNs + s_numGenerated * 1000000000ULL / s_messagesPerSec);
+        }
+
+        uint64_t nowNs = getMonotonicTimeNs();
+        if (s_numGenerated == 0) {
+            s_firstSendNs = nowNs;
+        }
+        s_lastSendNs = nowNs;
+        char* pPayload = s_line + s_payloadOffset;
+        snprintf(pPayload, PAYLOAD_HEADER_LEN + 1, "%016llx %016llx ",
+                 (unsigned long long) s_numGenerated, (unsigned long long) nowNs);
+        // snprintf ends the header with a \0, which would cut the line short.
+        pPayload[PAYLOAD_HEADER_LEN] = 'x';
+        if (!writeAll(s_inputFd, s_line, s_lineLength)) {
+            return NULL;
+        }
+        s_numGenerated++;
+    }
+
+    sleepUntil(getMonotonicTimeNs() + DRAIN_TIME_NS);
+    while (s_pNetemSettings != NULL && Netem_getNumQueued() > 0) {
+        // Wait out the delays of the datagrams still held by the forwarder.
+        sleepUntil(getMonotonicTimeNs() + DRAIN_TIME_NS / 10);
+    }
+#ifdef ALLOC_AUDIT
+    // Shutting down frees everything.
+    AllocAudit_disarm();
+#endif
+    const char* pTerminationLine = s_outputMode == OUTPUT_JSONL ? "{\"cmd\":\"quit\"}\n"
+                                   : s_outputMode == OUTPUT_TUI ? "!\r" : "!\n";
+    writeAll(s_inputFd, pTerminationLine, strlen(pTerminationLine));
+    return NULL;
+}
+
+/*
+ * Passes on a line that the program printed, and that isn't a received one.
+ */
+static void passThrough(const char* pLine, size_t length)
+{
+    writeAll(s_resultFd, pLine, length);
+    writeAll(s_resultFd, "\n", 1);
+}
+
+/*
+ * Returns true if the line starts with the header the generator writes: two numbers
+ * of 16 lowercase hex digits, each followed by a space.
+ */
+static bool hasPayloadHeader(const char* pLine, size_t length)
+{
+    if (length < PAYLOAD_HEADER_LEN) {
+        return false;
+    }
+    size_t i;
+    for (i = 0; i < PAYLOAD_HEADER_LEN; i++) {
+        char c = pLine[i];
+        bool isSeparator = i == PAYLOAD_HEADER_LEN / 2 - 1 || i == PAYLOAD_HEADER_LEN - 1;
+        bool isHexDigit = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+        if (isSeparator ? c != ' ' : !isHexDigit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Records a line of received text, without its newline.
+ */
+static void collectTextLine(char* pLine, size_t length)
+{
+    unsigned long long sequenceNumber;
+    unsigned long long sendNs;
+    if (length == 1 && pLine[0] == '!') {
+        // The termination line.
+        return;
+    }
+    if (!hasPayloadHeader(pLine, length)) {
+        if (s_outputMode == OUTPUT_PLAIN && (length == 0 || strspn(pLine, "x") != length)) {
+            // Something the program printed, such as an error notice or its stats.
+            passThrough(pLine, length);
+        } else {
+            // The rest of a line whose header was lost with a dropped datagram.
+            s_numMalformed++;
+        }
+    } else if (length != s_sizeOfMessage - 1
+               || sscanf(pLine, "%16llx %16llx ", &sequenceNumber, &sendNs) != 2
+               || sequenceNumber >= s_numToSend) {
+        // Pieces of lines that lost their other part to a dropped datagram.
+        s_numMalformed++;
+    } else if (s_pIsReceived[sequenceNumber]) {
+        s_numDuplicates++;
+    } else {
+        s_pIsReceived[sequenceNumber] = 1;
+        s_pLatenciesNs[s_numLatencies++] = s_lastReadNs - sendNs;
+        s_numReceived++;
+        s_lastReceiveNs = s_lastReadNs;
+    }
+}
+
+/*
+ * Takes the bytes up to each newline into the splitter's buffer, and hands each
+ * line to onLine without its newline, ending in a \0 character instead. Bytes past
+ * the capacity are dropped.
+ */
+static void splitLines(LineSplitter* pSplitter, const char* pText, size_t length,
+                       void (*onLine)(char* pLine, size_t length))
+{
+    while (length > 0) {
+        const char* pNewline = memchr(pText, '\n', length);
+        size_t numBytes = pNewline != NULL ? (size_t) (pNewline - pText) : length;
+        size_t numKept = numBytes;
+        if (pSplitter->length + numKept > pSplitter->capacity) {
+            numKept = pSplitter->capacity - pSplitter->length;
+        }
+        memcpy(pSplitter->pLine + pSplitter->length, pText, numKept);
+        pSplitter->length += numKept;
+        if (pNewline == NULL) {
+            return;
+        }
+        pSplitter->pLine[pSplitter->length] = '\0';
+        onLine(pSplitter->pLine, pSplitter->length);
+        pSplitter->length = 0;
+        pText += numBytes + 1;
+        length -= numBytes + 1;
+    }
+}
+
+/*
+ * Unescapes the text of a message event in place, and returns its length. The
+ * payload lines only need \n; other escapes are kept as the character after the \.
+ */
+static size_t unescapeJsonText(char* pText, size_t length)
+{
+    size_t outLength = 0;
+    size_t i;
+    for (i = 0; i < length && pText[i] != '"'; i++) {
+        if (pText[i] == '\\' && i + 1 < length) {
+            i++;
+            pText[outLength++] = pText[i] == 'n' ? '\n' : pText[i];
+        } else {
+            pText[outLength++] = pText[i];
+        }
+    }
+    return outLength;
+}
+
+/*
+ * Records the text of a JSON message event, and passes the other events on.
+ */
+static void collectJsonLine(char* pLine, size_t length)
+{
+    static const char textKey[] = "\"text\":\"";
+    char* pText = strstr(pLine, textKey);
+    if (strncmp(pLine, "{\"event\":\"message\"", 18) != 0 || pText == NULL) {
+        passThrough(pLine, length);
+        return;
+    }
+    pText += sizeof(textKey) - 1;
+    size_t textLength = unescapeJsonText(pText, length - (size_t) (pText - pLine));
+    splitLines(&s_textLines, pText, textLength, collectTextLine);
+}
+
+/*
+ * Passes on what the program prints after the terminal UI has left the screen, and
+ * takes the number of lines received from the UI's stats.
+ */
+static void collectTuiStatsLine(char* pLine, size_t length)
+{
+    if (length > 0 && pLine[length - 1] == '\r') {
+        pLine[--length] = '\0';
+    }
+    if (sscanf(pLine, "TUI: %lu lines received", &s_numReceived) == 1 && s_numReceived > 0) {
+        // Less the termination line, which is all but never lost after the drain time.
+        s_numReceived--;
+    }
+    passThrough(pLine, length);
+}
+
+/*
+ * Skips the frames of the terminal UI, which can't be read back into lines.
+ */
+static void collectTuiOutput(const char* pOutput, size_t length)
+{
+    static const char leaveAlternateScreen[] = "\x1b[?1049l";
+    size_t i;
+    for (i = 0; i < length && s_numLeaveMatched < sizeof(leaveAlternateScreen) - 1; i++) {
+        if (pOutput[i] == leaveAlternateScreen[s_numLeaveMatched]) {
+            s_numLeaveMatched++;
+        } else {
+            s_numLeaveMatched = pOutput[i] == leaveAlternateScreen[0] ? 1 : 0;
+        }
+    }
+    splitLines(&s_outputLines, pOutput + i, length - i, collectTuiStatsLine);
+}
+
+/*
+ * Reads what the screen printer writes until the pipeline has shut down and there
+ * is nothing more to read.
+ */
+static void* runCollector(void* stub)
+{
+    struct pollfd pollFd = {.fd = s_outputFd, .events = POLLIN};
+    while (1) {
+        int numReady = poll(&pollFd, 1, COLLECT_POLL_INTERVAL_MS);
+        if (numReady == -1 && errno == EINTR) {
+            continue;
+        }
+        if (numReady == 0 && !atomic_load(&s_isPipelineDone)) {
+            continue;
+        }
+        if (numReady <= 0) {
+            break;
+        }
+        ssize_t numRead = read(s_outputFd, s_readBuffer, sizeof(s_readBuffer));
+        if (numRead <= 0) {
+            // The pseudo-terminal reads as an error once nothing has it open.
+            break;
+        }
+        s_lastReadNs = getMonotonicTimeNs();
+        if (s_outputMode == OUTPUT_JSONL) {
+            splitLines(&s_outputLines, s_readBuffer, (size_t) numRead, collectJsonLine);
+        } else if (s_outputMode == OUTPUT_TUI) {
+            collectTuiOutput(s_readBuffer, (size_t) numRead);
+        } else {
+            splitLines(&s_textLines, s_readBuffer, (size_t) numRead, collectTextLine);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Points stdin at the generator and stdout at the collector: pipes, or both at a
+ * pseudo-terminal for the terminal UI. What they were is kept to put back.
+ */
+static bool redirectStdio()
+{
+    fflush(stdout);
+    s_savedStdinFd = dup(STDIN_FILENO);
+    s_resultFd = dup(STDOUT_FILENO);
+    if (s_savedStdinFd == -1 || s_resultFd == -1) {
+        fprintf(stderr, "Failed to keep stdin and stdout: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (s_outputMode == OUTPUT_TUI) {
+        int terminalFd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (terminalFd == -1 || grantpt(terminalFd) == -1 || unlockpt(terminalFd) == -1) {
+            fprintf(stderr, "Failed to open a pseudo-terminal: %s\n", strerror(errno));
+            return false;
+        }
+        int userFd = open(ptsname(terminalFd), O_RDWR | O_NOCTTY);
+        if (userFd == -1) {
+            fprintf(stderr, "Failed to open the pseudo-terminal: %s\n", strerror(errno));
+            return false;
+        }
+        dup2(userFd, STDIN_FILENO);
+        dup2(userFd, STDOUT_FILENO);
+        close(userFd);
+        s_inputFd = terminalFd;
+        s_outputFd = terminalFd;
+        return true;
+    }
+
+    int inputPipe[2];
+    int outputPipe[2];
+    if (pipe(inputPipe) == -1 || pipe(outputPipe) == -1) {
+        fprintf(stderr, "Failed to create the pipes: %s\n", strerror(errno));
+        return false;
+    }
+    dup2(inputPipe[0], STDIN_FILENO);
+    close(inputPipe[0]);
+    s_inputFd = inputPipe[1];
+    dup2(outputPipe[1], STDOUT_FILENO);
+    close(outputPipe[1]);
+    s_outputFd = outputPipe[0];
+    return true;
+}
+
+static void restoreStdio()
+{
+    fflush(stdout);
+    dup2(s_savedStdinFd, STDIN_FILENO);
+    dup2(s_resultFd, STDOUT_FILENO);
+    close(s_savedStdinFd);
+}
+
+static int compareLatencies(const void* pLeft, const void* pRight)
+{
+    uint64_t left = *(const uint64_t*) pLeft;
+    uint64_t right = *(const uint64_t*) pRight;
+    return (left > right) - (left < right);
+}
+
+static double getPercentileUs(double percentile)
+{
+    if (s_numLatencies == 0) {
+        return 0;
+    }
+    unsigned long index = (unsigned long) (percentile * s_numLatencies);
+    if (index >= s_numLatencies) {
+        index = s_numLatencies - 1;
+    }
+    return (double) s_pLatenciesNs[index] / 1e3;
+}
+
+static void printResults()
+{
+    static const char* const outputNames[] = {"plain", "jsonl", "tui"};
+    qsort(s_pLatenciesNs, s_numLatencies, sizeof(uint64_t), compareLatencies);
+
+    uint64_t endNs = s_lastReceiveNs > s_lastSendNs ? s_lastReceiveNs : s_lastSendNs;
+    double durationSec = (double) (endNs - s_firstSendNs) / 1e9;
+    if (durationSec <= 0) {
+        durationSec = 1e-9;
+    }
+    double dropRate = s_numReceived < s_numGenerated
+                      ? (double) (s_numGenerated - s_numReceived) / s_numGenerated : 0;
+
+    char result[1024];
+    snprintf(result, sizeof(result),
+             "{\"bench\":\"loopback\",\"output\":\"%s\",\"count\":%lu,\"size\":%zu,"
+             "\"rate\":%lu,\"sent\":%lu,\"received\":%lu,\"duplicates\":%lu,"
+             "\"malformed\":%lu,"
+             "\"drop_rate\":%.6f,\"duration_s\":%.6f,\"msgs_per_sec\":%.1f,"
+             "\"mbytes_per_sec\":%.3f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+             "\"max_us\":%.1f}",
+             outputNames[s_outputMode], s_numToSend, s_sizeOfMessage, s_messagesPerSec,
+             s_numGenerated, s_numReceived, s_numDuplicates, s_numMalformed,
+             dropRate, durationSec, s_numReceived / durationSec,
+             s_numReceived * (double) s_sizeOfMessage / durationSec / 1e6,
+             getPercentileUs(0.5), getPercentileUs(0.99), getPercentileUs(0.999),
+             getPercentileUs(1.0));
+    if (s_pNetemSettings != NULL) {
+        // Replace the closing brace with what the forwarder did.
+        NetemStats netemStats;
+        Netem_getStats(&netemStats);
+        size_t length = strlen(result) - 1;
+        snprintf(result + length, sizeof(result) - length,
+                 ",\"netem\":\"%s\",\"netem_lost\":%lu,\"netem_duplicated\":%lu,"
+                 "\"netem_reordered\":%lu,\"netem_overflowed\":%lu}",
+                 s_pNetemSettings, netemStats.numLost, netemStats.numDuplicated,
+                 netemStats.numReordered, netemStats.numOverflowed);
+    }
+    printf("%s\n", result);
+
+    if (s_pOutPath != NULL) {
+        FILE* pOutFile = fopen(s_pOutPath, "a");
+        if (pOutFile == NULL) {
+            fprintf(stderr, "Failed to open %s\n", s_pOutPath);
+            return;
+        }
+        fprintf(pOutFile, "%s\n", result);
+        fclose(pOutFile);
+    }
+}
+
+static void printUsage()
+{
+    fputs("usage: ./bench_loopback [count=N] [size=N] [rate=N] [port=N] [netem=SETTINGS] "
+          "[out=FILE] [-- two-chat options]\n", stderr);
+}
+
+/*
+ * Parses comma separated impairment settings into s_netemConfig.
+ */
+static bool parseNetemSettings(const char* pSettings)
+{
+    char settings[256];
+    if (strlen(pSettings) >= sizeof(settings)) {
+        return false;
+    }
+    strcpy(settings, pSettings);
+    Netem_initConfig(&s_netemConfig);
+    char* pSavePtr = NULL;
+    char* pSetting;
+    for (pSetting = strtok_r(settings, ",", &pSavePtr); pSetting != NULL;
+         pSetting = strtok_r(NULL, ",", &pSavePtr)) {
+        if (!Netem_parseSetting(&s_netemConfig, pSetting)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Parses the key=value arguments, and builds a two-chat command line out of the
+ * rest for Options_parse.
+ */
+static bool parseArgs(int argCount, char** args, int* pOptionsArgCount, char** optionsArgs)
+{
+    static char portArg[16];
+    int numOptionsArgs = 0;
+    optionsArgs[numOptionsArgs++] = args[0];
+    // The shared-memory ring would take over from UDP on 127.0.0.1, unless the
+    // options after "--" ask for it.
+    optionsArgs[numOptionsArgs++] = "--shm=off";
+
+    int i;
+    for (i = 1; i < argCount; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            for (i++; i < argCount && numOptionsArgs < MAX_PASSTHROUGH_ARGS + 2; i++) {
+                optionsArgs[numOptionsArgs++] = args[i];
+            }
+            break;
+        }
+        char* pValue = strchr(args[i], '=');
+        if (pValue == NULL) {
+            return false;
+        }
+        pValue++;
+        if (strncmp(args[i], "count=", 6) == 0) {
+            s_numToSend = strtoul(pValue, NULL, 10);
+        } else if (strncmp(args[i], "size=", 5) == 0) {
+            s_sizeOfMessage = strtoul(pValue, NULL, 10);
+        } else if (strncmp(args[i], "rate=", 5) == 0) {
+            s_messagesPerSec = strtoul(pValue, NULL, 10);
+        } else if (strncmp(args[i], "port=", 5) == 0) {
+            s_port = (in_port_t) strtoul(pValue, NULL, 10);
+        } else if (strncmp(args[i], "out=", 4) == 0) {
+            s_pOutPath = pValue;
+        } else if (strncmp(args[i], "netem=", 6) == 0) {
+            s_pNetemSettings = pValue;
+        } else {
+            return false;
+        }
+    }
+    if (s_numToSend == 0 || s_sizeOfMessage < MIN_MESSAGE_SIZE
+        || s_sizeOfMessage >= MSG_MAX_LEN || s_port == 65535) {
+        return false;
+    }
+    if (s_pNetemSettings != NULL && !parseNetemSettings(s_pNetemSettings)) {
+        return false;
+    }
+    if (s_numToSend / 10 < s_numWarmUpMessages) {
+        s_numWarmUpMessages = s_numToSend / 10;
+    }
+
+    snprintf(portArg, sizeof(portArg), "%u", (unsigned int) s_port);
+    optionsArgs[numOptionsArgs++] = portArg;
+    optionsArgs[numOptionsArgs++] = "127.0.0.1";
+    optionsArgs[numOptionsArgs++] = portArg;
+    optionsArgs[numOptionsArgs] = NULL;
+    *pOptionsArgCount = numOptionsArgs;
+    return true;
+}
+
+int main(int argCount, char** args)
+{
+    uint64_t startNs = getMonotonicTimeNs();
+    char* optionsArgs[MAX_PASSTHROUGH_ARGS + 6];
+    int optionsArgCount = 0;
+    if (!parseArgs(argCount, args, &optionsArgCount, optionsArgs)) {
+        printUsage();
+        return 1;
+    }
+    if (!Options_parse(optionsArgCount, optionsArgs)) {
+        return 1;
+    }
+    const Options* pOptions = Options_get();
+    s_outputMode = pOptions->isJsonlEnabled ? OUTPUT_JSONL
+                   : pOptions->isTuiEnabled ? OUTPUT_TUI : OUTPUT_PLAIN;
+
+    s_pLatenciesNs = malloc(sizeof(uint64_t) * s_numToSend);
+    s_pIsReceived = calloc(s_numToSend, 1);
+    if (s_pLatenciesNs == NULL || s_pIsReceived == NULL) {
+        fputs("Not enough memory for the results\n", stderr);
+        return 1;
+    }
+    prepareLine();
+
+    if (getSocketFdOrCreateAndBindIfDoesntExist(s_port) == -1) {
+        return 1;
+    }
+
+    // With impairments, the messages take a detour through the forwarder on the
+    // next port, which sends them back to this socket.
+    in_port_t destinationPort = s_port;
+    if (s_pNetemSettings != NULL) {
+        struct sockaddr_in sinSelf;
+        memset(&sinSelf, 0, sizeof(sinSelf));
+        sinSelf.sin_family = AF_INET;
+        sinSelf.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sinSelf.sin_port = htons(s_port);
+        destinationPort = s_port + 1;
+        if (!Netem_start(&s_netemConfig, destinationPort, &sinSelf, &sinSelf)) {
+            return 1;
+        }
+    }
+
+    if (!redirectStdio()) {
+        return 1;
+    }
+    if (s_outputMode == OUTPUT_JSONL && !Jsonl_init(pOptions->pRemoteHostname, destinationPort)) {
+        restoreStdio();
+        return 1;
+    }
+    pthread_t collectorPid;
+    pthread_create(&collectorPid, NULL, runCollector, NULL);
+
+    // The same start as two-chat's.
+    if (pOptions->pTracePath != NULL) {
+        Trace_init(pOptions->pTracePath, pOptions->traceEventsPerThread);
+    }
+    initBarriers();
+    bool isStarted = TimerWheel_init();
+    if (isStarted && s_outputMode == OUTPUT_TUI && !Tui_init()) {
+        TimerWheel_shutdown();
+        isStarted = false;
+    }
+    pthread_t generatorPid;
+    if (isStarted) {
+        KeyboardReader_init();
+        ScreenPrinter_init();
+        Sender_init(s_port, destinationPort);
+        Listener_init(s_port);
+        Keepalive_init();
+        if (!Resolver_init(pOptions->pRemoteHostname, destinationPort, startNs)) {
+            requestShutdownOfAllThreadsForProgram();
+        }
+        pthread_create(&generatorPid, NULL, runGenerator, NULL);
+        waitForShutdownOfAllThreads();
+        // Only still typing if the pipeline shut down early.
+        pthread_cancel(generatorPid);
+        pthread_join(generatorPid, NULL);
+    }
+
+    restoreStdio();
+    atomic_store(&s_isPipelineDone, true);
+    pthread_join(collectorPid, NULL);
+    close(s_inputFd);
+    if (s_outputFd != s_inputFd) {
+        close(s_outputFd);
+    }
+    if (!isStarted) {
+        fputs("Failed to start the pipeline\n", stderr);
+        return 1;
+    }
+
+    printResults();
+    Netem_stop();
+
+    free(s_pLatenciesNs);
+    free(s_pIsReceived);
+#ifdef ALLOC_AUDIT
+    if (AllocAudit_report() > 0) {
+        return 1;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,599 @@
+/*
+ * Microbenchmarks for the pieces of the message pipeline that run once per message.
+ * Prints one JSON object per benchmark, per line.
+ *
+ * usage: ./bench_micro [iterations scale]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common.h"
+#include "../list.h"
+#include "../fec.h"
+#include "../dedup.h"
+#include "../sanitizer.h"
+#include "../message_pool.h"
+#include "../jsonl.h"
+#include "../wire.h"
+
+// Messages appended before removing them all again. Well under LIST_MAX_NUM_NODES.
+#define LIST_BATCH_SIZE 256
+
+// Data datagrams per FEC block in the FEC benchmark.
+#define FEC_BENCH_BLOCK_SIZE 8
+
+// Where --gso cuts messages by default, for the sanitizer's pieces benchmark.
+#define GSO_BENCH_SEGMENT_BYTES 1472
+
+typedef enum {
+    SANITIZE_INPUT_ASCII,
+    SANITIZE_INPUT_UTF8,
+    SANITIZE_INPUT_BINARY,
+    // A run of euro signs, whose 3 bytes don't divide the GSO segment size.
+    SANITIZE_INPUT_EUROS
+} SanitizeInput;
+
+// Keeps the compiler from optimizing away results.
+static volatile size_t s_sink;
+
+static void printResult(const char* pName, size_t sizeOfMessage, unsigned long numOps,
+                        uint64_t elapsedNs)
+{
+    printf("{\"bench\":\"%s\",\"size\":%zu,\"ops\":%lu,\"ns_per_op\":%.2f,\"mops_per_sec\":%.3f}\n",
+           pName, sizeOfMessage, numOps, (double) elapsedNs / numOps,
+           numOps / ((double) elapsedNs / 1e9) / 1e6);
+}
+
+static void benchListAppendRemove(unsigned long scale)
+{
+    List* pList = List_create();
+    if (pList == NULL) {
+        fputs("Failed to create list\n", stderr);
+        return;
+    }
+    static int items[LIST_BATCH_SIZE];
+    unsigned long numRounds = 2000 * scale;
+
+    uint64_t startNs = getMonotonicTimeNs();
+    unsigned long round;
+    for (round = 0; round < numRounds; round++) {
+        int i;
+        for (i = 0; i < LIST_BATCH_SIZE; i++) {
+            List_append(pList, &items[i]);
+        }
+        // Dequeue from the front, like the message queues do.
+        for (i = 0; i < LIST_BATCH_SIZE; i++) {
+            List_first(pList);
+            s_sink += (size_t) List_remove(pList);
+        }
+    }
+    uint64_t elapsedNs = getMonotonicTimeNs() - startNs;
+
+    printResult("list_append_remove", 0, numRounds * LIST_BATCH_SIZE * 2, elapsedNs);
+    List_free(pList, NULL);
+}
+
+/*
+ * Scans a buffer of lines without a termination line, which is the worst case:
+ * the whole message is scanned.
+ */
+static void benchTerminationLineScan(size_t sizeOfMessage, unsigned long scale)
+{
+    char* pMessageBuffer = malloc(MSG_MAX_LEN);
+    char* pTemplate = malloc(MSG_MAX_LEN);
+    memset(pTemplate, 0, MSG_MAX_LEN);
+    size_t i;
+    for (i = 0; i < sizeOfMessage; i++) {
+        pTemplate[i] = (i % 64 == 63) ? '\n' : 'a' + (char) (i % 26);
+    }
+    unsigned long numOps = scale * (50000000UL / (sizeOfMessage + 64));
+    if (numOps == 0) {
+        numOps = 1;
+    }
+
+    // The scan may write into the buffer, so each run gets a fresh copy. The time
+    // for copying alone is measured first and subtracted.
+    unsigned long op;
+    uint64_t startNs = getMonotonicTimeNs();
+    for (op = 0; op < numOps; op++) {
+        memcpy(pMessageBuffer, pTemplate, sizeOfMessage + 1);
+        s_sink += (size_t) pMessageBuffer[op % (sizeOfMessage + 1)];
+    }
+    uint64_t copyNs = getMonotonicTimeNs() - startNs;
+
+    startNs = getMonotonicTimeNs();
+    for (op = 0; op < numOps; op++) {
+        memcpy(pMessageBuffer, pTemplate, sizeOfMessage + 1);
+        size_t scannedSize = 0;
+        s_sink += checkAndDiscardRestIfMessageHasTerminationLine(pMessageBuffer, &scannedSize);
+        s_sink += scannedSize;
+    }
+    uint64_t totalNs = getMonotonicTimeNs() - startNs;
+    totalNs = totalNs > copyNs ? totalNs - copyNs : 0;
+    printResult("termination_line_scan", sizeOfMessage, numOps, totalNs);
+
+    free(pTemplate);
+    free(pMessageBuffer);
+}
+
+static void benchMessageAllocFree(size_t sizeOfMessage, unsigned long scale)
+{
+    char* pText = malloc(sizeOfMessage + 1);
+    memset(pText, 'a', sizeOfMessage);
+    pText[sizeOfMessage] = '\0';
+    unsigned long numOps = 200000 * scale;
+
+    uint64_t startNs = getMonotonicTimeNs();
+    unsigned long op;
+    for (op = 0; op < numOps; op++) {
+        Message* pMessage = createMessage(pText, sizeOfMessage, false);
+        s_sink += pMessage->length;
+        freeMessageFn(pMessage);
+    }
+    uint64_t elapsedNs = getMonotonicTimeNs() - startNs;
+    printResult("message_alloc_free", sizeOfMessage, numOps, elapsedNs);
+
+    free(pText);
+}
+
+static void benchMessagePoolAllocFree(size_t sizeOfMessage, unsigned long scale)
+{
+    char* pText = malloc(sizeOfMessage + 1);
+    memset(pText, 'a', sizeOfMessage);
+    pText[sizeOfMessage] = '\0';
+    QueueLimits limits = {
+        .maxMessages = LIST_MAX_NUM_NODES,
+        .maxBytes = 16 * 1024 * 1024
+    };
+    MessagePool* pPool = MessagePool_create("Bench", &limits, MSG_MAX_LEN);
+    if (pPool == NULL) {
+        fputs("Failed to create message pool\n", stderr);
+        free(pText);
+        return;
+    }
+    unsigned long numOps = 200000 * scale;
+
+    uint64_t startNs = getMonotonicTimeNs();
+    unsigned long op;
+    for (op = 0; op < numOps; op++) {
+        Message* pMessage = MessagePool_createMessage(pPool, pText, sizeOfMessage, false);
+        s_sink += pMessage->length;
+        freeMessageFn(pMessage);
+    }
+    uint64_t elapsedNs = getMonotonicTimeNs() - startNs;
+    printResult("message_pool_alloc_free", sizeOfMessage, numOps, elapsedNs);
+
+    MessagePool_destroy(pPool);
+    free(pText);
+}
+
+static unsigned long s_numFecPayloads = 0;
+static size_t s_expectedFecPayloadLength = 0;
+
+static bool countFecPayload(const char* pPayload, size_t length)
+{
+    s_numFecPayloads++;
+    s_sink += (size_t) pPayload[0];
+    if (length != s_expectedFecPayloadLength) {
+        fputs("FEC payload has the wrong length\n", stderr);
+    }
+    return false;
+}
+
+/*
+ * Encodes blocks of FEC_BENCH_BLOCK_SIZE datagrams, then decodes them with the first
+ * datagram of each block dropped, so that every block has to be rebuilt.
+ */
+static void benchFec(size_t sizeOfMessage, unsigned long scale)
+{
+    if (sizeOfMessage > FEC_MAX_PAYLOAD_LEN) {
+        sizeOfMessage = FEC_MAX_PAYLOAD_LEN;
+    }
+    char* pText = malloc(sizeOfMessage);
+    char* pDatagrams = malloc((size_t) (FEC_BENCH_BLOCK_SIZE + 1) * MSG_MAX_LEN);
+    size_t sizeOfDatagrams[FEC_BENCH_BLOCK_SIZE + 1];
+    memset(pText, 'a', sizeOfMessage);
+    unsigned long numBlocks = scale * (20000000UL / (sizeOfMessage + 64) / FEC_BENCH_BLOCK_SIZE + 1);
+    FecEncoder_init(FEC_BENCH_BLOCK_SIZE);
+    s_numFecPayloads = 0;
+    s_expectedFecPayloadLength = sizeOfMessage;
+
+    uint64_t encodeNs = 0;
+    uint64_t decodeNs = 0;
+    unsigned long block;
+    for (block = 0; block < numBlocks; block++) {
+        uint64_t startNs = getMonotonicTimeNs();
+        int i;
+        for (i = 0; i < FEC_BENCH_BLOCK_SIZE; i++) {
+            sizeOfDatagrams[i] = FecEncoder_encodeData(pText, sizeOfMessage,
+                                                       pDatagrams + (size_t) i * MSG_MAX_LEN);
+        }
+        sizeOfDatagrams[i] = FecEncoder_takeParity(false, pDatagrams + (size_t) i * MSG_MAX_LEN);
+        uint64_t encodedNs = getMonotonicTimeNs();
+        for (i = 1; i <= FEC_BENCH_BLOCK_SIZE; i++) {
+            FecDecoder_receive(pDatagrams + (size_t) i * MSG_MAX_LEN, sizeOfDatagrams[i],
+                               countFecPayload);
+        }
+        uint64_t decodedNs = getMonotonicTimeNs();
+        encodeNs += encodedNs - startNs;
+        decodeNs += decodedNs - encodedNs;
+    }
+    printResult("fec_encode", sizeOfMessage, numBlocks * FEC_BENCH_BLOCK_SIZE, encodeNs);
+    printResult("fec_decode_rebuild", sizeOfMessage, numBlocks * FEC_BENCH_BLOCK_SIZE, decodeNs);
+    if (s_numFecPayloads != numBlocks * FEC_BENCH_BLOCK_SIZE) {
+        fprintf(stderr, "FEC delivered %lu of %lu payloads\n", s_numFecPayloads,
+                numBlocks * FEC_BENCH_BLOCK_SIZE);
+    }
+
+    free(pDatagrams);
+    free(pText);
+}
+
+/*
+ * Times encoding and decoding a message whose text the peer already holds, so every
+ * chunk but the short last one goes out as a reference. The first round, which
+ * sends everything as text, isn't timed.
+ */
+static void benchDedup(size_t sizeOfMessage, unsigned long scale)
+{
+    if (sizeOfMessage > DEDUP_MAX_TEXT_LEN) {
+        sizeOfMessage = DEDUP_MAX_TEXT_LEN;
+    }
+    char* pText = malloc(sizeOfMessage);
+    char* pDatagram = malloc(MSG_MAX_LEN);
+    char* pDecoded = malloc(MSG_MAX_LEN);
+    // Text without long runs of one byte, so that it is cut like real text.
+    uint32_t state = 1;
+    size_t i;
+    for (i = 0; i < sizeOfMessage; i++) {
+        state = state * 1103515245 + 12345;
+        pText[i] = (char) ('a' + (state >> 16) % 26);
+    }
+    if (!DedupEncoder_init(1024 * 1024) || !DedupDecoder_init(1024 * 1024)) {
+        return;
+    }
+    size_t sizeOfDatagram = DedupEncoder_encode(pText, sizeOfMessage, pDatagram);
+    DedupDecoder_receive(pDatagram, sizeOfDatagram, pDecoded, MSG_MAX_LEN);
+
+    unsigned long numOps = scale * (20000000UL / (sizeOfMessage + 64) + 1);
+    uint64_t encodeNs = 0;
+    uint64_t decodeNs = 0;
+    unsigned long op;
+    for (op = 0; op < numOps; op++) {
+        uint64_t startNs = getMonotonicTimeNs();
+        sizeOfDatagram = DedupEncoder_encode(pText, sizeOfMessage, pDatagram);
+        uint64_t encodedNs = getMonotonicTimeNs();
+        ssize_t decodedLength = DedupDecoder_receive(pDatagram, sizeOfDatagram, pDecoded,
+                                                     MSG_MAX_LEN);
+        uint64_t decodedNs = getMonotonicTimeNs();
+        s_sink += (size_t) decodedLength;
+        encodeNs += encodedNs - startNs;
+        decodeNs += decodedNs - encodedNs;
+    }
+    printResult("dedup_encode_repeat", sizeOfMessage, numOps, encodeNs);
+    printResult("dedup_decode_repeat", sizeOfMessage, numOps, decodeNs);
+    if (memcmp(pText, pDecoded, sizeOfMessage) != 0) {
+        fprintf(stderr, "Dedup decoded different text\n");
+    }
+
+    free(pDecoded);
+    free(pDatagram);
+    free(pText);
+}
+
+/*
+ * Fills the text the sanitizer is timed on: lines of ASCII, which are all plain,
+ * prose in a few scripts with an escape sequence now and then, random bytes, or
+ * euro signs.
+ */
+static void fillSanitizeInput(char* pText, size_t sizeOfMessage, SanitizeInput input)
+{
+    static const char utf8Text[] = "Gr\xc3\xbc\xc3\x9f dich, na\xc3\xafve caf\xc3\xa9 "
+        "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 \xe6\x97\xa5\xe6\x9c\xac "
+        "\xf0\x9f\x99\x82 \x1b[31mred\x1b[0m\n";
+    uint32_t state = 1;
+    size_t i;
+    for (i = 0; i < sizeOfMessage; i++) {
+        switch (input) {
+            case SANITIZE_INPUT_ASCII:
+                pText[i] = (i % 64 == 63) ? '\n' : 'a' + (char) (i % 26);
+                break;
+            case SANITIZE_INPUT_UTF8:
+                pText[i] = utf8Text[i % (sizeof(utf8Text) - 1)];
+                break;
+            case SANITIZE_INPUT_BINARY:
+                state = state * 1103515245 + 12345;
+                pText[i] = (char) (state >> 16);
+                break;
+            case SANITIZE_INPUT_EUROS:
+                pText[i] = "\xe2\x82\xac"[i % 3];
+                break;
+        }
+    }
+}
+
+/*
+ * Times the sanitizer against its scalar version on the same text, and checks that
+ * they agree.
+ */
+static void benchSanitize(SanitizeInput input, size_t sizeOfMessage, unsigned long scale)
+{
+    static const char* const names[][2] = {
+        {"sanitize_ascii", "sanitize_scalar_ascii"},
+        {"sanitize_utf8", "sanitize_scalar_utf8"},
+        {"sanitize_binary", "sanitize_scalar_binary"}
+    };
+    char* pText = malloc(sizeOfMessage);
+    char* pOut = malloc(SANITIZER_MAX_EXPANSION * sizeOfMessage);
+    char* pScalarOut = malloc(SANITIZER_MAX_EXPANSION * sizeOfMessage);
+    fillSanitizeInput(pText, sizeOfMessage, input);
+    unsigned long numOps = scale * (50000000UL / (sizeOfMessage + 64) + 1);
+
+    size_t length = 0;
+    size_t numReplaced = 0;
+    uint64_t startNs = getMonotonicTimeNs();
+    unsigned long op;
+    for (op = 0; op < numOps; op++) {
+        length = Sanitizer_sanitize(pText, sizeOfMessage, pOut, &numReplaced);
+        s_sink += length;
+    }
+    printResult(names[input][0], sizeOfMessage, numOps, getMonotonicTimeNs() - startNs);
+
+    size_t scalarLength = 0;
+    size_t numScalarReplaced = 0;
+    startNs = getMonotonicTimeNs();
+    for (op = 0; op < numOps; op++) {
+        scalarLength = Sanitizer_sanitizeScalar(pText, sizeOfMessage, pScalarOut,
+                                                &numScalarReplaced);
+        s_sink += scalarLength;
+    }
+    printResult(names[input][1], sizeOfMessage, numOps, getMonotonicTimeNs() - startNs);
+
+    if (length != scalarLength || numReplaced != numScalarReplaced
+        || memcmp(pOut, pScalarOut, length) != 0) {
+        fprintf(stderr, "The sanitizer and its scalar version disagree on %s\n",
+                names[input][0]);
+    }
+
+    free(pScalarOut);
+    free(pOut);
+    free(pText);
+}
+
+/*
+ * Times sanitizing text in the pieces --gso cuts it into, which puts cuts in the
+ * middle of characters, and checks that it comes out the same as the whole text.
+ */
+static void benchSanitizePieces(SanitizeInput input, size_t sizeOfMessage, unsigned long scale)
+{
+    char* pText = malloc(sizeOfMessage);
+    char* pWhole = malloc(SANITIZER_MAX_EXPANSION * sizeOfMessage);
+    char* pPieces = malloc(SANITIZER_MAX_EXPANSION * (sizeOfMessage + SANITIZER_MAX_HELD_LEN));
+    fillSanitizeInput(pText, sizeOfMessage, input);
+    size_t numWholeReplaced;
+    size_t wholeLength = Sanitizer_sanitize(pText, sizeOfMessage, pWhole, &numWholeReplaced);
+    unsigned long numOps = scale * (50000000UL / (sizeOfMessage + 64) + 1);
+
+    size_t length = 0;
+    size_t numReplaced = 0;
+    uint64_t startNs = getMonotonicTimeNs();
+    unsigned long op;
+    for (op = 0; op < numOps; op++) {
+        SanitizerStream stream = {.numHeld = 0};
+        length = 0;
+        numReplaced = 0;
+        size_t offset;
+        for (offset = 0; offset < sizeOfMessage; offset += GSO_BENCH_SEGMENT_BYTES) {
+            size_t pieceLength = sizeOfMessage - offset < GSO_BENCH_SEGMENT_BYTES
+                                 ? sizeOfMessage - offset : GSO_BENCH_SEGMENT_BYTES;
+            bool isContinued = offset + pieceLength < sizeOfMessage;
+            size_t numPieceReplaced;
+            length += Sanitizer_sanitizePiece(&stream, pText + offset, pieceLength, isContinued,
+                                              pPieces + length, &numPieceReplaced);
+            numReplaced += numPieceReplaced;
+        }
+        s_sink += length;
+    }
+    bool isEuros = input == SANITIZE_INPUT_EUROS;
+    printResult(isEuros ? "sanitize_pieces_euros" : "sanitize_pieces_utf8", sizeOfMessage,
+                numOps, getMonotonicTimeNs() - startNs);
+
+    if (length != wholeLength || numReplaced != numWholeReplaced
+        || memcmp(pPieces, pWhole, length) != 0) {
+        fprintf(stderr, "The sanitizer's pieces differ from the whole %s text\n",
+                isEuros ? "euro" : "UTF-8");
+    }
+
+    free(pPieces);
+    free(pWhole);
+    free(pText);
+}
+
+/*
+ * Times escaping text for --jsonl against the scalar version, on the sanitizer's
+ * inputs once they have been through it, as received text is.
+ */
+static void benchJsonlEscape(SanitizeInput input, size_t sizeOfMessage, unsigned long scale)
+{
+    static const char* const names[][2] = {
+        {"jsonl_escape_ascii", "jsonl_escape_scalar_ascii"},
+        {"jsonl_escape_utf8", "jsonl_escape_scalar_utf8"},
+        {"jsonl_escape_binary", "jsonl_escape_scalar_binary"}
+    };
+    char* pRaw = malloc(sizeOfMessage);
+    char* pText = malloc(SANITIZER_MAX_EXPANSION * sizeOfMessage);
+    fillSanitizeInput(pRaw, sizeOfMessage, input);
+    size_t numReplaced;
+    size_t textLength = Sanitizer_sanitize(pRaw, sizeOfMessage, pText, &numReplaced);
+    char* pOut = malloc(JSONL_MAX_EXPANSION * textLength);
+    char* pScalarOut = malloc(JSONL_MAX_EXPANSION * textLength);
+    unsigned long numOps = scale * (50000000UL / (textLength + 64) + 1);
+
+    size_t length = 0;
+    uint64_t startNs = getMonotonicTimeNs();
+    unsigned long op;
+    for (op = 0; op < numOps; op++) {
+        length = Jsonl_escape(pText, textLength, pOut);
+        s_sink += length;
+    }
+    printResult(names[input][0], sizeOfMessage, numOps, getMonotonicTimeNs() - startNs);
+
+    size_t scalarLength = 0;
+    startNs = getMonotonicTimeNs();
+    for (op = 0; op < numOps; op++) {
+        scalarLength = Jsonl_escapeScalar(pText, textLength, pScalarOut);
+        s_sink += scalarLength;
+    }
+    printResult(names[input][1], sizeOfMessage, numOps, getMonotonicTimeNs() - startNs);
+
+    if (length != scalarLength || memcmp(pOut, pScalarOut, length) != 0) {
+        fprintf(stderr, "The JSON escaper and its scalar version disagree on %s\n",
+                names[input][0]);
+    }
+
+    free(pScalarOut);
+    free(pOut);
+    free(pText);
+    free(pRaw);
+}
+
+/*
+ * Times decoding text frames, then checks that the frames of a peer that restarted
+ * without its hello getting through are accepted: its sequence starts over at 0,
+ * far behind the window, and only copies are dropped.
+ */
+static void benchWireDecode(size_t sizeOfMessage, unsigned long scale)
+{
+    if (sizeOfMessage > WIRE_MAX_PAYLOAD_LEN) {
+        sizeOfMessage = WIRE_MAX_PAYLOAD_LEN;
+    }
+    char* pText = malloc(sizeOfMessage);
+    char* pDatagram = malloc(MSG_MAX_LEN);
+    memset(pText, 'a', sizeOfMessage);
+    unsigned long numFrames = scale * (20000000UL / (sizeOfMessage + 64) + WIRE_DUPLICATE_WINDOW);
+    Wire wire;
+    Wire_init(&wire, WIRE_MODE_AUTO);
+    WireFrame frame;
+    unsigned long numAccepted = 0;
+
+    uint64_t decodeNs = 0;
+    unsigned long i;
+    for (i = 0; i < numFrames; i++) {
+        size_t length = WireEncoder_writeControl(pDatagram, WIRE_TYPE_TEXT, i, pText, sizeOfMessage);
+        uint64_t startNs = getMonotonicTimeNs();
+        numAccepted += WireDecoder_receive(&wire, pDatagram, length, &frame);
+        decodeNs += getMonotonicTimeNs() - startNs;
+        s_sink += frame.payloadLength;
+    }
+    printResult("wire_decode", sizeOfMessage, numFrames, decodeNs);
+
+    // The peer restarts, and its hello is lost.
+    for (i = 0; i < WIRE_DUPLICATE_WINDOW; i++) {
+        size_t length = WireEncoder_writeControl(pDatagram, WIRE_TYPE_TEXT, i, pText, sizeOfMessage);
+        numAccepted += WireDecoder_receive(&wire, pDatagram, length, &frame);
+    }
+    size_t length = WireEncoder_writeControl(pDatagram, WIRE_TYPE_TEXT, 0, pText, sizeOfMessage);
+    if (WireDecoder_receive(&wire, pDatagram, length, &frame)) {
+        fprintf(stderr, "The wire decoder accepted a copy of a frame after a restart\n");
+    }
+    if (numAccepted != numFrames + WIRE_DUPLICATE_WINDOW) {
+        fprintf(stderr, "The wire decoder accepted %lu of %lu frames around a restart without a hello\n",
+                numAccepted, numFrames + WIRE_DUPLICATE_WINDOW);
+    }
+
+    free(pDatagram);
+    free(pText);
+}
+
+/*
+ * Times parsing a send command for --jsonl whose text has a newline every 64 bytes.
+ * Each parse is of a fresh copy of the line, since it unescapes in place, and the
+ * copy is timed with it.
+ */
+static void benchJsonlParse(size_t sizeOfMessage, unsigned long scale)
+{
+    static const char prefix[] = "{\"cmd\":\"send\",\"text\":\"";
+    static const char suffix[] = "\"}";
+    char* pText = malloc(sizeOfMessage);
+    char* pCommandLine = malloc(JSONL_MAX_LINE_LEN);
+    char* pLine = malloc(JSONL_MAX_LINE_LEN);
+    fillSanitizeInput(pText, sizeOfMessage, SANITIZE_INPUT_ASCII);
+    size_t lineLength = sizeof(prefix) - 1;
+    memcpy(pCommandLine, prefix, lineLength);
+    lineLength += Jsonl_escape(pText, sizeOfMessage, pCommandLine + lineLength);
+    memcpy(pCommandLine + lineLength, suffix, sizeof(suffix) - 1);
+    lineLength += sizeof(suffix) - 1;
+    unsigned long numOps = scale * (50000000UL / (lineLength + 64) + 1);
+
+    bool isParsed = true;
+    JsonlCommand command = {0};
+    const char* pError = NULL;
+    uint64_t startNs = getMonotonicTimeNs();
+    unsigned long op;
+    for (op = 0; op < numOps; op++) {
+        memcpy(pLine, pCommandLine, lineLength);
+        isParsed &= Jsonl_parseCommand(pLine, lineLength, &command, &pError);
+        s_sink += command.length;
+    }
+    printResult("jsonl_parse_send", sizeOfMessage, numOps, getMonotonicTimeNs() - startNs);
+
+    if (!isParsed || command.length != sizeOfMessage
+        || memcmp(command.pText, pText, sizeOfMessage) != 0) {
+        fprintf(stderr, "The JSON parser didn't give back the text it was given\n");
+    }
+
+    free(pLine);
+    free(pCommandLine);
+    free(pText);
+}
+
+int main(int argCount, char** args)
+{
+    unsigned long scale = 1;
+    if (argCount > 1) {
+        scale = strtoul(args[1], NULL, 10);
+        if (scale == 0) {
+            fputs("usage: ./bench_micro [iterations scale]\n", stderr);
+            return 1;
+        }
+    }
+
+    static const size_t sizes[] = {16, 1024, MSG_MAX_LEN - 1};
+    size_t i;
+
+    benchListAppendRemove(scale);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        benchTerminationLineScan(sizes[i], scale);
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        benchMessageAllocFree(sizes[i], scale);
+        benchMessagePoolAllocFree(sizes[i], scale);
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        benchFec(sizes[i], scale);
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        benchDedup(sizes[i], scale);
+    }
+    Dedup_destroy();
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        benchSanitize(SANITIZE_INPUT_ASCII, sizes[i], scale);
+        benchSanitize(SANITIZE_INPUT_UTF8, sizes[i], scale);
+        benchSanitize(SANITIZE_INPUT_BINARY, sizes[i], scale);
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        benchSanitizePieces(SANITIZE_INPUT_UTF8, sizes[i], scale);
+        benchSanitizePieces(SANITIZE_INPUT_EUROS, sizes[i], scale);
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        benchJsonlEscape(SANITIZE_INPUT_ASCII, sizes[i], scale);
+        benchJsonlEscape(SANITIZE_INPUT_UTF8, sizes[i], scale);
+        benchJsonlEscape(SANITIZE_INPUT_BINARY, sizes[i], scale);
+        benchJsonlParse(sizes[i], scale);
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        benchWireDecode(sizes[i], scale);
+    }
+    return 0;
+}
@@ -8,7 +8,6 @@
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
-#include <assert.h>
 #include <stdlib.h>
 
 #include "common.h"
@@ -16,6 +15,17 @@
 #include "screen_printer.h"
 #include "message_listener.h"
 #include "message_sender.h"
+#include "socket_config.h"
+#include "shm_transport.h"
+#include "fec.h"
+#include "timer_wheel.h"
+#include "keepalive.h"
+#include "dedup.h"
+#include "trace.h"
+#include "wire.h"
+#include "multipath.h"
+#include "message_pool.h"
+#include "resolver.h"
 
 static pthread_t s_shutdownHelperThreadPid;
 
@@ -35,30 +45,6 @@ static pthread_barrier_t s_syncAllThreadsReadyBarrier;
 static bool s_barrierForAllThreadsReadyDestroyed = false;
 static pthread_mutex_t s_syncBarrierForAllThreadsReadyDestroyedMutex = PTHREAD_MUTEX_INITIALIZER;
 
-/*
- * Cleanup handler for use with pthread_cleanup_{push,pop}.
- * From the man pages:
- * After a push, this routine will be run in the following situations:
- * - The thread exits (that is, calls pthread_exit()).
- * - The thread acts upon a cancellation request.
- * - The thread calls pthread_cleanup_pop() with a non-zero execute argument.
- */
-void unlockMutexesCleanup(void* whichMutex)
-{
-    pthread_mutex_unlock((pthread_mutex_t*) whichMutex);
-}
-
-void freeMessageFn(void* pItem)
-{
-    Message* pMessage = (Message*) pItem;
-    if (pMessage != NULL) {
-        if (pMessage->pText != NULL) {
-            free(pMessage->pText);
-        }
-        free(pMessage);
-    }
-}
-
 /*
  * Gets a socket, creating one if a socket doesn't exist.
  * Will print errors and return -1 if it fails
@@ -100,74 +86,11 @@ int getSocketFdOrCreateAndBindIfDoesntExist(in_port_t ourPort)
         close(s_socketDescriptor);
         return -1;
     }
+    SocketConfig_apply(s_socketDescriptor);
     pthread_mutex_unlock(&s_syncSocketMutex);
     return s_socketDescriptor;
 }
 
-/*
- * Determines if the message buffer has a termination line, and then marks
- * the rest of the message as unneeded if there is a termination line.
- * If pSizeOfMessage is not NULL, *pSizeOfMessage will be set to the size
- * of message determined by scanning.
- */
-bool checkAndDiscardRestIfMessageHasTerminationLine(char* messageBuffer, size_t* pSizeOfMessage)
-{
-    // We assume that messageBuffer has size MSG_MAX_LEN.
-    if (messageBuffer == NULL) {
-        return false;
-    }
-    // Empty string check. Fundamentally, it doesn't have a termination line.
-    if (messageBuffer[0] == '\0') {
-        if (pSizeOfMessage != NULL) {
-            *pSizeOfMessage = 0;
-        }
-        return false;
-    }
-    // If the line starts with termination
-    if (messageBuffer[0] == '!' && messageBuffer[1] == '\n') {
-        messageBuffer[3] = '\0';
-        if (pSizeOfMessage != NULL) {
-            *pSizeOfMessage = 3;
-        }
-        return true;
-    }
-
-    bool isTerminationLinePresent = false;
-    size_t i;
-    for (i = 0; i < MSG_MAX_LEN - 1; i++) {
-        // Search for a line which has just a "!<enter>", checking two adjacent
-        // characters at a time.
-        if (messageBuffer[i] == '!' && messageBuffer[i + 1] == '\n') {
-            // Making sure this is a standalone line if we are not checking the beginning
-            // Note: In here, we know that i > 0, since the condition
-            // messageBuffer[0] == '!' && messageBuffer[1] == '\n' is false, since we
-            // got past the guard, "If the line starts with termination"
-            bool isExclamationOnItsOwnLine = (messageBuffer[i - 1] == '\n');
-            if (isExclamationOnItsOwnLine) {
-                if (i + 2 < MSG_MAX_LEN) {
-                    // Make it so that we discard portions beyond "!<enter>".
-                    messageBuffer[i + 2] = '\0';
-                }
-
-                isTerminationLinePresent = true;
-                break;
-            }
-        }
-
-        // If we reached the end of the string, stop searching
-        if (messageBuffer[i] == '\0' || messageBuffer[i + 1] == '\0') {
-            break;
-        }
-    }
-    if (pSizeOfMessage != NULL) {
-        // If the termination line is present, we need to add 1 more to the
-        // returned length, since we added an extra null character at the end.
-        *pSizeOfMessage = isTerminationLinePresent ? i + 2 : i + 1;
-        assert(strnlen(messageBuffer, MSG_MAX_LEN) == *pSizeOfMessage);
-    }
-    return isTerminationLinePresent;
-}
-
 ShutdownStatus shutdownThreadWithPid(pthread_t threadPid)
 {
     ShutdownStatus returnStatus = SUCCESSFUL_JOIN;
@@ -210,6 +133,10 @@ static void* shutdownOfAllThreadsForProgram(void* unused)
     // thread is also blocked on this barrier.
     pthread_barrier_wait(&s_syncAllThreadsGoingToShutdownBarrier);
 
+    // Timers go first, so that none of their callbacks runs against a thread
+    // that is already gone.
+    printShutdownStatusErrors("Timers", TimerWheel_shutdown());
+    printShutdownStatusErrors("Resolver", Resolver_shutdown());
     printShutdownStatusErrors("Screen printer", ScreenPrinter_shutdown());
     printShutdownStatusErrors("Keyboard reader", KeyboardReader_shutdown());
     printShutdownStatusErrors("Listener", Listener_shutdown());
@@ -284,6 +211,23 @@ void waitForShutdownOfAllThreads()
 
     ScreenPrinter_destroyMutexAndCondAndFreeLists();
     KeyboardReader_destroyMutexAndCondAndFreeList();
+    Sender_printStats();
+    Resolver_printStats();
+    Listener_printStats();
+    ShmTransport_printStats();
+    Fec_printStats();
+    Dedup_printStats();
+    Wire_printStats(Sender_getWire());
+    Multipath_printStats();
+    Keepalive_printStats();
+    TimerWheel_printStats();
+    Trace_write();
+    ShmTransport_destroy();
+    Fec_destroy();
+    Dedup_destroy();
+    Multipath_destroy();
+    TimerWheel_destroy();
+    Trace_destroy();
 }
 
 /*
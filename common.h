@@ -2,16 +2,9 @@
 #define _COMMON_FUNCS_CONSTANTS_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <netdb.h>
-
-// Max size for a UDP packet.
-#define MSG_MAX_LEN 65507
-
-typedef struct Message_s Message;
-struct Message_s {
-    char* pText;
-    bool isShutdownMessage;
-};
+#include "message.h"
 
 typedef enum {
     SUCCESSFUL_JOIN,
@@ -20,10 +13,6 @@ typedef enum {
     JOIN_ERROR
 } ShutdownStatus;
 
-void unlockMutexesCleanup(void* whichMutex);
-
-void freeMessageFn(void* pItem);
-
 ShutdownStatus shutdownThreadWithPid(pthread_t threadPid);
 
 void initBarriers();
@@ -36,11 +25,6 @@ void waitForAllThreadsReadyBarrier();
  */
 int getSocketFdOrCreateAndBindIfDoesntExist(in_port_t ourPort);
 
-/*
- * Returns true if the message has a line that is just "!\n", and false if not.
- */
-bool checkAndDiscardRestIfMessageHasTerminationLine(char* messageBuffer, size_t* pSizeOfMessage);
-
 /*
  * Wait until the thread used to manage shutdowns is done.
  * Used by the main thread to block itself.
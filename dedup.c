@@ -0,0 +1,607 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dedup.h"
+#include "message_sender.h"
+
+#define DEDUP_KIND_MESSAGE 'C'
+#define DEDUP_KIND_MISSES 'M'
+#define DEDUP_HEADER_LEN 3
+
+#define DEDUP_RECORD_LITERAL 1
+#define DEDUP_RECORD_REFERENCE 2
+#define DEDUP_LITERAL_HEADER_LEN 3
+#define DEDUP_REFERENCE_LEN 11
+
+// A cut is made where the top bits of the rolling hash are all zero, which puts
+// the average chunk at about 256 bytes past the minimum.
+#define DEDUP_BOUNDARY_SHIFT 56
+// Most hashes a miss report carries. Any more are reported with the next miss.
+#define DEDUP_MAX_MISSES_PER_REPORT 64
+// The listener keeps the text of chunks up to this long in small blocks, and the
+// rest in blocks of DEDUP_MAX_CHUNK_LEN.
+#define DEDUP_SMALL_BLOCK_LEN 256
+#define DEDUP_NUM_BLOCK_SIZES 2
+
+/*
+ * Layout of every dedup datagram:
+ *   0     \0
+ *   1     'D'
+ *   2     kind: message or misses
+ * A message is followed by its chunks in order, each one either
+ *   literal:    1, length u16, the text
+ *   reference:  2, length u16, hash u64
+ * and a miss report by the hashes of the chunks the listener didn't have, u64 each.
+ * Everything is in network byte order.
+ */
+
+/*
+ * One cached chunk. The entries form an LRU list through their indices, and free
+ * entries are chained through `newer`.
+ */
+typedef struct ChunkEntry_s ChunkEntry;
+struct ChunkEntry_s {
+    uint64_t hash;
+    uint32_t length;
+    int32_t newer;
+    int32_t older;
+    // Only kept by the listener's cache.
+    char* pText;
+};
+
+/*
+ * Blocks of one length cut from a slab, and a stack of the indices of the free ones.
+ */
+typedef struct TextBlocks_s TextBlocks;
+struct TextBlocks_s {
+    char* pSlab;
+    size_t blockLength;
+    int32_t* pFreeBlocks;
+    int32_t numFree;
+};
+
+/*
+ * An LRU cache of chunks by hash, bounded by the total length of the chunks. The
+ * hash table uses linear probing and holds entry indices, -1 for an empty slot.
+ * The same sequence of lookups and inserts evicts the same chunks on both sides.
+ *
+ * The listener's cache copies the text of its chunks into blocks set aside at init,
+ * so that caching a chunk doesn't allocate. There are enough blocks of each length
+ * for a cache full of the shortest chunks that go in them, so they never run out.
+ */
+typedef struct ChunkCache_s ChunkCache;
+struct ChunkCache_s {
+    ChunkEntry* pEntries;
+    int32_t* pSlots;
+    size_t slotMask;
+    int32_t freeEntry;
+    int32_t newest;
+    int32_t oldest;
+    size_t numBytes;
+    size_t maxBytes;
+    bool isKeepingText;
+    TextBlocks textBlocks[DEDUP_NUM_BLOCK_SIZES];
+};
+
+static uint64_t s_gearTable[256];
+
+// Encoder state. The cache is also touched by the listener when the peer reports
+// misses.
+static ChunkCache s_encoderCache;
+static pthread_mutex_t s_syncEncoderCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long s_numTextBytesSent = 0;
+static unsigned long long s_numDatagramBytesSent = 0;
+static unsigned long s_numChunksSent = 0;
+static unsigned long s_numReferencesSent = 0;
+static unsigned long s_numMissesReported = 0;
+
+// Decoder state. Only touched by the listener thread.
+static ChunkCache s_decoderCache;
+static unsigned long s_numMessagesReceived = 0;
+static unsigned long s_numReferencesReceived = 0;
+static unsigned long s_numMissing = 0;
+static unsigned long s_numMalformed = 0;
+
+static uint64_t mixBits(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/*
+ * The hash chunks are known by on the wire, so both sides must compute it the same way.
+ */
+static uint64_t hashChunk(const char* pText, size_t length)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+    size_t i;
+    for (i = 0; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, pText + i, sizeof(word));
+        hash = mixBits(hash ^ word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, pText + i, length - i);
+    return mixBits(hash ^ tail);
+}
+
+/*
+ * Returns the length of the chunk at the start of the text: the first place past
+ * DEDUP_MIN_CHUNK_LEN where the gear hash of the bytes before it has a boundary,
+ * or DEDUP_MAX_CHUNK_LEN. Cuts only depend on the last 64 bytes, so a repeated
+ * block of text is cut the same way after the first cut inside it.
+ */
+static size_t findChunkLength(const char* pText, size_t length)
+{
+    if (length <= DEDUP_MIN_CHUNK_LEN) {
+        return length;
+    }
+    size_t maxLength = length < DEDUP_MAX_CHUNK_LEN ? length : DEDUP_MAX_CHUNK_LEN;
+    uint64_t rollingHash = 0;
+    size_t i;
+    for (i = 0; i < maxLength; i++) {
+        rollingHash = (rollingHash << 1) + s_gearTable[(unsigned char) pText[i]];
+        if (i >= DEDUP_MIN_CHUNK_LEN && (rollingHash >> DEDUP_BOUNDARY_SHIFT) == 0) {
+            return i + 1;
+        }
+    }
+    return maxLength;
+}
+
+static void initGearTable()
+{
+    // splitmix64 from a fixed seed. Only the sender uses the table, but keeping it
+    // fixed keeps the cuts the same from run to run.
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    int i;
+    for (i = 0; i < 256; i++) {
+        state += 0x9e3779b97f4a7c15ULL;
+        s_gearTable[i] = mixBits(state);
+    }
+}
+
+static bool initTextBlocks(TextBlocks* pBlocks, size_t blockLength, size_t numBlocks)
+{
+    pBlocks->blockLength = blockLength;
+    pBlocks->pSlab = malloc(blockLength * numBlocks);
+    pBlocks->pFreeBlocks = malloc(sizeof(int32_t) * numBlocks);
+    if (pBlocks->pSlab == NULL || pBlocks->pFreeBlocks == NULL) {
+        return false;
+    }
+    size_t i;
+    for (i = 0; i < numBlocks; i++) {
+        pBlocks->pFreeBlocks[i] = (int32_t) (numBlocks - 1 - i);
+    }
+    pBlocks->numFree = (int32_t) numBlocks;
+    return true;
+}
+
+static TextBlocks* getTextBlocksForLength(ChunkCache* pCache, size_t length)
+{
+    return &pCache->textBlocks[length <= DEDUP_SMALL_BLOCK_LEN ? 0 : 1];
+}
+
+/*
+ * Returns NULL if the chunk is too long for a block, or there are none left.
+ */
+static char* takeTextBlock(ChunkCache* pCache, size_t length)
+{
+    TextBlocks* pBlocks = getTextBlocksForLength(pCache, length);
+    if (length > DEDUP_MAX_CHUNK_LEN || pBlocks->numFree == 0) {
+        return NULL;
+    }
+    return pBlocks->pSlab + (size_t) pBlocks->pFreeBlocks[--pBlocks->numFree] * pBlocks->blockLength;
+}
+
+static void putBackTextBlock(ChunkCache* pCache, char* pText, size_t length)
+{
+    TextBlocks* pBlocks = getTextBlocksForLength(pCache, length);
+    pBlocks->pFreeBlocks[pBlocks->numFree++] = (int32_t) ((size_t) (pText - pBlocks->pSlab)
+                                                          / pBlocks->blockLength);
+}
+
+static void destroyCache(ChunkCache* pCache)
+{
+    int i;
+    for (i = 0; i < DEDUP_NUM_BLOCK_SIZES; i++) {
+        free(pCache->textBlocks[i].pSlab);
+        free(pCache->textBlocks[i].pFreeBlocks);
+    }
+    free(pCache->pEntries);
+    free(pCache->pSlots);
+    memset(pCache, 0, sizeof(*pCache));
+}
+
+/*
+ * Replaces any cache there was before.
+ */
+static bool initCache(ChunkCache* pCache, size_t cacheBytes, bool isKeepingText)
+{
+    // Chunks shorter than the minimum are never cached, which bounds the entries.
+    size_t numEntries = cacheBytes / DEDUP_MIN_CHUNK_LEN + 1;
+    size_t numSlots = 1;
+    while (numSlots < numEntries * 2) {
+        numSlots <<= 1;
+    }
+    destroyCache(pCache);
+    memset(pCache, 0, sizeof(*pCache));
+    pCache->pEntries = calloc(numEntries, sizeof(ChunkEntry));
+    pCache->pSlots = malloc(numSlots * sizeof(int32_t));
+    // Every entry can hold a small chunk, but the cache only has room for so many
+    // chunks longer than a small block.
+    bool isAllocated = pCache->pEntries != NULL && pCache->pSlots != NULL
+        && (!isKeepingText
+            || (initTextBlocks(&pCache->textBlocks[0], DEDUP_SMALL_BLOCK_LEN, numEntries)
+                && initTextBlocks(&pCache->textBlocks[1], DEDUP_MAX_CHUNK_LEN,
+                                  cacheBytes / (DEDUP_SMALL_BLOCK_LEN + 1) + 1)));
+    if (!isAllocated) {
+        destroyCache(pCache);
+        return false;
+    }
+    memset(pCache->pSlots, 0xff, numSlots * sizeof(int32_t));
+    pCache->slotMask = numSlots - 1;
+    pCache->maxBytes = cacheBytes;
+    pCache->isKeepingText = isKeepingText;
+    pCache->newest = -1;
+    pCache->oldest = -1;
+    size_t i;
+    for (i = 0; i < numEntries; i++) {
+        pCache->pEntries[i].newer = i + 1 < numEntries ? (int32_t) (i + 1) : -1;
+    }
+    pCache->freeEntry = 0;
+    return true;
+}
+
+/*
+ * Returns the slot holding the entry with the hash, or the empty slot where it would go.
+ */
+static size_t findSlot(const ChunkCache* pCache, uint64_t hash)
+{
+    size_t slot = (size_t) hash & pCache->slotMask;
+    while (pCache->pSlots[slot] != -1 && pCache->pEntries[pCache->pSlots[slot]].hash != hash) {
+        slot = (slot + 1) & pCache->slotMask;
+    }
+    return slot;
+}
+
+static void unlinkEntry(ChunkCache* pCache, int32_t entry)
+{
+    ChunkEntry* pEntry = &pCache->pEntries[entry];
+    if (pEntry->newer != -1) {
+        pCache->pEntries[pEntry->newer].older = pEntry->older;
+    } else {
+        pCache->newest = pEntry->older;
+    }
+    if (pEntry->older != -1) {
+        pCache->pEntries[pEntry->older].newer = pEntry->newer;
+    } else {
+        pCache->oldest = pEntry->newer;
+    }
+}
+
+static void linkAsNewest(ChunkCache* pCache, int32_t entry)
+{
+    ChunkEntry* pEntry = &pCache->pEntries[entry];
+    pEntry->newer = -1;
+    pEntry->older = pCache->newest;
+    if (pCache->newest != -1) {
+        pCache->pEntries[pCache->newest].newer = entry;
+    } else {
+        pCache->oldest = entry;
+    }
+    pCache->newest = entry;
+}
+
+/*
+ * Empties the slot and moves any entries after it that belong closer to their home
+ * slot back, so that lookups never stop early at a hole.
+ */
+static void clearSlot(ChunkCache* pCache, size_t slot)
+{
+    size_t hole = slot;
+    size_t next = (slot + 1) & pCache->slotMask;
+    while (pCache->pSlots[next] != -1) {
+        size_t home = (size_t) pCache->pEntries[pCache->pSlots[next]].hash & pCache->slotMask;
+        // Move the entry if its home isn't cyclically between the hole and it.
+        if (((next - home) & pCache->slotMask) >= ((next - hole) & pCache->slotMask)) {
+            pCache->pSlots[hole] = pCache->pSlots[next];
+            hole = next;
+        }
+        next = (next + 1) & pCache->slotMask;
+    }
+    pCache->pSlots[hole] = -1;
+}
+
+static void removeEntry(ChunkCache* pCache, int32_t entry)
+{
+    ChunkEntry* pEntry = &pCache->pEntries[entry];
+    clearSlot(pCache, findSlot(pCache, pEntry->hash));
+    unlinkEntry(pCache, entry);
+    pCache->numBytes -= pEntry->length;
+    if (pEntry->pText != NULL) {
+        putBackTextBlock(pCache, pEntry->pText, pEntry->length);
+        pEntry->pText = NULL;
+    }
+    pEntry->newer = pCache->freeEntry;
+    pCache->freeEntry = entry;
+}
+
+/*
+ * Returns the entry with the hash, making it the newest, or -1 if there is none.
+ */
+static int32_t lookUpChunk(ChunkCache* pCache, uint64_t hash)
+{
+    int32_t entry = pCache->pSlots[findSlot(pCache, hash)];
+    if (entry != -1) {
+        unlinkEntry(pCache, entry);
+        linkAsNewest(pCache, entry);
+    }
+    return entry;
+}
+
+/*
+ * Adds the chunk as the newest entry, evicting the oldest ones to make room.
+ * The chunk must not be in the cache yet. The text is only copied by the
+ * listener's cache; if it is longer than the sender ever makes them, the chunk is
+ * just not cached.
+ */
+static void insertChunk(ChunkCache* pCache, uint64_t hash, const char* pText, size_t length)
+{
+    while (pCache->numBytes + length > pCache->maxBytes || pCache->freeEntry == -1) {
+        removeEntry(pCache, pCache->oldest);
+    }
+    char* pCopy = NULL;
+    if (pCache->isKeepingText) {
+        pCopy = takeTextBlock(pCache, length);
+        if (pCopy == NULL) {
+            return;
+        }
+        memcpy(pCopy, pText, length);
+    }
+    int32_t entry = pCache->freeEntry;
+    ChunkEntry* pEntry = &pCache->pEntries[entry];
+    pCache->freeEntry = pEntry->newer;
+    pEntry->hash = hash;
+    pEntry->length = (uint32_t) length;
+    pEntry->pText = pCopy;
+    pCache->pSlots[findSlot(pCache, hash)] = entry;
+    linkAsNewest(pCache, entry);
+    pCache->numBytes += length;
+}
+
+static void writeUint16(char* pDest, size_t value)
+{
+    uint16_t networkValue = htons((uint16_t) value);
+    memcpy(pDest, &networkValue, sizeof(networkValue));
+}
+
+static size_t readUint16(const char* pSource)
+{
+    uint16_t networkValue;
+    memcpy(&networkValue, pSource, sizeof(networkValue));
+    return ntohs(networkValue);
+}
+
+static void writeUint64(char* pDest, uint64_t value)
+{
+    uint32_t high = htonl((uint32_t) (value >> 32));
+    uint32_t low = htonl((uint32_t) value);
+    memcpy(pDest, &high, sizeof(high));
+    memcpy(pDest + 4, &low, sizeof(low));
+}
+
+static uint64_t readUint64(const char* pSource)
+{
+    uint32_t high;
+    uint32_t low;
+    memcpy(&high, pSource, sizeof(high));
+    memcpy(&low, pSource + 4, sizeof(low));
+    return ((uint64_t) ntohl(high) << 32) | ntohl(low);
+}
+
+bool Dedup_isDedupDatagram(const char* pDatagram, size_t length)
+{
+    return length >= DEDUP_HEADER_LEN && pDatagram[0] == '\0' && pDatagram[1] == 'D';
+}
+
+bool DedupEncoder_init(size_t cacheBytes)
+{
+    initGearTable();
+    if (!initCache(&s_encoderCache, cacheBytes, false)) {
+        printf("Not enough memory for the dedup cache; sending without dedup.\n");
+        return false;
+    }
+    return true;
+}
+
+size_t DedupEncoder_encode(const char* pText, size_t length, char* pDatagram)
+{
+    pDatagram[0] = '\0';
+    pDatagram[1] = 'D';
+    pDatagram[2] = DEDUP_KIND_MESSAGE;
+    size_t sizeOfDatagram = DEDUP_HEADER_LEN;
+
+    pthread_mutex_lock(&s_syncEncoderCacheMutex);
+    size_t offset = 0;
+    while (offset < length) {
+        size_t chunkLength = findChunkLength(pText + offset, length - offset);
+        const char* pChunk = pText + offset;
+        offset += chunkLength;
+        s_numChunksSent++;
+
+        // Short chunks are never worth a reference, and the listener knows not
+        // to cache them either.
+        if (chunkLength >= DEDUP_MIN_CHUNK_LEN) {
+            uint64_t hash = hashChunk(pChunk, chunkLength);
+            if (lookUpChunk(&s_encoderCache, hash) != -1) {
+                pDatagram[sizeOfDatagram] = DEDUP_RECORD_REFERENCE;
+                writeUint16(pDatagram + sizeOfDatagram + 1, chunkLength);
+                writeUint64(pDatagram + sizeOfDatagram + 3, hash);
+                sizeOfDatagram += DEDUP_REFERENCE_LEN;
+                s_numReferencesSent++;
+                continue;
+            }
+            insertChunk(&s_encoderCache, hash, NULL, chunkLength);
+        }
+        pDatagram[sizeOfDatagram] = DEDUP_RECORD_LITERAL;
+        writeUint16(pDatagram + sizeOfDatagram + 1, chunkLength);
+        memcpy(pDatagram + sizeOfDatagram + DEDUP_LITERAL_HEADER_LEN, pChunk, chunkLength);
+        sizeOfDatagram += DEDUP_LITERAL_HEADER_LEN + chunkLength;
+    }
+    pthread_mutex_unlock(&s_syncEncoderCacheMutex);
+
+    s_numTextBytesSent += length;
+    s_numDatagramBytesSent += sizeOfDatagram;
+    return sizeOfDatagram;
+}
+
+/*
+ * Forgets the chunks the peer didn't have, so that they are sent as text next time.
+ */
+static void handleMissReport(const char* pDatagram, size_t length)
+{
+    size_t offset;
+    pthread_mutex_lock(&s_syncEncoderCacheMutex);
+    if (s_encoderCache.pEntries != NULL) {
+        for (offset = DEDUP_HEADER_LEN; offset + 8 <= length; offset += 8) {
+            int32_t entry = s_encoderCache.pSlots[findSlot(&s_encoderCache,
+                                                           readUint64(pDatagram + offset))];
+            if (entry != -1) {
+                removeEntry(&s_encoderCache, entry);
+            }
+            s_numMissesReported++;
+        }
+    }
+    pthread_mutex_unlock(&s_syncEncoderCacheMutex);
+}
+
+bool DedupDecoder_init(size_t cacheBytes)
+{
+    if (!initCache(&s_decoderCache, cacheBytes, true)) {
+        printf("Not enough memory for the dedup cache; deduplicated messages will "
+               "show placeholders.\n");
+        return false;
+    }
+    return true;
+}
+
+ssize_t DedupDecoder_receive(const char* pDatagram, size_t length, char* pText,
+                             size_t maxTextLength)
+{
+    if (pDatagram[2] == DEDUP_KIND_MISSES) {
+        handleMissReport(pDatagram, length);
+        return -1;
+    }
+    if (pDatagram[2] != DEDUP_KIND_MESSAGE) {
+        s_numMalformed++;
+        return -1;
+    }
+    s_numMessagesReceived++;
+
+    char missReport[DEDUP_HEADER_LEN + DEDUP_MAX_MISSES_PER_REPORT * 8];
+    size_t sizeOfMissReport = DEDUP_HEADER_LEN;
+    size_t textLength = 0;
+    size_t offset = DEDUP_HEADER_LEN;
+    while (offset < length) {
+        char recordType = pDatagram[offset];
+        size_t recordLength = recordType == DEDUP_RECORD_REFERENCE ? DEDUP_REFERENCE_LEN
+                                                                     : DEDUP_LITERAL_HEADER_LEN;
+        if (offset + recordLength > length) {
+            s_numMalformed++;
+            return -1;
+        }
+        size_t chunkLength = readUint16(pDatagram + offset + 1);
+        if (textLength + chunkLength > maxTextLength) {
+            s_numMalformed++;
+            return -1;
+        }
+
+        if (recordType == DEDUP_RECORD_LITERAL) {
+            const char* pChunk = pDatagram + offset + DEDUP_LITERAL_HEADER_LEN;
+            if (offset + DEDUP_LITERAL_HEADER_LEN + chunkLength > length) {
+                s_numMalformed++;
+                return -1;
+            }
+            memcpy(pText + textLength, pChunk, chunkLength);
+            // Repeat exactly what the sender did to its copy of this cache.
+            if (chunkLength >= DEDUP_MIN_CHUNK_LEN && s_decoderCache.pEntries != NULL) {
+                uint64_t hash = hashChunk(pChunk, chunkLength);
+                if (lookUpChunk(&s_decoderCache, hash) == -1) {
+                    insertChunk(&s_decoderCache, hash, pChunk, chunkLength);
+                }
+            }
+            offset += DEDUP_LITERAL_HEADER_LEN + chunkLength;
+        } else if (recordType == DEDUP_RECORD_REFERENCE) {
+            uint64_t hash = readUint64(pDatagram + offset + 3);
+            int32_t entry = s_decoderCache.pEntries != NULL ? lookUpChunk(&s_decoderCache, hash) : -1;
+            s_numReferencesReceived++;
+            if (entry != -1 && s_decoderCache.pEntries[entry].length == chunkLength) {
+                memcpy(pText + textLength, s_decoderCache.pEntries[entry].pText, chunkLength);
+            } else {
+                // Shown in place of the chunk, cut to its length so that the text
+                // still fits where the chunk would have.
+                char placeholder[32];
+                int placeholderLength = snprintf(placeholder, sizeof(placeholder),
+                                                 "[%zu bytes lost]", chunkLength);
+                if ((size_t) placeholderLength < chunkLength) {
+                    chunkLength = (size_t) placeholderLength;
+                }
+                memcpy(pText + textLength, placeholder, chunkLength);
+                s_numMissing++;
+                if (sizeOfMissReport + 8 <= sizeof(missReport)) {
+                    writeUint64(missReport + sizeOfMissReport, hash);
+                    sizeOfMissReport += 8;
+                }
+            }
+            offset += DEDUP_REFERENCE_LEN;
+        } else {
+            s_numMalformed++;
+            return -1;
+        }
+        textLength += chunkLength;
+    }
+
+    if (sizeOfMissReport > DEDUP_HEADER_LEN) {
+        missReport[0] = '\0';
+        missReport[1] = 'D';
+        missReport[2] = DEDUP_KIND_MISSES;
+        Sender_sendFeedback(missReport, sizeOfMissReport);
+    }
+    return (ssize_t) textLength;
+}
+
+void Dedup_printStats()
+{
+    if (s_numChunksSent > 0) {
+        double savedPercent = s_numTextBytesSent > s_numDatagramBytesSent
+            ? 100.0 * (double) (s_numTextBytesSent - s_numDatagramBytesSent) / (double) s_numTextBytesSent
+            : 0;
+        printf("Dedup: %llu bytes of text sent as %llu bytes (%.1f%% saved), "
+               "%lu of %lu chunks sent as references, %lu reported missing by the peer\n",
+               s_numTextBytesSent, s_numDatagramBytesSent, savedPercent,
+               s_numReferencesSent, s_numChunksSent, s_numMissesReported);
+    }
+    if (s_numMessagesReceived > 0) {
+        printf("Dedup: %lu messages received, %lu chunk references, %lu missing",
+               s_numMessagesReceived, s_numReferencesReceived, s_numMissing);
+        if (s_numMalformed > 0) {
+            printf(", %lu malformed", s_numMalformed);
+        }
+        printf("\n");
+    }
+}
+
+void Dedup_destroy()
+{
+    destroyCache(&s_encoderCache);
+    destroyCache(&s_decoderCache);
+    pthread_mutex_destroy(&s_syncEncoderCacheMutex);
+}
@@ -0,0 +1,65 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "common.h"
+
+/*
+ * Deduplication of repeated text sent over UDP.
+ *
+ * The sender cuts each message into content-defined chunks, so that the same text
+ * is cut the same way wherever it appears in a message, and each side keeps an LRU
+ * cache of the chunks that went by. The sender's cache only holds the hashes and
+ * lengths and mirrors the listener's: a chunk the listener should still hold is sent
+ * as a reference to its hash, and anything else as literal text.
+ *
+ * The mirror goes out of step when a datagram is lost or the peer restarts. The
+ * listener then shows the missing chunk as a placeholder and reports its hash back,
+ * and the sender forgets it so that it goes out as text the next time.
+ *
+ * Dedup datagrams start with a \0 byte like FEC datagrams, and can be carried in FEC
+ * datagrams. Decoding is always on; only sending them is optional.
+ */
+
+#define DEDUP_MIN_CHUNK_LEN 64
+#define DEDUP_MAX_CHUNK_LEN 1024
+// Longer messages are sent without dedup. Leaves room for the record headers of the
+// most chunks a message this long can have, even inside a frame inside an FEC datagram.
+#define DEDUP_MAX_TEXT_LEN 60000
+
+bool Dedup_isDedupDatagram(const char* pDatagram, size_t length);
+
+/*
+ * cacheBytes is the total length of the chunks each cache holds. It should be the
+ * same on both sides; a listener with a smaller cache reports more misses.
+ */
+bool DedupEncoder_init(size_t cacheBytes);
+
+/*
+ * Writes the dedup datagram for the text into pDatagram, which must have room for
+ * MSG_MAX_LEN bytes. The text must be at most DEDUP_MAX_TEXT_LEN long.
+ * Returns the length of the datagram. Only called by the sender.
+ */
+size_t DedupEncoder_encode(const char* pText, size_t length, char* pDatagram);
+
+bool DedupDecoder_init(size_t cacheBytes);
+
+/*
+ * Handles one dedup datagram. Message datagrams are decoded into pText, which must
+ * have room for maxTextLength bytes; miss reports from the peer update the sender's
+ * cache. Returns the length of the text, or -1 if the datagram has no text or is
+ * malformed. Only called by the listener.
+ */
+ssize_t DedupDecoder_receive(const char* pDatagram, size_t length, char* pText,
+                             size_t maxTextLength);
+
+void Dedup_printStats();
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Dedup_destroy();
+
+#endif // _DEDUP_H
@@ -0,0 +1,488 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fec.h"
+#include "message_sender.h"
+
+#define FEC_KIND_DATA 0
+#define FEC_KIND_PARITY 1
+
+#define FEC_NUM_WORDS ((FEC_MAX_PAYLOAD_LEN + 7) / 8)
+// Blocks the decoder keeps around waiting for their missing datagram or parity.
+#define FEC_WINDOW_BLOCKS 16
+// Loss is measured over this many data datagrams at a time.
+#define FEC_LOSS_WINDOW 256
+// A sequence number this far behind the highest one seen means the peer restarted.
+#define FEC_RESTART_DISTANCE (1 << 20)
+// With adaptive block sizes, aim for this many losses per block on average. XOR
+// parity can only rebuild one, so this keeps blocks with two or more rare.
+#define FEC_LOSSES_PER_BLOCK 0.1
+#define FEC_MIN_ADAPTIVE_BLOCK_SIZE 2
+#define FEC_MAX_ADAPTIVE_BLOCK_SIZE 16
+
+/*
+ * Header of every FEC datagram, in network byte order:
+ *   0     \0
+ *   1     'F'
+ *   2     kind: data or parity
+ *   3     data: index in the block, parity: number of data datagrams in the block
+ *   4-7   sequence number of the first data datagram in the block
+ *   8-9   data: payload length, parity: XOR of the data payload lengths
+ *   10    parity: loss measured on the datagrams received from the peer, out of 255
+ *   11    reserved, 0
+ * The parity payload is the XOR of the data payloads, each padded with zeros to the
+ * longest one.
+ */
+typedef struct FecHeader_s FecHeader;
+struct FecHeader_s {
+    unsigned char kind;
+    unsigned char indexOrCount;
+    uint32_t blockStart;
+    uint16_t length;
+    unsigned char lossReport;
+};
+
+/*
+ * A block the decoder is collecting. The XOR of everything received for the block
+ * is kept instead of the datagrams themselves: once the parity and all but one data
+ * payload are in, it is the missing payload.
+ */
+typedef struct FecBlock_s FecBlock;
+struct FecBlock_s {
+    bool isInUse;
+    // Every payload of the block was delivered.
+    bool isComplete;
+    uint32_t blockStart;
+    uint32_t receivedMask;
+    // 0 until the parity datagram arrives.
+    int numInBlock;
+    uint16_t lengthXor;
+    // How far into pWords anything was XORed.
+    size_t xorLength;
+    uint64_t* pWords;
+};
+
+// Protects the loss measurements shared between the sender and the listener.
+static pthread_mutex_t s_syncLossMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_adaptiveBlockSize = FEC_MAX_ADAPTIVE_BLOCK_SIZE;
+static double s_measuredLoss = 0;
+
+// Encoder state. Only touched by the sender thread.
+static int s_fixedBlockSize = 0;
+static uint32_t s_nextSeq = 0;
+static uint32_t s_blockStart = 0;
+static int s_blockSize = 0;
+static int s_numInBlock = 0;
+static uint16_t s_lengthXor = 0;
+static size_t s_parityLength = 0;
+static uint64_t s_parityWords[FEC_NUM_WORDS];
+static unsigned long s_numDataSent = 0;
+static unsigned long s_numParitySent = 0;
+
+// Decoder state. Only touched by the listener thread.
+static FecBlock s_blocks[FEC_WINDOW_BLOCKS];
+static uint64_t* s_pBlockWords = NULL;
+static bool s_isDecoderUnavailable = false;
+static bool s_hasSeenData = false;
+static uint32_t s_windowStart = 0;
+static uint32_t s_highestSeq = 0;
+static unsigned long s_numInWindow = 0;
+static bool s_hasPeerReport = false;
+static uint32_t s_lastPeerReportBlockStart = 0;
+static unsigned long long s_numExpectedBeforeWindow = 0;
+static unsigned long long s_numDataReceived = 0;
+static unsigned long long s_numParityReceived = 0;
+static unsigned long long s_numRecovered = 0;
+static unsigned long long s_numDuplicates = 0;
+static unsigned long long s_numMalformed = 0;
+
+/*
+ * XORs the bytes into the words, 8 bytes at a time. The loop is simple enough for
+ * the compiler to vectorize.
+ */
+static void xorIntoWords(uint64_t* pWords, const char* pBytes, size_t length)
+{
+    size_t numWords = length / 8;
+    size_t i;
+    for (i = 0; i < numWords; i++) {
+        uint64_t word;
+        memcpy(&word, pBytes + i * 8, sizeof(word));
+        pWords[i] ^= word;
+    }
+    unsigned char* pTail = (unsigned char*) (pWords + numWords);
+    for (i = numWords * 8; i < length; i++) {
+        pTail[i - numWords * 8] ^= (unsigned char) pBytes[i];
+    }
+}
+
+static void writeHeader(char* pDatagram, const FecHeader* pHeader)
+{
+    uint32_t blockStart = htonl(pHeader->blockStart);
+    uint16_t length = htons(pHeader->length);
+    pDatagram[0] = '\0';
+    pDatagram[1] = 'F';
+    pDatagram[2] = (char) pHeader->kind;
+    pDatagram[3] = (char) pHeader->indexOrCount;
+    memcpy(pDatagram + 4, &blockStart, sizeof(blockStart));
+    memcpy(pDatagram + 8, &length, sizeof(length));
+    pDatagram[10] = (char) pHeader->lossReport;
+    pDatagram[11] = '\0';
+}
+
+static void readHeader(const char* pDatagram, FecHeader* pHeader)
+{
+    uint32_t blockStart;
+    uint16_t length;
+    memcpy(&blockStart, pDatagram + 4, sizeof(blockStart));
+    memcpy(&length, pDatagram + 8, sizeof(length));
+    pHeader->kind = (unsigned char) pDatagram[2];
+    pHeader->indexOrCount = (unsigned char) pDatagram[3];
+    pHeader->blockStart = ntohl(blockStart);
+    pHeader->length = ntohs(length);
+    pHeader->lossReport = (unsigned char) pDatagram[10];
+}
+
+bool Fec_isFecDatagram(const char* pDatagram, size_t length)
+{
+    return length >= FEC_HEADER_LEN && pDatagram[0] == '\0' && pDatagram[1] == 'F';
+}
+
+static int getBlockSizeForLoss(double lossFraction)
+{
+    if (lossFraction * FEC_MAX_ADAPTIVE_BLOCK_SIZE <= FEC_LOSSES_PER_BLOCK) {
+        return FEC_MAX_ADAPTIVE_BLOCK_SIZE;
+    }
+    int blockSize = (int) (FEC_LOSSES_PER_BLOCK / lossFraction);
+    return blockSize < FEC_MIN_ADAPTIVE_BLOCK_SIZE ? FEC_MIN_ADAPTIVE_BLOCK_SIZE : blockSize;
+}
+
+void FecEncoder_init(int blockSize)
+{
+    s_fixedBlockSize = blockSize;
+}
+
+size_t FecEncoder_encodeData(const char* pPayload, size_t length, char* pDatagram)
+{
+    if (s_numInBlock == 0) {
+        s_blockStart = s_nextSeq;
+        if (s_fixedBlockSize > 0) {
+            s_blockSize = s_fixedBlockSize;
+        } else {
+            pthread_mutex_lock(&s_syncLossMutex);
+            s_blockSize = s_adaptiveBlockSize;
+            pthread_mutex_unlock(&s_syncLossMutex);
+        }
+    }
+
+    FecHeader header = {
+        .kind = FEC_KIND_DATA,
+        .indexOrCount = (unsigned char) s_numInBlock,
+        .blockStart = s_blockStart,
+        .length = (uint16_t) length
+    };
+    writeHeader(pDatagram, &header);
+    memcpy(pDatagram + FEC_HEADER_LEN, pPayload, length);
+
+    xorIntoWords(s_parityWords, pPayload, length);
+    s_lengthXor ^= (uint16_t) length;
+    if (length > s_parityLength) {
+        s_parityLength = length;
+    }
+    s_numInBlock++;
+    s_nextSeq++;
+    s_numDataSent++;
+    return FEC_HEADER_LEN + length;
+}
+
+size_t FecEncoder_takeParity(bool isFlushing, char* pDatagram)
+{
+    if (s_numInBlock == 0 || (s_numInBlock < s_blockSize && !isFlushing)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&s_syncLossMutex);
+    double measuredLoss = s_measuredLoss;
+    pthread_mutex_unlock(&s_syncLossMutex);
+
+    FecHeader header = {
+        .kind = FEC_KIND_PARITY,
+        .indexOrCount = (unsigned char) s_numInBlock,
+        .blockStart = s_blockStart,
+        .length = s_lengthXor,
+        // Round up so that any loss at all is reported.
+        .lossReport = (unsigned char) (measuredLoss >= 1.0 ? 255 : measuredLoss * 255 + 0.999)
+    };
+    writeHeader(pDatagram, &header);
+    memcpy(pDatagram + FEC_HEADER_LEN, s_parityWords, s_parityLength);
+    size_t sizeOfDatagram = FEC_HEADER_LEN + s_parityLength;
+
+    memset(s_parityWords, 0, (s_parityLength + 7) / 8 * 8);
+    s_parityLength = 0;
+    s_lengthXor = 0;
+    s_numInBlock = 0;
+    s_numParitySent++;
+    return sizeOfDatagram;
+}
+
+void FecEncoder_onLossReport(double lossFraction)
+{
+    pthread_mutex_lock(&s_syncLossMutex);
+    s_adaptiveBlockSize = getBlockSizeForLoss(lossFraction);
+    pthread_mutex_unlock(&s_syncLossMutex);
+}
+
+static void resetBlock(FecBlock* pBlock, uint32_t blockStart)
+{
+    memset(pBlock->pWords, 0, (pBlock->xorLength + 7) / 8 * 8);
+    pBlock->isInUse = true;
+    pBlock->isComplete = false;
+    pBlock->blockStart = blockStart;
+    pBlock->receivedMask = 0;
+    pBlock->numInBlock = 0;
+    pBlock->lengthXor = 0;
+    pBlock->xorLength = 0;
+}
+
+static bool allocateBlocks()
+{
+    if (s_pBlockWords != NULL) {
+        return true;
+    }
+    if (s_isDecoderUnavailable) {
+        return false;
+    }
+    s_pBlockWords = calloc((size_t) FEC_WINDOW_BLOCKS * FEC_NUM_WORDS, sizeof(uint64_t));
+    if (s_pBlockWords == NULL) {
+        fputs("Not enough memory for FEC decoding, lost datagrams won't be rebuilt\n", stdout);
+        s_isDecoderUnavailable = true;
+        return false;
+    }
+    int i;
+    for (i = 0; i < FEC_WINDOW_BLOCKS; i++) {
+        s_blocks[i].pWords = s_pBlockWords + (size_t) i * FEC_NUM_WORDS;
+    }
+    return true;
+}
+
+/*
+ * Returns the block starting at blockStart, replacing the oldest block if it isn't
+ * in the window yet. Returns NULL if the block is older than all of the window.
+ */
+static FecBlock* findBlock(uint32_t blockStart)
+{
+    if (!allocateBlocks()) {
+        return NULL;
+    }
+    FecBlock* pVictim = NULL;
+    int i;
+    for (i = 0; i < FEC_WINDOW_BLOCKS; i++) {
+        FecBlock* pBlock = &s_blocks[i];
+        if (!pBlock->isInUse) {
+            pVictim = pBlock;
+        } else if (pBlock->blockStart == blockStart) {
+            return pBlock;
+        } else if (pVictim == NULL
+                   || (pVictim->isInUse && (int32_t) (pBlock->blockStart - pVictim->blockStart) < 0)) {
+            pVictim = pBlock;
+        }
+    }
+    if (pVictim->isInUse && (int32_t) (blockStart - pVictim->blockStart) < 0) {
+        return NULL;
+    }
+    resetBlock(pVictim, blockStart);
+    return pVictim;
+}
+
+static void addToBlock(FecBlock* pBlock, const char* pPayload, size_t length, uint16_t lengthXor)
+{
+    xorIntoWords(pBlock->pWords, pPayload, length);
+    pBlock->lengthXor ^= lengthXor;
+    if (length > pBlock->xorLength) {
+        pBlock->xorLength = length;
+    }
+}
+
+/*
+ * Keeps track of the sequence numbers seen to measure loss before recovery.
+ */
+static void noteSequenceNumber(uint32_t seq, bool isReceived)
+{
+    if (!s_hasSeenData) {
+        s_hasSeenData = true;
+        s_windowStart = seq;
+        s_highestSeq = seq;
+    }
+    if ((int32_t) (seq - s_highestSeq) > 0) {
+        s_highestSeq = seq;
+    }
+    if (isReceived && (int32_t) (seq - s_windowStart) >= 0) {
+        s_numInWindow++;
+    }
+
+    uint32_t windowLength = s_highestSeq - s_windowStart + 1;
+    if (windowLength >= FEC_LOSS_WINDOW) {
+        unsigned long numReceived = s_numInWindow < windowLength ? s_numInWindow : windowLength;
+        pthread_mutex_lock(&s_syncLossMutex);
+        s_measuredLoss = 1.0 - (double) numReceived / windowLength;
+        pthread_mutex_unlock(&s_syncLossMutex);
+
+        s_numExpectedBeforeWindow += windowLength;
+        s_windowStart = s_highestSeq + 1;
+        s_numInWindow = 0;
+    }
+}
+
+/*
+ * Starts over, keeping the totals, if the peer's sequence numbers went far back
+ * because it restarted.
+ */
+static void checkForPeerRestart(uint32_t blockStart)
+{
+    if (!s_hasSeenData || (int32_t) (blockStart - s_highestSeq) >= -FEC_RESTART_DISTANCE) {
+        return;
+    }
+    s_numExpectedBeforeWindow += s_highestSeq - s_windowStart + 1;
+    s_windowStart = blockStart;
+    s_highestSeq = blockStart;
+    s_numInWindow = 0;
+    s_hasPeerReport = false;
+    int i;
+    for (i = 0; i < FEC_WINDOW_BLOCKS; i++) {
+        s_blocks[i].isInUse = false;
+    }
+}
+
+/*
+ * Rebuilds the block's missing payload if the parity and all other payloads are in.
+ * Returns true if onPayload did.
+ */
+static bool tryRecover(FecBlock* pBlock, FecPayloadFn onPayload)
+{
+    if (pBlock->numInBlock == 0 || pBlock->isComplete) {
+        return false;
+    }
+    uint32_t allMask = pBlock->numInBlock == 32 ? UINT32_MAX : (1U << pBlock->numInBlock) - 1;
+    uint32_t missingMask = allMask & ~pBlock->receivedMask;
+    if (missingMask == 0) {
+        pBlock->isComplete = true;
+        return false;
+    }
+    if ((missingMask & (missingMask - 1)) != 0) {
+        // More than one is missing, so wait for the others.
+        return false;
+    }
+    pBlock->isComplete = true;
+    if (pBlock->lengthXor > pBlock->xorLength) {
+        s_numMalformed++;
+        return false;
+    }
+    pBlock->receivedMask |= missingMask;
+    s_numRecovered++;
+    return onPayload((const char*) pBlock->pWords, pBlock->lengthXor);
+}
+
+/*
+ * Passes the loss the peer measured on our datagrams to the sender, at most once
+ * per loss window.
+ */
+static void handlePeerLossReport(const FecHeader* pHeader)
+{
+    if (s_hasPeerReport
+        && (int32_t) (pHeader->blockStart - s_lastPeerReportBlockStart) < FEC_LOSS_WINDOW) {
+        return;
+    }
+    s_hasPeerReport = true;
+    s_lastPeerReportBlockStart = pHeader->blockStart;
+    Sender_onLossReport(pHeader->lossReport / 255.0);
+}
+
+bool FecDecoder_receive(const char* pDatagram, size_t length, FecPayloadFn onPayload)
+{
+    FecHeader header;
+    readHeader(pDatagram, &header);
+    const char* pPayload = pDatagram + FEC_HEADER_LEN;
+    size_t sizeOfPayload = length - FEC_HEADER_LEN;
+    checkForPeerRestart(header.blockStart);
+
+    if (header.kind == FEC_KIND_DATA) {
+        if (header.indexOrCount >= FEC_MAX_BLOCK_SIZE || header.length != sizeOfPayload) {
+            s_numMalformed++;
+            return false;
+        }
+        uint32_t bit = 1U << header.indexOrCount;
+        FecBlock* pBlock = findBlock(header.blockStart);
+        if (pBlock != NULL && (pBlock->receivedMask & bit) != 0) {
+            // Already received, or rebuilt before it showed up.
+            s_numDuplicates++;
+            return false;
+        }
+        noteSequenceNumber(header.blockStart + header.indexOrCount, true);
+        s_numDataReceived++;
+        if (pBlock != NULL) {
+            pBlock->receivedMask |= bit;
+            addToBlock(pBlock, pPayload, sizeOfPayload, header.length);
+        }
+        if (onPayload(pPayload, sizeOfPayload)) {
+            return true;
+        }
+        return pBlock != NULL && tryRecover(pBlock, onPayload);
+    }
+
+    if (header.kind == FEC_KIND_PARITY) {
+        if (header.indexOrCount == 0 || header.indexOrCount > FEC_MAX_BLOCK_SIZE) {
+            s_numMalformed++;
+            return false;
+        }
+        s_numParityReceived++;
+        noteSequenceNumber(header.blockStart + header.indexOrCount - 1, false);
+        handlePeerLossReport(&header);
+
+        FecBlock* pBlock = findBlock(header.blockStart);
+        if (pBlock == NULL || pBlock->numInBlock != 0) {
+            return false;
+        }
+        pBlock->numInBlock = header.indexOrCount;
+        addToBlock(pBlock, pPayload, sizeOfPayload, header.length);
+        return tryRecover(pBlock, onPayload);
+    }
+
+    s_numMalformed++;
+    return false;
+}
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Fec_printStats()
+{
+    if (s_numDataSent > 0) {
+        printf("FEC: %lu data and %lu parity datagrams sent\n", s_numDataSent, s_numParitySent);
+    }
+    if (!s_hasSeenData) {
+        return;
+    }
+    unsigned long long numExpected = s_numExpectedBeforeWindow;
+    if ((int32_t) (s_highestSeq - s_windowStart) >= 0) {
+        numExpected += s_highestSeq - s_windowStart + 1;
+    }
+    unsigned long long numLost = numExpected > s_numDataReceived ? numExpected - s_numDataReceived : 0;
+    unsigned long long numUnrecoverable = numLost > s_numRecovered ? numLost - s_numRecovered : 0;
+    printf("FEC: %llu data and %llu parity datagrams received, %llu of %llu lost, "
+           "%llu rebuilt, %llu unrecoverable",
+           s_numDataReceived, s_numParityReceived, numLost, numExpected,
+           s_numRecovered, numUnrecoverable);
+    if (s_numDuplicates > 0 || s_numMalformed > 0) {
+        printf(", %llu duplicates, %llu malformed", s_numDuplicates, s_numMalformed);
+    }
+    printf("\n");
+}
+
+void Fec_destroy()
+{
+    free(s_pBlockWords);
+    s_pBlockWords = NULL;
+    memset(s_blocks, 0, sizeof(s_blocks));
+}
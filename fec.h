@@ -0,0 +1,78 @@
+#ifndef _FEC_H
+#define _FEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "common.h"
+
+/*
+ * Forward error correction for datagrams sent over UDP.
+ *
+ * Outbound datagrams are grouped into blocks of up to FEC_MAX_BLOCK_SIZE, and each
+ * block is followed by one parity datagram holding the XOR of the block's payloads.
+ * The receiver can rebuild any single lost datagram of a block without a round trip.
+ * Parity datagrams also carry the loss the receiver measured in the other direction,
+ * so that each sender can adapt its block size to the loss on its own path.
+ *
+ * FEC datagrams start with a \0 byte, which a plain text datagram never does, so they
+ * can be mixed with plain datagrams on the same socket. Decoding is always on; only
+ * sending them is optional.
+ */
+
+#define FEC_HEADER_LEN 12
+#define FEC_MAX_BLOCK_SIZE 32
+// Messages longer than this are sent without FEC.
+#define FEC_MAX_PAYLOAD_LEN (MSG_MAX_LEN - FEC_HEADER_LEN)
+
+/*
+ * Called by the decoder with each payload it received or rebuilt. Returns true if
+ * the listener should stop.
+ */
+typedef bool (*FecPayloadFn)(const char* pPayload, size_t length);
+
+/*
+ * Returns true if the datagram is an FEC data or parity datagram.
+ */
+bool Fec_isFecDatagram(const char* pDatagram, size_t length);
+
+/*
+ * blockSize is the number of data datagrams per parity datagram, or 0 to pick it
+ * from the loss reported by the peer.
+ */
+void FecEncoder_init(int blockSize);
+
+/*
+ * Writes the FEC data datagram for the payload into pDatagram, which must have
+ * room for MSG_MAX_LEN bytes, and adds the payload to the current block's parity.
+ * Returns the length of the datagram. Only called by the sender.
+ */
+size_t FecEncoder_encodeData(const char* pPayload, size_t length, char* pDatagram);
+
+/*
+ * If the current block is full, or it has anything in it and isFlushing is true,
+ * writes its parity datagram into pDatagram and starts a new block.
+ * Returns the length of the parity datagram, or 0 if there is none to send yet.
+ * Only called by the sender.
+ */
+size_t FecEncoder_takeParity(bool isFlushing, char* pDatagram);
+
+/*
+ * Adapts the block size to the fraction of our datagrams the peer reported as lost.
+ */
+void FecEncoder_onLossReport(double lossFraction);
+
+/*
+ * Handles one FEC datagram, calling onPayload for its payload and for any payload
+ * it lets the decoder rebuild. Rebuilt payloads may come after ones sent later.
+ * Returns true if onPayload did. Only called by the listener.
+ */
+bool FecDecoder_receive(const char* pDatagram, size_t length, FecPayloadFn onPayload);
+
+void Fec_printStats();
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Fec_destroy();
+
+#endif // _FEC_H
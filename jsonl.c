@@ -0,0 +1,666 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "jsonl.h"
+
+#define JSONL_OUT_BUFFER_LEN (64 * 1024)
+// Room the escaper needs at the end of the buffer to take one more vector of text.
+#define JSONL_MIN_ESCAPE_ROOM (16 * JSONL_MAX_EXPANSION)
+#define JSONL_MAX_PEER_LEN 300
+
+static bool s_isEnabled = false;
+
+// The stdout that was, which only JSON is written to.
+static int s_outFd = -1;
+static char s_outBuffer[JSONL_OUT_BUFFER_LEN];
+static size_t s_outLength = 0;
+// Set if stdout was closed, after which output is dropped.
+static bool s_hasOutputFailed = false;
+// The printer writes messages and the keyboard reader writes errors.
+static pthread_mutex_t s_syncOutputMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The peer's "host:port", escaped once for every message.
+static char s_escapedPeer[JSONL_MAX_EXPANSION * JSONL_MAX_PEER_LEN];
+static size_t s_escapedPeerLength = 0;
+// Added to CLOCK_MONOTONIC times to make them Unix times.
+static int64_t s_realtimeOffsetNs = 0;
+static uint64_t s_nextSequence = 1;
+
+// Lines of stdin are read into here, and parsed in place.
+static char s_lineBuffer[JSONL_MAX_LINE_LEN];
+static size_t s_lineStart = 0;
+static size_t s_lineEnd = 0;
+// Set while the rest of a line too long for the buffer is thrown away.
+static bool s_isSkippingLine = false;
+
+static unsigned long s_numMessagesWritten = 0;
+static unsigned long s_numFlushes = 0;
+static unsigned long s_numCommands = 0;
+static unsigned long s_numBadLines = 0;
+
+static const char s_hexDigits[] = "0123456789abcdef";
+
+/*
+ * Writes the byte as an escape sequence. Returns where the escape ends.
+ */
+static char* escapeByte(char* pOut, uint8_t byte)
+{
+    pOut[0] = '\\';
+    switch (byte) {
+        case '"':
+        case '\\':
+            pOut[1] = (char) byte;
+            return pOut + 2;
+        case '\n':
+            pOut[1] = 'n';
+            return pOut + 2;
+        case '\r':
+            pOut[1] = 'r';
+            return pOut + 2;
+        case '\t':
+            pOut[1] = 't';
+            return pOut + 2;
+        case '\b':
+            pOut[1] = 'b';
+            return pOut + 2;
+        case '\f':
+            pOut[1] = 'f';
+            return pOut + 2;
+        default:
+            memcpy(pOut + 1, "u00", 3);
+            pOut[4] = s_hexDigits[byte >> 4];
+            pOut[5] = s_hexDigits[byte & 0xf];
+            return pOut + 6;
+    }
+}
+
+static bool isEscaped(uint8_t byte)
+{
+    return byte < 0x20 || byte == '"' || byte == '\\';
+}
+
+size_t Jsonl_escapeScalar(const char* pText, size_t length, char* pOut)
+{
+    char* pOutStart = pOut;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        uint8_t byte = (uint8_t) pText[i];
+        if (isEscaped(byte)) {
+            pOut = escapeByte(pOut, byte);
+        } else {
+            *pOut++ = (char) byte;
+        }
+    }
+    return (size_t) (pOut - pOutStart);
+}
+
+#ifdef __SSE2__
+/*
+ * Returns a mask of the bytes that are controls, quotes or backslashes.
+ */
+static unsigned int getSpecialMask(__m128i bytes)
+{
+    // A byte is under 0x20 if the smaller of it and 0x1f is itself, which compares
+    // them as unsigned, unlike _mm_cmplt_epi8.
+    __m128i isControl = _mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(0x1f)), bytes);
+    __m128i isQuote = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"'));
+    __m128i isBackslash = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\'));
+    return (unsigned int) _mm_movemask_epi8(_mm_or_si128(isControl,
+                                                         _mm_or_si128(isQuote, isBackslash)));
+}
+#endif
+
+size_t Jsonl_escape(const char* pText, size_t length, char* pOut)
+{
+#ifdef __SSE2__
+    const char* pIn = pText;
+    const char* pEnd = pText + length;
+    char* pOutStart = pOut;
+    while (pEnd - pIn >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) pIn);
+        // Stored before it is known how much of it is copied as is. The output has
+        // room for it, and the bytes past those are written over.
+        _mm_storeu_si128((__m128i*) pOut, bytes);
+        unsigned int specialMask = getSpecialMask(bytes);
+        if (specialMask == 0) {
+            pIn += 16;
+            pOut += 16;
+            continue;
+        }
+        int numPlain = __builtin_ctz(specialMask);
+        pOut = escapeByte(pOut + numPlain, (uint8_t) pIn[numPlain]);
+        pIn += numPlain + 1;
+    }
+    return (size_t) (pOut - pOutStart) + Jsonl_escapeScalar(pIn, (size_t) (pEnd - pIn), pOut);
+#else
+    return Jsonl_escapeScalar(pText, length, pOut);
+#endif
+}
+
+/*
+ * Returns the first quote, backslash or control character in the string, or pEnd.
+ */
+static char* findStringSpecial(char* p, const char* pEnd)
+{
+#ifdef __SSE2__
+    while (pEnd - p >= 16) {
+        unsigned int specialMask = getSpecialMask(_mm_loadu_si128((const __m128i*) p));
+        if (specialMask != 0) {
+            return p + __builtin_ctz(specialMask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < pEnd && !isEscaped((uint8_t) *p)) {
+        p++;
+    }
+    return p;
+}
+
+static char* skipSpace(char* p, const char* pEnd)
+{
+    while (p < pEnd && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+/*
+ * Reads 4 hex digits. Returns -1 if they aren't.
+ */
+static long parseHex4(const char* p, const char* pEnd)
+{
+    if (pEnd - p < 4) {
+        return -1;
+    }
+    long value = 0;
+    int i;
+    for (i = 0; i < 4; i++) {
+        char c = p[i];
+        int digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return -1;
+        }
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+static char* writeUtf8(char* pOut, unsigned long codePoint)
+{
+    if (codePoint < 0x80) {
+        *pOut++ = (char) codePoint;
+    } else if (codePoint < 0x800) {
+        *pOut++ = (char) (0xc0 | (codePoint >> 6));
+        *pOut++ = (char) (0x80 | (codePoint & 0x3f));
+    } else if (codePoint < 0x10000) {
+        *pOut++ = (char) (0xe0 | (codePoint >> 12));
+        *pOut++ = (char) (0x80 | ((codePoint >> 6) & 0x3f));
+        *pOut++ = (char) (0x80 | (codePoint & 0x3f));
+    } else {
+        *pOut++ = (char) (0xf0 | (codePoint >> 18));
+        *pOut++ = (char) (0x80 | ((codePoint >> 12) & 0x3f));
+        *pOut++ = (char) (0x80 | ((codePoint >> 6) & 0x3f));
+        *pOut++ = (char) (0x80 | (codePoint & 0x3f));
+    }
+    return pOut;
+}
+
+/*
+ * Reads a \u escape, or a surrogate pair of them, starting after the "\u", and
+ * writes it as UTF-8. The UTF-8 is never longer than the escape, so this works in
+ * place. Returns where the escape ends, or NULL if it is invalid.
+ */
+static char* unescapeUnicode(char* p, const char* pEnd, char** ppOut)
+{
+    long codePoint = parseHex4(p, pEnd);
+    if (codePoint < 0 || (codePoint >= 0xdc00 && codePoint <= 0xdfff)) {
+        return NULL;
+    }
+    p += 4;
+    if (codePoint >= 0xd800 && codePoint <= 0xdbff) {
+        long low = pEnd - p >= 2 && p[0] == '\\' && p[1] == 'u' ? parseHex4(p + 2, pEnd) : -1;
+        if (low < 0xdc00 || low > 0xdfff) {
+            return NULL;
+        }
+        codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+        p += 6;
+    }
+    *ppOut = writeUtf8(*ppOut, (unsigned long) codePoint);
+    return p;
+}
+
+/*
+ * Parses the string starting at the quote at *pp, unescaping it in place, and
+ * moves *pp past it. Returns false, with why in *ppError, if it isn't valid.
+ */
+static bool parseString(char** pp, const char* pEnd, char** ppString, size_t* pLength,
+                        const char** ppError)
+{
+    char* p = *pp + 1;
+    char* pOut = p;
+    *ppString = pOut;
+    while (1) {
+        // Runs of plain characters are found a vector at a time, and only moved
+        // once an escape has made the string shorter than the line.
+        char* pSpecial = findStringSpecial(p, pEnd);
+        size_t runLength = (size_t) (pSpecial - p);
+        if (pOut != p) {
+            memmove(pOut, p, runLength);
+        }
+        pOut += runLength;
+        p = pSpecial;
+        if (p == pEnd) {
+            *ppError = "unterminated string";
+            return false;
+        }
+        if (*p == '"') {
+            break;
+        }
+        if (*p != '\\') {
+            *ppError = "control character in string";
+            return false;
+        }
+        if (pEnd - p < 2) {
+            *ppError = "unterminated string";
+            return false;
+        }
+        char escape = p[1];
+        p += 2;
+        switch (escape) {
+            case '"':
+            case '\\':
+            case '/':
+                *pOut++ = escape;
+                break;
+            case 'n':
+                *pOut++ = '\n';
+                break;
+            case 'r':
+                *pOut++ = '\r';
+                break;
+            case 't':
+                *pOut++ = '\t';
+                break;
+            case 'b':
+                *pOut++ = '\b';
+                break;
+            case 'f':
+                *pOut++ = '\f';
+                break;
+            case 'u':
+                p = unescapeUnicode(p, pEnd, &pOut);
+                if (p == NULL) {
+                    *ppError = "invalid \\u escape";
+                    return false;
+                }
+                break;
+            default:
+                *ppError = "invalid escape";
+                return false;
+        }
+    }
+    *pLength = (size_t) (pOut - *ppString);
+    *pp = p + 1;
+    return true;
+}
+
+/*
+ * Skips a number, true, false or null. Returns false if there isn't one.
+ */
+static bool skipLiteral(char** pp, const char* pEnd)
+{
+    char* p = *pp;
+    while (p < pEnd && ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z')
+                        || *p == '-' || *p == '+' || *p == '.' || *p == 'E')) {
+        p++;
+    }
+    bool isLiteral = p != *pp;
+    *pp = p;
+    return isLiteral;
+}
+
+static bool isString(const char* pString, size_t length, const char* pExpected)
+{
+    return length == strlen(pExpected) && memcmp(pString, pExpected, length) == 0;
+}
+
+bool Jsonl_parseCommand(char* pLine, size_t length, JsonlCommand* pCommand,
+                        const char** ppError)
+{
+    const char* pEnd = pLine + length;
+    char* p = skipSpace(pLine, pEnd);
+    if (p == pEnd || *p != '{') {
+        *ppError = "expected an object";
+        return false;
+    }
+    p = skipSpace(p + 1, pEnd);
+
+    char* pCmd = NULL;
+    size_t cmdLength = 0;
+    char* pText = NULL;
+    size_t textLength = 0;
+    bool isEmpty = p < pEnd && *p == '}';
+    while (!isEmpty) {
+        if (p == pEnd || *p != '"') {
+            *ppError = "expected a key";
+            return false;
+        }
+        char* pKey;
+        size_t keyLength;
+        if (!parseString(&p, pEnd, &pKey, &keyLength, ppError)) {
+            return false;
+        }
+        p = skipSpace(p, pEnd);
+        if (p == pEnd || *p != ':') {
+            *ppError = "expected a colon";
+            return false;
+        }
+        p = skipSpace(p + 1, pEnd);
+
+        bool isCmd = isString(pKey, keyLength, "cmd");
+        bool isText = isString(pKey, keyLength, "text");
+        if (p < pEnd && *p == '"') {
+            char* pValue;
+            size_t valueLength;
+            if (!parseString(&p, pEnd, &pValue, &valueLength, ppError)) {
+                return false;
+            }
+            if (isCmd) {
+                pCmd = pValue;
+                cmdLength = valueLength;
+            } else if (isText) {
+                pText = pValue;
+                textLength = valueLength;
+            }
+        } else if (isCmd || isText) {
+            *ppError = isCmd ? "cmd must be a string" : "text must be a string";
+            return false;
+        } else if (p < pEnd && (*p == '{' || *p == '[')) {
+            *ppError = "objects and arrays aren't supported as values";
+            return false;
+        } else if (!skipLiteral(&p, pEnd)) {
+            *ppError = "expected a value";
+            return false;
+        }
+
+        // Other keys are skipped, so that newer clients can add them.
+        p = skipSpace(p, pEnd);
+        if (p < pEnd && *p == '}') {
+            break;
+        }
+        if (p == pEnd || *p != ',') {
+            *ppError = "expected a comma or the end of the object";
+            return false;
+        }
+        p = skipSpace(p + 1, pEnd);
+    }
+    if (skipSpace(p + 1, pEnd) != pEnd) {
+        *ppError = "more after the end of the object";
+        return false;
+    }
+
+    if (pCmd != NULL && isString(pCmd, cmdLength, "quit")) {
+        pCommand->type = JSONL_COMMAND_QUIT;
+        pCommand->pText = NULL;
+        pCommand->length = 0;
+        return true;
+    }
+    if (pCmd == NULL || !isString(pCmd, cmdLength, "send")) {
+        *ppError = "cmd must be send or quit";
+        return false;
+    }
+    if (pText == NULL || textLength == 0) {
+        *ppError = "send needs a text that isn't empty";
+        return false;
+    }
+    // Messages go out as \0 terminated text, with room for that in a datagram.
+    if (textLength >= MSG_MAX_LEN || memchr(pText, '\0', textLength) != NULL) {
+        *ppError = "text must fit in a datagram and can't have \\u0000 in it";
+        return false;
+    }
+    pCommand->type = JSONL_COMMAND_SEND;
+    pCommand->pText = pText;
+    pCommand->length = textLength;
+    return true;
+}
+
+/*
+ * Must hold s_syncOutputMutex.
+ */
+static void flushOutput()
+{
+    size_t offset = 0;
+    while (offset < s_outLength && !s_hasOutputFailed) {
+        ssize_t numWritten = write(s_outFd, s_outBuffer + offset, s_outLength - offset);
+        if (numWritten > 0) {
+            offset += (size_t) numWritten;
+        } else if (numWritten == -1 && errno != EINTR) {
+            // The other side is gone, and there is no one left to tell.
+            s_hasOutputFailed = true;
+        }
+    }
+    if (s_outLength > 0) {
+        s_numFlushes++;
+    }
+    s_outLength = 0;
+}
+
+/*
+ * Must hold s_syncOutputMutex.
+ */
+static void writeOutput(const char* pData, size_t length)
+{
+    while (length > 0) {
+        if (s_outLength == JSONL_OUT_BUFFER_LEN) {
+            flushOutput();
+        }
+        size_t room = JSONL_OUT_BUFFER_LEN - s_outLength;
+        size_t pieceLength = length < room ? length : room;
+        memcpy(s_outBuffer + s_outLength, pData, pieceLength);
+        s_outLength += pieceLength;
+        pData += pieceLength;
+        length -= pieceLength;
+    }
+}
+
+/*
+ * Must hold s_syncOutputMutex. Escapes the text straight into the buffer, in
+ * pieces small enough that each one fits even if all of it needs escaping.
+ */
+static void writeEscaped(const char* pText, size_t length)
+{
+    while (length > 0) {
+        if (JSONL_OUT_BUFFER_LEN - s_outLength < JSONL_MIN_ESCAPE_ROOM) {
+            flushOutput();
+        }
+        size_t room = (JSONL_OUT_BUFFER_LEN - s_outLength) / JSONL_MAX_EXPANSION;
+        size_t pieceLength = length < room ? length : room;
+        s_outLength += Jsonl_escape(pText, pieceLength, s_outBuffer + s_outLength);
+        pText += pieceLength;
+        length -= pieceLength;
+    }
+}
+
+/*
+ * Must hold s_syncOutputMutex.
+ */
+static void writeUnsigned(uint64_t value, int minDigits)
+{
+    char digits[20];
+    int numDigits = 0;
+    do {
+        digits[sizeof(digits) - 1 - numDigits++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0 || numDigits < minDigits);
+    writeOutput(digits + sizeof(digits) - numDigits, (size_t) numDigits);
+}
+
+#define WRITE_LITERAL(pLiteral) writeOutput(pLiteral, sizeof(pLiteral) - 1)
+
+bool Jsonl_init(const char* pPeerHostname, in_port_t peerPort)
+{
+    char peer[JSONL_MAX_PEER_LEN];
+    snprintf(peer, sizeof(peer), "%s:%u", pPeerHostname, (unsigned int) peerPort);
+    s_escapedPeerLength = Jsonl_escape(peer, strlen(peer), s_escapedPeer);
+
+    struct timespec realtime;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    s_realtimeOffsetNs = (int64_t) realtime.tv_sec * 1000000000LL + realtime.tv_nsec
+                         - (int64_t) getMonotonicTimeNs();
+
+    // The banner, stats and error notices all print to stdout, so it is pointed at
+    // stderr, and the JSON goes to a copy of what stdout was.
+    fflush(stdout);
+    s_outFd = dup(STDOUT_FILENO);
+    if (s_outFd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+        printf("Failed to take over stdout for JSON: %s\n", strerror(errno));
+        return false;
+    }
+    s_isEnabled = true;
+    return true;
+}
+
+bool Jsonl_isEnabled()
+{
+    return s_isEnabled;
+}
+
+void Jsonl_writeMessage(const Message* pMessage)
+{
+    uint64_t timestampNs = (uint64_t) ((int64_t) pMessage->enqueueNs + s_realtimeOffsetNs);
+    pthread_mutex_lock(&s_syncOutputMutex);
+    {
+        WRITE_LITERAL("{\"event\":\"message\",\"peer\":\"");
+        writeOutput(s_escapedPeer, s_escapedPeerLength);
+        WRITE_LITERAL("\",\"sequence\":");
+        writeUnsigned(s_nextSequence++, 1);
+        WRITE_LITERAL(",\"timestamp\":");
+        writeUnsigned(timestampNs / 1000000000ULL, 1);
+        WRITE_LITERAL(".");
+        writeUnsigned(timestampNs % 1000000000ULL / 1000, 6);
+        WRITE_LITERAL(",\"length\":");
+        writeUnsigned(pMessage->length, 1);
+        WRITE_LITERAL(",\"text\":\"");
+        writeEscaped(pMessage->pText, pMessage->length);
+        WRITE_LITERAL("\"}\n");
+        s_numMessagesWritten++;
+    }
+    pthread_mutex_unlock(&s_syncOutputMutex);
+}
+
+void Jsonl_writeError(const char* pError)
+{
+    pthread_cleanup_push(unlockMutexesCleanup, &s_syncOutputMutex);
+    pthread_mutex_lock(&s_syncOutputMutex);
+    {
+        WRITE_LITERAL("{\"event\":\"error\",\"error\":\"");
+        writeEscaped(pError, strlen(pError));
+        WRITE_LITERAL("\"}\n");
+        flushOutput();
+    }
+    pthread_cleanup_pop(1);
+}
+
+void Jsonl_flush()
+{
+    // write is a cancellation point.
+    pthread_cleanup_push(unlockMutexesCleanup, &s_syncOutputMutex);
+    pthread_mutex_lock(&s_syncOutputMutex);
+    {
+        flushOutput();
+    }
+    pthread_cleanup_pop(1);
+}
+
+/*
+ * Parses the line, answering it with an error event if it isn't a valid command.
+ * Blank lines are skipped. Returns true if it was a command.
+ */
+static bool handleLine(char* pLine, size_t length, JsonlCommand* pCommand)
+{
+    if (length > 0 && pLine[length - 1] == '\r') {
+        length--;
+    }
+    if (skipSpace(pLine, pLine + length) == pLine + length) {
+        return false;
+    }
+    const char* pError;
+    if (!Jsonl_parseCommand(pLine, length, pCommand, &pError)) {
+        s_numBadLines++;
+        Jsonl_writeError(pError);
+        return false;
+    }
+    s_numCommands++;
+    return true;
+}
+
+bool Jsonl_readCommand(JsonlCommand* pCommand)
+{
+    size_t scanStart = s_lineStart;
+    while (1) {
+        char* pNewline = memchr(s_lineBuffer + scanStart, '\n', s_lineEnd - scanStart);
+        if (pNewline != NULL) {
+            char* pLine = s_lineBuffer + s_lineStart;
+            s_lineStart = (size_t) (pNewline - s_lineBuffer) + 1;
+            scanStart = s_lineStart;
+            if (s_isSkippingLine) {
+                s_isSkippingLine = false;
+            } else if (handleLine(pLine, (size_t) (pNewline - pLine), pCommand)) {
+                return true;
+            }
+            continue;
+        }
+
+        // Only part of a line is left, so it is moved to the front to make room.
+        size_t partLength = s_lineEnd - s_lineStart;
+        memmove(s_lineBuffer, s_lineBuffer + s_lineStart, partLength);
+        s_lineStart = 0;
+        s_lineEnd = partLength;
+        scanStart = partLength;
+        if (s_lineEnd == sizeof(s_lineBuffer)) {
+            if (!s_isSkippingLine) {
+                s_numBadLines++;
+                Jsonl_writeError("line is too long");
+            }
+            s_isSkippingLine = true;
+            s_lineEnd = 0;
+            scanStart = 0;
+        }
+
+        ssize_t numRead = read(STDIN_FILENO, s_lineBuffer + s_lineEnd,
+                               sizeof(s_lineBuffer) - s_lineEnd);
+        if (numRead <= 0) {
+            // The last line may not have a newline.
+            bool isCommand = !s_isSkippingLine && s_lineEnd > 0
+                             && handleLine(s_lineBuffer, s_lineEnd, pCommand);
+            s_lineEnd = 0;
+            return isCommand;
+        }
+        s_lineEnd += (size_t) numRead;
+    }
+}
+
+void Jsonl_printStats()
+{
+    if (!s_isEnabled) {
+        return;
+    }
+    printf("JSON lines: %lu messages written in %lu writes, %lu commands read, %lu bad lines\n",
+           s_numMessagesWritten, s_numFlushes, s_numCommands, s_numBadLines);
+}
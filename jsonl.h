@@ -0,0 +1,97 @@
+#ifndef _JSONL_H
+#define _JSONL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "common.h"
+
+/*
+ * JSON lines for scripts and bots (--jsonl): each received message is written to
+ * stdout as one object on a line of its own,
+ *     {"event":"message","peer":"host:port","sequence":1,"timestamp":1700000000.123456,
+ *      "length":3,"text":"hi\n"}
+ * and each line of stdin is a command,
+ *     {"cmd":"send","text":"hi\n"}
+ *     {"cmd":"quit"}
+ * A line that isn't a valid command is answered with {"event":"error","error":"..."}.
+ *
+ * Everything else the program prints goes to stderr instead, so stdout only has
+ * JSON on it. Nothing is allocated per message: objects are written through a
+ * fixed buffer, and commands are parsed in place in the line they came in.
+ */
+
+// The most a byte of text grows when escaped, as \u00XX.
+#define JSONL_MAX_EXPANSION 6
+// The longest command line: a whole datagram of text that all needs \u escapes.
+#define JSONL_MAX_LINE_LEN (JSONL_MAX_EXPANSION * MSG_MAX_LEN + 256)
+
+typedef enum {
+    JSONL_COMMAND_SEND,
+    JSONL_COMMAND_QUIT
+} JsonlCommandType;
+
+typedef struct JsonlCommand_s JsonlCommand;
+struct JsonlCommand_s {
+    JsonlCommandType type;
+    // The text to send, unescaped in place in the line. Not \0 terminated.
+    char* pText;
+    size_t length;
+};
+
+/*
+ * Escapes the text for a JSON string, 16 bytes at a time with SSE2 where there is
+ * nothing to escape. pOut must have room for JSONL_MAX_EXPANSION times the length.
+ * Bytes of 0x80 and up are copied as they are, so the text must already be valid
+ * UTF-8, which the sanitizer makes sure of.
+ * Returns the length of the escaped text.
+ */
+size_t Jsonl_escape(const char* pText, size_t length, char* pOut);
+
+/*
+ * Jsonl_escape one byte at a time. Kept for the benchmark.
+ */
+size_t Jsonl_escapeScalar(const char* pText, size_t length, char* pOut);
+
+/*
+ * Parses a command from a line without its newline, unescaping its text in place.
+ * Returns false, with why in *ppError, if it isn't a valid command.
+ */
+bool Jsonl_parseCommand(char* pLine, size_t length, JsonlCommand* pCommand,
+                        const char** ppError);
+
+/*
+ * Takes stdout over for JSON, and points what the rest of the program prints to
+ * stdout at stderr. Called by main before anything is printed.
+ * Returns false (after printing why) if it can't.
+ */
+bool Jsonl_init(const char* pPeerHostname, in_port_t peerPort);
+
+bool Jsonl_isEnabled();
+
+/*
+ * Writes a received message. Only called by the screen printer. The output is
+ * buffered until Jsonl_flush, or until the buffer is full.
+ */
+void Jsonl_writeMessage(const Message* pMessage);
+
+/*
+ * Writes an error event, and flushes it out with anything buffered before it.
+ */
+void Jsonl_writeError(const char* pError);
+
+void Jsonl_flush();
+
+/*
+ * Reads the next valid command from stdin, answering the lines that aren't with
+ * an error event. Returns false at the end of input. Only called by the keyboard
+ * reader.
+ */
+bool Jsonl_readCommand(JsonlCommand* pCommand);
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Jsonl_printStats();
+
+#endif // _JSONL_H
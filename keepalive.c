@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "keepalive.h"
+#include "message_sender.h"
+#include "options.h"
+#include "timer_wheel.h"
+
+#define NS_PER_MS 1000000ULL
+
+static bool s_isEnabled = false;
+static uint64_t s_heartbeatNs = 0;
+static uint64_t s_peerTimeoutNs = 0;
+static uint64_t s_idleTimeoutNs = 0;
+
+static Timer s_heartbeatTimer;
+static Timer s_peerTimer;
+static Timer s_idleTimer;
+
+// Written by the sender and listener, read by the timer thread.
+static _Atomic uint64_t s_lastSendNs;
+static _Atomic uint64_t s_lastReceiveNs;
+static _Atomic uint64_t s_lastMessageNs;
+
+static atomic_ulong s_numHeartbeatsSent;
+static atomic_ulong s_numHeartbeatsReceived;
+
+/*
+ * Rounded up, so that the check after the wait never comes just before the deadline.
+ */
+static uint64_t nsToMs(uint64_t ns)
+{
+    return (ns + NS_PER_MS - 1) / NS_PER_MS;
+}
+
+/*
+ * Returns how long until `lastNs + periodNs`, or 0 if that has passed.
+ */
+static uint64_t getNsUntilDeadline(uint64_t lastNs, uint64_t periodNs, uint64_t nowNs)
+{
+    uint64_t deadlineNs = lastNs + periodNs;
+    return deadlineNs > nowNs ? deadlineNs - nowNs : 0;
+}
+
+static void onHeartbeatTimer(void* unused)
+{
+    uint64_t nowNs = getMonotonicTimeNs();
+    uint64_t waitNs = getNsUntilDeadline(atomic_load_explicit(&s_lastSendNs, memory_order_relaxed),
+                                         s_heartbeatNs, nowNs);
+    if (waitNs == 0) {
+        Sender_sendHeartbeat();
+        waitNs = s_heartbeatNs;
+    }
+    Timer_schedule(&s_heartbeatTimer, nsToMs(waitNs));
+}
+
+static void onPeerTimer(void* unused)
+{
+    uint64_t nowNs = getMonotonicTimeNs();
+    uint64_t lastReceiveNs = atomic_load_explicit(&s_lastReceiveNs, memory_order_relaxed);
+    uint64_t waitNs = getNsUntilDeadline(lastReceiveNs, s_peerTimeoutNs, nowNs);
+    if (waitNs == 0) {
+        printf("Nothing received from the peer for %.1f s. Shutting down.\n",
+               (double) (nowNs - lastReceiveNs) / 1e9);
+        requestShutdownOfAllThreadsForProgram();
+        return;
+    }
+    Timer_schedule(&s_peerTimer, nsToMs(waitNs));
+}
+
+static void onIdleTimer(void* unused)
+{
+    uint64_t nowNs = getMonotonicTimeNs();
+    uint64_t lastMessageNs = atomic_load_explicit(&s_lastMessageNs, memory_order_relaxed);
+    uint64_t waitNs = getNsUntilDeadline(lastMessageNs, s_idleTimeoutNs, nowNs);
+    if (waitNs == 0) {
+        printf("No messages for %.1f s. Shutting down.\n",
+               (double) (nowNs - lastMessageNs) / 1e9);
+        requestShutdownOfAllThreadsForProgram();
+        return;
+    }
+    Timer_schedule(&s_idleTimer, nsToMs(waitNs));
+}
+
+void Keepalive_init()
+{
+    const Options* pOptions = Options_get();
+    s_peerTimeoutNs = pOptions->peerTimeoutMs * NS_PER_MS;
+    s_idleTimeoutNs = pOptions->idleTimeoutMs * NS_PER_MS;
+    s_heartbeatNs = pOptions->heartbeatMs * NS_PER_MS;
+    if (pOptions->heartbeatMs == 0 && s_peerTimeoutNs > 0) {
+        // Leaves room for two lost heartbeats before the peer gives up on us,
+        // assuming it uses the same timeout.
+        s_heartbeatNs = s_peerTimeoutNs / 3;
+    }
+    s_isEnabled = s_heartbeatNs > 0 || s_peerTimeoutNs > 0 || s_idleTimeoutNs > 0;
+    if (!s_isEnabled) {
+        return;
+    }
+
+    uint64_t nowNs = getMonotonicTimeNs();
+    atomic_store(&s_lastSendNs, nowNs);
+    atomic_store(&s_lastReceiveNs, nowNs);
+    atomic_store(&s_lastMessageNs, nowNs);
+
+    if (s_heartbeatNs > 0) {
+        Timer_init(&s_heartbeatTimer, onHeartbeatTimer, NULL);
+        Timer_schedule(&s_heartbeatTimer, nsToMs(s_heartbeatNs));
+    }
+    if (s_peerTimeoutNs > 0) {
+        Timer_init(&s_peerTimer, onPeerTimer, NULL);
+        Timer_schedule(&s_peerTimer, nsToMs(s_peerTimeoutNs));
+    }
+    if (s_idleTimeoutNs > 0) {
+        Timer_init(&s_idleTimer, onIdleTimer, NULL);
+        Timer_schedule(&s_idleTimer, nsToMs(s_idleTimeoutNs));
+    }
+}
+
+void Keepalive_onSend(bool isHeartbeat)
+{
+    if (!s_isEnabled) {
+        return;
+    }
+    uint64_t nowNs = getMonotonicTimeNs();
+    atomic_store_explicit(&s_lastSendNs, nowNs, memory_order_relaxed);
+    if (isHeartbeat) {
+        atomic_fetch_add_explicit(&s_numHeartbeatsSent, 1, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(&s_lastMessageNs, nowNs, memory_order_relaxed);
+    }
+}
+
+void Keepalive_onReceive(bool isHeartbeat)
+{
+    if (isHeartbeat) {
+        // Counted even with keepalive off, so that the stats show a peer that sends them.
+        atomic_fetch_add_explicit(&s_numHeartbeatsReceived, 1, memory_order_relaxed);
+    }
+    if (!s_isEnabled) {
+        return;
+    }
+    uint64_t nowNs = getMonotonicTimeNs();
+    atomic_store_explicit(&s_lastReceiveNs, nowNs, memory_order_relaxed);
+    if (!isHeartbeat) {
+        atomic_store_explicit(&s_lastMessageNs, nowNs, memory_order_relaxed);
+    }
+}
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Keepalive_printStats()
+{
+    unsigned long numSent = atomic_load(&s_numHeartbeatsSent);
+    unsigned long numReceived = atomic_load(&s_numHeartbeatsReceived);
+    if (numSent == 0 && numReceived == 0) {
+        return;
+    }
+    printf("Heartbeats: %lu sent, %lu received\n", numSent, numReceived);
+}
@@ -0,0 +1,38 @@
+#ifndef _KEEPALIVE_H
+#define _KEEPALIVE_H
+
+#include <stdbool.h>
+
+/*
+ * Heartbeats and timeouts, run on the timer wheel.
+ *
+ * With --heartbeat-ms, an empty datagram goes to the peer whenever nothing else was
+ * sent for that long, so that the peer (and any NAT or firewall in between) can
+ * tell we are still there. With --peer-timeout-ms, the program shuts down when
+ * nothing at all has come from the peer for that long, and with --idle-timeout-ms,
+ * when no message was sent or received for that long. Heartbeats don't count as
+ * messages.
+ *
+ * Every check reschedules itself for the moment its deadline would pass, so no
+ * timer fires more often than the deadline can actually move.
+ */
+
+/*
+ * Schedules the timers the options ask for. Called after the timer wheel and the
+ * sender are initialized.
+ */
+void Keepalive_init();
+
+/*
+ * Called by the sender after sending a message or a heartbeat.
+ */
+void Keepalive_onSend(bool isHeartbeat);
+
+/*
+ * Called by the listener for every datagram or shared-memory record.
+ */
+void Keepalive_onReceive(bool isHeartbeat);
+
+void Keepalive_printStats();
+
+#endif // _KEEPALIVE_H
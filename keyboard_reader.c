@@ -5,65 +5,99 @@
 #include <unistd.h>
 #include <errno.h>
 #include "keyboard_reader.h"
-#include "list.h"
+#include "message_queue.h"
+#include "message_pool.h"
+#include "options.h"
+#include "thread_placement.h"
 #include "common.h"
+#include "jsonl.h"
+#include "tui.h"
+#include "trace.h"
+
+// Keys come in a few at a time, or a paste at a time, in the terminal UI.
+#define TUI_KEY_BUFFER_LEN 4096
 
 static pthread_t s_threadPid;
-static pthread_cond_t s_syncMessagesAvailableCondVar = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t s_accessQueueMutex = PTHREAD_MUTEX_INITIALIZER;
 
-static List* s_outMessageQueue = NULL;
+static MessageQueue* s_pOutMessageQueue = NULL;
+static MessagePool* s_pOutMessagePool = NULL;
 
 static bool createMessageFromBufferAndPutOnQueue(char* messageBuffer, size_t sizeOfMessage,
                                                  bool isShutdownMessage)
 {
-    if (s_outMessageQueue == NULL) {
+    if (s_pOutMessageQueue == NULL) {
         return false;
     }
 
-    // Account for \0 character.
     // Will be freed after it has been sent by the message sender.
-    // Do not let this thread be cancelled, or pMessageText might be left unfreed.
+    // Do not let this thread be cancelled, or pMessage might be left unfreed.
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-    char* pMessageText = malloc(sizeof(char) * (sizeOfMessage + 1));;
-    memset(pMessageText, 0, sizeof(char) * (sizeOfMessage + 1));
-    strncpy(pMessageText, messageBuffer, sizeOfMessage);
-
-    Message* pMessage = malloc(sizeof(Message));
-    pMessage->pText = pMessageText;
-    pMessage->isShutdownMessage = isShutdownMessage;
-
-    bool isEnqueueSuccessful;
-
-    pthread_cleanup_push(unlockMutexesCleanup, &s_accessQueueMutex);
-    pthread_mutex_lock(&s_accessQueueMutex);
-    {
-        if (List_append(s_outMessageQueue, pMessage) == LIST_FAIL) {
-            fputs("**The sending message queue is too large!**\n", stdout);
-            fputs("**Your most recent message will be dropped, please try resending**\n",
-                  stdout);
-            isEnqueueSuccessful = false;
-            freeMessageFn(pMessage);
-            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    Message* pMessage = MessagePool_createMessage(s_pOutMessagePool, messageBuffer, sizeOfMessage,
+                                                  isShutdownMessage);
+    if (pMessage == NULL) {
+        return false;
+    }
+
+    // The queue applies the overflow policy if the sender has fallen behind,
+    // which may block this thread until there is room.
+    uint64_t traceId = pMessage->traceId;
+    uint64_t startNs = Trace_begin();
+    bool isEnqueueSuccessful = MessageQueue_put(s_pOutMessageQueue, pMessage);
+    Trace_end("enqueue", startNs, traceId, TRACE_FLOW_START);
+    return isEnqueueSuccessful;
+}
+
+/*
+ * Reads the next message into messageBuffer, which is all \0 characters.
+ * Returns false at the end of input.
+ */
+static bool readMessage(char* messageBuffer)
+{
+    if (Jsonl_isEnabled()) {
+        JsonlCommand command;
+        if (!Jsonl_readCommand(&command)) {
+            return false;
+        }
+        if (command.type == JSONL_COMMAND_QUIT) {
+            // The same as typing the termination line.
+            memcpy(messageBuffer, "!\n", 2);
         } else {
-            // Here, the append was successful, so the queue is not empty.
-            // If the sender is blocked on this cond var, then the reader will block
-            // until reader thread is done.
-            pthread_cond_signal(&s_syncMessagesAvailableCondVar);
-            isEnqueueSuccessful = true;
+            // The parser made sure it fits with its \0 character.
+            memcpy(messageBuffer, command.pText, command.length);
         }
+        return true;
     }
-    // Unlock the mutex.
-    pthread_cleanup_pop(1);
 
-    return isEnqueueSuccessful;
+    if (!Tui_isActive()) {
+        read(STDIN_FILENO, messageBuffer, MSG_MAX_LEN);
+        return messageBuffer[0] != '\0';
+    }
+
+    // Keys edit the input line until a line is entered.
+    char keyBuffer[TUI_KEY_BUFFER_LEN];
+    while (1) {
+        ssize_t numKeys = read(STDIN_FILENO, keyBuffer, sizeof(keyBuffer));
+        if (numKeys <= 0) {
+            return false;
+        }
+        bool isEndOfInput = false;
+        size_t sizeOfMessage = Tui_handleInput(keyBuffer, (size_t) numKeys, messageBuffer,
+                                               &isEndOfInput);
+        if (isEndOfInput) {
+            return false;
+        }
+        if (sizeOfMessage > 0) {
+            return true;
+        }
+    }
 }
 
 static void* KeyboardReader_run(void* stub)
 {
     waitForAllThreadsReadyBarrier();
+    Trace_setThreadName("keyboard reader");
 
-    if (s_outMessageQueue == NULL) {
+    if (s_pOutMessageQueue == NULL) {
         fputs("KeyboardReader_run: error: message list is NULL\n", stderr);
     }
 
@@ -71,9 +105,10 @@ static void* KeyboardReader_run(void* stub)
     while (1) {
         memset(messageBuffer, 0, sizeof(char) * MSG_MAX_LEN);
 
-        read(STDIN_FILENO, messageBuffer, MSG_MAX_LEN);
-
-        if (messageBuffer[0] == '\0') {
+        uint64_t startNs = Trace_begin();
+        bool hasMessage = readMessage(messageBuffer);
+        Trace_end("stdin read", startNs, 0, TRACE_FLOW_NONE);
+        if (!hasMessage) {
             pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
             requestShutdownOfAllThreadsForProgram();
             break;
@@ -81,8 +116,10 @@ static void* KeyboardReader_run(void* stub)
 
         // Discard parts of the message that are not needed.
         size_t sizeOfMessage = 0;
+        startNs = Trace_begin();
         bool isCancellationMessage = checkAndDiscardRestIfMessageHasTerminationLine(messageBuffer,
                                                                                     &sizeOfMessage);
+        Trace_end("scan", startNs, 0, TRACE_FLOW_NONE);
 
         bool isEnqueueSuccessful = createMessageFromBufferAndPutOnQueue(messageBuffer,
                                                                          sizeOfMessage,
@@ -112,47 +149,21 @@ static void* KeyboardReader_run(void* stub)
  */
 Message* KeyboardReader_getMessageFromQueue()
 {
-    if (s_outMessageQueue == NULL) {
-        return NULL;
-    }
-
-    Message* pMessage = NULL;
-
-    pthread_cleanup_push(unlockMutexesCleanup, &s_accessQueueMutex);
-    pthread_mutex_lock(&s_accessQueueMutex);
-    {
-        while (List_count(s_outMessageQueue) == 0) {
-            // When it blocks, the queue mutex will be unlocked so that the keyboard
-            // reader can put messages on it and then signal to unblock the sender.
-            pthread_cond_wait(&s_syncMessagesAvailableCondVar, &s_accessQueueMutex);
-        }
-        // Dequeue
-        List_first(s_outMessageQueue);
-        // Do not let us cancel this thread while it holds a pointer to a message
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-        /* SENDER THREAD NOT CANCELLABLE HERE */
-        pMessage = List_remove(s_outMessageQueue);
-        if (pMessage == NULL || pMessage->pText == NULL) {
-            // If the message isn't anything, enable cancels for this thread.
-            // Note that pthread_cleanup_{push,pop} will make it so that the
-            // mutex is unlocked when this thread cancels while it holds the mutex.
-            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-        }
-    }
-    // This pop unlocks the mutex via unlockMutexesCleanup
-    // It also will make sure the mutex is released if the thread
-    // cancels while it is blocked by the cond_wait, since the
-    // routine is triggered if the thread cancels.
-    pthread_cleanup_pop(1);
+    return MessageQueue_take(s_pOutMessageQueue);
+}
 
-    return pMessage;
+bool KeyboardReader_hasQueuedMessages()
+{
+    return MessageQueue_hasMessages(s_pOutMessageQueue);
 }
 
 void KeyboardReader_init()
 {
-    s_outMessageQueue = List_create();
-    if (s_outMessageQueue != NULL) {
-        int status = pthread_create(&s_threadPid, NULL, KeyboardReader_run, NULL);
+    s_pOutMessageQueue = MessageQueue_create("Sending", &Options_get()->queueLimits);
+    s_pOutMessagePool = MessagePool_create("Sending", &Options_get()->queueLimits,
+                                           MSG_MAX_LEN);
+    if (s_pOutMessageQueue != NULL && s_pOutMessagePool != NULL) {
+        int status = ThreadPlacement_createThread(THREAD_KEYBOARD_READER, &s_threadPid, KeyboardReader_run);
         if (status != 0) {
             printf("Failed to create keyboard reader thread: %s\n", strerror(status));
             requestShutdownOfAllThreadsForProgram();
@@ -165,8 +176,9 @@ void KeyboardReader_init()
 
 ShutdownStatus KeyboardReader_shutdown()
 {
-    pthread_cond_signal(&s_syncMessagesAvailableCondVar);
-    pthread_mutex_unlock(&s_accessQueueMutex);
+    // Wakes up the sender if it is waiting for messages, and this thread if it
+    // is blocked waiting for room on the queue.
+    MessageQueue_close(s_pOutMessageQueue);
 
     return shutdownThreadWithPid(s_threadPid);
 }
@@ -176,9 +188,11 @@ ShutdownStatus KeyboardReader_shutdown()
  */
 void KeyboardReader_destroyMutexAndCondAndFreeList()
 {
-    pthread_cond_destroy(&s_syncMessagesAvailableCondVar);
-    pthread_mutex_destroy(&s_accessQueueMutex);
-
-    List_free(s_outMessageQueue, freeMessageFn);
-    s_outMessageQueue = NULL;
+    MessageQueue_printStats(s_pOutMessageQueue);
+    MessagePool_printStats(s_pOutMessagePool);
+    // The queue frees the messages left on it into the pool.
+    MessageQueue_destroy(s_pOutMessageQueue);
+    s_pOutMessageQueue = NULL;
+    MessagePool_destroy(s_pOutMessagePool);
+    s_pOutMessagePool = NULL;
 }
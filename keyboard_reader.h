@@ -11,6 +11,11 @@ void KeyboardReader_init();
  */
 Message* KeyboardReader_getMessageFromQueue();
 
+/*
+ * Returns true if there are messages waiting for the sender.
+ */
+bool KeyboardReader_hasQueuedMessages();
+
 ShutdownStatus KeyboardReader_shutdown();
 
 void KeyboardReader_destroyMutexAndCondAndFreeList();
@@ -0,0 +1,144 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "message.h"
+#include "message_pool.h"
+#include "trace.h"
+
+/*
+ * Cleanup handler for use with pthread_cleanup_{push,pop}.
+ * From the man pages:
+ * After a push, this routine will be run in the following situations:
+ * - The thread exits (that is, calls pthread_exit()).
+ * - The thread acts upon a cancellation request.
+ * - The thread calls pthread_cleanup_pop() with a non-zero execute argument.
+ */
+void unlockMutexesCleanup(void* whichMutex)
+{
+    pthread_mutex_unlock((pthread_mutex_t*) whichMutex);
+}
+
+uint64_t getMonotonicTimeNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+Message* createMessage(const char* pText, size_t length, bool isShutdownMessage)
+{
+    Message* pMessage = malloc(sizeof(Message));
+    if (pMessage == NULL) {
+        return NULL;
+    }
+    // Account for \0 character.
+    pMessage->pText = malloc(sizeof(char) * (length + 1));
+    if (pMessage->pText == NULL) {
+        free(pMessage);
+        return NULL;
+    }
+    memcpy(pMessage->pText, pText, length);
+    pMessage->pText[length] = '\0';
+    pMessage->length = length;
+    pMessage->isShutdownMessage = isShutdownMessage;
+    pMessage->lane = LANE_INTERACTIVE;
+    pMessage->enqueueNs = 0;
+    pMessage->traceId = Trace_newMessageId();
+    pMessage->pPool = NULL;
+    pMessage->releaseFn = NULL;
+    pMessage->pReleaseArg = NULL;
+    pMessage->pNext = NULL;
+    return pMessage;
+}
+
+void freeMessageFn(void* pItem)
+{
+    Message* pMessage = (Message*) pItem;
+    if (pMessage != NULL && pMessage->pPool != NULL) {
+        MessagePool_release(pMessage);
+    } else if (pMessage != NULL) {
+        if (pMessage->pText != NULL) {
+            free(pMessage->pText);
+        }
+        free(pMessage);
+    }
+}
+
+/*
+ * Determines if the message buffer has a termination line, and then marks
+ * the rest of the message as unneeded if there is a termination line.
+ * If pSizeOfMessage is not NULL, *pSizeOfMessage will be set to the size
+ * of message determined by scanning.
+ */
+bool checkAndDiscardRestIfMessageHasTerminationLine(char* messageBuffer, size_t* pSizeOfMessage)
+{
+    // We assume that messageBuffer has size MSG_MAX_LEN.
+    if (messageBuffer == NULL) {
+        return false;
+    }
+    // Empty string check. Fundamentally, it doesn't have a termination line.
+    if (messageBuffer[0] == '\0') {
+        if (pSizeOfMessage != NULL) {
+            *pSizeOfMessage = 0;
+        }
+        return false;
+    }
+    // If the line starts with termination
+    if (messageBuffer[0] == '!' && messageBuffer[1] == '\n') {
+        messageBuffer[3] = '\0';
+        if (pSizeOfMessage != NULL) {
+            *pSizeOfMessage = 3;
+        }
+        return true;
+    }
+
+    bool isTerminationLinePresent = false;
+    size_t i;
+    for (i = 0; i < MSG_MAX_LEN - 1; i++) {
+        // Search for a line which has just a "!<enter>", checking two adjacent
+        // characters at a time.
+        if (messageBuffer[i] == '!' && messageBuffer[i + 1] == '\n') {
+            // Making sure this is a standalone line if we are not checking the beginning
+            // Note: In here, we know that i > 0, since the condition
+            // messageBuffer[0] == '!' && messageBuffer[1] == '\n' is false, since we
+            // got past the guard, "If the line starts with termination"
+            bool isExclamationOnItsOwnLine = (messageBuffer[i - 1] == '\n');
+            if (isExclamationOnItsOwnLine) {
+                if (i + 2 < MSG_MAX_LEN) {
+                    // Make it so that we discard portions beyond "!<enter>".
+                    messageBuffer[i + 2] = '\0';
+                }
+
+                isTerminationLinePresent = true;
+                break;
+            }
+        }
+
+        // If we reached the end of the string, stop searching
+        if (messageBuffer[i] == '\0' || messageBuffer[i + 1] == '\0') {
+            break;
+        }
+    }
+    if (pSizeOfMessage != NULL) {
+        // If the termination line is present, we need to add 1 more to the
+        // returned length, since we added an extra null character at the end.
+        *pSizeOfMessage = isTerminationLinePresent ? i + 2 : i + 1;
+        assert(strnlen(messageBuffer, MSG_MAX_LEN) == *pSizeOfMessage);
+    }
+    return isTerminationLinePresent;
+}
+
+size_t findTerminationLine(const char* pText, size_t length)
+{
+    size_t i;
+    for (i = 0; i + 1 < length; i++) {
+        // Only a "!" at the start of a line counts.
+        if (pText[i] == '!' && pText[i + 1] == '\n' && (i == 0 || pText[i - 1] == '\n')) {
+            return i + 2;
+        }
+    }
+    return 0;
+}
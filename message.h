@@ -0,0 +1,90 @@
+#ifndef _MESSAGE_H
+#define _MESSAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Messages and the helpers that the queues and pools built from them share. Kept
+ * apart from the rest of common.h, which runs the program's threads, so that
+ * libtwotalk can be built from the same pipeline.
+ */
+
+// Max size for a UDP packet.
+#define MSG_MAX_LEN 65507
+
+/*
+ * Priority lanes of the message queues, from most to least urgent.
+ */
+typedef enum {
+    // The shutdown message.
+    LANE_CONTROL,
+    // Short messages typed by a person.
+    LANE_INTERACTIVE,
+    // Long messages, and the rest of a paste or stream that came in right after one.
+    LANE_BULK,
+    NUM_MESSAGE_LANES
+} MessageLane;
+
+typedef struct MessagePool_s MessagePool;
+
+/*
+ * Called instead of freeing the text of a message that only borrows it.
+ */
+typedef void (*MessageReleaseFn)(void* pReleaseArg, const char* pText);
+
+typedef struct Message_s Message;
+struct Message_s {
+    char* pText;
+    // Length of pText, not counting the \0 character.
+    size_t length;
+    bool isShutdownMessage;
+    // Set by the queue the message is put on.
+    MessageLane lane;
+    uint64_t enqueueNs;
+    // Ties the message's spans together in the trace. 0 when not tracing.
+    uint64_t traceId;
+    // The pool the message came from, or NULL if it was malloc'd by createMessage.
+    MessagePool* pPool;
+    // NULL unless the text is borrowed from the producer, in which case it isn't
+    // written to, isn't \0 terminated, and is handed back with this when the message
+    // is freed.
+    MessageReleaseFn releaseFn;
+    void* pReleaseArg;
+    // The next message in the same lane of the queue it is on.
+    Message* pNext;
+};
+
+void unlockMutexesCleanup(void* whichMutex);
+
+/*
+ * Returns the time from CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t getMonotonicTimeNs();
+
+/*
+ * Copies the first `length` characters of pText into a new message. The pipelines
+ * take theirs from a MessagePool instead.
+ * Returns NULL if out of memory.
+ */
+Message* createMessage(const char* pText, size_t length, bool isShutdownMessage);
+
+/*
+ * Frees a message from createMessage, or puts it back in its pool.
+ */
+void freeMessageFn(void* pItem);
+
+/*
+ * Returns true if the message has a line that is just "!\n", and false if not.
+ */
+bool checkAndDiscardRestIfMessageHasTerminationLine(char* messageBuffer, size_t* pSizeOfMessage);
+
+/*
+ * The same check for text that can't be written to, such as a borrowed buffer.
+ * Returns the length of the text up to the end of its termination line, or 0 if it
+ * doesn't have one.
+ */
+size_t findTerminationLine(const char* pText, size_t length);
+
+#endif // _MESSAGE_H
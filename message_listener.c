@@ -6,85 +6,469 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <asm/socket.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 
+#include "thread_placement.h"
 #include "common.h"
 #include "message_listener.h"
 #include "screen_printer.h"
+#include "options.h"
+#include "shm_transport.h"
+#include "fec.h"
+#include "keepalive.h"
+#include "dedup.h"
+#include "trace.h"
+#include "wire.h"
+#include "message_sender.h"
+#include "multipath.h"
+#include "sanitizer.h"
+#include "resolver.h"
+
+// Room for the SO_RXQ_OVFL, SO_TIMESTAMPING and UDP_GRO control messages.
+#define CONTROL_BUFFER_LEN 256
+// With UDP_GRO, a receive can return a train of datagrams up to the largest IP packet.
+#define RX_BUFFER_LEN 65536
 
 static pthread_t s_threadPid;
 static int s_socketDescriptor;
 static in_port_t s_ourPort;
+static bool s_isSharedMemoryEnabled = false;
+// Plain text payloads of FEC datagrams and of datagrams coalesced by GRO are copied
+// here to be scanned for the termination line, and dedup datagrams decoded here.
+static char s_payloadBuffer[MSG_MAX_LEN];
+// Received text is made safe to print here before it is copied into a message.
+static char s_sanitizedBuffer[LISTENER_MAX_TEXT_LEN];
+// A character cut in two at the end of a plain datagram, which may be a GSO segment
+// of a longer message, waiting for the rest of it in the next datagram.
+static SanitizerStream s_sanitizerStream;
+static bool s_isSanitizeEnabled = true;
+
+// Receive statistics. Only written by the listener thread.
+static unsigned long s_numDatagrams = 0;
+static uint32_t s_numKernelDrops = 0;
+static unsigned long s_numTimestamps = 0;
+static uint64_t s_totalKernelToListenerNs = 0;
+static uint64_t s_maxKernelToListenerNs = 0;
+static unsigned long s_numCoalescedReceives = 0;
+static unsigned long s_numCoalescedDatagrams = 0;
+static unsigned long s_numTruncated = 0;
+static unsigned long s_numSanitizedMessages = 0;
+static unsigned long s_numSanitizedCharacters = 0;
+
+// Size of each datagram in the last receive if the kernel coalesced them, else 0.
+static size_t s_groSegmentBytes = 0;
+
+static void recordKernelTimestamp(const struct timespec* pKernelTime)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t latencyNs = (int64_t) (now.tv_sec - pKernelTime->tv_sec) * 1000000000LL
+                        + (now.tv_nsec - pKernelTime->tv_nsec);
+    if (latencyNs < 0) {
+        return;
+    }
+    s_numTimestamps++;
+    s_totalKernelToListenerNs += (uint64_t) latencyNs;
+    if ((uint64_t) latencyNs > s_maxKernelToListenerNs) {
+        s_maxKernelToListenerNs = (uint64_t) latencyNs;
+    }
+}
+
+static void handleControlMessages(struct msghdr* pHeader)
+{
+    s_groSegmentBytes = 0;
+    struct cmsghdr* pControl;
+    for (pControl = CMSG_FIRSTHDR(pHeader); pControl != NULL;
+         pControl = CMSG_NXTHDR(pHeader, pControl)) {
+        if (pControl->cmsg_level == IPPROTO_UDP && pControl->cmsg_type == UDP_GRO) {
+            int segmentBytes;
+            memcpy(&segmentBytes, CMSG_DATA(pControl), sizeof(segmentBytes));
+            s_groSegmentBytes = segmentBytes > 0 ? (size_t) segmentBytes : 0;
+            continue;
+        }
+        if (pControl->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+        if (pControl->cmsg_type == SO_RXQ_OVFL) {
+            // The kernel reports the running total of drops on this socket.
+            memcpy(&s_numKernelDrops, CMSG_DATA(pControl), sizeof(s_numKernelDrops));
+        } else if (pControl->cmsg_type == SCM_TIMESTAMPING) {
+            // struct scm_timestamping: the software timestamp is the first one.
+            struct timespec timestamps[3];
+            memcpy(timestamps, CMSG_DATA(pControl), sizeof(timestamps));
+            recordKernelTimestamp(&timestamps[0]);
+        }
+    }
+}
+
+/*
+ * Receives one datagram, or a train of them coalesced by GRO, into messageRxBuffer,
+ * which must have room for RX_BUFFER_LEN bytes. With --spin-usec, this first polls
+ * with non-blocking receives for that long, so that a datagram arriving soon after
+ * the previous one is picked up without the thread going to sleep.
+ */
+static ssize_t receiveDatagram(char* messageRxBuffer, struct sockaddr_in* pSinRemote)
+{
+    char controlBuffer[CONTROL_BUFFER_LEN];
+    struct iovec ioVector = {
+        .iov_base = messageRxBuffer,
+        .iov_len = RX_BUFFER_LEN
+    };
+    struct msghdr header;
+
+    long spinUsec = Options_get()->socketTuning.spinUsec;
+    uint64_t spinDeadlineNs = spinUsec > 0 ? getMonotonicTimeNs() + (uint64_t) spinUsec * 1000 : 0;
+    ssize_t bytesRx;
+    while (1) {
+        memset(&header, 0, sizeof(header));
+        header.msg_name = pSinRemote;
+        header.msg_namelen = sizeof(*pSinRemote);
+        header.msg_iov = &ioVector;
+        header.msg_iovlen = 1;
+        header.msg_control = controlBuffer;
+        header.msg_controllen = sizeof(controlBuffer);
+
+        bool isSpinning = spinDeadlineNs != 0 && getMonotonicTimeNs() < spinDeadlineNs;
+        errno = 0;
+        uint64_t startNs = Trace_begin();
+        bytesRx = recvmsg(s_socketDescriptor, &header, isSpinning ? MSG_DONTWAIT : 0);
+        if (bytesRx >= 0) {
+            // Empty spins aren't recorded, so that they don't fill the trace.
+            Trace_end("recvfrom", startNs, 0, TRACE_FLOW_NONE);
+        }
+        if (bytesRx >= 0 || !isSpinning || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            break;
+        }
+        pthread_testcancel();
+    }
+    if (bytesRx >= 0) {
+        s_numDatagrams++;
+        if (header.msg_flags & MSG_TRUNC) {
+            s_numTruncated++;
+        }
+        handleControlMessages(&header);
+    }
+    return bytesRx;
+}
+
+/*
+ * Copies the text into a message and puts it on the printer queue. The listener
+ * must not be cancellable when this is called, and is cancellable again after.
+ * `isPlainText` is for text that came in a datagram of its own without a header,
+ * which may be one of the segments --gso cuts a message into.
+ * Returns true if it was the termination message, after which the listener stops.
+ */
+static bool deliverMessage(const char* pText, size_t length, bool isShutdownMessage,
+                           bool isPlainText)
+{
+    if (s_isSanitizeEnabled) {
+        // Segments are cut at fixed offsets, which can be in the middle of a
+        // character, so one cut short is finished with the next datagram.
+        size_t numReplaced;
+        length = Sanitizer_sanitizePiece(&s_sanitizerStream, pText, length,
+                                         isPlainText && !isShutdownMessage,
+                                         s_sanitizedBuffer, &numReplaced);
+        pText = s_sanitizedBuffer;
+        if (numReplaced > 0) {
+            s_numSanitizedMessages++;
+            s_numSanitizedCharacters += numReplaced;
+        }
+    }
+    Message* pMessage = ScreenPrinter_createMessage(pText, length, isShutdownMessage);
+
+    // This drops pMessage if the printer queue is full and its overflow policy gives up.
+    uint64_t traceId = pMessage != NULL ? pMessage->traceId : 0;
+    uint64_t startNs = Trace_begin();
+    bool isEnqueueSuccessful = pMessage != NULL && ScreenPrinter_putMessageOnQueue(pMessage);
+    Trace_end("enqueue", startNs, traceId, TRACE_FLOW_START);
+
+    // Now that pMessage is put on the queue, it is safe to cancel the listener thread.
+    /* LISTENER THREAD CANCELABLE HERE */
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (isShutdownMessage) {
+        // Let the screen printer request shutdown of the program
+        // so that it can show the message first, unless enqueueing failed.
+        if (!isEnqueueSuccessful) {
+            // If the enqueueing of the shutdown message failed, then
+            // the threads won't be requested for shutdown by the
+            // printer because it won't get the message.
+            requestShutdownOfAllThreadsForProgram();
+        }
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Parses the header of a framed datagram, and handles the frames that aren't
+ * messages: the peer's hello is answered unless it is an answer itself, and so are
+ * its pings. Returns false if there is no message to deliver.
+ */
+static bool receiveFrame(const char* pDatagram, size_t length, WireFrame* pFrame)
+{
+    Wire* pWire = Sender_getWire();
+    if (!WireDecoder_receive(pWire, pDatagram, length, pFrame)) {
+        return false;
+    }
+    switch (pFrame->type) {
+        case WIRE_TYPE_HELLO:
+            if (!(pFrame->flags & WIRE_FLAG_REPLY) && Wire_isHelloEnabled(pWire)) {
+                Sender_sendHello(true);
+            }
+            return false;
+        case WIRE_TYPE_PING:
+            if (pFrame->payloadLength <= WIRE_MAX_PING_PAYLOAD_LEN && Wire_isHelloEnabled(pWire)) {
+                char pong[WIRE_MAX_HEADER_LEN + WIRE_MAX_PING_PAYLOAD_LEN];
+                size_t sizeOfPong = WireEncoder_writeControl(pong, WIRE_TYPE_PONG,
+                                                             pFrame->sequence, pFrame->pPayload,
+                                                             pFrame->payloadLength);
+                Sender_sendFeedback(pong, sizeOfPong);
+            }
+            return false;
+        case WIRE_TYPE_PONG:
+            Multipath_onPong(pFrame);
+            return false;
+        default:
+            return true;
+    }
+}
+
+/*
+ * Delivers the message of a frame, a dedup datagram, or plain text in a larger
+ * buffer. Also called by the FEC decoder for every payload it receives or rebuilds.
+ * Returns true if it was the termination message.
+ */
+static bool deliverPayload(const char* pPayload, size_t length)
+{
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    /* LISTENER THREAD NOT CANCELABLE HERE */
+    WireFrame frame;
+    bool isFramed = Wire_isFramedDatagram(pPayload, length);
+    if (isFramed) {
+        if (!receiveFrame(pPayload, length, &frame)) {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            return false;
+        }
+        pPayload = frame.pPayload;
+        length = frame.payloadLength;
+        if (frame.type == WIRE_TYPE_TEXT) {
+            // The header says if it is the termination message, so the text is
+            // delivered straight from the datagram without being scanned.
+            return deliverMessage(pPayload, length, (frame.flags & WIRE_FLAG_SHUTDOWN) != 0,
+                                  false);
+        }
+    }
+    bool isDedup = Dedup_isDedupDatagram(pPayload, length);
+    if (isDedup) {
+        ssize_t textLength = DedupDecoder_receive(pPayload, length, s_payloadBuffer,
+                                                  sizeof(s_payloadBuffer) - 2);
+        if (textLength < 0) {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            return false;
+        }
+        length = (size_t) textLength;
+        if (isFramed) {
+            return deliverMessage(s_payloadBuffer, length, (frame.flags & WIRE_FLAG_SHUTDOWN) != 0,
+                                  false);
+        }
+    } else {
+        memcpy(s_payloadBuffer, pPayload, length);
+    }
+    // The scan for the termination line stops at the first \0 after the text.
+    s_payloadBuffer[length] = '\0';
+    s_payloadBuffer[length + 1] = '\0';
+    bool isShutdownMessage = checkAndDiscardRestIfMessageHasTerminationLine(s_payloadBuffer, NULL);
+    return deliverMessage(s_payloadBuffer, strnlen(s_payloadBuffer, length), isShutdownMessage,
+                          !isDedup);
+}
+
+/*
+ * Splits a train of datagrams coalesced by GRO back into the datagrams the peer sent,
+ * and handles each one. Returns true if one of them was the termination message.
+ */
+static bool handleCoalescedDatagrams(const char* messageRxBuffer, size_t bytesRx)
+{
+    s_numCoalescedReceives++;
+    size_t offset;
+    for (offset = 0; offset < bytesRx; offset += s_groSegmentBytes) {
+        size_t length = bytesRx - offset < s_groSegmentBytes ? bytesRx - offset : s_groSegmentBytes;
+        const char* pDatagram = messageRxBuffer + offset;
+        s_numCoalescedDatagrams++;
+        bool shouldExitProgram;
+        if (Fec_isFecDatagram(pDatagram, length)) {
+            shouldExitProgram = FecDecoder_receive(pDatagram, length, deliverPayload);
+        } else if (Wire_isFramedDatagram(pDatagram, length)
+                   || Dedup_isDedupDatagram(pDatagram, length)) {
+            shouldExitProgram = deliverPayload(pDatagram, length);
+        } else {
+            shouldExitProgram = deliverPayload(pDatagram, strnlen(pDatagram, length));
+        }
+        if (shouldExitProgram) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Delivers every message waiting in the shared-memory ring, reading each in place.
+ * Returns true if one of them was the termination message.
+ */
+static bool drainSharedMemoryRing()
+{
+    const char* pText;
+    size_t length;
+    bool isShutdownMessage;
+    while (ShmTransport_peekRecord(&pText, &length, &isShutdownMessage)) {
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        /* LISTENER THREAD NOT CANCELABLE HERE */
+        // The sender already knows if it is the termination message, so the text
+        // doesn't need to be scanned.
+        Keepalive_onReceive(false);
+        bool shouldExitProgram = deliverMessage(pText, strnlen(pText, length), isShutdownMessage,
+                                                false);
+        ShmTransport_releaseRecord();
+        if (shouldExitProgram) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Blocks until there is a datagram on the UDP socket, serving the shared-memory
+ * ring in the meantime: delivering its messages and handing it out to local peers.
+ * Returns false if the termination message came through the ring.
+ */
+static bool waitForDatagramServingSharedMemory()
+{
+    struct pollfd fds[3] = {
+        {.fd = s_socketDescriptor, .events = POLLIN},
+        {.fd = ShmTransport_getEventFd(), .events = POLLIN},
+        {.fd = ShmTransport_getListenFd(), .events = POLLIN}
+    };
+    long spinUsec = Options_get()->socketTuning.spinUsec;
+    while (1) {
+        if (drainSharedMemoryRing()) {
+            return false;
+        }
+        if (spinUsec > 0) {
+            // Messages from the ring keep coming without any syscalls while they
+            // arrive within the spin time of each other.
+            uint64_t spinDeadlineNs = getMonotonicTimeNs() + (uint64_t) spinUsec * 1000;
+            const char* pText;
+            size_t length;
+            bool isShutdownMessage;
+            bool hasRecord = false;
+            while (!hasRecord && getMonotonicTimeNs() < spinDeadlineNs) {
+                hasRecord = ShmTransport_peekRecord(&pText, &length, &isShutdownMessage);
+            }
+            if (hasRecord) {
+                continue;
+            }
+        }
+        if (!ShmTransport_prepareToSleep()) {
+            continue;
+        }
+        // poll is a cancellation point.
+        int numReady = poll(fds, 3, -1);
+        ShmTransport_clearWakeup();
+        if (numReady <= 0) {
+            continue;
+        }
+        if (fds[2].revents & POLLIN) {
+            ShmTransport_acceptProducer();
+        }
+        if (fds[0].revents & (POLLIN | POLLERR)) {
+            return true;
+        }
+    }
+}
 
 static void* Listener_run(void* stub)
 {
     waitForAllThreadsReadyBarrier();
+    Trace_setThreadName("listener");
 
     s_socketDescriptor = getSocketFdOrCreateAndBindIfDoesntExist(s_ourPort);
 
-    char messageRxBuffer[MSG_MAX_LEN];
+    char messageRxBuffer[RX_BUFFER_LEN];
 
     bool shouldExitProgram = false;
     while (1) {
         // Receive UDP packets
         struct sockaddr_in sinRemote;
-        unsigned int sin_len = sizeof(sinRemote);
-        memset(messageRxBuffer, 0, sizeof(char) * MSG_MAX_LEN);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        if (s_isSharedMemoryEnabled && !waitForDatagramServingSharedMemory()) {
+            break;
+        }
 
         // Blocking call to receive data from UDP packets. No persistent connection required,
         // unlike TCP.
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-        ssize_t bytesRx = recvfrom(s_socketDescriptor,
-                               messageRxBuffer, MSG_MAX_LEN, 0,
-                               (struct sockaddr*) &sinRemote, &sin_len);
+        ssize_t bytesRx = receiveDatagram(messageRxBuffer, &sinRemote);
 
         if (bytesRx == -1) {
             fputs("**Error receiving message**\n", stdout);
             requestShutdownOfAllThreadsForProgram();
             break;
         }
+        // Anything from the peer settles which of its addresses to send to.
+        Resolver_onReceive(&sinRemote);
+        // An empty datagram is a heartbeat, which is never shown. Pings and pongs
+        // aren't messages, and mustn't hold off the idle timeout.
+        if (!Wire_isProbeDatagram(messageRxBuffer, (size_t) bytesRx)) {
+            Keepalive_onReceive(bytesRx == 0);
+        }
+        if (bytesRx == 0) {
+            continue;
+        }
+        if (s_groSegmentBytes > 0 && (size_t) bytesRx > s_groSegmentBytes) {
+            if (handleCoalescedDatagrams(messageRxBuffer, (size_t) bytesRx)) {
+                break;
+            }
+            continue;
+        }
+        if (Fec_isFecDatagram(messageRxBuffer, (size_t) bytesRx)) {
+            if (FecDecoder_receive(messageRxBuffer, (size_t) bytesRx, deliverPayload)) {
+                break;
+            }
+            continue;
+        }
+        if (Wire_isFramedDatagram(messageRxBuffer, (size_t) bytesRx)
+            || Dedup_isDedupDatagram(messageRxBuffer, (size_t) bytesRx)) {
+            if (deliverPayload(messageRxBuffer, (size_t) bytesRx)) {
+                break;
+            }
+            continue;
+        }
+
         // If there is an incoming pMessage, handle it before we do anything else.
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, false);
         /* LISTENER THREAD NOT CANCELABLE HERE */
 
+        // The buffer isn't cleared between receives, so the text is ended with the
+        // \0 characters that the scan for the termination line stops at, instead of
+        // whatever a longer datagram before left after it. Coalesced trains were
+        // handled above, so this is one datagram, and the buffer has room past it.
+        size_t textLength = (size_t) bytesRx < MSG_MAX_LEN ? (size_t) bytesRx : MSG_MAX_LEN;
+        messageRxBuffer[textLength] = '\0';
+        messageRxBuffer[textLength + 1] = '\0';
+
         // Scan the input buffer for the termination line "!\n".
-        // When it find
-        // Note: This function doesn't rely on null termination to exit its loop, so
-        // it's fine to put this check before the null termination placement.
         shouldExitProgram = checkAndDiscardRestIfMessageHasTerminationLine(messageRxBuffer, NULL);
 
-        // Make it null terminated (so string functions work):
-        ssize_t terminateIdx = (bytesRx < MSG_MAX_LEN) ? bytesRx : MSG_MAX_LEN - 1;
-        messageRxBuffer[terminateIdx] = 0;
-
-        // Copy the pMessageText so that we can add it to the print queue.
-        // accounting for the needed \0 character.
-        char* pMessageText = malloc(bytesRx + 1);
-        memset(pMessageText, 0, bytesRx + 1);
-        strncpy(pMessageText, messageRxBuffer, bytesRx);
-
-        Message* pMessage = malloc(sizeof(Message));
-        pMessage->pText = pMessageText;
-        pMessage->isShutdownMessage = shouldExitProgram;
-
-        // This potentially ignores the added pMessage if there are not enough list nodes.
-        bool isEnqueueSuccessful = ScreenPrinter_putMessageOnQueue(pMessage);
-
-        // Now that pMessage is put on the queue, it is safe to cancel the listener thread.
-        /* LISTENER THREAD CANCELABLE HERE */
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-        if (shouldExitProgram) {
+        // The text stops at the first \0 character, if the datagram has one.
+        if (deliverMessage(messageRxBuffer, strnlen(messageRxBuffer, textLength),
+                           shouldExitProgram, true)) {
             // Break so that we do not listen to anymore messages.
-            // Let the screen printer request shutdown of the program
-            // so that it can show the message first, unless enqueueing failed.
-            if (!isEnqueueSuccessful) {
-                // If the enqueueing of the shutdown message failed, then
-                // the threads won't be requested for shutdown by the
-                // printer because it won't get the message.
-                requestShutdownOfAllThreadsForProgram();
-            }
             break;
         }
     }
@@ -94,7 +478,13 @@ static void* Listener_run(void* stub)
 void Listener_init(in_port_t ourPort)
 {
     s_ourPort = ourPort;
-    int status = pthread_create(&s_threadPid, NULL, Listener_run, NULL);
+    s_isSanitizeEnabled = Options_get()->isSanitizeEnabled;
+    // Offer the ring before any threads start, so that a sender in this process
+    // (or a local peer) can attach to it as soon as it has something to send.
+    s_isSharedMemoryEnabled = Options_get()->isShmEnabled && ShmTransport_initReceiver(ourPort);
+    DedupDecoder_init(Options_get()->dedupCacheBytes);
+
+    int status = ThreadPlacement_createThread(THREAD_LISTENER, &s_threadPid, Listener_run);
     if (status != 0) {
         printf("Failed to create listener thread: %s\n", strerror(status));
         requestShutdownOfAllThreadsForProgram();
@@ -108,3 +498,29 @@ ShutdownStatus Listener_shutdown()
 {
     return shutdownThreadWithPid(s_threadPid);
 }
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Listener_printStats()
+{
+    printf("Listener: %lu datagrams received, %u dropped by the kernel",
+           s_numDatagrams, s_numKernelDrops);
+    if (s_numTimestamps > 0) {
+        printf(", kernel to listener latency avg %.1f us, max %.1f us",
+               (double) s_totalKernelToListenerNs / s_numTimestamps / 1e3,
+               (double) s_maxKernelToListenerNs / 1e3);
+    }
+    if (s_numCoalescedReceives > 0) {
+        printf(", %lu GRO receives holding %lu datagrams",
+               s_numCoalescedReceives, s_numCoalescedDatagrams);
+    }
+    if (s_numTruncated > 0) {
+        printf(", %lu truncated", s_numTruncated);
+    }
+    if (s_numSanitizedMessages > 0) {
+        printf(", %lu messages with %lu control characters or invalid UTF-8 sequences replaced",
+               s_numSanitizedMessages, s_numSanitizedCharacters);
+    }
+    printf("\n");
+}
@@ -1,8 +1,21 @@
 #ifndef _MESSAGE_LISTENER_H
 #define _MESSAGE_LISTENER_H
 
+#include "common.h"
+#include "sanitizer.h"
+
+// The longest text the listener delivers: a datagram after sanitizing, with the rest
+// of a character cut short at the end of the datagram before it.
+#define LISTENER_MAX_TEXT_LEN (SANITIZER_MAX_EXPANSION * (MSG_MAX_LEN + SANITIZER_MAX_HELD_LEN))
+
 void Listener_init(in_port_t ourPort);
 
 ShutdownStatus Listener_shutdown();
 
+/*
+ * Prints how many datagrams were received and how many the kernel dropped
+ * because the socket's receive buffer was full.
+ */
+void Listener_printStats();
+
 #endif //_MESSAGE_LISTENER_H
@@ -0,0 +1,363 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "message_pool.h"
+#include "trace.h"
+
+#define MESSAGE_POOL_NUM_CLASSES 4
+
+// Each class holds 8 times as much text as the one before, and the last one, which
+// isn't listed, the longest text of the pipeline and its \0 character.
+static const size_t s_classCapacities[MESSAGE_POOL_NUM_CLASSES - 1] = {
+    256, 2048, 16384
+};
+
+/*
+ * Blocks of one size cut from a slab, with a stack of the free ones so that the
+ * block freed last, which is likely still in the cache, is the next one used.
+ */
+typedef struct BlockStack_s BlockStack;
+struct BlockStack_s {
+    char* pSlab;
+    size_t blockSize;
+    size_t numBlocks;
+    char** ppFreeBlocks;
+    size_t numFree;
+    // The fewest there have been free, for the stats.
+    size_t minNumFree;
+};
+
+struct MessagePool_s {
+    const char* pName;
+    BlockStack messages;
+    BlockStack textClasses[MESSAGE_POOL_NUM_CLASSES];
+    // The stacks are shared by the producer, which takes messages and drops them
+    // when the queue overflows, and the consumer, which frees them.
+    pthread_mutex_t accessPoolMutex;
+    unsigned long numTaken;
+    // Messages and texts malloc'd because the pool had nothing left that fit.
+    unsigned long numOverflows;
+};
+
+static bool initStack(BlockStack* pStack, size_t blockSize, size_t numBlocks)
+{
+    pStack->blockSize = blockSize;
+    pStack->numBlocks = numBlocks;
+    pStack->pSlab = malloc(blockSize * numBlocks);
+    pStack->ppFreeBlocks = malloc(sizeof(char*) * numBlocks);
+    if (pStack->pSlab == NULL || pStack->ppFreeBlocks == NULL) {
+        return false;
+    }
+    // The first block ends up on top, and the slab is used from the start.
+    size_t i;
+    for (i = 0; i < numBlocks; i++) {
+        pStack->ppFreeBlocks[i] = pStack->pSlab + (numBlocks - 1 - i) * blockSize;
+    }
+    pStack->numFree = numBlocks;
+    pStack->minNumFree = numBlocks;
+    return true;
+}
+
+/*
+ * Must hold accessPoolMutex. Returns NULL if the stack is empty.
+ */
+static char* popBlock(BlockStack* pStack)
+{
+    if (pStack->numFree == 0) {
+        return NULL;
+    }
+    char* pBlock = pStack->ppFreeBlocks[--pStack->numFree];
+    if (pStack->numFree < pStack->minNumFree) {
+        pStack->minNumFree = pStack->numFree;
+    }
+    return pBlock;
+}
+
+static bool isBlockOfStack(const BlockStack* pStack, const void* pBlock)
+{
+    uintptr_t address = (uintptr_t) pBlock;
+    uintptr_t slabStart = (uintptr_t) pStack->pSlab;
+    return address >= slabStart && address < slabStart + pStack->blockSize * pStack->numBlocks;
+}
+
+/*
+ * Must hold accessPoolMutex. Returns false if the block isn't from this stack.
+ */
+static bool pushBlock(BlockStack* pStack, void* pBlock)
+{
+    if (!isBlockOfStack(pStack, pBlock)) {
+        return false;
+    }
+    pStack->ppFreeBlocks[pStack->numFree++] = pBlock;
+    return true;
+}
+
+/*
+ * Must hold accessPoolMutex. Returns a block with room for the text and its \0
+ * character from the smallest class that has one, or NULL if none does.
+ */
+static char* popTextBlock(MessagePool* pPool, size_t length)
+{
+    int textClass;
+    for (textClass = 0; textClass < MESSAGE_POOL_NUM_CLASSES; textClass++) {
+        BlockStack* pStack = &pPool->textClasses[textClass];
+        if (length < pStack->blockSize && pStack->numFree > 0) {
+            return popBlock(pStack);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Must hold accessPoolMutex. Returns false if the text isn't from the pool.
+ */
+static bool pushTextBlock(MessagePool* pPool, char* pText)
+{
+    int textClass;
+    for (textClass = 0; textClass < MESSAGE_POOL_NUM_CLASSES; textClass++) {
+        if (pushBlock(&pPool->textClasses[textClass], pText)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Returns the room the text has, counting its \0 character, or 0 if it was malloc'd.
+ */
+static size_t getTextCapacity(const MessagePool* pPool, const char* pText)
+{
+    int textClass;
+    for (textClass = 0; textClass < MESSAGE_POOL_NUM_CLASSES; textClass++) {
+        if (isBlockOfStack(&pPool->textClasses[textClass], pText)) {
+            return pPool->textClasses[textClass].blockSize;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Puts the message and the text back in the pool, or frees them if they were
+ * malloc'd. Either may be NULL.
+ */
+static void putBack(MessagePool* pPool, Message* pMessage, char* pText)
+{
+    bool isTextPutBack;
+    bool isMessagePutBack;
+    pthread_mutex_lock(&pPool->accessPoolMutex);
+    {
+        isTextPutBack = pText == NULL || pushTextBlock(pPool, pText);
+        isMessagePutBack = pMessage == NULL || pushBlock(&pPool->messages, pMessage);
+    }
+    pthread_mutex_unlock(&pPool->accessPoolMutex);
+
+    if (!isTextPutBack) {
+        free(pText);
+    }
+    if (!isMessagePutBack) {
+        free(pMessage);
+    }
+}
+
+MessagePool* MessagePool_create(const char* pName, const QueueLimits* pLimits, size_t maxLength)
+{
+    MessagePool* pPool = calloc(1, sizeof(MessagePool));
+    if (pPool == NULL) {
+        return NULL;
+    }
+    pPool->pName = pName;
+    pthread_mutex_init(&pPool->accessPoolMutex, NULL);
+    bool isAllocated = initStack(&pPool->messages, sizeof(Message),
+                                 pLimits->maxMessages + MESSAGE_POOL_NUM_SPARE);
+    int textClass;
+    for (textClass = 0; textClass < MESSAGE_POOL_NUM_CLASSES && isAllocated; textClass++) {
+        size_t capacity = textClass < MESSAGE_POOL_NUM_CLASSES - 1
+                          ? s_classCapacities[textClass] : maxLength + 1;
+        size_t numBlocks = pLimits->maxBytes / capacity;
+        if (numBlocks > pLimits->maxMessages) {
+            numBlocks = pLimits->maxMessages;
+        }
+        isAllocated = initStack(&pPool->textClasses[textClass], capacity,
+                                numBlocks + MESSAGE_POOL_NUM_SPARE);
+    }
+    if (!isAllocated) {
+        MessagePool_destroy(pPool);
+        return NULL;
+    }
+    return pPool;
+}
+
+Message* MessagePool_createMessage(MessagePool* pPool, const char* pText, size_t length,
+                                   bool isShutdownMessage)
+{
+    Message* pMessage;
+    char* pMessageText;
+    pthread_mutex_lock(&pPool->accessPoolMutex);
+    {
+        pMessage = (Message*) popBlock(&pPool->messages);
+        pMessageText = popTextBlock(pPool, length);
+        pPool->numOverflows += (pMessage == NULL) + (pMessageText == NULL);
+        pPool->numTaken++;
+    }
+    pthread_mutex_unlock(&pPool->accessPoolMutex);
+
+    if (pMessage == NULL) {
+        pMessage = malloc(sizeof(Message));
+    }
+    if (pMessageText == NULL) {
+        // Account for \0 character.
+        pMessageText = malloc(length + 1);
+    }
+    if (pMessage == NULL || pMessageText == NULL) {
+        putBack(pPool, pMessage, pMessageText);
+        return NULL;
+    }
+
+    memcpy(pMessageText, pText, length);
+    pMessageText[length] = '\0';
+    pMessage->pText = pMessageText;
+    pMessage->length = length;
+    pMessage->isShutdownMessage = isShutdownMessage;
+    pMessage->lane = LANE_INTERACTIVE;
+    pMessage->enqueueNs = 0;
+    pMessage->traceId = Trace_newMessageId();
+    pMessage->pPool = pPool;
+    pMessage->releaseFn = NULL;
+    pMessage->pReleaseArg = NULL;
+    pMessage->pNext = NULL;
+    return pMessage;
+}
+
+Message* MessagePool_borrowText(MessagePool* pPool, const char* pText, size_t length,
+                                bool isShutdownMessage, MessageReleaseFn releaseFn,
+                                void* pReleaseArg)
+{
+    Message* pMessage;
+    pthread_mutex_lock(&pPool->accessPoolMutex);
+    {
+        pMessage = (Message*) popBlock(&pPool->messages);
+        pPool->numOverflows += pMessage == NULL;
+        pPool->numTaken++;
+    }
+    pthread_mutex_unlock(&pPool->accessPoolMutex);
+
+    if (pMessage == NULL) {
+        pMessage = malloc(sizeof(Message));
+        if (pMessage == NULL) {
+            return NULL;
+        }
+    }
+    // Only ever read, as releaseFn marks it borrowed.
+    pMessage->pText = (char*) pText;
+    pMessage->length = length;
+    pMessage->isShutdownMessage = isShutdownMessage;
+    pMessage->lane = LANE_INTERACTIVE;
+    pMessage->enqueueNs = 0;
+    pMessage->traceId = Trace_newMessageId();
+    pMessage->pPool = pPool;
+    pMessage->releaseFn = releaseFn;
+    pMessage->pReleaseArg = pReleaseArg;
+    pMessage->pNext = NULL;
+    return pMessage;
+}
+
+bool MessagePool_growText(Message* pMessage, size_t length)
+{
+    if (pMessage->releaseFn != NULL) {
+        return false;
+    }
+    MessagePool* pPool = pMessage->pPool;
+    size_t capacity = pPool != NULL ? getTextCapacity(pPool, pMessage->pText) : 0;
+    if (capacity == 0) {
+        char* pText = realloc(pMessage->pText, length + 1);
+        if (pText == NULL) {
+            return false;
+        }
+        pMessage->pText = pText;
+        return true;
+    }
+    if (length < capacity) {
+        return true;
+    }
+
+    char* pText;
+    pthread_mutex_lock(&pPool->accessPoolMutex);
+    {
+        pText = popTextBlock(pPool, length);
+        pPool->numOverflows += pText == NULL;
+    }
+    pthread_mutex_unlock(&pPool->accessPoolMutex);
+    if (pText == NULL) {
+        pText = malloc(length + 1);
+        if (pText == NULL) {
+            return false;
+        }
+    }
+    memcpy(pText, pMessage->pText, pMessage->length + 1);
+
+    putBack(pPool, NULL, pMessage->pText);
+    pMessage->pText = pText;
+    return true;
+}
+
+void MessagePool_release(Message* pMessage)
+{
+    if (pMessage->releaseFn != NULL) {
+        pMessage->releaseFn(pMessage->pReleaseArg, pMessage->pText);
+        putBack(pMessage->pPool, pMessage, NULL);
+    } else {
+        putBack(pMessage->pPool, pMessage, pMessage->pText);
+    }
+}
+
+static void printStackUse(const BlockStack* pStack)
+{
+    printf("%zu/%zu", pStack->numBlocks - pStack->minNumFree, pStack->numBlocks);
+}
+
+void MessagePool_printStats(MessagePool* pPool)
+{
+    if (pPool == NULL || pPool->numTaken == 0) {
+        return;
+    }
+    printf("%s message pool: %lu taken, most in use at once ", pPool->pName, pPool->numTaken);
+    printStackUse(&pPool->messages);
+    printf(" messages, texts");
+    int textClass;
+    for (textClass = 0; textClass < MESSAGE_POOL_NUM_CLASSES; textClass++) {
+        const BlockStack* pStack = &pPool->textClasses[textClass];
+        if (pStack->blockSize < 1024) {
+            printf(" %zub ", pStack->blockSize);
+        } else {
+            printf(" %zuk ", (pStack->blockSize + 1023) / 1024);
+        }
+        printStackUse(pStack);
+    }
+    if (pPool->numOverflows > 0) {
+        printf(", %lu malloc'd when it ran out", pPool->numOverflows);
+    }
+    printf("\n");
+}
+
+static void destroyStack(BlockStack* pStack)
+{
+    free(pStack->pSlab);
+    free(pStack->ppFreeBlocks);
+}
+
+void MessagePool_destroy(MessagePool* pPool)
+{
+    if (pPool == NULL) {
+        return;
+    }
+    destroyStack(&pPool->messages);
+    int textClass;
+    for (textClass = 0; textClass < MESSAGE_POOL_NUM_CLASSES; textClass++) {
+        destroyStack(&pPool->textClasses[textClass]);
+    }
+    pthread_mutex_destroy(&pPool->accessPoolMutex);
+    free(pPool);
+}
@@ -0,0 +1,74 @@
+#ifndef _MESSAGE_POOL_H
+#define _MESSAGE_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "message.h"
+#include "message_queue.h"
+
+/*
+ * Messages for one pipeline (the keyboard reader to the sender, or the listener to
+ * the printer), allocated up front so that passing messages along doesn't touch the
+ * heap.
+ *
+ * The text of a message goes in a block from the smallest of a few size classes it
+ * fits in, up to the longest text the pipeline carries. The pool is sized from the limits of the
+ * pipeline's queue: enough messages to fill it, and enough blocks of each class to
+ * fill its byte limit with them, plus a few more for the messages the producer and
+ * consumer are holding. The memory is only touched as it is used. When a class runs
+ * out, a larger one is used, and when they all have, the message is malloc'd, which
+ * is counted in the stats.
+ */
+
+// Messages owned outside the queue: one being made, one being taken, and the
+// termination message.
+#define MESSAGE_POOL_NUM_SPARE 4
+
+/*
+ * Returns NULL if there isn't enough memory. `pName` is used when printing stats, and
+ * `maxLength` is the longest text a message of the pipeline can have, which sizes the
+ * largest class. It must be at least 16k.
+ */
+MessagePool* MessagePool_create(const char* pName, const QueueLimits* pLimits, size_t maxLength);
+
+/*
+ * Copies the first `length` characters of pText into a message from the pool.
+ * It goes back to the pool with freeMessageFn. Safe to call from any thread.
+ * Returns NULL if out of memory.
+ */
+Message* MessagePool_createMessage(MessagePool* pPool, const char* pText, size_t length,
+                                   bool isShutdownMessage);
+
+/*
+ * Makes a message from the pool that borrows the text instead of copying it. The
+ * text must stay as it is until the message is freed, which hands it back with
+ * releaseFn(pReleaseArg, pText) instead of putting it in the pool. releaseFn can't
+ * be NULL. Safe to call from any thread.
+ * Returns NULL if out of memory, without calling releaseFn.
+ */
+Message* MessagePool_borrowText(MessagePool* pPool, const char* pText, size_t length,
+                                bool isShutdownMessage, MessageReleaseFn releaseFn,
+                                void* pReleaseArg);
+
+/*
+ * Makes room in the text of the message for `length` characters, keeping those it
+ * has. Messages from createMessage are realloc'd.
+ * Returns false if out of memory or the text is borrowed, in which case the message
+ * is left alone.
+ */
+bool MessagePool_growText(Message* pMessage, size_t length);
+
+/*
+ * Puts the message and its text back in its pool. Called by freeMessageFn.
+ */
+void MessagePool_release(Message* pMessage);
+
+void MessagePool_printStats(MessagePool* pPool);
+
+/*
+ * Only called when all threads using the pool are shutdown and every message taken
+ * from it has been freed.
+ */
+void MessagePool_destroy(MessagePool* pPool);
+
+#endif // _MESSAGE_POOL_H
@@ -0,0 +1,501 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "message_queue.h"
+#include "message_pool.h"
+
+// A message this soon after a bulk message is taken to be more of the same paste
+// or stream, even if it is short.
+#define BULK_CONTINUATION_NS 10000000ULL
+
+static const char* s_laneNames[NUM_MESSAGE_LANES] = {
+    "control",
+    "interactive",
+    "bulk"
+};
+
+/*
+ * The messages of one lane, linked through their pNext, oldest first.
+ */
+typedef struct Lane_s Lane;
+struct Lane_s {
+    Message* pFirst;
+    Message* pLast;
+};
+
+struct MessageQueue_s {
+    const char* pName;
+    QueueLimits limits;
+
+    Lane lanes[NUM_MESSAGE_LANES];
+    size_t numMessages;
+    size_t numBytes;
+    bool isClosed;
+
+    // Messages each lane can still take in this round of the scheduler.
+    unsigned int laneCredits[NUM_MESSAGE_LANES];
+    LaneStats laneStats[NUM_MESSAGE_LANES];
+
+    // For classifying the producer's messages.
+    bool wasLastBulk;
+    uint64_t lastPutNs;
+
+    pthread_mutex_t accessQueueMutex;
+    pthread_cond_t syncMessagesAvailableCondVar;
+    pthread_cond_t syncRoomAvailableCondVar;
+
+    // Overflow counters. Only touched while holding accessQueueMutex.
+    unsigned long numDroppedNewest;
+    unsigned long numDroppedOldest;
+    unsigned long numCoalesced;
+    unsigned long numBlocked;
+    unsigned long numBlockTimeouts;
+    unsigned long long numBytesDropped;
+};
+
+MessageQueue* MessageQueue_create(const char* pName, const QueueLimits* pLimits)
+{
+    MessageQueue* pQueue = malloc(sizeof(MessageQueue));
+    if (pQueue == NULL) {
+        return NULL;
+    }
+    memset(pQueue, 0, sizeof(MessageQueue));
+    pQueue->pName = pName;
+    pQueue->limits = *pLimits;
+
+    pthread_mutex_init(&pQueue->accessQueueMutex, NULL);
+    pthread_cond_init(&pQueue->syncMessagesAvailableCondVar, NULL);
+
+    // Block timeouts are measured against the monotonic clock so that changes to
+    // the wall clock can't make a producer block forever.
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pQueue->syncRoomAvailableCondVar, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+
+    return pQueue;
+}
+
+/*
+ * Must hold accessQueueMutex.
+ */
+static bool isFullForMessageOfLength(MessageQueue* pQueue, size_t length)
+{
+    if (pQueue->numMessages >= pQueue->limits.maxMessages) {
+        return true;
+    }
+    // A single message larger than the byte limit is still let through when the
+    // queue is empty, otherwise it could never be queued.
+    return pQueue->numMessages > 0 && pQueue->numBytes + length > pQueue->limits.maxBytes;
+}
+
+/*
+ * Must hold accessQueueMutex. Picks the lane for a message from its producer's
+ * pattern: the shutdown message is control, and a message is bulk if it is long or
+ * comes right after a bulk message, as the pieces of a paste or a file do.
+ * Anything else was typed, and is interactive.
+ */
+static MessageLane classifyMessage(MessageQueue* pQueue, const Message* pMessage, uint64_t nowNs)
+{
+    if (pMessage->isShutdownMessage) {
+        return LANE_CONTROL;
+    }
+    bool isBulk = pMessage->length > pQueue->limits.interactiveMaxBytes
+                  || (pQueue->wasLastBulk && nowNs - pQueue->lastPutNs < BULK_CONTINUATION_NS);
+    pQueue->wasLastBulk = isBulk;
+    pQueue->lastPutNs = nowNs;
+    return isBulk ? LANE_BULK : LANE_INTERACTIVE;
+}
+
+/*
+ * Must hold accessQueueMutex. Appends the message to its lane and updates the counts.
+ */
+static void appendToLane(MessageQueue* pQueue, Message* pMessage)
+{
+    Lane* pLane = &pQueue->lanes[pMessage->lane];
+    pMessage->pNext = NULL;
+    if (pLane->pLast == NULL) {
+        pLane->pFirst = pMessage;
+    } else {
+        pLane->pLast->pNext = pMessage;
+    }
+    pLane->pLast = pMessage;
+
+    LaneStats* pStats = &pQueue->laneStats[pMessage->lane];
+    pQueue->numMessages++;
+    pQueue->numBytes += pMessage->length;
+    pStats->depth++;
+    if (pStats->depth > pStats->maxDepth) {
+        pStats->maxDepth = pStats->depth;
+    }
+}
+
+/*
+ * Must hold accessQueueMutex. Removes the first message of the lane and updates the
+ * counts. The lane must not be empty.
+ */
+static Message* removeFirstOfLane(MessageQueue* pQueue, MessageLane lane)
+{
+    Lane* pLane = &pQueue->lanes[lane];
+    Message* pMessage = pLane->pFirst;
+    pLane->pFirst = pMessage->pNext;
+    if (pLane->pFirst == NULL) {
+        pLane->pLast = NULL;
+    }
+    pMessage->pNext = NULL;
+    pQueue->numMessages--;
+    pQueue->laneStats[lane].depth--;
+    pQueue->numBytes -= pMessage->length;
+    return pMessage;
+}
+
+/*
+ * Must hold accessQueueMutex. Drops the oldest message of the least urgent lane that
+ * has any. Returns false if the queue is empty.
+ */
+static bool dropOldestMessage(MessageQueue* pQueue)
+{
+    int lane = NUM_MESSAGE_LANES - 1;
+    while (lane >= 0 && pQueue->lanes[lane].pFirst == NULL) {
+        lane--;
+    }
+    if (lane < 0) {
+        return false;
+    }
+    Message* pOldest = removeFirstOfLane(pQueue, lane);
+    pQueue->numBytesDropped += pOldest->length;
+    freeMessageFn(pOldest);
+    pQueue->numDroppedOldest++;
+    return true;
+}
+
+/*
+ * Must hold accessQueueMutex. Appends the text of pMessage onto the last message
+ * in its lane and frees pMessage. Returns false if it can't be coalesced, in which
+ * case pMessage is left alone.
+ */
+static bool tryCoalesceWithLastMessage(MessageQueue* pQueue, Message* pMessage)
+{
+    if (pMessage->isShutdownMessage
+        || pQueue->numBytes + pMessage->length > pQueue->limits.maxBytes) {
+        return false;
+    }
+    Message* pLast = pQueue->lanes[pMessage->lane].pLast;
+    if (pLast == NULL || pLast->pText == NULL || pLast->isShutdownMessage) {
+        return false;
+    }
+    // The coalesced message still has to fit in one datagram.
+    size_t coalescedLength = pLast->length + pMessage->length;
+    if (coalescedLength >= MSG_MAX_LEN) {
+        return false;
+    }
+    if (!MessagePool_growText(pLast, coalescedLength)) {
+        return false;
+    }
+    memcpy(pLast->pText + pLast->length, pMessage->pText, pMessage->length);
+    pLast->pText[coalescedLength] = '\0';
+    pLast->length = coalescedLength;
+
+    pQueue->numBytes += pMessage->length;
+    pQueue->numCoalesced++;
+    freeMessageFn(pMessage);
+    return true;
+}
+
+/*
+ * Must hold accessQueueMutex. Waits until the message fits or the timeout expires.
+ * Returns true if there is room for the message.
+ */
+static bool waitForRoom(MessageQueue* pQueue, size_t length)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += pQueue->limits.blockTimeoutMs / 1000;
+    deadline.tv_nsec += (pQueue->limits.blockTimeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pQueue->numBlocked++;
+    while (isFullForMessageOfLength(pQueue, length) && !pQueue->isClosed) {
+        int status = pthread_cond_timedwait(&pQueue->syncRoomAvailableCondVar,
+                                            &pQueue->accessQueueMutex, &deadline);
+        if (status == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (isFullForMessageOfLength(pQueue, length) || pQueue->isClosed) {
+        pQueue->numBlockTimeouts++;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Must hold accessQueueMutex. Applies the overflow policy to a full queue.
+ * Returns true if pMessage was consumed (coalesced or dropped), and sets
+ * *pIsQueued to whether its text made it onto the queue.
+ */
+static bool handleOverflow(MessageQueue* pQueue, Message* pMessage, bool* pIsQueued)
+{
+    switch (pQueue->limits.policy) {
+        case OVERFLOW_BLOCK:
+            if (waitForRoom(pQueue, pMessage->length)) {
+                return false;
+            }
+            break;
+        case OVERFLOW_DROP_OLDEST:
+            while (isFullForMessageOfLength(pQueue, pMessage->length)
+                   && dropOldestMessage(pQueue)) {
+            }
+            return false;
+        case OVERFLOW_COALESCE:
+            if (tryCoalesceWithLastMessage(pQueue, pMessage)) {
+                *pIsQueued = true;
+                return true;
+            }
+            break;
+        case OVERFLOW_DROP_NEWEST:
+            // Pass through
+        default:
+            break;
+    }
+
+    // The shutdown message is the last one a producer will send, so make room for
+    // it rather than losing it.
+    if (pMessage->isShutdownMessage && !pQueue->isClosed) {
+        while (isFullForMessageOfLength(pQueue, pMessage->length)
+               && dropOldestMessage(pQueue)) {
+        }
+        return false;
+    }
+
+    pQueue->numDroppedNewest++;
+    pQueue->numBytesDropped += pMessage->length;
+    freeMessageFn(pMessage);
+    *pIsQueued = false;
+    return true;
+}
+
+bool MessageQueue_put(MessageQueue* pQueue, Message* pMessage)
+{
+    if (pQueue == NULL) {
+        freeMessageFn(pMessage);
+        return false;
+    }
+
+    bool isEnqueueSuccessful = false;
+
+    pthread_cleanup_push(unlockMutexesCleanup, &pQueue->accessQueueMutex);
+    pthread_mutex_lock(&pQueue->accessQueueMutex);
+    {
+        pMessage->enqueueNs = getMonotonicTimeNs();
+        pMessage->lane = classifyMessage(pQueue, pMessage, pMessage->enqueueNs);
+
+        bool isMessageConsumed = false;
+        if (pQueue->isClosed) {
+            pQueue->numDroppedNewest++;
+            pQueue->numBytesDropped += pMessage->length;
+            freeMessageFn(pMessage);
+            isMessageConsumed = true;
+        } else if (isFullForMessageOfLength(pQueue, pMessage->length)) {
+            isMessageConsumed = handleOverflow(pQueue, pMessage, &isEnqueueSuccessful);
+        }
+
+        if (!isMessageConsumed) {
+            appendToLane(pQueue, pMessage);
+            pthread_cond_signal(&pQueue->syncMessagesAvailableCondVar);
+            isEnqueueSuccessful = true;
+        } else if (isEnqueueSuccessful) {
+            pthread_cond_signal(&pQueue->syncMessagesAvailableCondVar);
+        }
+    }
+    // Unlocks the mutex.
+    pthread_cleanup_pop(1);
+
+    return isEnqueueSuccessful;
+}
+
+/*
+ * Must hold accessQueueMutex. Returns the lane to take the next message from, or
+ * NUM_MESSAGE_LANES if the queue is empty. The control lane always goes first. The
+ * others take turns in weighted rounds: each gets up to its weight in messages per
+ * round, and a lane with nothing queued gives up its turn.
+ */
+static MessageLane pickLane(MessageQueue* pQueue)
+{
+    if (pQueue->lanes[LANE_CONTROL].pFirst != NULL) {
+        return LANE_CONTROL;
+    }
+    int round;
+    for (round = 0; round < 2; round++) {
+        int lane;
+        for (lane = LANE_INTERACTIVE; lane < NUM_MESSAGE_LANES; lane++) {
+            if (pQueue->laneCredits[lane] > 0 && pQueue->lanes[lane].pFirst != NULL) {
+                pQueue->laneCredits[lane]--;
+                return lane;
+            }
+        }
+        // Every lane with messages has used up its share, so start a new round.
+        for (lane = LANE_INTERACTIVE; lane < NUM_MESSAGE_LANES; lane++) {
+            pQueue->laneCredits[lane] = pQueue->limits.laneWeights[lane];
+        }
+    }
+    return NUM_MESSAGE_LANES;
+}
+
+Message* MessageQueue_take(MessageQueue* pQueue)
+{
+    if (pQueue == NULL) {
+        return NULL;
+    }
+
+    Message* pMessage = NULL;
+
+    pthread_cleanup_push(unlockMutexesCleanup, &pQueue->accessQueueMutex);
+    pthread_mutex_lock(&pQueue->accessQueueMutex);
+    {
+        // Block if list is empty until list has items.
+        while (pQueue->numMessages == 0 && !pQueue->isClosed) {
+            // When it blocks, the mutex will be released to allow the producer
+            // to be able to add messages onto the queue.
+            pthread_cond_wait(&pQueue->syncMessagesAvailableCondVar, &pQueue->accessQueueMutex);
+        }
+        MessageLane lane = pickLane(pQueue);
+        if (lane != NUM_MESSAGE_LANES) {
+            // Do not let the consumer be cancelled while it holds a pointer to a message.
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            /* CONSUMER THREAD NOT CANCELLABLE HERE */
+            // Dequeue
+            pMessage = removeFirstOfLane(pQueue, lane);
+            if (pMessage == NULL || pMessage->pText == NULL) {
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            } else {
+                LaneStats* pStats = &pQueue->laneStats[lane];
+                uint64_t waitNs = getMonotonicTimeNs() - pMessage->enqueueNs;
+                pStats->numTaken++;
+                pStats->totalWaitNs += waitNs;
+                if (waitNs > pStats->maxWaitNs) {
+                    pStats->maxWaitNs = waitNs;
+                }
+            }
+            pthread_cond_signal(&pQueue->syncRoomAvailableCondVar);
+        }
+    }
+    // This pop releases the mutex via unlockMutexesCleanup
+    // It also will make sure the mutex is released if the thread
+    // cancels while it is blocked by the cond_wait, since the
+    // routine is triggered if the thread cancels.
+    pthread_cleanup_pop(1);
+
+    return pMessage;
+}
+
+void MessageQueue_getLaneStats(MessageQueue* pQueue, MessageLane lane, LaneStats* pStats)
+{
+    pthread_mutex_lock(&pQueue->accessQueueMutex);
+    *pStats = pQueue->laneStats[lane];
+    pthread_mutex_unlock(&pQueue->accessQueueMutex);
+}
+
+bool MessageQueue_hasMessages(MessageQueue* pQueue)
+{
+    if (pQueue == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&pQueue->accessQueueMutex);
+    bool hasMessages = pQueue->numMessages > 0;
+    pthread_mutex_unlock(&pQueue->accessQueueMutex);
+    return hasMessages;
+}
+
+void MessageQueue_close(MessageQueue* pQueue)
+{
+    if (pQueue == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pQueue->accessQueueMutex);
+    pQueue->isClosed = true;
+    pthread_cond_broadcast(&pQueue->syncMessagesAvailableCondVar);
+    pthread_cond_broadcast(&pQueue->syncRoomAvailableCondVar);
+    pthread_mutex_unlock(&pQueue->accessQueueMutex);
+}
+
+void MessageQueue_printStats(MessageQueue* pQueue)
+{
+    if (pQueue == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pQueue->accessQueueMutex);
+    int lane;
+    bool hasPrintedLane = false;
+    for (lane = 0; lane < NUM_MESSAGE_LANES; lane++) {
+        const LaneStats* pStats = &pQueue->laneStats[lane];
+        if (pStats->numTaken == 0) {
+            continue;
+        }
+        if (hasPrintedLane) {
+            printf("; ");
+        } else {
+            printf("%s queue lanes: ", pQueue->pName);
+        }
+        printf("%s %lu taken, max depth %zu, wait avg %.3f ms, max %.3f ms",
+               s_laneNames[lane], pStats->numTaken, pStats->maxDepth,
+               (double) pStats->totalWaitNs / pStats->numTaken / 1e6,
+               (double) pStats->maxWaitNs / 1e6);
+        hasPrintedLane = true;
+    }
+    if (hasPrintedLane) {
+        printf("\n");
+    }
+
+    bool hasOverflowed = pQueue->numDroppedNewest > 0 || pQueue->numDroppedOldest > 0
+                         || pQueue->numCoalesced > 0 || pQueue->numBlocked > 0;
+    if (hasOverflowed) {
+        printf("%s queue overflowed: %lu dropped newest, %lu dropped oldest, %lu coalesced, "
+               "%lu blocked (%lu timed out), %llu bytes dropped\n",
+               pQueue->pName,
+               pQueue->numDroppedNewest, pQueue->numDroppedOldest, pQueue->numCoalesced,
+               pQueue->numBlocked, pQueue->numBlockTimeouts, pQueue->numBytesDropped);
+    }
+    pthread_mutex_unlock(&pQueue->accessQueueMutex);
+}
+
+void MessageQueue_destroy(MessageQueue* pQueue)
+{
+    if (pQueue == NULL) {
+        return;
+    }
+    pthread_cond_destroy(&pQueue->syncMessagesAvailableCondVar);
+    pthread_cond_destroy(&pQueue->syncRoomAvailableCondVar);
+    pthread_mutex_destroy(&pQueue->accessQueueMutex);
+
+    int lane;
+    for (lane = 0; lane < NUM_MESSAGE_LANES; lane++) {
+        while (pQueue->lanes[lane].pFirst != NULL) {
+            freeMessageFn(removeFirstOfLane(pQueue, lane));
+        }
+    }
+    free(pQueue);
+}
+
+bool MessageQueue_parseOverflowPolicy(const char* pName, OverflowPolicy* pPolicy)
+{
+    if (strcmp(pName, "block") == 0) {
+        *pPolicy = OVERFLOW_BLOCK;
+    } else if (strcmp(pName, "drop-oldest") == 0) {
+        *pPolicy = OVERFLOW_DROP_OLDEST;
+    } else if (strcmp(pName, "drop-newest") == 0) {
+        *pPolicy = OVERFLOW_DROP_NEWEST;
+    } else if (strcmp(pName, "coalesce") == 0) {
+        *pPolicy = OVERFLOW_COALESCE;
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,109 @@
+#ifndef _MESSAGE_QUEUE_H
+#define _MESSAGE_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "message.h"
+
+/*
+ * What a producer does when the queue is at its message or byte limit.
+ */
+typedef enum {
+    // Block the producer until there is room, dropping the newest message on timeout.
+    OVERFLOW_BLOCK,
+    // Evict the oldest queued messages to make room.
+    OVERFLOW_DROP_OLDEST,
+    // Drop the message being put on the queue.
+    OVERFLOW_DROP_NEWEST,
+    // Append the message's text onto the last queued message if it fits in a datagram.
+    OVERFLOW_COALESCE
+} OverflowPolicy;
+
+// The most messages a queue can be set to hold. Its pool sets aside a message for
+// each one up front.
+#define MESSAGE_QUEUE_MAX_MESSAGES 500
+
+typedef struct QueueLimits_s QueueLimits;
+struct QueueLimits_s {
+    size_t maxMessages;
+    size_t maxBytes;
+    OverflowPolicy policy;
+    // Only used for OVERFLOW_BLOCK.
+    long blockTimeoutMs;
+    // Messages longer than this go in the bulk lane.
+    size_t interactiveMaxBytes;
+    // How many messages each lane gets to send per round while the others are
+    // waiting. The control lane always goes first, so its weight isn't used.
+    unsigned int laneWeights[NUM_MESSAGE_LANES];
+};
+
+typedef struct LaneStats_s LaneStats;
+struct LaneStats_s {
+    size_t depth;
+    size_t maxDepth;
+    unsigned long numTaken;
+    uint64_t totalWaitNs;
+    uint64_t maxWaitNs;
+};
+
+typedef struct MessageQueue_s MessageQueue;
+
+/*
+ * Creates a queue with the given limits. `pName` is used when printing stats.
+ * Returns NULL on error.
+ */
+MessageQueue* MessageQueue_create(const char* pName, const QueueLimits* pLimits);
+
+/*
+ * Puts pMessage on the queue, applying the overflow policy if the queue is full.
+ * The message goes in a lane picked from its length and from how soon it came after
+ * the previous one, so each queue should only have one producer.
+ * The queue takes ownership of pMessage either way: it is freed if it gets dropped.
+ * Returns true if the message (or its text, when coalesced) was queued.
+ */
+bool MessageQueue_put(MessageQueue* pQueue, Message* pMessage);
+
+/*
+ * Removes the oldest message of the lane whose turn it is, blocking the caller while
+ * the queue is empty. Messages in a lane stay in order, but can overtake messages
+ * queued earlier in a less urgent lane.
+ * If a message is returned, the calling thread is left with cancellation disabled
+ * so that it cannot be cancelled while it owns the message.
+ * Returns NULL once the queue is closed and empty.
+ */
+Message* MessageQueue_take(MessageQueue* pQueue);
+
+/*
+ * Returns true if there are messages waiting on the queue.
+ */
+bool MessageQueue_hasMessages(MessageQueue* pQueue);
+
+/*
+ * Wakes up every producer and consumer blocked on the queue. Producers waiting
+ * for room drop their message, and consumers get NULL once the queue drains.
+ */
+void MessageQueue_close(MessageQueue* pQueue);
+
+/*
+ * Copies the current depth and the wait times so far of one lane.
+ */
+void MessageQueue_getLaneStats(MessageQueue* pQueue, MessageLane lane, LaneStats* pStats);
+
+/*
+ * Prints the per-lane depth and wait times, and the overflow counters if there
+ * were any overflows.
+ */
+void MessageQueue_printStats(MessageQueue* pQueue);
+
+/*
+ * Only called when all threads using the queue are shutdown.
+ */
+void MessageQueue_destroy(MessageQueue* pQueue);
+
+/*
+ * Parses "block", "drop-oldest", "drop-newest" or "coalesce".
+ * Returns false if the name isn't one of those.
+ */
+bool MessageQueue_parseOverflowPolicy(const char* pName, OverflowPolicy* pPolicy);
+
+#endif // _MESSAGE_QUEUE_H
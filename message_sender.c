@@ -10,37 +10,449 @@
 #include <netdb.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 
+#include "thread_placement.h"
 #include "common.h"
 #include "message_sender.h"
 #include "keyboard_reader.h"
+#include "options.h"
+#include "shm_transport.h"
+#include "fec.h"
+#include "socket_config.h"
+#include "keepalive.h"
+#include "dedup.h"
+#include "trace.h"
+#include "wire.h"
+#include "multipath.h"
+#include "resolver.h"
+
+// Loss above this fraction makes the adaptive pacer back off.
+#define PACING_LOSS_THRESHOLD 0.01
+// The adaptive pacer never goes below this fraction of the configured rate.
+#define PACING_MIN_RATE_DIVISOR 64
+// How much of the configured rate the adaptive pacer adds back per loss-free report.
+#define PACING_INCREASE_DIVISOR 32
+
+// The most segments the kernel accepts in one UDP_SEGMENT send.
+#define GSO_MAX_SEGMENTS 64
+
+// How often to retry attaching to a local peer's shared-memory ring.
+#define SHM_ATTACH_RETRY_NS 1000000000ULL
+
+/*
+ * Token bucket used to pace the sender. A rate of 0 means unlimited.
+ * Tokens may go negative so that a message larger than the burst can still be
+ * sent; the debt is paid off before the next message goes out.
+ */
+typedef struct TokenBucket_s TokenBucket;
+struct TokenBucket_s {
+    double ratePerSec;
+    double maxRatePerSec;
+    double burst;
+    double tokens;
+    uint64_t lastRefillNs;
+};
 
 static pthread_t s_threadPid;
-static in_addr_t s_destinationAddr;
 static in_port_t s_destinationPort;
 static in_port_t s_ourPort;
 
 static int s_socketDescriptor;
 
+static bool s_isFecEnabled = false;
+static bool s_isDedupEnabled = false;
+// Shared with the listener, which decodes the peer's frames.
+static Wire s_wire;
+// Dedup datagrams and frames for FEC are built here, behind room for a frame header,
+// so that FEC can wrap them in messageTxBuffer.
+static char s_payloadTxBuffer[WIRE_MAX_HEADER_LEN + MSG_MAX_LEN];
+// 0 when messages aren't split with UDP_SEGMENT.
+static size_t s_gsoSegmentBytes = 0;
+static unsigned long s_numSegmentedSends = 0;
+static unsigned long s_numSegments = 0;
+
+static bool s_isPeerLocal = false;
+// The address s_isPeerLocal was worked out for, which changes if the peer's name
+// resolves somewhere else.
+static in_addr_t s_localCheckedAddr = 0;
+static uint64_t s_nextShmAttachAttemptNs = 0;
+
+static bool s_isPacingEnabled = false;
+static TokenBucket s_byteBucket;
+static TokenBucket s_packetBucket;
+// Protects the bucket rates, which the adaptive pacer changes from other threads.
+static pthread_mutex_t s_syncPacingRateMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long s_numSends = 0;
+static uint64_t s_firstSendNs = 0;
+static unsigned long s_numPacedSends = 0;
+static uint64_t s_totalPacingWaitNs = 0;
+
+static void initTokenBucket(TokenBucket* pBucket, double ratePerSec, double burst, uint64_t nowNs)
+{
+    pBucket->ratePerSec = ratePerSec;
+    pBucket->maxRatePerSec = ratePerSec;
+    pBucket->burst = burst;
+    pBucket->tokens = burst;
+    pBucket->lastRefillNs = nowNs;
+}
+
+/*
+ * Must hold s_syncPacingRateMutex.
+ */
+static void refillTokenBucket(TokenBucket* pBucket, uint64_t nowNs)
+{
+    double elapsedSec = (double) (nowNs - pBucket->lastRefillNs) / 1e9;
+    pBucket->lastRefillNs = nowNs;
+    pBucket->tokens += elapsedSec * pBucket->ratePerSec;
+    if (pBucket->tokens > pBucket->burst) {
+        pBucket->tokens = pBucket->burst;
+    }
+}
+
+/*
+ * Must hold s_syncPacingRateMutex. Returns how long to wait until `cost` tokens
+ * can be taken from the bucket.
+ */
+static uint64_t getNsUntilTokensAvailable(const TokenBucket* pBucket, double cost)
+{
+    if (pBucket->ratePerSec <= 0) {
+        return 0;
+    }
+    double needed = cost < pBucket->burst ? cost : pBucket->burst;
+    if (pBucket->tokens >= needed) {
+        return 0;
+    }
+    return (uint64_t) ((needed - pBucket->tokens) / pBucket->ratePerSec * 1e9) + 1;
+}
+
+/*
+ * Blocks the sender until the rate limits allow numDatagrams datagrams totalling
+ * sizeOfMessage bytes, then takes the tokens for them. The sleep is on an absolute CLOCK_MONOTONIC
+ * deadline so that wakeup latency doesn't add up across messages.
+ */
+static void waitForPacingBudget(size_t sizeOfMessage, size_t numDatagrams)
+{
+    if (!s_isPacingEnabled) {
+        return;
+    }
+    bool isDelayed = false;
+    while (1) {
+        uint64_t nowNs = getMonotonicTimeNs();
+        uint64_t waitNs;
+
+        pthread_mutex_lock(&s_syncPacingRateMutex);
+        {
+            refillTokenBucket(&s_byteBucket, nowNs);
+            refillTokenBucket(&s_packetBucket, nowNs);
+            waitNs = getNsUntilTokensAvailable(&s_byteBucket, (double) sizeOfMessage);
+            uint64_t packetWaitNs = getNsUntilTokensAvailable(&s_packetBucket,
+                                                              (double) numDatagrams);
+            if (packetWaitNs > waitNs) {
+                waitNs = packetWaitNs;
+            }
+            if (waitNs == 0) {
+                s_byteBucket.tokens -= (double) sizeOfMessage;
+                s_packetBucket.tokens -= (double) numDatagrams;
+            }
+        }
+        pthread_mutex_unlock(&s_syncPacingRateMutex);
+
+        if (waitNs == 0) {
+            break;
+        }
+        isDelayed = true;
+        s_totalPacingWaitNs += waitNs;
+
+        uint64_t releaseNs = nowNs + waitNs;
+        struct timespec releaseTime = {
+            .tv_sec = (time_t) (releaseNs / 1000000000ULL),
+            .tv_nsec = (long) (releaseNs % 1000000000ULL)
+        };
+        // The message has already been copied out and freed, so the sender can
+        // be cancelled while it sleeps.
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &releaseTime, NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    }
+    if (isDelayed) {
+        s_numPacedSends++;
+    }
+}
+
+static void scaleTokenBucketRate(TokenBucket* pBucket, double lossFraction)
+{
+    if (pBucket->maxRatePerSec <= 0) {
+        return;
+    }
+    double minRate = pBucket->maxRatePerSec / PACING_MIN_RATE_DIVISOR;
+    if (lossFraction > PACING_LOSS_THRESHOLD) {
+        // Multiplicative decrease, proportional to how much is being lost.
+        double factor = 1.0 - (lossFraction > 1.0 ? 1.0 : lossFraction) / 2;
+        pBucket->ratePerSec *= factor;
+        if (pBucket->ratePerSec < minRate) {
+            pBucket->ratePerSec = minRate;
+        }
+    } else {
+        // Additive increase back up to the configured rate.
+        pBucket->ratePerSec += pBucket->maxRatePerSec / PACING_INCREASE_DIVISOR;
+        if (pBucket->ratePerSec > pBucket->maxRatePerSec) {
+            pBucket->ratePerSec = pBucket->maxRatePerSec;
+        }
+    }
+}
+
+/*
+ * Returns true if the peer is on this host and we are attached to its
+ * shared-memory ring, trying to attach at most once per SHM_ATTACH_RETRY_NS.
+ */
+static bool isSharedMemoryAttached(const struct sockaddr_in* pSinRemote)
+{
+    if (pSinRemote->sin_addr.s_addr != s_localCheckedAddr) {
+        s_localCheckedAddr = pSinRemote->sin_addr.s_addr;
+        s_isPeerLocal = Options_get()->isShmEnabled
+                        && ShmTransport_isPeerLocal(ntohl(s_localCheckedAddr));
+    }
+    if (!s_isPeerLocal) {
+        return false;
+    }
+    if (ShmTransport_isProducerAttached()) {
+        return true;
+    }
+    uint64_t nowNs = getMonotonicTimeNs();
+    if (nowNs < s_nextShmAttachAttemptNs) {
+        return false;
+    }
+    s_nextShmAttachAttemptNs = nowNs + SHM_ATTACH_RETRY_NS;
+    return ShmTransport_attachProducer(s_destinationPort);
+}
+
+/*
+ * Writes the message straight from its text into the peer's shared-memory ring,
+ * and frees it if that worked. Returns false if the message still has to go over UDP.
+ */
+static bool trySendOverSharedMemory(const struct sockaddr_in* pSinRemote,
+                                    Message* pOutputMessage, size_t sizeOfMessage)
+{
+    if (!isSharedMemoryAttached(pSinRemote)) {
+        return false;
+    }
+    bool isWritten;
+    // Pacing and a full ring can both let the sender be cancelled while it owns
+    // the message.
+    pthread_cleanup_push(freeMessageFn, pOutputMessage);
+    waitForPacingBudget(sizeOfMessage, 1);
+    isWritten = ShmTransport_write(pOutputMessage->pText, sizeOfMessage,
+                                   pOutputMessage->isShutdownMessage);
+    pthread_cleanup_pop(isWritten);
+    return isWritten;
+}
+
+/*
+ * Paces and sends one datagram over UDP, on each path picked with --multipath.
+ * The sender may be cancelled while it waits, so it must not own anything when
+ * calling this.
+ */
+static void sendDatagram(const struct sockaddr_in* pSinRemote, const char* pDatagram,
+                         size_t sizeOfDatagram)
+{
+    int socketFds[MULTIPATH_MAX_PATHS] = {s_socketDescriptor};
+    int numSockets = 1;
+    // The peer can only drop the copies of frames (and of FEC datagrams, which hold
+    // frames then), so plain text only goes out on the default path.
+    if (Multipath_isEnabled() && pDatagram[0] == '\0') {
+        numSockets = Multipath_pickSockets(socketFds);
+    }
+    waitForPacingBudget(sizeOfDatagram * (size_t) numSockets, (size_t) numSockets);
+
+    // Transmit the message:
+    int i;
+    for (i = 0; i < numSockets; i++) {
+        uint64_t startNs = Trace_begin();
+        ssize_t status = sendto(socketFds[i], pDatagram, sizeOfDatagram, 0,
+                                (const struct sockaddr*) pSinRemote, sizeof(*pSinRemote));
+        Trace_end("sendto", startNs, 0, TRACE_FLOW_NONE);
+        if (status == -1) {
+            fputs("**Error sending message**\n", stdout);
+        }
+    }
+}
+
+/*
+ * The listener scans each datagram for the termination line on its own, so a split
+ * must not put a "!" at either side of a cut, where it could start or end a line
+ * that isn't one in the whole message.
+ */
+static bool canSplitIntoSegments(const char* pText, size_t sizeOfMessage)
+{
+    if (s_gsoSegmentBytes == 0 || sizeOfMessage <= s_gsoSegmentBytes
+        || (sizeOfMessage + s_gsoSegmentBytes - 1) / s_gsoSegmentBytes > GSO_MAX_SEGMENTS) {
+        return false;
+    }
+    size_t cut;
+    for (cut = s_gsoSegmentBytes; cut < sizeOfMessage; cut += s_gsoSegmentBytes) {
+        if (pText[cut - 1] == '!' || pText[cut] == '!') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Sends the message as a train of s_gsoSegmentBytes datagrams with one sendmsg call,
+ * which the kernel (or the NIC) splits up. If the kernel refuses, GSO is turned off
+ * and the message goes out as one datagram like the others.
+ */
+static void sendSegmented(const struct sockaddr_in* pSinRemote, const char* pText,
+                          size_t sizeOfMessage)
+{
+    size_t numSegments = (sizeOfMessage + s_gsoSegmentBytes - 1) / s_gsoSegmentBytes;
+    waitForPacingBudget(sizeOfMessage, numSegments);
+
+    char controlBuffer[CMSG_SPACE(sizeof(uint16_t))];
+    memset(controlBuffer, 0, sizeof(controlBuffer));
+    struct iovec ioVector = {
+        .iov_base = (void*) pText,
+        .iov_len = sizeOfMessage
+    };
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_name = (void*) pSinRemote;
+    header.msg_namelen = sizeof(*pSinRemote);
+    header.msg_iov = &ioVector;
+    header.msg_iovlen = 1;
+    header.msg_control = controlBuffer;
+    header.msg_controllen = sizeof(controlBuffer);
+
+    struct cmsghdr* pControl = CMSG_FIRSTHDR(&header);
+    pControl->cmsg_level = IPPROTO_UDP;
+    pControl->cmsg_type = UDP_SEGMENT;
+    pControl->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segmentBytes = (uint16_t) s_gsoSegmentBytes;
+    memcpy(CMSG_DATA(pControl), &segmentBytes, sizeof(segmentBytes));
+
+    uint64_t startNs = Trace_begin();
+    bool isSent = sendmsg(s_socketDescriptor, &header, 0) != -1;
+    Trace_end("sendmsg", startNs, 0, TRACE_FLOW_NONE);
+    if (isSent) {
+        s_numSegmentedSends++;
+        s_numSegments += numSegments;
+        return;
+    }
+    if (errno != EIO && errno != EINVAL && errno != ENOPROTOOPT && errno != EOPNOTSUPP) {
+        fputs("**Error sending message**\n", stdout);
+        return;
+    }
+    // EIO means the device can't checksum the segments.
+    printf("Warning: UDP_SEGMENT send failed (%s), sending whole messages instead\n",
+           strerror(errno));
+    s_gsoSegmentBytes = 0;
+    if (sendto(s_socketDescriptor, pText, sizeOfMessage, 0,
+               (const struct sockaddr*) pSinRemote, sizeof(*pSinRemote)) == -1) {
+        fputs("**Error sending message**\n", stdout);
+    }
+}
+
+/*
+ * Sends an FEC data datagram, followed by the parity of its block if the block is
+ * full or should be cut short.
+ */
+static void sendFecDatagram(const struct sockaddr_in* pSinRemote, char* messageTxBuffer,
+                            size_t sizeOfDatagram, bool isShutdownMessage)
+{
+    sendDatagram(pSinRemote, messageTxBuffer, sizeOfDatagram);
+
+    // Waiting for a full block while idle would leave the last messages unprotected,
+    // so the block is cut short instead.
+    bool isFlushing = isShutdownMessage || !KeyboardReader_hasQueuedMessages();
+    sizeOfDatagram = FecEncoder_takeParity(isFlushing, messageTxBuffer);
+    if (sizeOfDatagram > 0) {
+        sendDatagram(pSinRemote, messageTxBuffer, sizeOfDatagram);
+    }
+}
+
+/*
+ * Copies the message's text into pBuffer behind room for a frame header, and frames
+ * it. Returns where the frame starts, and its length in pSizeOfFrame.
+ */
+static char* frameText(char* pBuffer, const Message* pOutputMessage, size_t sizeOfMessage,
+                       size_t* pSizeOfFrame)
+{
+    char* pPayload = pBuffer + WIRE_MAX_HEADER_LEN;
+    memcpy(pPayload, pOutputMessage->pText, sizeOfMessage);
+    char* pFrame = WireEncoder_prependHeader(&s_wire, pPayload, sizeOfMessage, WIRE_TYPE_TEXT,
+                                             pOutputMessage->isShutdownMessage
+                                             ? WIRE_FLAG_SHUTDOWN : 0);
+    *pSizeOfFrame = (size_t) (pPayload + sizeOfMessage - pFrame);
+    return pFrame;
+}
+
+static void sendWithFec(const struct sockaddr_in* pSinRemote, Message* pOutputMessage,
+                        size_t sizeOfMessage, char* messageTxBuffer, bool isFramed)
+{
+    bool isShutdownMessage = pOutputMessage->isShutdownMessage;
+    const char* pPayload = pOutputMessage->pText;
+    size_t sizeOfPayload = sizeOfMessage;
+    if (isFramed) {
+        pPayload = frameText(s_payloadTxBuffer, pOutputMessage, sizeOfMessage, &sizeOfPayload);
+    }
+    size_t sizeOfDatagram = FecEncoder_encodeData(pPayload, sizeOfPayload, messageTxBuffer);
+    freeMessageFn(pOutputMessage);
+    sendFecDatagram(pSinRemote, messageTxBuffer, sizeOfDatagram, isShutdownMessage);
+}
+
+/*
+ * Sends the message as chunk references and text, inside an FEC datagram if FEC
+ * is on. A dedup datagram can't be split with GSO, since the listener only decodes
+ * whole ones.
+ */
+static void sendWithDedup(const struct sockaddr_in* pSinRemote, Message* pOutputMessage,
+                          size_t sizeOfMessage, char* messageTxBuffer, bool isFramed)
+{
+    bool isShutdownMessage = pOutputMessage->isShutdownMessage;
+    char* pPayload = s_payloadTxBuffer + WIRE_MAX_HEADER_LEN;
+    size_t sizeOfDatagram = DedupEncoder_encode(pOutputMessage->pText, sizeOfMessage, pPayload);
+    freeMessageFn(pOutputMessage);
+    if (isFramed) {
+        char* pFrame = WireEncoder_prependHeader(&s_wire, pPayload, sizeOfDatagram, WIRE_TYPE_DEDUP,
+                                                 isShutdownMessage ? WIRE_FLAG_SHUTDOWN : 0);
+        sizeOfDatagram += (size_t) (pPayload - pFrame);
+        pPayload = pFrame;
+    }
+    if (s_isFecEnabled) {
+        sizeOfDatagram = FecEncoder_encodeData(pPayload, sizeOfDatagram, messageTxBuffer);
+        sendFecDatagram(pSinRemote, messageTxBuffer, sizeOfDatagram, isShutdownMessage);
+    } else {
+        sendDatagram(pSinRemote, pPayload, sizeOfDatagram);
+    }
+}
+
 static void* Sender_run(void* stub)
 {
     waitForAllThreadsReadyBarrier();
+    Trace_setThreadName("sender");
 
     // Get the binded socket for UDP
     s_socketDescriptor = getSocketFdOrCreateAndBindIfDoesntExist(s_ourPort);
 
-    // Set up the Internet socket address to communicate to the other two-chat client.
-    struct sockaddr_in sinRemote;
-    memset(&sinRemote, 0, sizeof(sinRemote));
-    sinRemote.sin_family = AF_INET;
-    sinRemote.sin_port = htons(s_destinationPort);
-    sinRemote.sin_addr.s_addr = htonl(s_destinationAddr);
+    // Messages typed in the meantime wait in the queue.
+    if (!Resolver_waitForAddress()) {
+        return NULL;
+    }
+    if (SocketConfig_isGsoAvailable()) {
+        s_gsoSegmentBytes = (size_t) Options_get()->socketTuning.gsoSegmentBytes;
+    }
+    if (Wire_isHelloEnabled(&s_wire)) {
+        Sender_sendHello(false);
+    }
 
     Message* pOutputMessage = NULL;
     char messageTxBuffer[MSG_MAX_LEN];
 
     bool shouldExitProgram = false;
-    unsigned int sin_len;
     while (1) {
         // If we don't zero the buffer, then subsequent messages may still have pieces
         // from the previous message.
@@ -49,8 +461,11 @@ static void* Sender_run(void* stub)
         // Get the reply message and prepare to send it
         // This call will block if there are no messages yet in the queue.
         // The queue is managed by the keyboard reader.
+        uint64_t startNs = Trace_begin();
         pOutputMessage = KeyboardReader_getMessageFromQueue();
         /* SENDER THREAD NOT CANCELLABLE HERE */
+        uint64_t traceId = pOutputMessage != NULL ? pOutputMessage->traceId : 0;
+        Trace_end("dequeue", startNs, traceId, TRACE_FLOW_NONE);
         // Sender will not be cancelled here to make sure we don't leak pMessage and to make
         // sure we get this message out first. The socket will not be killed until all threads
         // are shutdown.
@@ -61,19 +476,45 @@ static void* Sender_run(void* stub)
             break;
         }
 
-        strncpy(messageTxBuffer, pOutputMessage->pText, MSG_MAX_LEN);
         shouldExitProgram = pOutputMessage->isShutdownMessage;
-        freeMessageFn(pOutputMessage);
-
-        size_t sizeOfMessage = strnlen(messageTxBuffer, MSG_MAX_LEN);
+        size_t sizeOfMessage = strnlen(pOutputMessage->pText, MSG_MAX_LEN);
+        s_numSends++;
+        bool isFramed = Wire_isSendingFramed(&s_wire);
+        size_t sizeOfHeaderRoom = isFramed ? WIRE_MAX_HEADER_LEN : 0;
+        // Taken for each message, since the resolver can move the peer to another address.
+        struct sockaddr_in sinRemote;
+        Resolver_getPeer(&sinRemote);
 
-        sin_len = sizeof(sinRemote);
-        // Transmit the message:
-        int status = sendto(s_socketDescriptor, messageTxBuffer, sizeOfMessage, 0,
-                            (struct sockaddr*) &sinRemote, sin_len);
-        if (status == -1) {
-            fputs("**Error sending message**\n", stdout);
+        startNs = Trace_begin();
+        if (trySendOverSharedMemory(&sinRemote, pOutputMessage, sizeOfMessage)) {
+            // The ring doesn't lose messages, so FEC isn't needed, and its records
+            // already carry the shutdown flag, so frames aren't either.
+        } else if (s_isDedupEnabled && sizeOfMessage <= DEDUP_MAX_TEXT_LEN) {
+            sendWithDedup(&sinRemote, pOutputMessage, sizeOfMessage, messageTxBuffer, isFramed);
+        } else if (s_isFecEnabled && sizeOfMessage + sizeOfHeaderRoom <= FEC_MAX_PAYLOAD_LEN) {
+            sendWithFec(&sinRemote, pOutputMessage, sizeOfMessage, messageTxBuffer, isFramed);
+        } else if (isFramed && sizeOfMessage <= WIRE_MAX_PAYLOAD_LEN
+                   && !canSplitIntoSegments(pOutputMessage->pText, sizeOfMessage)) {
+            size_t sizeOfFrame;
+            char* pFrame = frameText(messageTxBuffer, pOutputMessage, sizeOfMessage, &sizeOfFrame);
+            freeMessageFn(pOutputMessage);
+            sendDatagram(&sinRemote, pFrame, sizeOfFrame);
+        } else {
+            // Plain text: for legacy peers, messages too long for a header, and
+            // messages split with GSO, since only the first segment could carry one.
+            memcpy(messageTxBuffer, pOutputMessage->pText, sizeOfMessage);
+            freeMessageFn(pOutputMessage);
+            if (canSplitIntoSegments(messageTxBuffer, sizeOfMessage)) {
+                sendSegmented(&sinRemote, messageTxBuffer, sizeOfMessage);
+            } else {
+                sendDatagram(&sinRemote, messageTxBuffer, sizeOfMessage);
+            }
         }
+        Trace_end("send", startNs, traceId, TRACE_FLOW_END);
+        if (s_firstSendNs == 0) {
+            s_firstSendNs = getMonotonicTimeNs();
+        }
+        Keepalive_onSend(false);
 
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
         /* SENDER THREAD CANCELLABLE HERE */
@@ -89,14 +530,39 @@ static void* Sender_run(void* stub)
     return NULL;
 }
 
-void Sender_init(in_addr_t destinationAddr, in_port_t ourPort,
-                 in_port_t destinationPort)
+void Sender_init(in_port_t ourPort, in_port_t destinationPort)
 {
-    s_destinationAddr = destinationAddr;
     s_ourPort = ourPort;
     s_destinationPort = destinationPort;
 
-    int status = pthread_create(&s_threadPid, NULL, Sender_run, NULL);
+    const Options* pOptions = Options_get();
+    s_isFecEnabled = pOptions->isFecEnabled;
+    if (s_isFecEnabled) {
+        FecEncoder_init(pOptions->fecBlockSize);
+    }
+    Wire_init(&s_wire, pOptions->wireMode);
+    // The socket is created by main before any thread, so this doesn't block.
+    Multipath_init(pOptions->multipathMode, getSocketFdOrCreateAndBindIfDoesntExist(ourPort),
+                   pOptions->pathNames, pOptions->numPathNames);
+    s_isDedupEnabled = pOptions->isDedupEnabled && DedupEncoder_init(pOptions->dedupCacheBytes);
+    s_isPacingEnabled = pOptions->rateBytesPerSec > 0 || pOptions->ratePacketsPerSec > 0;
+    if (s_isPacingEnabled) {
+        uint64_t nowNs = getMonotonicTimeNs();
+        // By default, allow bursts of 100 ms worth of data, but at least one full datagram.
+        double burstBytes = pOptions->burstBytes > 0 ? (double) pOptions->burstBytes
+                                                     : (double) pOptions->rateBytesPerSec / 10;
+        if (burstBytes < MSG_MAX_LEN) {
+            burstBytes = MSG_MAX_LEN;
+        }
+        double burstPackets = (double) pOptions->ratePacketsPerSec / 10;
+        if (burstPackets < 1) {
+            burstPackets = 1;
+        }
+        initTokenBucket(&s_byteBucket, (double) pOptions->rateBytesPerSec, burstBytes, nowNs);
+        initTokenBucket(&s_packetBucket, (double) pOptions->ratePacketsPerSec, burstPackets, nowNs);
+    }
+
+    int status = ThreadPlacement_createThread(THREAD_SENDER, &s_threadPid, Sender_run);
     if (status != 0) {
         printf("Failed to create sender thread: %s\n", strerror(status));
         requestShutdownOfAllThreadsForProgram();
@@ -107,3 +573,109 @@ ShutdownStatus Sender_shutdown()
 {
     return shutdownThreadWithPid(s_threadPid);
 }
+
+/*
+ * Sends a datagram right away, skipping the queue and pacing.
+ */
+static bool sendUnpacedTo(const struct sockaddr_in* pSinPeer, const char* pDatagram,
+                          size_t sizeOfDatagram)
+{
+    // The socket is created by main before any thread, so this doesn't block.
+    int socketDescriptor = getSocketFdOrCreateAndBindIfDoesntExist(s_ourPort);
+    ssize_t status = sendto(socketDescriptor, pDatagram, sizeOfDatagram, 0,
+                            (const struct sockaddr*) pSinPeer, sizeof(*pSinPeer));
+    return status != -1;
+}
+
+/*
+ * Like sendUnpacedTo, to the peer's current address. Until the name is resolved,
+ * there is no one to send to, so nothing is sent.
+ */
+static bool sendUnpaced(const char* pDatagram, size_t sizeOfDatagram)
+{
+    struct sockaddr_in sinPeer;
+    return !Resolver_getPeer(&sinPeer) || sendUnpacedTo(&sinPeer, pDatagram, sizeOfDatagram);
+}
+
+void Sender_sendHeartbeat()
+{
+    // There is no peer to keep alive before its address is known.
+    struct sockaddr_in sinPeer;
+    if (!Resolver_getPeer(&sinPeer)) {
+        return;
+    }
+    // Heartbeats are tiny and rare, so they skip pacing and can't be held up
+    // behind a paced message.
+    if (!sendUnpacedTo(&sinPeer, "", 0)) {
+        fputs("**Error sending heartbeat**\n", stdout);
+        return;
+    }
+    Keepalive_onSend(true);
+}
+
+void Sender_sendHello(bool isReply)
+{
+    char datagram[WIRE_MAX_HEADER_LEN];
+    size_t sizeOfDatagram = WireEncoder_writeHello(&s_wire, datagram, isReply);
+    if (!sendUnpaced(datagram, sizeOfDatagram)) {
+        fputs("**Error sending hello**\n", stdout);
+    }
+}
+
+void Sender_sendHelloTo(const struct sockaddr_in* pSinPeer)
+{
+    char datagram[WIRE_MAX_HEADER_LEN];
+    size_t sizeOfDatagram = WireEncoder_writeHello(&s_wire, datagram, false);
+    if (!sendUnpacedTo(pSinPeer, datagram, sizeOfDatagram)) {
+        fputs("**Error sending hello**\n", stdout);
+    }
+}
+
+void Sender_sendFeedback(const char* pDatagram, size_t sizeOfDatagram)
+{
+    if (!sendUnpaced(pDatagram, sizeOfDatagram)) {
+        fputs("**Error sending feedback**\n", stdout);
+    }
+}
+
+void Sender_onLossReport(double lossFraction)
+{
+    if (s_isFecEnabled && Options_get()->fecBlockSize == 0) {
+        FecEncoder_onLossReport(lossFraction);
+    }
+    if (!s_isPacingEnabled || !Options_get()->isPacingAdaptive) {
+        return;
+    }
+    pthread_mutex_lock(&s_syncPacingRateMutex);
+    scaleTokenBucketRate(&s_byteBucket, lossFraction);
+    scaleTokenBucketRate(&s_packetBucket, lossFraction);
+    pthread_mutex_unlock(&s_syncPacingRateMutex);
+}
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Sender_printStats()
+{
+    if (s_numSegmentedSends > 0) {
+        printf("Sender GSO: %lu messages sent as %lu segments\n",
+               s_numSegmentedSends, s_numSegments);
+    }
+    if (!s_isPacingEnabled) {
+        return;
+    }
+    printf("Sender pacing: %lu of %lu messages delayed, %.1f ms spent waiting, "
+           "final rate %.0f bytes/s, %.0f packets/s\n",
+           s_numPacedSends, s_numSends, (double) s_totalPacingWaitNs / 1e6,
+           s_byteBucket.ratePerSec, s_packetBucket.ratePerSec);
+}
+
+Wire* Sender_getWire()
+{
+    return &s_wire;
+}
+
+uint64_t Sender_getFirstSendNs()
+{
+    return s_firstSendNs;
+}
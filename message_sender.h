@@ -1,9 +1,56 @@
 #ifndef _MESSAGE_SENDER_H
 #define _MESSAGE_SENDER_H
 
-void Sender_init(in_addr_t destinationAddr, in_port_t ourPort,
-                 in_port_t destinationPort);
+#include "wire.h"
+
+/*
+ * The sender sends nothing until the peer's address is resolved.
+ */
+void Sender_init(in_port_t ourPort, in_port_t destinationPort);
 
 ShutdownStatus Sender_shutdown();
 
+/*
+ * Sends an empty datagram to the peer right away. Called from the timer thread.
+ */
+void Sender_sendHeartbeat();
+
+/*
+ * Sends a hello frame to the peer right away, so that it starts sending frames.
+ * Called by the sender when it starts, and by the listener to answer the peer's hello.
+ */
+void Sender_sendHello(bool isReply);
+
+/*
+ * Sends a hello to one of the peer's addresses, to race them. Called by the resolver.
+ */
+void Sender_sendHelloTo(const struct sockaddr_in* pSinPeer);
+
+/*
+ * Sends a small datagram the listener owes the peer, such as a dedup miss report,
+ * right away, skipping the queue and pacing.
+ */
+void Sender_sendFeedback(const char* pDatagram, size_t sizeOfDatagram);
+
+/*
+ * Feeds the fraction of datagrams measured as lost into the adaptive pacer,
+ * which backs off multiplicatively on loss and recovers additively without it,
+ * and into the FEC block size with --fec=auto.
+ * Does nothing unless one of those is enabled.
+ */
+void Sender_onLossReport(double lossFraction);
+
+void Sender_printStats();
+
+/*
+ * The wire state of the peer, which the listener shares.
+ */
+Wire* Sender_getWire();
+
+/*
+ * Returns when the first message was sent, or 0 if none was.
+ * Only called when all threads are shutdown.
+ */
+uint64_t Sender_getFirstSendNs();
+
 #endif //_MESSAGE_SENDER_H
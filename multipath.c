@@ -0,0 +1,299 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <asm/socket.h>
+
+#include "common.h"
+#include "multipath.h"
+#include "resolver.h"
+#include "socket_config.h"
+#include "timer_wheel.h"
+
+// Pings remembered per path to measure its loss.
+#define MULTIPATH_PING_WINDOW 32
+// A ping that isn't answered in this long is counted as lost.
+#define MULTIPATH_PONG_TIMEOUT_NS 1000000000ULL
+// Paths that lose more of their pings are only picked if all of them do.
+#define MULTIPATH_MAX_GOOD_LOSS 0.05
+#define MULTIPATH_MAX_PATH_NAME_LEN 64
+
+typedef struct Path_s Path;
+struct Path_s {
+    int socketFd;
+    char name[MULTIPATH_MAX_PATH_NAME_LEN];
+
+    // The rest is protected by s_syncPathsMutex, apart from numDatagramsSent,
+    // which is only written by the sender.
+    uint64_t nextPingSequence;
+    // The recent pings, by sequence number modulo the window.
+    uint64_t pingSequences[MULTIPATH_PING_WINDOW];
+    uint64_t pingSentNs[MULTIPATH_PING_WINDOW];
+    bool isPingAnswered[MULTIPATH_PING_WINDOW];
+    // 0 until the first pong.
+    uint64_t smoothedRttNs;
+    uint64_t minRttNs;
+    double lossFraction;
+    unsigned long numPingsSent;
+    unsigned long numPongsReceived;
+    unsigned long numDatagramsSent;
+};
+
+static MultipathMode s_mode = MULTIPATH_OFF;
+static Path s_paths[MULTIPATH_MAX_PATHS];
+static int s_numPaths = 0;
+
+// Protects the ping state of the paths, which the timer thread and listener update.
+static pthread_mutex_t s_syncPathsMutex = PTHREAD_MUTEX_INITIALIZER;
+static Timer s_pingTimer;
+// Read by the sender for each frame with --multipath=best.
+static atomic_int s_bestPath = 0;
+static unsigned long s_numBestPathChanges = 0;
+
+/*
+ * Returns a socket bound to the local address or the interface pName names, or -1
+ * (after printing why) if it can't.
+ */
+static int openPathSocket(const char* pName)
+{
+    int socketFd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (socketFd == -1) {
+        printf("Failed to create a socket for path %s: %s\n", pName, strerror(errno));
+        return -1;
+    }
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    // Anything but an address is taken as an interface name. Binding to an interface
+    // needs CAP_NET_RAW.
+    bool isAddress = inet_pton(AF_INET, pName, &sin.sin_addr) == 1;
+    if (!isAddress && setsockopt(socketFd, SOL_SOCKET, SO_BINDTODEVICE, pName,
+                                 (socklen_t) strlen(pName) + 1) == -1) {
+        printf("Failed to bind path %s to its interface: %s\n", pName, strerror(errno));
+        close(socketFd);
+        return -1;
+    }
+    if (bind(socketFd, (struct sockaddr*) &sin, sizeof(sin)) == -1) {
+        printf("Failed to bind path %s: %s\n", pName, strerror(errno));
+        close(socketFd);
+        return -1;
+    }
+    SocketConfig_apply(socketFd);
+    return socketFd;
+}
+
+static void addPath(int socketFd, const char* pName)
+{
+    Path* pPath = &s_paths[s_numPaths++];
+    memset(pPath, 0, sizeof(*pPath));
+    pPath->socketFd = socketFd;
+    snprintf(pPath->name, sizeof(pPath->name), "%s", pName);
+}
+
+/*
+ * Sends the path's next ping. The payload is the index of the path, since all of
+ * the pongs come back to the main socket.
+ */
+static void sendPing(int pathIndex, const struct sockaddr_in* pSinRemote, uint64_t nowNs)
+{
+    Path* pPath = &s_paths[pathIndex];
+    uint64_t sequence = pPath->nextPingSequence++;
+    int slot = (int) (sequence % MULTIPATH_PING_WINDOW);
+    pPath->pingSequences[slot] = sequence;
+    pPath->pingSentNs[slot] = nowNs;
+    pPath->isPingAnswered[slot] = false;
+    pPath->numPingsSent++;
+
+    char payload = (char) pathIndex;
+    char datagram[WIRE_MAX_HEADER_LEN + 1];
+    size_t sizeOfDatagram = WireEncoder_writeControl(datagram, WIRE_TYPE_PING, sequence,
+                                                     &payload, 1);
+    // A path that can't send, such as one whose interface is down, just loses its pings.
+    sendto(pPath->socketFd, datagram, sizeOfDatagram, 0,
+           (const struct sockaddr*) pSinRemote, sizeof(*pSinRemote));
+}
+
+/*
+ * Measures the loss over the pings in the window that had time to be answered.
+ */
+static void updateLoss(Path* pPath, uint64_t nowNs)
+{
+    int numTimedOut = 0;
+    int numLost = 0;
+    int slot;
+    for (slot = 0; slot < MULTIPATH_PING_WINDOW; slot++) {
+        uint64_t sentNs = pPath->pingSentNs[slot];
+        if (sentNs == 0 || nowNs - sentNs < MULTIPATH_PONG_TIMEOUT_NS) {
+            continue;
+        }
+        numTimedOut++;
+        if (!pPath->isPingAnswered[slot]) {
+            numLost++;
+        }
+    }
+    if (numTimedOut > 0) {
+        pPath->lossFraction = (double) numLost / numTimedOut;
+    }
+}
+
+/*
+ * A path that is answering pings and losing few of them beats one that isn't.
+ * Between two of those, the lower round trip wins, and otherwise the lower loss.
+ */
+static bool isBetterPath(const Path* pPath, const Path* pBest)
+{
+    bool isGood = pPath->smoothedRttNs != 0 && pPath->lossFraction <= MULTIPATH_MAX_GOOD_LOSS;
+    bool isBestGood = pBest->smoothedRttNs != 0 && pBest->lossFraction <= MULTIPATH_MAX_GOOD_LOSS;
+    if (isGood != isBestGood) {
+        return isGood;
+    }
+    if (isGood) {
+        return pPath->smoothedRttNs < pBest->smoothedRttNs;
+    }
+    return pPath->lossFraction < pBest->lossFraction;
+}
+
+static void pickBestPath()
+{
+    int bestPath = 0;
+    int i;
+    for (i = 1; i < s_numPaths; i++) {
+        if (isBetterPath(&s_paths[i], &s_paths[bestPath])) {
+            bestPath = i;
+        }
+    }
+    if (bestPath != atomic_load_explicit(&s_bestPath, memory_order_relaxed)) {
+        s_numBestPathChanges++;
+        atomic_store_explicit(&s_bestPath, bestPath, memory_order_relaxed);
+    }
+}
+
+static void onPingTimer(void* unused)
+{
+    struct sockaddr_in sinRemote;
+    if (!Resolver_getPeer(&sinRemote)) {
+        Timer_schedule(&s_pingTimer, MULTIPATH_PING_INTERVAL_MS);
+        return;
+    }
+    uint64_t nowNs = getMonotonicTimeNs();
+    pthread_mutex_lock(&s_syncPathsMutex);
+    {
+        int i;
+        for (i = 0; i < s_numPaths; i++) {
+            sendPing(i, &sinRemote, nowNs);
+            updateLoss(&s_paths[i], nowNs);
+        }
+        pickBestPath();
+    }
+    pthread_mutex_unlock(&s_syncPathsMutex);
+    Timer_schedule(&s_pingTimer, MULTIPATH_PING_INTERVAL_MS);
+}
+
+void Multipath_init(MultipathMode mode, int mainSocketFd, const char* const* ppPathNames,
+                    int numPathNames)
+{
+    s_mode = mode;
+    if (mode == MULTIPATH_OFF) {
+        return;
+    }
+    addPath(mainSocketFd, "default");
+    int i;
+    for (i = 0; i < numPathNames && s_numPaths < MULTIPATH_MAX_PATHS; i++) {
+        int socketFd = openPathSocket(ppPathNames[i]);
+        if (socketFd == -1) {
+            printf("Sending without path %s.\n", ppPathNames[i]);
+            continue;
+        }
+        addPath(socketFd, ppPathNames[i]);
+    }
+    Timer_init(&s_pingTimer, onPingTimer, NULL);
+    Timer_schedule(&s_pingTimer, MULTIPATH_PING_INTERVAL_MS);
+}
+
+bool Multipath_isEnabled()
+{
+    return s_mode != MULTIPATH_OFF;
+}
+
+int Multipath_pickSockets(int* pSocketFds)
+{
+    if (s_mode == MULTIPATH_BEST) {
+        Path* pPath = &s_paths[atomic_load_explicit(&s_bestPath, memory_order_relaxed)];
+        pPath->numDatagramsSent++;
+        pSocketFds[0] = pPath->socketFd;
+        return 1;
+    }
+    int i;
+    for (i = 0; i < s_numPaths; i++) {
+        s_paths[i].numDatagramsSent++;
+        pSocketFds[i] = s_paths[i].socketFd;
+    }
+    return s_numPaths;
+}
+
+void Multipath_onPong(const WireFrame* pPong)
+{
+    if (s_mode == MULTIPATH_OFF || pPong->payloadLength != 1
+        || (uint8_t) pPong->pPayload[0] >= s_numPaths) {
+        return;
+    }
+    uint64_t nowNs = getMonotonicTimeNs();
+    Path* pPath = &s_paths[(uint8_t) pPong->pPayload[0]];
+    int slot = (int) (pPong->sequence % MULTIPATH_PING_WINDOW);
+    pthread_mutex_lock(&s_syncPathsMutex);
+    {
+        // A pong for a ping that has left the window, or a second one, is ignored.
+        if (pPath->pingSequences[slot] == pPong->sequence && pPath->pingSentNs[slot] != 0
+            && !pPath->isPingAnswered[slot]) {
+            pPath->isPingAnswered[slot] = true;
+            pPath->numPongsReceived++;
+            uint64_t rttNs = nowNs - pPath->pingSentNs[slot];
+            if (pPath->smoothedRttNs == 0) {
+                pPath->smoothedRttNs = rttNs;
+                pPath->minRttNs = rttNs;
+            } else {
+                // Weighted 1/8 like TCP's SRTT.
+                pPath->smoothedRttNs = (7 * pPath->smoothedRttNs + rttNs) / 8;
+                if (rttNs < pPath->minRttNs) {
+                    pPath->minRttNs = rttNs;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&s_syncPathsMutex);
+}
+
+void Multipath_printStats()
+{
+    int i;
+    for (i = 0; i < s_numPaths; i++) {
+        const Path* pPath = &s_paths[i];
+        printf("Path %d (%s): %lu datagrams sent, %lu of %lu pings answered",
+               i, pPath->name, pPath->numDatagramsSent, pPath->numPongsReceived,
+               pPath->numPingsSent);
+        if (pPath->smoothedRttNs != 0) {
+            printf(", round trip %.3f ms, min %.3f ms",
+                   (double) pPath->smoothedRttNs / 1e6, (double) pPath->minRttNs / 1e6);
+        }
+        printf(", %.1f%% loss\n", pPath->lossFraction * 100);
+    }
+    if (s_mode == MULTIPATH_BEST && s_numPaths > 1) {
+        printf("Multipath: best path changed %lu times, last path %d\n",
+               s_numBestPathChanges, atomic_load(&s_bestPath));
+    }
+}
+
+void Multipath_destroy()
+{
+    // Path 0 is the main socket, which is closed with the others.
+    int i;
+    for (i = 1; i < s_numPaths; i++) {
+        close(s_paths[i].socketFd);
+    }
+    s_numPaths = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef _MULTIPATH_H
+#define _MULTIPATH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "wire.h"
+
+/*
+ * Sending over more than one network path to the peer.
+ *
+ * Path 0 is the socket everything else uses. Every other path has its own socket,
+ * bound to a local address or to a network interface, so that its datagrams leave
+ * by another route. Frames carry a sequence number, so they can go out on every
+ * path and the peer drops the copies; plain text only goes out on path 0.
+ *
+ * Each path is probed with a ping frame every MULTIPATH_PING_INTERVAL_MS, which
+ * the peer answers with a pong to our port. That measures the round trip out over
+ * the path and back over the peer's default route, and the pings that get no
+ * answer give the loss of the path. With --multipath=best, frames only go out on
+ * the path with the lowest round trip among those losing few pings.
+ */
+
+#define MULTIPATH_MAX_PATHS 8
+#define MULTIPATH_PING_INTERVAL_MS 200
+
+typedef enum {
+    MULTIPATH_OFF,
+    // Every frame goes out on every path.
+    MULTIPATH_ALL,
+    // Every frame goes out on the best path.
+    MULTIPATH_BEST
+} MultipathMode;
+
+/*
+ * Opens a socket for each of the other paths, named by local IPv4 addresses or
+ * interface names, and starts pinging the peer on all of them. A path that can't be
+ * opened is left out after printing why. The pings start once the peer's name is
+ * resolved. Only called by the sender's init.
+ */
+void Multipath_init(MultipathMode mode, int mainSocketFd, const char* const* ppPathNames,
+                    int numPathNames);
+
+bool Multipath_isEnabled();
+
+/*
+ * Fills pSocketFds (room for MULTIPATH_MAX_PATHS) with the sockets the next frame
+ * goes out on and returns how many there are. Only called by the sender.
+ */
+int Multipath_pickSockets(int* pSocketFds);
+
+/*
+ * Takes in a pong for one of our pings. Only called by the listener.
+ */
+void Multipath_onPong(const WireFrame* pPong);
+
+void Multipath_printStats();
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Multipath_destroy();
+
+#endif // _MULTIPATH_H
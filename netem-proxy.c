@@ -0,0 +1,113 @@
+/*
+ * Forwards UDP between two two-chat peers on this host, impairing the traffic.
+ *
+ * usage: ./netem-proxy [impairment=value ...] <port> <host A>:<port A> <host B>:<port B>
+ * Both peers use <port> on this host as their remote port, e.g.
+ *   ./netem-proxy loss=2 delay-ms=40 jitter-ms=10 9000 localhost:7000 localhost:7001
+ *   ./two-chat 7000 localhost 9000
+ *   ./two-chat 7001 localhost 9000
+ * Runs until interrupted, then prints what it did.
+ */
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+
+#include "netem.h"
+
+static void printUsage()
+{
+    fputs("usage: ./netem-proxy [impairment=value ...] <port> <host A>:<port A> <host B>:<port B>\n",
+          stdout);
+    Netem_printSettingsUsage();
+}
+
+/*
+ * Parses "host:port" into an IPv4 address. Returns false (after printing why) if
+ * it can't.
+ */
+static bool parsePeer(const char* pArg, struct sockaddr_in* pPeer)
+{
+    char hostname[256];
+    const char* pColon = strrchr(pArg, ':');
+    if (pColon == NULL || (size_t) (pColon - pArg) >= sizeof(hostname)) {
+        printf("Invalid peer: %s. It must be <host>:<port>.\n", pArg);
+        return false;
+    }
+    memcpy(hostname, pArg, (size_t) (pColon - pArg));
+    hostname[pColon - pArg] = '\0';
+    char* pEnd = NULL;
+    unsigned long port = strtoul(pColon + 1, &pEnd, 10);
+    if (*pEnd != '\0' || port == 0 || port > 65535) {
+        printf("Invalid port: %s\n", pColon + 1);
+        return false;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo* pAddressList = NULL;
+    int statusCode = getaddrinfo(hostname, NULL, &hints, &pAddressList);
+    if (statusCode != 0 || pAddressList == NULL) {
+        printf("Failed to get the address of %s: %s\n", hostname,
+               statusCode != 0 ? gai_strerror(statusCode) : "no address");
+        return false;
+    }
+    memcpy(pPeer, pAddressList->ai_addr, sizeof(struct sockaddr_in));
+    pPeer->sin_port = htons((in_port_t) port);
+    freeaddrinfo(pAddressList);
+    return true;
+}
+
+int main(int argCount, char** args)
+{
+    NetemConfig config;
+    Netem_initConfig(&config);
+    int i = 1;
+    while (i < argCount && strchr(args[i], '=') != NULL) {
+        if (!Netem_parseSetting(&config, args[i])) {
+            printUsage();
+            return 1;
+        }
+        i++;
+    }
+    if (argCount - i != 3) {
+        printUsage();
+        return 1;
+    }
+    char* pEnd = NULL;
+    unsigned long port = strtoul(args[i], &pEnd, 10);
+    struct sockaddr_in peerA;
+    struct sockaddr_in peerB;
+    if (*pEnd != '\0' || port == 0 || port > 65535) {
+        printf("Invalid port: %s\n", args[i]);
+        return 1;
+    }
+    if (!parsePeer(args[i + 1], &peerA) || !parsePeer(args[i + 2], &peerB)) {
+        return 1;
+    }
+
+    // Block the signals before the forwarder thread starts, so that only this
+    // thread takes them.
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+    if (!Netem_start(&config, (in_port_t) port, &peerA, &peerB)) {
+        return 1;
+    }
+    printf("Forwarding between %s and %s on port %lu. Interrupt to stop.\n",
+           args[i + 1], args[i + 2], port);
+    fflush(stdout);
+
+    int signal;
+    sigwait(&stopSignals, &signal);
+    Netem_stop();
+    Netem_printStats();
+    return 0;
+}
@@ -0,0 +1,462 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "netem.h"
+
+#define NETEM_MAX_DATAGRAM_LEN 65535
+// Room for bursts while the datagrams wait out their delay.
+#define NETEM_SOCKET_BUFFER_BYTES (4 * 1024 * 1024)
+// Datagrams taken in before sending the due ones again.
+#define NETEM_MAX_BATCH 64
+#define DIRECTION_A_TO_B 0
+#define DIRECTION_B_TO_A 1
+
+/*
+ * A datagram waiting for its departure time.
+ */
+typedef struct Packet_s Packet;
+struct Packet_s {
+    uint64_t departureNs;
+    // Breaks ties in arrival order.
+    uint64_t order;
+    const struct sockaddr_in* pDestination;
+    size_t length;
+    char data[];
+};
+
+static NetemConfig s_config;
+static struct sockaddr_in s_peerA;
+static struct sockaddr_in s_peerB;
+static int s_socketFd = -1;
+static int s_timerFd = -1;
+static pthread_t s_threadPid;
+static bool s_isRunning = false;
+static uint64_t s_randomState;
+static char s_receiveBuffer[NETEM_MAX_DATAGRAM_LEN];
+
+// Protects the heap and the stats, which are read by other threads.
+static pthread_mutex_t s_syncNetemMutex = PTHREAD_MUTEX_INITIALIZER;
+// Min-heap of waiting datagrams ordered by departure time.
+static Packet** s_pHeap = NULL;
+static size_t s_heapSize = 0;
+static size_t s_heapCapacity = 0;
+static uint64_t s_nextOrder = 0;
+// When each direction's link is done sending what was queued on it.
+static uint64_t s_linkFreeNs[2];
+static NetemStats s_stats;
+
+static uint64_t getTimeNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/*
+ * splitmix64.
+ */
+static uint64_t nextRandom()
+{
+    uint64_t z = (s_randomState += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Returns true with the given probability.
+ */
+static bool isRandomlyChosen(double fraction)
+{
+    if (fraction <= 0) {
+        return false;
+    }
+    return (double) (nextRandom() >> 11) * 0x1.0p-53 < fraction;
+}
+
+void Netem_initConfig(NetemConfig* pConfig)
+{
+    memset(pConfig, 0, sizeof(NetemConfig));
+    pConfig->reorderMs = 10;
+    pConfig->maxQueuedPackets = 100000;
+    pConfig->seed = 1;
+}
+
+/*
+ * Parses a number with an optional k, m or g (binary) suffix.
+ */
+static bool parseAmount(const char* pValue, double* pAmount)
+{
+    char* pEnd = NULL;
+    errno = 0;
+    double amount = strtod(pValue, &pEnd);
+    if (errno != 0 || pEnd == pValue || amount < 0) {
+        return false;
+    }
+    if (*pEnd == 'k' || *pEnd == 'K') {
+        amount *= 1024;
+        pEnd++;
+    } else if (*pEnd == 'm' || *pEnd == 'M') {
+        amount *= 1024 * 1024;
+        pEnd++;
+    } else if (*pEnd == 'g' || *pEnd == 'G') {
+        amount *= 1024 * 1024 * 1024;
+        pEnd++;
+    }
+    *pAmount = amount;
+    return *pEnd == '\0';
+}
+
+bool Netem_parseSetting(NetemConfig* pConfig, const char* pSetting)
+{
+    const char* pValue = strchr(pSetting, '=');
+    double amount;
+    if (pValue == NULL || !parseAmount(pValue + 1, &amount)) {
+        printf("Invalid impairment setting: %s\n", pSetting);
+        return false;
+    }
+    size_t keyLength = (size_t) (pValue - pSetting);
+    const char* pKey = pSetting;
+    if (keyLength == 4 && strncmp(pKey, "loss", 4) == 0 && amount <= 100) {
+        pConfig->lossFraction = amount / 100;
+    } else if (keyLength == 3 && strncmp(pKey, "dup", 3) == 0 && amount <= 100) {
+        pConfig->duplicateFraction = amount / 100;
+    } else if (keyLength == 7 && strncmp(pKey, "reorder", 7) == 0 && amount <= 100) {
+        pConfig->reorderFraction = amount / 100;
+    } else if (keyLength == 8 && strncmp(pKey, "delay-ms", 8) == 0) {
+        pConfig->delayMs = (unsigned long) amount;
+    } else if (keyLength == 9 && strncmp(pKey, "jitter-ms", 9) == 0) {
+        pConfig->jitterMs = (unsigned long) amount;
+    } else if (keyLength == 10 && strncmp(pKey, "reorder-ms", 10) == 0) {
+        pConfig->reorderMs = (unsigned long) amount;
+    } else if (keyLength == 4 && strncmp(pKey, "rate", 4) == 0) {
+        pConfig->rateBytesPerSec = (unsigned long long) amount;
+    } else if (keyLength == 5 && strncmp(pKey, "limit", 5) == 0 && amount >= 1) {
+        pConfig->maxQueuedPackets = (size_t) amount;
+    } else if (keyLength == 4 && strncmp(pKey, "seed", 4) == 0) {
+        pConfig->seed = (uint64_t) amount;
+    } else {
+        printf("Invalid impairment setting: %s\n", pSetting);
+        return false;
+    }
+    return true;
+}
+
+void Netem_printSettingsUsage()
+{
+    fputs("impairments:\n"
+          "  loss=P          percent of datagrams to drop\n"
+          "  dup=P           percent of datagrams to send twice\n"
+          "  reorder=P       percent of datagrams to hold back by reorder-ms, so that\n"
+          "                  later ones overtake them\n"
+          "  delay-ms=N      delay for every datagram\n"
+          "  jitter-ms=N     random variation of the delay, up to N ms either way\n"
+          "  reorder-ms=N    extra delay for reordered datagrams (default: 10)\n"
+          "  rate=N          bytes per second in each direction, accepts k/m/g suffixes\n"
+          "  limit=N         datagrams held at once before dropping (default: 100000)\n"
+          "  seed=N          seed for the random choices (default: 1)\n",
+          stdout);
+}
+
+static bool isBefore(const Packet* pLeft, const Packet* pRight)
+{
+    return pLeft->departureNs < pRight->departureNs
+           || (pLeft->departureNs == pRight->departureNs && pLeft->order < pRight->order);
+}
+
+/*
+ * Must hold s_syncNetemMutex.
+ */
+static bool pushPacket(Packet* pPacket)
+{
+    if (s_heapSize == s_heapCapacity) {
+        size_t capacity = s_heapCapacity == 0 ? 1024 : s_heapCapacity * 2;
+        Packet** pHeap = realloc(s_pHeap, capacity * sizeof(Packet*));
+        if (pHeap == NULL) {
+            return false;
+        }
+        s_pHeap = pHeap;
+        s_heapCapacity = capacity;
+    }
+    size_t index = s_heapSize++;
+    while (index > 0 && isBefore(pPacket, s_pHeap[(index - 1) / 2])) {
+        s_pHeap[index] = s_pHeap[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    s_pHeap[index] = pPacket;
+    return true;
+}
+
+/*
+ * Must hold s_syncNetemMutex, and the heap must not be empty.
+ */
+static Packet* popPacket()
+{
+    Packet* pFirst = s_pHeap[0];
+    Packet* pLast = s_pHeap[--s_heapSize];
+    size_t index = 0;
+    while (1) {
+        size_t child = 2 * index + 1;
+        if (child >= s_heapSize) {
+            break;
+        }
+        if (child + 1 < s_heapSize && isBefore(s_pHeap[child + 1], s_pHeap[child])) {
+            child++;
+        }
+        if (!isBefore(s_pHeap[child], pLast)) {
+            break;
+        }
+        s_pHeap[index] = s_pHeap[child];
+        index = child;
+    }
+    if (s_heapSize > 0) {
+        s_pHeap[index] = pLast;
+    }
+    return pFirst;
+}
+
+static bool isSameAddress(const struct sockaddr_in* pLeft, const struct sockaddr_in* pRight)
+{
+    return pLeft->sin_addr.s_addr == pRight->sin_addr.s_addr && pLeft->sin_port == pRight->sin_port;
+}
+
+/*
+ * Must hold s_syncNetemMutex. Queues one copy of the datagram on the link of its
+ * direction, then delays it.
+ */
+static void schedulePacket(const char* pData, size_t length, int direction, uint64_t arrivalNs)
+{
+    if (s_heapSize >= s_config.maxQueuedPackets) {
+        s_stats.numOverflowed++;
+        return;
+    }
+    Packet* pPacket = malloc(sizeof(Packet) + length);
+    if (pPacket == NULL) {
+        s_stats.numOverflowed++;
+        return;
+    }
+    uint64_t sentNs = arrivalNs;
+    if (s_config.rateBytesPerSec > 0) {
+        uint64_t startNs = s_linkFreeNs[direction] > arrivalNs ? s_linkFreeNs[direction] : arrivalNs;
+        sentNs = startNs + (uint64_t) length * 1000000000ULL / s_config.rateBytesPerSec;
+        s_linkFreeNs[direction] = sentNs;
+    }
+    int64_t delayNs = (int64_t) s_config.delayMs * 1000000;
+    if (s_config.jitterMs > 0) {
+        uint64_t jitterRangeNs = 2 * (uint64_t) s_config.jitterMs * 1000000 + 1;
+        delayNs += (int64_t) (nextRandom() % jitterRangeNs) - (int64_t) s_config.jitterMs * 1000000;
+        if (delayNs < 0) {
+            delayNs = 0;
+        }
+    }
+    if (isRandomlyChosen(s_config.reorderFraction)) {
+        delayNs += (int64_t) s_config.reorderMs * 1000000;
+        s_stats.numReordered++;
+    }
+    pPacket->departureNs = sentNs + (uint64_t) delayNs;
+    pPacket->order = s_nextOrder++;
+    pPacket->pDestination = direction == DIRECTION_A_TO_B ? &s_peerB : &s_peerA;
+    pPacket->length = length;
+    memcpy(pPacket->data, pData, length);
+    if (!pushPacket(pPacket)) {
+        free(pPacket);
+        s_stats.numOverflowed++;
+    }
+}
+
+/*
+ * Must hold s_syncNetemMutex. Takes in the datagrams waiting on the socket, up to
+ * a batch.
+ */
+static void receivePackets()
+{
+    struct sockaddr_in sinSource;
+    socklen_t sinLength = sizeof(sinSource);
+    ssize_t bytesRx;
+    int numInBatch = 0;
+    while (numInBatch++ < NETEM_MAX_BATCH
+           && (bytesRx = recvfrom(s_socketFd, s_receiveBuffer, sizeof(s_receiveBuffer), MSG_DONTWAIT,
+                               (struct sockaddr*) &sinSource, &sinLength)) >= 0) {
+        uint64_t arrivalNs = getTimeNs();
+        sinLength = sizeof(sinSource);
+        int direction;
+        if (isSameAddress(&sinSource, &s_peerA)) {
+            direction = DIRECTION_A_TO_B;
+        } else if (isSameAddress(&sinSource, &s_peerB)) {
+            direction = DIRECTION_B_TO_A;
+        } else {
+            s_stats.numStrays++;
+            continue;
+        }
+        s_stats.numReceived++;
+        if (isRandomlyChosen(s_config.lossFraction)) {
+            s_stats.numLost++;
+            continue;
+        }
+        schedulePacket(s_receiveBuffer, (size_t) bytesRx, direction, arrivalNs);
+        if (isRandomlyChosen(s_config.duplicateFraction)) {
+            s_stats.numDuplicated++;
+            schedulePacket(s_receiveBuffer, (size_t) bytesRx, direction, arrivalNs);
+        }
+    }
+}
+
+/*
+ * Must hold s_syncNetemMutex. Sends the datagrams that are due, and arms the timer
+ * for the next one.
+ */
+static void sendDuePackets()
+{
+    uint64_t nowNs = getTimeNs();
+    while (s_heapSize > 0 && s_pHeap[0]->departureNs <= nowNs) {
+        Packet* pPacket = popPacket();
+        if (sendto(s_socketFd, pPacket->data, pPacket->length, 0,
+                   (const struct sockaddr*) pPacket->pDestination, sizeof(struct sockaddr_in)) != -1) {
+            s_stats.numForwarded++;
+        }
+        free(pPacket);
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (s_heapSize > 0) {
+        spec.it_value.tv_sec = (time_t) (s_pHeap[0]->departureNs / 1000000000ULL);
+        spec.it_value.tv_nsec = (long) (s_pHeap[0]->departureNs % 1000000000ULL);
+    }
+    timerfd_settime(s_timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void* runForwarder(void* stub)
+{
+    // Only cancelled while waiting, so that no datagram is left half handled.
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    struct pollfd pollFds[2] = {
+        {.fd = s_socketFd, .events = POLLIN},
+        {.fd = s_timerFd, .events = POLLIN}
+    };
+    while (1) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int numReady = poll(pollFds, 2, -1);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (numReady == -1 && errno != EINTR) {
+            printf("Failed to wait for datagrams: %s\n", strerror(errno));
+            break;
+        }
+        if (pollFds[1].revents != 0) {
+            uint64_t numExpirations;
+            read(s_timerFd, &numExpirations, sizeof(numExpirations));
+        }
+        pthread_mutex_lock(&s_syncNetemMutex);
+        receivePackets();
+        sendDuePackets();
+        pthread_mutex_unlock(&s_syncNetemMutex);
+    }
+    return NULL;
+}
+
+/*
+ * Closes what Netem_start opened.
+ */
+static void closeFds()
+{
+    if (s_timerFd != -1) {
+        close(s_timerFd);
+        s_timerFd = -1;
+    }
+    if (s_socketFd != -1) {
+        close(s_socketFd);
+        s_socketFd = -1;
+    }
+}
+
+bool Netem_start(const NetemConfig* pConfig, in_port_t port,
+                 const struct sockaddr_in* pPeerA, const struct sockaddr_in* pPeerB)
+{
+    s_config = *pConfig;
+    s_peerA = *pPeerA;
+    s_peerB = *pPeerB;
+    s_randomState = pConfig->seed;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+    s_socketFd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (s_socketFd == -1 || bind(s_socketFd, (struct sockaddr*) &sin, sizeof(sin)) == -1) {
+        printf("Failed to bind port %u for the forwarder: %s\n", (unsigned int) port, strerror(errno));
+        closeFds();
+        return false;
+    }
+    // Capped by net.core.rmem_max and wmem_max, which is fine.
+    int bufferBytes = NETEM_SOCKET_BUFFER_BYTES;
+    setsockopt(s_socketFd, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+    setsockopt(s_socketFd, SOL_SOCKET, SO_SNDBUF, &bufferBytes, sizeof(bufferBytes));
+
+    s_timerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (s_timerFd == -1) {
+        printf("Failed to create the forwarder's timer: %s\n", strerror(errno));
+        closeFds();
+        return false;
+    }
+    int status = pthread_create(&s_threadPid, NULL, runForwarder, NULL);
+    if (status != 0) {
+        printf("Failed to create the forwarder thread: %s\n", strerror(status));
+        closeFds();
+        return false;
+    }
+    s_isRunning = true;
+    return true;
+}
+
+size_t Netem_getNumQueued()
+{
+    pthread_mutex_lock(&s_syncNetemMutex);
+    size_t numQueued = s_heapSize;
+    pthread_mutex_unlock(&s_syncNetemMutex);
+    return numQueued;
+}
+
+void Netem_getStats(NetemStats* pStats)
+{
+    pthread_mutex_lock(&s_syncNetemMutex);
+    *pStats = s_stats;
+    pthread_mutex_unlock(&s_syncNetemMutex);
+}
+
+void Netem_printStats()
+{
+    NetemStats stats;
+    Netem_getStats(&stats);
+    printf("Forwarder: %lu datagrams received, %lu forwarded, %lu lost, %lu duplicated, "
+           "%lu reordered, %lu dropped at the limit, %lu from neither peer\n",
+           stats.numReceived, stats.numForwarded, stats.numLost, stats.numDuplicated,
+           stats.numReordered, stats.numOverflowed, stats.numStrays);
+}
+
+void Netem_stop()
+{
+    if (!s_isRunning) {
+        return;
+    }
+    pthread_cancel(s_threadPid);
+    pthread_join(s_threadPid, NULL);
+    s_isRunning = false;
+    closeFds();
+
+    while (s_heapSize > 0) {
+        free(popPacket());
+    }
+    free(s_pHeap);
+    s_pHeap = NULL;
+    s_heapCapacity = 0;
+}
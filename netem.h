@@ -0,0 +1,92 @@
+#ifndef _NETEM_H
+#define _NETEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * UDP forwarder that impairs the traffic between two peers, for testing two-chat
+ * under loss, reordering and latency on a single host.
+ *
+ * Both peers send to the forwarder's port. Datagrams from peer A go to peer B and
+ * the other way around; when both are the same address (one socket talking to
+ * itself), they go back to it. Each datagram can be lost, duplicated, held back so
+ * that later ones overtake it, and delayed with jitter, after queuing for a link
+ * with a capped rate in its direction.
+ *
+ * All of the random choices come from one generator seeded from the config, so the
+ * same seed and the same order of arriving datagrams give the same impairments.
+ */
+
+typedef struct NetemConfig_s NetemConfig;
+struct NetemConfig_s {
+    // Fractions of datagrams, from 0 to 1.
+    double lossFraction;
+    double duplicateFraction;
+    double reorderFraction;
+    // Every datagram is delayed by delayMs plus or minus up to jitterMs, and
+    // reordered ones by another reorderMs.
+    unsigned long delayMs;
+    unsigned long jitterMs;
+    unsigned long reorderMs;
+    // Bytes per second in each direction. 0 doesn't cap it.
+    unsigned long long rateBytesPerSec;
+    // Datagrams held at once, beyond which arriving ones are dropped.
+    size_t maxQueuedPackets;
+    uint64_t seed;
+};
+
+typedef struct NetemStats_s NetemStats;
+struct NetemStats_s {
+    unsigned long numReceived;
+    unsigned long numForwarded;
+    unsigned long numLost;
+    unsigned long numDuplicated;
+    unsigned long numReordered;
+    // Dropped because maxQueuedPackets were already held.
+    unsigned long numOverflowed;
+    // From neither peer.
+    unsigned long numStrays;
+};
+
+/*
+ * Sets the defaults: no impairments, 10 ms reorder delay, seed 1.
+ */
+void Netem_initConfig(NetemConfig* pConfig);
+
+/*
+ * Applies one "key=value" setting: loss, dup and reorder in percent, delay-ms,
+ * jitter-ms, reorder-ms, rate in bytes per second (accepts k/m/g suffixes), limit
+ * and seed. Returns false (after printing why) if it isn't one.
+ */
+bool Netem_parseSetting(NetemConfig* pConfig, const char* pSetting);
+
+/*
+ * Prints the settings Netem_parseSetting accepts.
+ */
+void Netem_printSettingsUsage();
+
+/*
+ * Binds the forwarder's port on all addresses and starts its thread.
+ * Returns false (after printing why) if it can't.
+ */
+bool Netem_start(const NetemConfig* pConfig, in_port_t port,
+                 const struct sockaddr_in* pPeerA, const struct sockaddr_in* pPeerB);
+
+/*
+ * Returns the number of datagrams waiting to be forwarded.
+ */
+size_t Netem_getNumQueued();
+
+void Netem_getStats(NetemStats* pStats);
+
+void Netem_printStats();
+
+/*
+ * Stops the thread and drops the datagrams still waiting.
+ */
+void Netem_stop();
+
+#endif // _NETEM_H
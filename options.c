@@ -0,0 +1,632 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "options.h"
+#include "fec.h"
+
+enum {
+    OPT_OVERFLOW_POLICY = 256,
+    OPT_QUEUE_MAX_MESSAGES,
+    OPT_QUEUE_MAX_BYTES,
+    OPT_QUEUE_BLOCK_TIMEOUT_MS,
+    OPT_RATE_BYTES,
+    OPT_RATE_PACKETS,
+    OPT_BURST_BYTES,
+    OPT_PACE_ADAPTIVE,
+    OPT_RCVBUF,
+    OPT_SNDBUF,
+    OPT_BUSY_POLL_USEC,
+    OPT_TIMESTAMPS,
+    OPT_TOS,
+    OPT_DSCP,
+    OPT_SPIN_USEC,
+    OPT_CPU_READER,
+    OPT_CPU_PRINTER,
+    OPT_CPU_SENDER,
+    OPT_CPU_LISTENER,
+    OPT_COLOCATE_PAIRS,
+    OPT_SCHED_FIFO,
+    OPT_STACK_SIZE,
+    OPT_SHM,
+    OPT_SHM_RING_SIZE,
+    OPT_FEC,
+    OPT_GSO,
+    OPT_GSO_SEGMENT,
+    OPT_GRO,
+    OPT_INTERACTIVE_MAX_BYTES,
+    OPT_LANE_WEIGHTS,
+    OPT_HEARTBEAT_MS,
+    OPT_PEER_TIMEOUT_MS,
+    OPT_IDLE_TIMEOUT_MS,
+    OPT_DEDUP,
+    OPT_DEDUP_CACHE,
+    OPT_SANITIZE,
+    OPT_TUI,
+    OPT_TUI_FPS,
+    OPT_JSONL,
+    OPT_TRACE,
+    OPT_TRACE_EVENTS,
+    OPT_WIRE,
+    OPT_MULTIPATH,
+    OPT_PATH,
+    OPT_RESOLVE_TTL,
+};
+
+// Each worker thread keeps a MSG_MAX_LEN buffer on its stack.
+#define MIN_THREAD_STACK_SIZE (128 * 1024)
+// Fits a 1500 byte MTU after the IPv4 and UDP headers.
+#define DEFAULT_GSO_SEGMENT_BYTES 1472
+#define MIN_GSO_SEGMENT_BYTES 512
+// Jumbo frames.
+#define MAX_GSO_SEGMENT_BYTES 9000
+// Matches the kernel's largest NR_CPUS.
+#define CPU_NUMBER_MAX 8191
+
+static const struct option s_longOptions[] = {
+    {"overflow-policy", required_argument, NULL, OPT_OVERFLOW_POLICY},
+    {"queue-max-messages", required_argument, NULL, OPT_QUEUE_MAX_MESSAGES},
+    {"queue-max-bytes", required_argument, NULL, OPT_QUEUE_MAX_BYTES},
+    {"queue-block-timeout-ms", required_argument, NULL, OPT_QUEUE_BLOCK_TIMEOUT_MS},
+    {"rate-bytes", required_argument, NULL, OPT_RATE_BYTES},
+    {"rate-packets", required_argument, NULL, OPT_RATE_PACKETS},
+    {"burst-bytes", required_argument, NULL, OPT_BURST_BYTES},
+    {"pace-adaptive", no_argument, NULL, OPT_PACE_ADAPTIVE},
+    {"rcvbuf", required_argument, NULL, OPT_RCVBUF},
+    {"sndbuf", required_argument, NULL, OPT_SNDBUF},
+    {"busy-poll-usec", required_argument, NULL, OPT_BUSY_POLL_USEC},
+    {"timestamps", no_argument, NULL, OPT_TIMESTAMPS},
+    {"tos", required_argument, NULL, OPT_TOS},
+    {"dscp", required_argument, NULL, OPT_DSCP},
+    {"spin-usec", required_argument, NULL, OPT_SPIN_USEC},
+    {"cpu-reader", required_argument, NULL, OPT_CPU_READER},
+    {"cpu-printer", required_argument, NULL, OPT_CPU_PRINTER},
+    {"cpu-sender", required_argument, NULL, OPT_CPU_SENDER},
+    {"cpu-listener", required_argument, NULL, OPT_CPU_LISTENER},
+    {"colocate-pairs", no_argument, NULL, OPT_COLOCATE_PAIRS},
+    {"sched-fifo", required_argument, NULL, OPT_SCHED_FIFO},
+    {"stack-size", required_argument, NULL, OPT_STACK_SIZE},
+    {"shm", required_argument, NULL, OPT_SHM},
+    {"shm-ring-size", required_argument, NULL, OPT_SHM_RING_SIZE},
+    {"fec", required_argument, NULL, OPT_FEC},
+    {"gso", no_argument, NULL, OPT_GSO},
+    {"gso-segment", required_argument, NULL, OPT_GSO_SEGMENT},
+    {"gro", no_argument, NULL, OPT_GRO},
+    {"interactive-max-bytes", required_argument, NULL, OPT_INTERACTIVE_MAX_BYTES},
+    {"lane-weights", required_argument, NULL, OPT_LANE_WEIGHTS},
+    {"heartbeat-ms", required_argument, NULL, OPT_HEARTBEAT_MS},
+    {"peer-timeout-ms", required_argument, NULL, OPT_PEER_TIMEOUT_MS},
+    {"idle-timeout-ms", required_argument, NULL, OPT_IDLE_TIMEOUT_MS},
+    {"dedup", no_argument, NULL, OPT_DEDUP},
+    {"dedup-cache", required_argument, NULL, OPT_DEDUP_CACHE},
+    {"sanitize", required_argument, NULL, OPT_SANITIZE},
+    {"tui", no_argument, NULL, OPT_TUI},
+    {"tui-fps", required_argument, NULL, OPT_TUI_FPS},
+    {"jsonl", no_argument, NULL, OPT_JSONL},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"trace-events", required_argument, NULL, OPT_TRACE_EVENTS},
+    {"wire", required_argument, NULL, OPT_WIRE},
+    {"multipath", required_argument, NULL, OPT_MULTIPATH},
+    {"path", required_argument, NULL, OPT_PATH},
+    {"resolve-ttl", required_argument, NULL, OPT_RESOLVE_TTL},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static Options s_options = {
+    .resolveTtlSec = 300,
+    .queueLimits = {
+        .maxMessages = MESSAGE_QUEUE_MAX_MESSAGES,
+        .maxBytes = 16 * 1024 * 1024,
+        .policy = OVERFLOW_BLOCK,
+        .blockTimeoutMs = 1000,
+        .interactiveMaxBytes = 512,
+        .laneWeights = {1, 4, 1}
+    },
+    .socketTuning = {
+        .typeOfService = -1
+    },
+    .threadPlacement = {
+        .cpuForRole = {-1, -1, -1, -1},
+        .stackSizeBytes = 256 * 1024
+    },
+    .isShmEnabled = true,
+    .shmRingBytes = 4 * 1024 * 1024,
+    .dedupCacheBytes = 1024 * 1024,
+    .isSanitizeEnabled = true,
+    .tuiFramesPerSec = 60,
+    .traceEventsPerThread = 1024 * 1024,
+    .wireMode = WIRE_MODE_AUTO,
+    .multipathMode = MULTIPATH_OFF,
+};
+
+void Options_printUsage()
+{
+    fputs("usage: ./two-chat [options] <our port number> <remote machine name> <remote port number>\n"
+          "options:\n"
+          "  --overflow-policy=block|drop-oldest|drop-newest|coalesce\n"
+          "                          what to do when a message queue is full (default: block)\n"
+          "  --queue-max-messages=N  max messages in each queue (default and most: 500)\n"
+          "  --queue-max-bytes=N     max bytes of text in each queue, accepts k/m suffixes\n"
+          "                          (default: 16m)\n"
+          "  --queue-block-timeout-ms=N\n"
+          "                          how long to block before dropping (default: 1000)\n"
+          "  --interactive-max-bytes=N\n"
+          "                          longer messages go in the bulk lane (default: 512)\n"
+          "  --lane-weights=I,B      messages the interactive and bulk lanes each get per\n"
+          "                          round when both are waiting (default: 4,1)\n"
+          "  --rate-bytes=N          limit sending to N bytes/s, accepts k/m/g suffixes\n"
+          "  --rate-packets=N        limit sending to N datagrams/s\n"
+          "  --burst-bytes=N         bytes that can be sent at once when under the rate\n"
+          "                          (default: 100 ms worth, at least one datagram)\n"
+          "  --pace-adaptive         lower the send rate when loss is measured\n"
+          "  --rcvbuf=N, --sndbuf=N  socket receive/send buffer sizes, accepts k/m suffixes\n"
+          "  --busy-poll-usec=N      busy poll the device queue for N us on receive\n"
+          "  --timestamps            measure latency using kernel receive timestamps\n"
+          "  --tos=N                 set the IP TOS byte\n"
+          "  --dscp=N                set the DSCP code point (the upper 6 bits of the TOS)\n"
+          "  --spin-usec=N           spin for N us on non-blocking receives before blocking\n"
+          "  --cpu-reader=N, --cpu-printer=N, --cpu-sender=N, --cpu-listener=N\n"
+          "                          pin a thread to a CPU\n"
+          "  --colocate-pairs        put the unpinned thread of the reader/sender and\n"
+          "                          listener/printer pairs on the sibling hyperthread\n"
+          "  --sched-fifo=PRIO       run the sender and listener with SCHED_FIFO\n"
+          "  --stack-size=N          stack size of each thread, accepts k/m suffixes\n"
+          "                          (default: 256k)\n"
+          "  --shm=auto|off          use shared memory instead of UDP for peers on this\n"
+          "                          host (default: auto)\n"
+          "  --shm-ring-size=N       bytes in the shared-memory ring, rounded up to a power\n"
+          "                          of 2 (default: 4m)\n"
+          "  --fec=off|auto|N        send a parity datagram after every N datagrams so that\n"
+          "                          one lost datagram in each block can be rebuilt; auto\n"
+          "                          picks N from the loss the peer reports (default: off)\n"
+          "  --gso                   split messages longer than one datagram into a train\n"
+          "                          of datagrams in one send with UDP_SEGMENT\n"
+          "  --gso-segment=N         bytes per datagram with --gso (default: 1472)\n"
+          "  --gro                   receive trains of datagrams at once with UDP_GRO\n"
+          "  --heartbeat-ms=N        send an empty datagram when nothing was sent for N ms\n"
+          "                          (default: a third of --peer-timeout-ms, otherwise off)\n"
+          "  --peer-timeout-ms=N     shut down when nothing comes from the peer for N ms\n"
+          "  --idle-timeout-ms=N     shut down when no message is sent or received for N ms\n"
+          "  --dedup                 send chunks of text the peer has seen recently as\n"
+          "                          references instead of the text\n"
+          "  --dedup-cache=N         bytes of chunks each side remembers, accepts k/m\n"
+          "                          suffixes; should match the peer's (default: 1m)\n"
+          "  --sanitize=on|off       show control characters received as ^X and invalid\n"
+          "                          UTF-8 as U+FFFD instead of passing them to the\n"
+          "                          terminal (default: on)\n"
+          "  --tui                   full-screen UI with the input line kept apart from\n"
+          "                          incoming text\n"
+          "  --tui-fps=N             most screen updates per second with --tui (default: 60)\n"
+          "  --jsonl                 write each received message to stdout as a JSON object\n"
+          "                          on a line of its own, and read JSON commands from stdin;\n"
+          "                          everything else goes to stderr\n"
+          "  --trace=FILE            record where each message spends its time and write\n"
+          "                          it to FILE at exit, for chrome://tracing or Perfetto\n"
+          "  --trace-events=N        spans kept per thread with --trace, accepts k/m\n"
+          "                          suffixes; 32 bytes each (default: 1m)\n"
+          "  --wire=auto|legacy|framed\n"
+          "                          put a header with a sequence number and flags in\n"
+          "                          front of each datagram; auto does once the peer does\n"
+          "                          (default: auto)\n"
+          "  --multipath=all|best    send each message on every path to the peer, or on\n"
+          "                          the one with the lowest round trip and loss; the\n"
+          "                          peer drops the copies (needs frames)\n"
+          "  --path=ADDR|IFNAME      another path with --multipath, from a local address\n"
+          "                          or an interface (needs CAP_NET_RAW); repeatable\n"
+          "  --resolve-ttl=N         resolve the remote machine name again every N seconds;\n"
+          "                          0 only resolves it at startup (default: 300)\n",
+          stdout);
+}
+
+/*
+ * Parses an unsigned integer with an optional k, m or g (binary) suffix.
+ * Returns false if pArg isn't a number or it is greater than maxValue.
+ */
+static bool parseUnsigned(const char* pArg, unsigned long long maxValue,
+                          unsigned long long* pValue)
+{
+    char* pEnd = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(pArg, &pEnd, 10);
+    if (errno == ERANGE || pEnd == pArg || pArg[0] == '-') {
+        return false;
+    }
+    switch (*pEnd) {
+        case 'g':
+        case 'G':
+            value *= 1024;
+            // Pass through
+        case 'm':
+        case 'M':
+            value *= 1024;
+            // Pass through
+        case 'k':
+        case 'K':
+            value *= 1024;
+            pEnd++;
+            break;
+        default:
+            break;
+    }
+    if (*pEnd != '\0' || value > maxValue) {
+        return false;
+    }
+    *pValue = value;
+    return true;
+}
+
+static bool parsePort(const char* pArg, in_port_t* pPort)
+{
+    unsigned long long port;
+    if (!parseUnsigned(pArg, 65535, &port)) {
+        return false;
+    }
+    *pPort = (in_port_t) port;
+    return true;
+}
+
+/*
+ * Parses "I,B", the interactive and bulk lane weights.
+ */
+static bool parseLaneWeights(const char* pArg)
+{
+    char interactiveWeight[32];
+    const char* pComma = strchr(pArg, ',');
+    unsigned long long interactive;
+    unsigned long long bulk;
+    if (pComma == NULL || (size_t) (pComma - pArg) >= sizeof(interactiveWeight)) {
+        printf("--lane-weights must look like 4,1.\n");
+        return false;
+    }
+    memcpy(interactiveWeight, pArg, (size_t) (pComma - pArg));
+    interactiveWeight[pComma - pArg] = '\0';
+    if (!parseUnsigned(interactiveWeight, 1000, &interactive) || interactive == 0
+        || !parseUnsigned(pComma + 1, 1000, &bulk) || bulk == 0) {
+        printf("The lane weights must be between 1 and 1000.\n");
+        return false;
+    }
+    s_options.queueLimits.laneWeights[LANE_INTERACTIVE] = (unsigned int) interactive;
+    s_options.queueLimits.laneWeights[LANE_BULK] = (unsigned int) bulk;
+    return true;
+}
+
+static bool parseOption(int option, const char* pArg)
+{
+    unsigned long long value;
+    switch (option) {
+        case OPT_OVERFLOW_POLICY:
+            if (!MessageQueue_parseOverflowPolicy(pArg, &s_options.queueLimits.policy)) {
+                printf("Unknown overflow policy: %s\n", pArg);
+                return false;
+            }
+            return true;
+        case OPT_QUEUE_MAX_MESSAGES:
+            if (!parseUnsigned(pArg, MESSAGE_QUEUE_MAX_MESSAGES, &value) || value == 0) {
+                printf("The max queue length must be between 1 and %d.\n",
+                       MESSAGE_QUEUE_MAX_MESSAGES);
+                return false;
+            }
+            s_options.queueLimits.maxMessages = value;
+            return true;
+        case OPT_QUEUE_MAX_BYTES:
+            if (!parseUnsigned(pArg, SIZE_MAX, &value) || value == 0) {
+                printf("Invalid max queue size: %s\n", pArg);
+                return false;
+            }
+            s_options.queueLimits.maxBytes = value;
+            return true;
+        case OPT_QUEUE_BLOCK_TIMEOUT_MS:
+            if (!parseUnsigned(pArg, 24 * 60 * 60 * 1000, &value)) {
+                printf("Invalid block timeout: %s\n", pArg);
+                return false;
+            }
+            s_options.queueLimits.blockTimeoutMs = (long) value;
+            return true;
+        case OPT_INTERACTIVE_MAX_BYTES:
+            if (!parseUnsigned(pArg, MSG_MAX_LEN, &value)) {
+                printf("The interactive message size must be at most %d bytes.\n", MSG_MAX_LEN);
+                return false;
+            }
+            s_options.queueLimits.interactiveMaxBytes = value;
+            return true;
+        case OPT_LANE_WEIGHTS:
+            return parseLaneWeights(pArg);
+        case OPT_RATE_BYTES:
+            if (!parseUnsigned(pArg, ULLONG_MAX, &s_options.rateBytesPerSec)) {
+                printf("Invalid byte rate: %s\n", pArg);
+                return false;
+            }
+            return true;
+        case OPT_RATE_PACKETS:
+            if (!parseUnsigned(pArg, ULLONG_MAX, &s_options.ratePacketsPerSec)) {
+                printf("Invalid packet rate: %s\n", pArg);
+                return false;
+            }
+            return true;
+        case OPT_BURST_BYTES:
+            if (!parseUnsigned(pArg, ULLONG_MAX, &s_options.burstBytes)) {
+                printf("Invalid burst size: %s\n", pArg);
+                return false;
+            }
+            return true;
+        case OPT_PACE_ADAPTIVE:
+            s_options.isPacingAdaptive = true;
+            return true;
+        case OPT_RCVBUF:
+        case OPT_SNDBUF:
+            if (!parseUnsigned(pArg, INT_MAX, &value)) {
+                printf("Invalid socket buffer size: %s\n", pArg);
+                return false;
+            }
+            if (option == OPT_RCVBUF) {
+                s_options.socketTuning.receiveBufferBytes = (int) value;
+            } else {
+                s_options.socketTuning.sendBufferBytes = (int) value;
+            }
+            return true;
+        case OPT_BUSY_POLL_USEC:
+            if (!parseUnsigned(pArg, INT_MAX, &value)) {
+                printf("Invalid busy poll time: %s\n", pArg);
+                return false;
+            }
+            s_options.socketTuning.busyPollUsec = (int) value;
+            return true;
+        case OPT_TIMESTAMPS:
+            s_options.socketTuning.isTimestampingEnabled = true;
+            return true;
+        case OPT_TOS:
+            if (!parseUnsigned(pArg, 255, &value)) {
+                printf("The TOS byte must be between 0 and 255.\n");
+                return false;
+            }
+            s_options.socketTuning.typeOfService = (int) value;
+            return true;
+        case OPT_DSCP:
+            if (!parseUnsigned(pArg, 63, &value)) {
+                printf("The DSCP code point must be between 0 and 63.\n");
+                return false;
+            }
+            // Keep the ECN bits clear.
+            s_options.socketTuning.typeOfService = (int) (value << 2);
+            return true;
+        case OPT_SPIN_USEC:
+            if (!parseUnsigned(pArg, 1000000, &value)) {
+                printf("The spin time must be at most 1000000 us.\n");
+                return false;
+            }
+            s_options.socketTuning.spinUsec = (long) value;
+            return true;
+        case OPT_CPU_READER:
+        case OPT_CPU_PRINTER:
+        case OPT_CPU_SENDER:
+        case OPT_CPU_LISTENER:
+            if (!parseUnsigned(pArg, CPU_NUMBER_MAX, &value)) {
+                printf("Invalid CPU number: %s\n", pArg);
+                return false;
+            }
+            s_options.threadPlacement.cpuForRole[
+                option == OPT_CPU_READER ? THREAD_KEYBOARD_READER
+                : option == OPT_CPU_PRINTER ? THREAD_SCREEN_PRINTER
+                : option == OPT_CPU_SENDER ? THREAD_SENDER
+                : THREAD_LISTENER] = (int) value;
+            return true;
+        case OPT_COLOCATE_PAIRS:
+            s_options.threadPlacement.isColocatingPairs = true;
+            return true;
+        case OPT_SCHED_FIFO:
+            if (!parseUnsigned(pArg, 99, &value) || value == 0) {
+                printf("The SCHED_FIFO priority must be between 1 and 99.\n");
+                return false;
+            }
+            s_options.threadPlacement.fifoPriority = (int) value;
+            return true;
+        case OPT_STACK_SIZE:
+            if (!parseUnsigned(pArg, SIZE_MAX, &value) || value < MIN_THREAD_STACK_SIZE) {
+                printf("The stack size must be at least %d bytes.\n", MIN_THREAD_STACK_SIZE);
+                return false;
+            }
+            s_options.threadPlacement.stackSizeBytes = value;
+            return true;
+        case OPT_SHM:
+            if (strcmp(pArg, "auto") == 0) {
+                s_options.isShmEnabled = true;
+            } else if (strcmp(pArg, "off") == 0) {
+                s_options.isShmEnabled = false;
+            } else {
+                printf("--shm must be auto or off.\n");
+                return false;
+            }
+            return true;
+        case OPT_SHM_RING_SIZE:
+            // Must hold at least one full datagram.
+            if (!parseUnsigned(pArg, 1ULL << 30, &value) || value < 2 * MSG_MAX_LEN) {
+                printf("The shared-memory ring size must be between %d and 1g bytes.\n",
+                       2 * MSG_MAX_LEN);
+                return false;
+            }
+            s_options.shmRingBytes = value;
+            return true;
+        case OPT_FEC:
+            if (strcmp(pArg, "off") == 0) {
+                s_options.isFecEnabled = false;
+            } else if (strcmp(pArg, "auto") == 0) {
+                s_options.isFecEnabled = true;
+                s_options.fecBlockSize = 0;
+            } else if (parseUnsigned(pArg, FEC_MAX_BLOCK_SIZE, &value) && value > 0) {
+                s_options.isFecEnabled = true;
+                s_options.fecBlockSize = (int) value;
+            } else {
+                printf("--fec must be off, auto or a block size between 1 and %d.\n",
+                       FEC_MAX_BLOCK_SIZE);
+                return false;
+            }
+            return true;
+        case OPT_GSO:
+            if (s_options.socketTuning.gsoSegmentBytes == 0) {
+                s_options.socketTuning.gsoSegmentBytes = DEFAULT_GSO_SEGMENT_BYTES;
+            }
+            return true;
+        case OPT_GSO_SEGMENT:
+            if (!parseUnsigned(pArg, MAX_GSO_SEGMENT_BYTES, &value)
+                || value < MIN_GSO_SEGMENT_BYTES) {
+                printf("The GSO segment size must be between %d and %d bytes.\n",
+                       MIN_GSO_SEGMENT_BYTES, MAX_GSO_SEGMENT_BYTES);
+                return false;
+            }
+            s_options.socketTuning.gsoSegmentBytes = (int) value;
+            return true;
+        case OPT_GRO:
+            s_options.socketTuning.isGroEnabled = true;
+            return true;
+        case OPT_HEARTBEAT_MS:
+        case OPT_PEER_TIMEOUT_MS:
+        case OPT_IDLE_TIMEOUT_MS:
+            if (!parseUnsigned(pArg, 7 * 24 * 60 * 60 * 1000ULL, &value)) {
+                printf("Invalid time: %s. It must be in ms and at most a week.\n", pArg);
+                return false;
+            }
+            if (option == OPT_HEARTBEAT_MS) {
+                s_options.heartbeatMs = value;
+            } else if (option == OPT_PEER_TIMEOUT_MS) {
+                s_options.peerTimeoutMs = value;
+            } else {
+                s_options.idleTimeoutMs = value;
+            }
+            return true;
+        case OPT_DEDUP:
+            s_options.isDedupEnabled = true;
+            return true;
+        case OPT_DEDUP_CACHE:
+            if (!parseUnsigned(pArg, 1ULL << 30, &value) || value < 64 * 1024) {
+                printf("The dedup cache size must be between 64k and 1g bytes.\n");
+                return false;
+            }
+            s_options.dedupCacheBytes = value;
+            return true;
+        case OPT_SANITIZE:
+            if (strcmp(pArg, "on") == 0) {
+                s_options.isSanitizeEnabled = true;
+            } else if (strcmp(pArg, "off") == 0) {
+                s_options.isSanitizeEnabled = false;
+            } else {
+                printf("--sanitize must be on or off.\n");
+                return false;
+            }
+            return true;
+        case OPT_TUI:
+            s_options.isTuiEnabled = true;
+            return true;
+        case OPT_TUI_FPS:
+            if (!parseUnsigned(pArg, 240, &value) || value == 0) {
+                printf("The TUI frame rate must be between 1 and 240.\n");
+                return false;
+            }
+            s_options.tuiFramesPerSec = (int) value;
+            return true;
+        case OPT_JSONL:
+            s_options.isJsonlEnabled = true;
+            return true;
+        case OPT_TRACE:
+            s_options.pTracePath = pArg;
+            return true;
+        case OPT_TRACE_EVENTS:
+            if (!parseUnsigned(pArg, 64ULL * 1024 * 1024, &value) || value == 0) {
+                printf("The number of trace spans must be between 1 and 64m.\n");
+                return false;
+            }
+            s_options.traceEventsPerThread = value;
+            return true;
+        case OPT_WIRE:
+            if (strcmp(pArg, "auto") == 0) {
+                s_options.wireMode = WIRE_MODE_AUTO;
+            } else if (strcmp(pArg, "legacy") == 0) {
+                s_options.wireMode = WIRE_MODE_LEGACY;
+            } else if (strcmp(pArg, "framed") == 0) {
+                s_options.wireMode = WIRE_MODE_FRAMED;
+            } else {
+                printf("--wire must be auto, legacy or framed.\n");
+                return false;
+            }
+            return true;
+        case OPT_MULTIPATH:
+            if (strcmp(pArg, "all") == 0) {
+                s_options.multipathMode = MULTIPATH_ALL;
+            } else if (strcmp(pArg, "best") == 0) {
+                s_options.multipathMode = MULTIPATH_BEST;
+            } else {
+                printf("--multipath must be all or best.\n");
+                return false;
+            }
+            return true;
+        case OPT_PATH:
+            if (s_options.numPathNames == MULTIPATH_MAX_PATHS - 1) {
+                printf("There can be at most %d paths besides the default one.\n",
+                       MULTIPATH_MAX_PATHS - 1);
+                return false;
+            }
+            s_options.pathNames[s_options.numPathNames++] = pArg;
+            return true;
+        case OPT_RESOLVE_TTL:
+            if (!parseUnsigned(pArg, 7 * 24 * 60 * 60, &value)) {
+                printf("Invalid time: %s. It must be in seconds and at most a week.\n", pArg);
+                return false;
+            }
+            s_options.resolveTtlSec = value;
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool Options_parse(int argCount, char** args)
+{
+    int option;
+    while ((option = getopt_long(argCount, args, "h", s_longOptions, NULL)) != -1) {
+        if (option == 'h' || option == '?' || !parseOption(option, optarg)) {
+            Options_printUsage();
+            return false;
+        }
+    }
+
+    if (argCount - optind != 3) {
+        Options_printUsage();
+        return false;
+    }
+    if (s_options.isJsonlEnabled && s_options.isTuiEnabled) {
+        fputs("--jsonl is for scripts, so it can't be used with --tui.\n", stdout);
+        return false;
+    }
+    if (s_options.numPathNames > 0 && s_options.multipathMode == MULTIPATH_OFF) {
+        fputs("--path needs --multipath.\n", stdout);
+        return false;
+    }
+    if (s_options.multipathMode != MULTIPATH_OFF) {
+        if (s_options.wireMode == WIRE_MODE_LEGACY) {
+            fputs("--multipath needs frames, so it can't be used with --wire=legacy.\n", stdout);
+            return false;
+        }
+        // The peer tells the copies of a message apart by their sequence numbers.
+        s_options.wireMode = WIRE_MODE_FRAMED;
+    }
+
+    if (!parsePort(args[optind], &s_options.ourPort)) {
+        fputs("Our port number is out of range. Please enter a valid port number.\n", stdout);
+        return false;
+    }
+    s_options.pRemoteHostname = args[optind + 1];
+    if (!parsePort(args[optind + 2], &s_options.remotePort)) {
+        fputs("Remote port number is out of range. Please enter a valid port number.\n", stdout);
+        return false;
+    }
+    return true;
+}
+
+const Options* Options_get()
+{
+    return &s_options;
+}
@@ -0,0 +1,90 @@
+#ifndef _OPTIONS_H
+#define _OPTIONS_H
+
+#include <stdbool.h>
+#include <netdb.h>
+#include "message_queue.h"
+#include "socket_config.h"
+#include "thread_placement.h"
+#include "wire.h"
+#include "multipath.h"
+
+typedef struct Options_s Options;
+struct Options_s {
+    in_port_t ourPort;
+    const char* pRemoteHostname;
+    in_port_t remotePort;
+    // How long to keep the addresses of the remote hostname before resolving it
+    // again. 0 resolves it only at startup.
+    unsigned long long resolveTtlSec;
+
+    // Limits for both the sending and the receiving message queues.
+    QueueLimits queueLimits;
+
+    // Sender pacing. A rate of 0 means unlimited.
+    unsigned long long rateBytesPerSec;
+    unsigned long long ratePacketsPerSec;
+    // 0 picks a burst from the byte rate.
+    unsigned long long burstBytes;
+    bool isPacingAdaptive;
+
+    SocketTuning socketTuning;
+
+    ThreadPlacementOptions threadPlacement;
+
+    // Use a shared-memory ring instead of UDP when the peer is on this host.
+    bool isShmEnabled;
+    size_t shmRingBytes;
+
+    // Send FEC parity over UDP. A block size of 0 adapts it to the measured loss.
+    bool isFecEnabled;
+    int fecBlockSize;
+
+    // Send repeated chunks of text as references to the peer's chunk cache.
+    bool isDedupEnabled;
+    size_t dedupCacheBytes;
+
+    // Keepalive. 0 turns each one off; a heartbeat of 0 with a peer timeout
+    // sends heartbeats at a third of the timeout.
+    unsigned long long heartbeatMs;
+    unsigned long long peerTimeoutMs;
+    unsigned long long idleTimeoutMs;
+
+    // Replace control characters and invalid UTF-8 in received text before printing it.
+    bool isSanitizeEnabled;
+
+    // Full-screen terminal UI, redrawn at most tuiFramesPerSec times a second.
+    bool isTuiEnabled;
+    int tuiFramesPerSec;
+
+    // JSON lines on stdin and stdout, for scripts, instead of text.
+    bool isJsonlEnabled;
+
+    // Where to write the trace, or NULL to not trace.
+    const char* pTracePath;
+    size_t traceEventsPerThread;
+
+    // Whether to frame datagrams: always, never, or once the peer does.
+    WireMode wireMode;
+
+    // Send frames over the extra paths as well as the default one, or over the
+    // best of them. The paths are local IPv4 addresses or interface names.
+    MultipathMode multipathMode;
+    const char* pathNames[MULTIPATH_MAX_PATHS - 1];
+    int numPathNames;
+};
+
+/*
+ * Parses the command line into the options for the program.
+ * Prints the reason and returns false if the command line is invalid.
+ */
+bool Options_parse(int argCount, char** args);
+
+/*
+ * Returns the parsed options. Only valid after Options_parse succeeds.
+ */
+const Options* Options_get();
+
+void Options_printUsage();
+
+#endif // _OPTIONS_H
@@ -0,0 +1,376 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "resolver.h"
+#include "message_sender.h"
+#include "options.h"
+#include "wire.h"
+
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+// How long to wait before trying again when resolving the name again fails. Until
+// then, messages go to the address from before.
+#define RESOLVER_RETRY_SEC 30
+
+static const char* s_pHostname;
+static in_port_t s_port;
+static uint64_t s_ttlNs;
+
+static pthread_t s_threadPid;
+static bool s_isRunning = false;
+
+// Protects the addresses, the race and the state at startup. The address messages
+// go to is also kept in s_peerAddress, so that sending doesn't take the mutex.
+static pthread_mutex_t s_syncAddressesMutex = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when the name is first resolved, or can't be.
+static pthread_cond_t s_resolvedCond = PTHREAD_COND_INITIALIZER;
+// Signalled when the peer answers from one of the addresses being raced. Uses
+// CLOCK_MONOTONIC, so it is set up in Resolver_init.
+static pthread_cond_t s_answeredCond;
+static in_addr_t s_addresses[RESOLVER_MAX_ADDRESSES];
+static int s_numAddresses = 0;
+static bool s_isResolved = false;
+static bool s_hasFailed = false;
+
+// In network byte order, and 0 until the name is resolved.
+static atomic_uint_least32_t s_peerAddress = 0;
+// Set until the peer is heard from at one of the addresses.
+static atomic_bool s_isRacing = false;
+
+static uint64_t s_startNs = 0;
+static uint64_t s_resolvedNs = 0;
+static unsigned long s_numResolutions = 0;
+static unsigned long s_numFailures = 0;
+static unsigned long s_numAddressChanges = 0;
+static unsigned long s_numRaces = 0;
+// Races won by an address other than the first one.
+static unsigned long s_numRacesWonByOthers = 0;
+
+static void fillSin(struct sockaddr_in* pSin, in_addr_t address)
+{
+    memset(pSin, 0, sizeof(*pSin));
+    pSin->sin_family = AF_INET;
+    pSin->sin_port = htons(s_port);
+    pSin->sin_addr.s_addr = address;
+}
+
+static const char* formatAddress(in_addr_t address, char* pBuffer)
+{
+    return inet_ntop(AF_INET, &address, pBuffer, INET_ADDRSTRLEN);
+}
+
+/*
+ * Must hold s_syncAddressesMutex. Returns the index of the address, or -1.
+ */
+static int findAddress(in_addr_t address)
+{
+    int i;
+    for (i = 0; i < s_numAddresses; i++) {
+        if (s_addresses[i] == address) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Resolves the name into pAddresses, in the order the resolver prefers them,
+ * leaving out repeats. Returns 0, or the error from getaddrinfo.
+ */
+static int resolve(in_addr_t* pAddresses, int* pNumAddresses)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    // The list is only allocated when getaddrinfo succeeds, so there is nothing to
+    // free otherwise.
+    struct addrinfo* pAddressList;
+    int statusCode = getaddrinfo(s_pHostname, NULL, &hints, &pAddressList);
+    if (statusCode != 0) {
+        return statusCode;
+    }
+    int numAddresses = 0;
+    struct addrinfo* pEntry;
+    for (pEntry = pAddressList; pEntry != NULL && numAddresses < RESOLVER_MAX_ADDRESSES;
+         pEntry = pEntry->ai_next) {
+        in_addr_t address = ((struct sockaddr_in*) pEntry->ai_addr)->sin_addr.s_addr;
+        int i;
+        for (i = 0; i < numAddresses && pAddresses[i] != address; i++) {
+        }
+        if (i == numAddresses) {
+            pAddresses[numAddresses++] = address;
+        }
+    }
+    freeaddrinfo(pAddressList);
+    *pNumAddresses = numAddresses;
+    return numAddresses > 0 ? 0 : EAI_NONAME;
+}
+
+/*
+ * Keeps the new addresses. Messages keep going to the address they went to if it is
+ * still among them, and otherwise go to the first one, which starts a race if there
+ * are others. Returns true if a race was started.
+ */
+static bool updateAddresses(const in_addr_t* pAddresses, int numAddresses)
+{
+    in_addr_t oldAddress = atomic_load(&s_peerAddress);
+    bool isKept;
+    bool isRacing = false;
+    pthread_mutex_lock(&s_syncAddressesMutex);
+    {
+        memcpy(s_addresses, pAddresses, sizeof(in_addr_t) * numAddresses);
+        s_numAddresses = numAddresses;
+        s_numResolutions++;
+        isKept = findAddress(oldAddress) != -1;
+        if (!isKept) {
+            atomic_store(&s_peerAddress, pAddresses[0]);
+            isRacing = numAddresses > 1;
+            atomic_store(&s_isRacing, isRacing);
+        }
+        if (!s_isResolved) {
+            s_isResolved = true;
+            s_resolvedNs = getMonotonicTimeNs();
+            pthread_cond_broadcast(&s_resolvedCond);
+        }
+    }
+    pthread_mutex_unlock(&s_syncAddressesMutex);
+
+    if (oldAddress != 0 && !isKept) {
+        s_numAddressChanges++;
+        char oldText[INET_ADDRSTRLEN];
+        char newText[INET_ADDRSTRLEN];
+        printf("%s no longer resolves to %s, sending to %s\n", s_pHostname,
+               formatAddress(oldAddress, oldText), formatAddress(pAddresses[0], newText));
+    }
+    return isRacing;
+}
+
+/*
+ * Returns once the peer has answered at one of the addresses being raced, or at
+ * deadlineNs.
+ */
+static void waitForAnswer(uint64_t deadlineNs)
+{
+    struct timespec deadline = {
+        .tv_sec = (time_t) (deadlineNs / NS_PER_SEC),
+        .tv_nsec = (long) (deadlineNs % NS_PER_SEC)
+    };
+    pthread_cleanup_push(unlockMutexesCleanup, &s_syncAddressesMutex);
+    pthread_mutex_lock(&s_syncAddressesMutex);
+    {
+        while (atomic_load(&s_isRacing)
+               && pthread_cond_timedwait(&s_answeredCond, &s_syncAddressesMutex,
+                                         &deadline) != ETIMEDOUT) {
+        }
+    }
+    pthread_cleanup_pop(1);
+}
+
+/*
+ * Says hello at each address in turn, RESOLVER_ATTEMPT_DELAY_MS apart, until the
+ * peer answers at one of them. The race stays open after the last hello, so that an
+ * answer that comes later, or a datagram the peer sends by itself, still ends it.
+ * The sender's own hello at startup goes to the first address as well, which the
+ * peer just answers twice.
+ */
+static void raceAddresses()
+{
+    in_addr_t addresses[RESOLVER_MAX_ADDRESSES];
+    int numAddresses;
+    pthread_mutex_lock(&s_syncAddressesMutex);
+    {
+        memcpy(addresses, s_addresses, sizeof(in_addr_t) * s_numAddresses);
+        numAddresses = s_numAddresses;
+    }
+    pthread_mutex_unlock(&s_syncAddressesMutex);
+    s_numRaces++;
+
+    if (!Wire_isHelloEnabled(Sender_getWire())) {
+        return;
+    }
+    int i;
+    for (i = 0; i < numAddresses && atomic_load(&s_isRacing); i++) {
+        struct sockaddr_in sinCandidate;
+        fillSin(&sinCandidate, addresses[i]);
+        Sender_sendHelloTo(&sinCandidate);
+        waitForAnswer(getMonotonicTimeNs() + RESOLVER_ATTEMPT_DELAY_MS * NS_PER_MS);
+    }
+}
+
+static void sleepUntil(uint64_t deadlineNs)
+{
+    struct timespec deadline = {
+        .tv_sec = (time_t) (deadlineNs / NS_PER_SEC),
+        .tv_nsec = (long) (deadlineNs % NS_PER_SEC)
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
+
+static void* Resolver_run(void* stub)
+{
+    while (1) {
+        in_addr_t addresses[RESOLVER_MAX_ADDRESSES];
+        int numAddresses = 0;
+        int statusCode = resolve(addresses, &numAddresses);
+        if (statusCode == 0) {
+            if (updateAddresses(addresses, numAddresses)) {
+                raceAddresses();
+            }
+            if (s_ttlNs == 0) {
+                return NULL;
+            }
+            sleepUntil(getMonotonicTimeNs() + s_ttlNs);
+            continue;
+        }
+
+        bool isResolved;
+        pthread_mutex_lock(&s_syncAddressesMutex);
+        {
+            isResolved = s_isResolved;
+            s_hasFailed = !isResolved;
+            pthread_cond_broadcast(&s_resolvedCond);
+        }
+        pthread_mutex_unlock(&s_syncAddressesMutex);
+        if (!isResolved) {
+            printf("Error in getting address of remote machine: %s\n", gai_strerror(statusCode));
+            requestShutdownOfAllThreadsForProgram();
+            return NULL;
+        }
+        // The addresses from before are kept until the name resolves again.
+        if (s_numFailures++ == 0) {
+            printf("Warning: failed to resolve %s again (%s), still using the old address\n",
+                   s_pHostname, gai_strerror(statusCode));
+        }
+        uint64_t retryNs = RESOLVER_RETRY_SEC * NS_PER_SEC;
+        sleepUntil(getMonotonicTimeNs() + (retryNs < s_ttlNs ? retryNs : s_ttlNs));
+    }
+}
+
+bool Resolver_init(const char* pHostname, in_port_t port, uint64_t startNs)
+{
+    s_pHostname = pHostname;
+    s_port = port;
+    s_ttlNs = Options_get()->resolveTtlSec * NS_PER_SEC;
+    s_startNs = startNs;
+
+    struct in_addr address;
+    if (inet_pton(AF_INET, pHostname, &address) == 1) {
+        in_addr_t addresses[1] = {address.s_addr};
+        updateAddresses(addresses, 1);
+        return true;
+    }
+
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s_answeredCond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+
+    // Like the timer thread, this one doesn't wait on the ready barrier. It is
+    // started after the worker threads, which are all created by then.
+    s_isRunning = true;
+    int status = pthread_create(&s_threadPid, NULL, Resolver_run, NULL);
+    if (status != 0) {
+        printf("Failed to create resolver thread: %s\n", strerror(status));
+        s_isRunning = false;
+        pthread_cond_destroy(&s_answeredCond);
+        return false;
+    }
+    return true;
+}
+
+bool Resolver_getPeer(struct sockaddr_in* pSinPeer)
+{
+    in_addr_t address = atomic_load_explicit(&s_peerAddress, memory_order_relaxed);
+    if (address == 0) {
+        return false;
+    }
+    fillSin(pSinPeer, address);
+    return true;
+}
+
+bool Resolver_waitForAddress()
+{
+    bool isResolved;
+    pthread_cleanup_push(unlockMutexesCleanup, &s_syncAddressesMutex);
+    pthread_mutex_lock(&s_syncAddressesMutex);
+    {
+        while (!s_isResolved && !s_hasFailed) {
+            pthread_cond_wait(&s_resolvedCond, &s_syncAddressesMutex);
+        }
+        isResolved = s_isResolved;
+    }
+    pthread_cleanup_pop(1);
+    return isResolved;
+}
+
+void Resolver_onReceive(const struct sockaddr_in* pSinFrom)
+{
+    if (!atomic_load_explicit(&s_isRacing, memory_order_relaxed)
+        || pSinFrom->sin_family != AF_INET || pSinFrom->sin_port != htons(s_port)) {
+        return;
+    }
+    pthread_mutex_lock(&s_syncAddressesMutex);
+    {
+        int index = findAddress(pSinFrom->sin_addr.s_addr);
+        if (atomic_load(&s_isRacing) && index != -1) {
+            atomic_store(&s_peerAddress, s_addresses[index]);
+            atomic_store(&s_isRacing, false);
+            s_numRacesWonByOthers += index != 0;
+            pthread_cond_signal(&s_answeredCond);
+        }
+    }
+    pthread_mutex_unlock(&s_syncAddressesMutex);
+}
+
+bool Resolver_hasFailed()
+{
+    return s_hasFailed;
+}
+
+ShutdownStatus Resolver_shutdown()
+{
+    if (!s_isRunning) {
+        return SUCCESSFUL_JOIN;
+    }
+    return shutdownThreadWithPid(s_threadPid);
+}
+
+void Resolver_printStats()
+{
+    if (s_numResolutions == 0) {
+        return;
+    }
+    if (s_isRunning) {
+        char addressText[INET_ADDRSTRLEN];
+        printf("Resolver: %s resolved %.1f ms after startup, sending to %s of %d addresses",
+               s_pHostname, (double) (s_resolvedNs - s_startNs) / 1e6,
+               formatAddress(atomic_load(&s_peerAddress), addressText), s_numAddresses);
+        if (s_numResolutions > 1 || s_numFailures > 0) {
+            printf(", resolved again %lu times, %lu failed", s_numResolutions - 1, s_numFailures);
+        }
+        if (s_numRaces > 0) {
+            printf(", %lu of %lu races won by another address than the first",
+                   s_numRacesWonByOthers, s_numRaces);
+        }
+        if (s_numAddressChanges > 0) {
+            printf(", address changed %lu times", s_numAddressChanges);
+        }
+        printf("\n");
+    }
+    uint64_t firstSendNs = Sender_getFirstSendNs();
+    if (firstSendNs != 0) {
+        printf("Startup: first message sent %.1f ms after startup\n",
+               (double) (firstSendNs - s_startNs) / 1e6);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "common.h"
+
+/*
+ * Resolves the peer's hostname on a thread of its own, so that the other threads
+ * start without waiting for the resolver, and keeps the result for --resolve-ttl
+ * seconds before resolving it again.
+ *
+ * When the name has more than one IPv4 address, they are raced like Happy Eyeballs
+ * (RFC 8305): a hello goes to the first, then to the next every
+ * RESOLVER_ATTEMPT_DELAY_MS until one of them is heard from, and messages go to the
+ * first address until then. Without hellos (--wire=legacy), the address the peer's
+ * first datagram comes from wins.
+ */
+
+#define RESOLVER_MAX_ADDRESSES 8
+// RFC 8305's recommended Connection Attempt Delay.
+#define RESOLVER_ATTEMPT_DELAY_MS 250
+
+/*
+ * Starts resolving pHostname. A name in x.x.x.x notation is taken as it is, without
+ * a thread. `startNs` is when the program started, for the stats.
+ * Returns false (after printing why) if the thread can't be started.
+ */
+bool Resolver_init(const char* pHostname, in_port_t port, uint64_t startNs);
+
+/*
+ * Fills in pSinPeer with the address messages go to. Returns false if the name
+ * hasn't been resolved yet. Safe to call from any thread.
+ */
+bool Resolver_getPeer(struct sockaddr_in* pSinPeer);
+
+/*
+ * Blocks until the name is first resolved. Returns false if it couldn't be, in which
+ * case the program is already shutting down.
+ */
+bool Resolver_waitForAddress();
+
+/*
+ * Called by the listener with the source of each datagram, to end a race when the
+ * peer answers from one of its addresses.
+ */
+void Resolver_onReceive(const struct sockaddr_in* pSinFrom);
+
+/*
+ * Returns true if the name couldn't be resolved at startup.
+ */
+bool Resolver_hasFailed();
+
+ShutdownStatus Resolver_shutdown();
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Resolver_printStats();
+
+#endif // _RESOLVER_H
@@ -0,0 +1,225 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sanitizer.h"
+
+// U+FFFD REPLACEMENT CHARACTER in UTF-8.
+static const char s_replacement[] = "\xef\xbf\xbd";
+
+static bool isPlainAscii(uint8_t byte)
+{
+    return (byte >= 0x20 && byte < 0x7f) || byte == '\n' || byte == '\t';
+}
+
+static char* writeReplacement(char* pOut, size_t* pNumReplaced)
+{
+    memcpy(pOut, s_replacement, 3);
+    (*pNumReplaced)++;
+    return pOut + 3;
+}
+
+/*
+ * Writes the character that starts at pIn, or what it is replaced with, to *ppOut
+ * and moves that past it. Returns how many bytes of the input it took.
+ *
+ * The second byte of a UTF-8 sequence has a narrower range after some lead bytes,
+ * which rules out overlong encodings, surrogates and code points past U+10FFFF.
+ * An invalid sequence is replaced by one U+FFFD for as much of it as was valid so
+ * far, the same as most decoders do.
+ */
+static size_t sanitizeCharacter(const uint8_t* pIn, const uint8_t* pEnd, char** ppOut,
+                                size_t* pNumReplaced)
+{
+    char* pOut = *ppOut;
+    uint8_t lead = pIn[0];
+    if (isPlainAscii(lead)) {
+        *pOut = (char) lead;
+        *ppOut = pOut + 1;
+        return 1;
+    }
+    if (lead < 0x80) {
+        // Caret notation: ^@ to ^_ for the C0 controls, and ^? for DEL.
+        pOut[0] = '^';
+        pOut[1] = (char) (lead == 0x7f ? '?' : lead + 0x40);
+        (*pNumReplaced)++;
+        *ppOut = pOut + 2;
+        return 1;
+    }
+
+    size_t length;
+    uint8_t secondMin = 0x80;
+    uint8_t secondMax = 0xbf;
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        length = 2;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        length = 3;
+        if (lead == 0xe0) {
+            secondMin = 0xa0;
+        } else if (lead == 0xed) {
+            secondMax = 0x9f;
+        }
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        length = 4;
+        if (lead == 0xf0) {
+            secondMin = 0x90;
+        } else if (lead == 0xf4) {
+            secondMax = 0x8f;
+        }
+    } else {
+        // A continuation byte on its own, or a lead byte that is never valid.
+        *ppOut = writeReplacement(pOut, pNumReplaced);
+        return 1;
+    }
+
+    size_t i;
+    for (i = 1; i < length; i++) {
+        uint8_t min = i == 1 ? secondMin : 0x80;
+        uint8_t max = i == 1 ? secondMax : 0xbf;
+        if (pIn + i >= pEnd || pIn[i] < min || pIn[i] > max) {
+            *ppOut = writeReplacement(pOut, pNumReplaced);
+            return i;
+        }
+    }
+    // U+0080 to U+009F are the C1 controls, and CSI (U+009B) starts an escape
+    // sequence on terminals that take 8-bit controls.
+    if (lead == 0xc2 && pIn[1] <= 0x9f) {
+        *ppOut = writeReplacement(pOut, pNumReplaced);
+        return 2;
+    }
+    memcpy(pOut, pIn, length);
+    *ppOut = pOut + length;
+    return length;
+}
+
+size_t Sanitizer_sanitizeScalar(const char* pText, size_t length, char* pOut,
+                                size_t* pNumReplaced)
+{
+    const uint8_t* pIn = (const uint8_t*) pText;
+    const uint8_t* pEnd = pIn + length;
+    char* pOutStart = pOut;
+    *pNumReplaced = 0;
+    while (pIn < pEnd) {
+        pIn += sanitizeCharacter(pIn, pEnd, &pOut, pNumReplaced);
+    }
+    return (size_t) (pOut - pOutStart);
+}
+
+size_t Sanitizer_sanitize(const char* pText, size_t length, char* pOut, size_t* pNumReplaced)
+{
+#ifdef __SSE2__
+    const uint8_t* pIn = (const uint8_t*) pText;
+    const uint8_t* pEnd = pIn + length;
+    char* pOutStart = pOut;
+    *pNumReplaced = 0;
+
+    const __m128i maxControl = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t');
+    while (pEnd - pIn >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) pIn);
+        // Stored before it is known how much of it is plain. The output always has
+        // room for it, since 16 more bytes of input are left, and the bytes past the
+        // plain ones are written over.
+        _mm_storeu_si128((__m128i*) pOut, bytes);
+        // Compared as signed, the bytes of 0x80 and up are negative, so this
+        // leaves out the controls and everything that isn't ASCII at once.
+        __m128i isPlain = _mm_andnot_si128(_mm_cmpeq_epi8(bytes, del),
+                                           _mm_cmpgt_epi8(bytes, maxControl));
+        isPlain = _mm_or_si128(isPlain, _mm_or_si128(_mm_cmpeq_epi8(bytes, newline),
+                                                     _mm_cmpeq_epi8(bytes, tab)));
+        unsigned int notPlainMask = ~(unsigned int) _mm_movemask_epi8(isPlain) & 0xffff;
+        if (notPlainMask == 0) {
+            pIn += 16;
+            pOut += 16;
+            continue;
+        }
+        int numPlain = __builtin_ctz(notPlainMask);
+        pIn += numPlain;
+        pOut += numPlain;
+        // Text that isn't ASCII tends to come in runs, which aren't worth going
+        // back to the vector loop for between each character.
+        do {
+            pIn += sanitizeCharacter(pIn, pEnd, &pOut, pNumReplaced);
+        } while (pIn < pEnd && !isPlainAscii(*pIn));
+    }
+    while (pIn < pEnd) {
+        pIn += sanitizeCharacter(pIn, pEnd, &pOut, pNumReplaced);
+    }
+    return (size_t) (pOut - pOutStart);
+#else
+    return Sanitizer_sanitizeScalar(pText, length, pOut, pNumReplaced);
+#endif
+}
+
+static bool isContinuationByte(uint8_t byte)
+{
+    return (byte & 0xc0) == 0x80;
+}
+
+/*
+ * Returns how many bytes at the end of the text are a UTF-8 sequence that is cut short.
+ */
+static size_t getCutSequenceLength(const char* pText, size_t length)
+{
+    size_t numTail;
+    for (numTail = 1; numTail <= SANITIZER_MAX_HELD_LEN && numTail <= length; numTail++) {
+        uint8_t lead = (uint8_t) pText[length - numTail];
+        if (isContinuationByte(lead)) {
+            continue;
+        }
+        size_t sequenceLength = 1;
+        if (lead >= 0xc2 && lead <= 0xdf) {
+            sequenceLength = 2;
+        } else if (lead >= 0xe0 && lead <= 0xef) {
+            sequenceLength = 3;
+        } else if (lead >= 0xf0 && lead <= 0xf4) {
+            sequenceLength = 4;
+        }
+        return sequenceLength > numTail ? numTail : 0;
+    }
+    return 0;
+}
+
+size_t Sanitizer_sanitizePiece(SanitizerStream* pStream, const char* pText, size_t length,
+                               bool isContinued, char* pOut, size_t* pNumReplaced)
+{
+    size_t outLength = 0;
+    size_t numHeldReplaced = 0;
+    if (pStream->numHeld > 0) {
+        // The held sequence takes the continuation bytes this piece starts with. The
+        // byte after them can't be part of it, so the rest is sanitized on its own.
+        char joined[2 * SANITIZER_MAX_HELD_LEN];
+        size_t numJoined = 0;
+        while (numJoined < length && numJoined < SANITIZER_MAX_HELD_LEN
+               && isContinuationByte((uint8_t) pText[numJoined])) {
+            numJoined++;
+        }
+        memcpy(joined, pStream->held, pStream->numHeld);
+        memcpy(joined + pStream->numHeld, pText, numJoined);
+        size_t joinedLength = pStream->numHeld + numJoined;
+        pStream->numHeld = 0;
+        pText += numJoined;
+        length -= numJoined;
+        if (length == 0) {
+            // The whole piece went into the sequence, which may still be cut short.
+            return Sanitizer_sanitizePiece(pStream, joined, joinedLength, isContinued, pOut,
+                                           pNumReplaced);
+        }
+        outLength = Sanitizer_sanitize(joined, joinedLength, pOut, &numHeldReplaced);
+    }
+    if (isContinued) {
+        size_t numHeld = getCutSequenceLength(pText, length);
+        length -= numHeld;
+        memcpy(pStream->held, pText + length, numHeld);
+        pStream->numHeld = numHeld;
+    }
+    outLength += Sanitizer_sanitize(pText, length, pOut + outLength, pNumReplaced);
+    *pNumReplaced += numHeldReplaced;
+    return outLength;
+}
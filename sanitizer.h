@@ -0,0 +1,57 @@
+#ifndef _SANITIZER_H
+#define _SANITIZER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Makes received text safe to write to a terminal, so that a peer can't send escape
+ * sequences that move the cursor, retitle the window or worse.
+ *
+ * Printable ASCII, \n, \t and valid UTF-8 pass through. Other C0 controls and DEL
+ * are written in caret notation (ESC becomes "^["), and C1 controls, which some
+ * terminals also take as escape sequences, and each invalid UTF-8 sequence become
+ * U+FFFD. That can make the text up to SANITIZER_MAX_EXPANSION times as long.
+ *
+ * Runs of plain ASCII are found 16 bytes at a time with SSE2 where it is available,
+ * which is most text; everything else goes through the scalar path.
+ */
+
+// An invalid byte becomes the 3 bytes of U+FFFD.
+#define SANITIZER_MAX_EXPANSION 3
+// The most bytes of a UTF-8 sequence cut short that are held for the next piece.
+#define SANITIZER_MAX_HELD_LEN 3
+
+/*
+ * What is left over from the last piece of a text that comes in pieces.
+ */
+typedef struct SanitizerStream_s SanitizerStream;
+struct SanitizerStream_s {
+    char held[SANITIZER_MAX_HELD_LEN];
+    size_t numHeld;
+};
+
+/*
+ * Writes the sanitized text into pOut, which must have room for
+ * SANITIZER_MAX_EXPANSION times length bytes. Returns its length, and the number of
+ * characters and sequences replaced in pNumReplaced.
+ */
+size_t Sanitizer_sanitize(const char* pText, size_t length, char* pOut, size_t* pNumReplaced);
+
+/*
+ * The same, one byte at a time. The reference for tests and benchmarks.
+ */
+size_t Sanitizer_sanitizeScalar(const char* pText, size_t length, char* pOut,
+                                size_t* pNumReplaced);
+
+/*
+ * Sanitizes a piece of a text that was cut at any byte, such as one GSO segment of a
+ * message. If isContinued, a UTF-8 sequence cut short at the end is held in pStream
+ * and sanitized with the start of the next piece, so that the pieces come out the
+ * same as the whole text would. pOut must have room for SANITIZER_MAX_EXPANSION
+ * times (length + SANITIZER_MAX_HELD_LEN) bytes.
+ */
+size_t Sanitizer_sanitizePiece(SanitizerStream* pStream, const char* pText, size_t length,
+                               bool isContinued, char* pOut, size_t* pNumReplaced);
+
+#endif // _SANITIZER_H
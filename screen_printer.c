@@ -5,79 +5,71 @@
 #include <unistd.h>
 #include <asm/errno.h>
 #include "screen_printer.h"
+#include "message_listener.h"
 #include "keyboard_reader.h"
-#include "list.h"
+#include "message_queue.h"
+#include "message_pool.h"
+#include "options.h"
+#include "thread_placement.h"
 #include "common.h"
+#include "jsonl.h"
+#include "tui.h"
+#include "trace.h"
 
 static pthread_t s_threadPid;
-static pthread_cond_t s_syncMessagesAvailableCondVar = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t s_accessQueueMutex = PTHREAD_MUTEX_INITIALIZER;
 
-static List* s_pInMessageQueue = NULL;
-
-static Message* getMessageFromQueue()
-{
-    if (s_pInMessageQueue == NULL) {
-        return NULL;
-    }
-
-    // Example used for pthread_cleanup_push:
-    // https://www.systutorials.com/docs/linux/man/3p-pthread_cleanup_push/
-    Message* pMessage = NULL;
-
-    pthread_cleanup_push(unlockMutexesCleanup, &s_accessQueueMutex);
-    pthread_mutex_lock(&s_accessQueueMutex);
-    {
-        // Block if list is empty until list has items.
-        while (List_count(s_pInMessageQueue) == 0) {
-            // When it blocks, the mutex will be released to allow the listener process
-            // to be able to add messages onto the queue.
-            pthread_cond_wait(&s_syncMessagesAvailableCondVar, &s_accessQueueMutex);
-        }
-        // Dequeue
-        List_first(s_pInMessageQueue);
-        // Do not let the printer thread be cancelled until pMessage is freed or it is NULL.
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-        /* LISTENER THREAD NOT CANCELABLE HERE */
-        pMessage = List_remove(s_pInMessageQueue);
-        if (pMessage == NULL || pMessage->pText == NULL) {
-            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-        }
-    }
-    // This pop releases the mutex via unlockMutexesCleanup
-    // It also will make sure the mutex is released if the thread
-    // cancels while it is blocked by the cond_wait, since the
-    // routine is triggered if the thread cancels.
-    pthread_cleanup_pop(1);
-
-    return pMessage;
-}
+static MessageQueue* s_pInMessageQueue = NULL;
+static MessagePool* s_pInMessagePool = NULL;
 
 static void* ScreenPrinter_run(void* stub)
 {
     waitForAllThreadsReadyBarrier();
+    Trace_setThreadName("screen printer");
     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     while (1) {
         // This blocks until there is a pMessage on list.
         // This call will set the cancel state for the printer thread to be
         // disabled so that it does not cancel while it hasn't freed pMessage.
-        Message* pMessage = getMessageFromQueue();
+        uint64_t startNs = Trace_begin();
+        Message* pMessage = MessageQueue_take(s_pInMessageQueue);
         /* PRINTER THREAD NOT CANCELABLE HERE */
+        uint64_t traceId = pMessage != NULL ? pMessage->traceId : 0;
+        Trace_end("dequeue", startNs, traceId, TRACE_FLOW_NONE);
 
-        if (pMessage == NULL || pMessage->pText == NULL) {
+        if (pMessage == NULL) {
+            // The queue was closed because the program is shutting down.
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            break;
+        }
+        if (pMessage->pText == NULL) {
             pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
             continue;
         }
 
         bool shouldExitProgram = pMessage->isShutdownMessage;
-        fputs(pMessage->pText, stdout);
+        startNs = Trace_begin();
+        if (Jsonl_isEnabled()) {
+            Jsonl_writeMessage(pMessage);
+        } else if (Tui_isActive()) {
+            Tui_appendText(pMessage->pText, pMessage->length);
+        } else {
+            fputs(pMessage->pText, stdout);
+        }
+        Trace_end("fputs", startNs, traceId, TRACE_FLOW_END);
         freeMessageFn(pMessage);
 
         // Now that we have displayed and freed our pMessage, we can now set the printer thread
         // as ready to cancel.
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
         /* PRINTER THREAD CANCELABLE HERE */
-        fflush(stdout);
+        startNs = Trace_begin();
+        if (!Jsonl_isEnabled()) {
+            fflush(stdout);
+        } else if (shouldExitProgram || !MessageQueue_hasMessages(s_pInMessageQueue)) {
+            // A burst of messages goes out in as few writes as the buffer allows.
+            Jsonl_flush();
+        }
+        Trace_end("fflush", startNs, traceId, TRACE_FLOW_NONE);
 
         if (shouldExitProgram) {
             requestShutdownOfAllThreadsForProgram();
@@ -88,40 +80,33 @@ static void* ScreenPrinter_run(void* stub)
     return NULL;
 }
 
+/*
+ * For the message listener to make the messages it puts on the queue.
+ * Returns NULL if out of memory.
+ */
+Message* ScreenPrinter_createMessage(const char* pText, size_t length, bool isShutdownMessage)
+{
+    return MessagePool_createMessage(s_pInMessagePool, pText, length, isShutdownMessage);
+}
+
 /*
  * For the message listener to add messages on the queue.
  * Returns true if it was successfully put onto the queue, and false if not.
  */
 bool ScreenPrinter_putMessageOnQueue(Message* pMessage)
 {
-    bool isEnqueueSuccessful;
-
-    pthread_cleanup_push(unlockMutexesCleanup, &s_accessQueueMutex);
-    pthread_mutex_lock(&s_accessQueueMutex);
-    {
-        if (List_append(s_pInMessageQueue, pMessage) == LIST_FAIL) {
-            fputs("**The receiving message queue is too large!**\n", stdout);
-            fputs("**The most recent message will be dropped, please tell the other to resend**\n",
-                  stdout);
-            isEnqueueSuccessful = false;
-	        freeMessageFn(pMessage);
-            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-        } else {
-            pthread_cond_signal(&s_syncMessagesAvailableCondVar);
-            isEnqueueSuccessful = true;
-        }
-    }
-    // Unlocks the mutex.
-    pthread_cleanup_pop(1);
-
-    return isEnqueueSuccessful;
+    // The queue applies the overflow policy if the printer has fallen behind,
+    // which may block the listener until there is room.
+    return MessageQueue_put(s_pInMessageQueue, pMessage);
 }
 
 void ScreenPrinter_init()
 {
-    s_pInMessageQueue = List_create();
-    if (s_pInMessageQueue != NULL) {
-        int status = pthread_create(&s_threadPid, NULL, ScreenPrinter_run, NULL);
+    s_pInMessageQueue = MessageQueue_create("Receiving", &Options_get()->queueLimits);
+    s_pInMessagePool = MessagePool_create("Receiving", &Options_get()->queueLimits,
+                                          LISTENER_MAX_TEXT_LEN);
+    if (s_pInMessageQueue != NULL && s_pInMessagePool != NULL) {
+        int status = ThreadPlacement_createThread(THREAD_SCREEN_PRINTER, &s_threadPid, ScreenPrinter_run);
         if (status != 0) {
             printf("Failed to create screen display thread: %s\n", strerror(status));
             requestShutdownOfAllThreadsForProgram();
@@ -134,8 +119,9 @@ void ScreenPrinter_init()
 
 ShutdownStatus ScreenPrinter_shutdown()
 {
-    pthread_cond_signal(&s_syncMessagesAvailableCondVar);
-    pthread_mutex_unlock(&s_accessQueueMutex);
+    // Wakes up this thread if it is waiting for messages, and the listener if it
+    // is blocked waiting for room on the queue.
+    MessageQueue_close(s_pInMessageQueue);
 
     return shutdownThreadWithPid(s_threadPid);
 }
@@ -145,9 +131,17 @@ ShutdownStatus ScreenPrinter_shutdown()
  */
 void ScreenPrinter_destroyMutexAndCondAndFreeLists()
 {
-    pthread_cond_destroy(&s_syncMessagesAvailableCondVar);
-    pthread_mutex_destroy(&s_accessQueueMutex);
-
-    List_free(s_pInMessageQueue, freeMessageFn);
+    // Give the terminal back before anything else is printed.
+    Tui_destroy();
+    Tui_printStats();
+    // Whatever was written after the last flush, if the printer was cancelled.
+    Jsonl_flush();
+    Jsonl_printStats();
+    MessageQueue_printStats(s_pInMessageQueue);
+    MessagePool_printStats(s_pInMessagePool);
+    // The queue frees the messages left on it into the pool.
+    MessageQueue_destroy(s_pInMessageQueue);
     s_pInMessageQueue = NULL;
+    MessagePool_destroy(s_pInMessagePool);
+    s_pInMessagePool = NULL;
 }
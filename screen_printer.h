@@ -5,6 +5,13 @@
 
 void ScreenPrinter_init();
 
+/*
+ * For the message listener to make the messages it puts on the queue, from the
+ * receiving pipeline's pool.
+ * Returns NULL if out of memory.
+ */
+Message* ScreenPrinter_createMessage(const char* pText, size_t length, bool isShutdownMessage);
+
 /*
  * For the message listener to add messages on the queue.
  * Returns true if it was successfully put onto the queue, and false if not.
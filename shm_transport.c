@@ -0,0 +1,485 @@
+// For memfd_create and getifaddrs.
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "shm_transport.h"
+#include "common.h"
+#include "options.h"
+
+#define RING_MAGIC 0x324b5454
+#define RING_VERSION 1
+// The ring data starts on its own page after the header.
+#define RING_DATA_OFFSET 4096
+#define CACHE_LINE_SIZE 64
+
+#define RECORD_FLAG_SHUTDOWN 1
+// Fills the end of the ring when a record doesn't fit before wrapping around.
+#define RECORD_FLAG_PADDING 2
+
+// How long a producer sleeps between checks when the ring is full.
+#define FULL_RING_POLL_NS 50000
+// How often a producer waiting on a full ring checks if the consumer is still alive.
+#define FULL_RING_LIVENESS_CHECK_NS 1000000000ULL
+// How long a producer waits for the peer to hand over its ring.
+#define ATTACH_TIMEOUT_SEC 1
+
+typedef struct RingHeader_s RingHeader;
+struct RingHeader_s {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    int32_t consumerPid;
+    _Atomic int32_t producerPid;
+    // Positions count every byte ever read and written. They are on separate cache
+    // lines so that the consumer and producer don't false-share.
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t tail;
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t isConsumerWaiting;
+};
+
+typedef struct RecordHeader_s RecordHeader;
+struct RecordHeader_s {
+    uint32_t length;
+    uint32_t flags;
+};
+
+// Receiving end, used by the listener thread.
+static RingHeader* s_pReceiverRing = NULL;
+static size_t s_receiverMapSize = 0;
+static int s_receiverMemFd = -1;
+static int s_eventFd = -1;
+static int s_listenFd = -1;
+static size_t s_pendingRecordSize = 0;
+static unsigned long s_numReceived = 0;
+
+// Sending end, used by the sender thread.
+static RingHeader* s_pProducerRing = NULL;
+static size_t s_producerMapSize = 0;
+static int s_producerEventFd = -1;
+static unsigned long s_numSent = 0;
+
+static size_t getRecordSize(size_t length)
+{
+    return (sizeof(RecordHeader) + length + 7) & ~(size_t) 7;
+}
+
+static char* getRingData(RingHeader* pRing)
+{
+    return (char*) pRing + RING_DATA_OFFSET;
+}
+
+static socklen_t makeSocketAddress(in_port_t port, struct sockaddr_un* pAddress)
+{
+    memset(pAddress, 0, sizeof(*pAddress));
+    pAddress->sun_family = AF_UNIX;
+    // Abstract socket: the leading \0 keeps it out of the filesystem.
+    int nameLength = snprintf(pAddress->sun_path + 1, sizeof(pAddress->sun_path) - 1,
+                              "two-talk-%u", (unsigned int) port);
+    return (socklen_t) (offsetof(struct sockaddr_un, sun_path) + 1 + nameLength);
+}
+
+static bool isProcessAlive(int32_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+bool ShmTransport_initReceiver(in_port_t ourPort)
+{
+    size_t capacity = 1;
+    while (capacity < Options_get()->shmRingBytes) {
+        capacity <<= 1;
+    }
+    s_receiverMapSize = RING_DATA_OFFSET + capacity;
+
+    errno = 0;
+    s_receiverMemFd = memfd_create("two-talk-ring", MFD_CLOEXEC);
+    if (s_receiverMemFd == -1 || ftruncate(s_receiverMemFd, (off_t) s_receiverMapSize) == -1) {
+        printf("Shared memory transport disabled: failed to create ring: %s\n", strerror(errno));
+        ShmTransport_destroy();
+        return false;
+    }
+    void* pMapping = mmap(NULL, s_receiverMapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          s_receiverMemFd, 0);
+    if (pMapping == MAP_FAILED) {
+        printf("Shared memory transport disabled: failed to map ring: %s\n", strerror(errno));
+        ShmTransport_destroy();
+        return false;
+    }
+    s_pReceiverRing = pMapping;
+    s_pReceiverRing->magic = RING_MAGIC;
+    s_pReceiverRing->version = RING_VERSION;
+    s_pReceiverRing->capacity = capacity;
+    s_pReceiverRing->consumerPid = (int32_t) getpid();
+
+    s_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    s_listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address;
+    socklen_t addressLength = makeSocketAddress(ourPort, &address);
+    if (s_eventFd == -1 || s_listenFd == -1
+        || bind(s_listenFd, (struct sockaddr*) &address, addressLength) == -1
+        || listen(s_listenFd, 4) == -1) {
+        printf("Shared memory transport disabled: failed to offer ring: %s\n", strerror(errno));
+        ShmTransport_destroy();
+        return false;
+    }
+    return true;
+}
+
+int ShmTransport_getListenFd()
+{
+    return s_listenFd;
+}
+
+int ShmTransport_getEventFd()
+{
+    return s_eventFd;
+}
+
+void ShmTransport_acceptProducer()
+{
+    int connectionFd = accept(s_listenFd, NULL, NULL);
+    if (connectionFd == -1) {
+        return;
+    }
+
+    // Let a new producer take over from one that died without detaching.
+    int32_t producerPid = atomic_load(&s_pReceiverRing->producerPid);
+    if (producerPid != 0 && !isProcessAlive(producerPid)) {
+        atomic_compare_exchange_strong(&s_pReceiverRing->producerPid, &producerPid, 0);
+    }
+
+    uint64_t mapSize = s_receiverMapSize;
+    struct iovec ioVector = {
+        .iov_base = &mapSize,
+        .iov_len = sizeof(mapSize)
+    };
+    int fds[2] = {s_receiverMemFd, s_eventFd};
+    char controlBuffer[CMSG_SPACE(sizeof(fds))];
+    memset(controlBuffer, 0, sizeof(controlBuffer));
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &ioVector;
+    header.msg_iovlen = 1;
+    header.msg_control = controlBuffer;
+    header.msg_controllen = sizeof(controlBuffer);
+    struct cmsghdr* pControl = CMSG_FIRSTHDR(&header);
+    pControl->cmsg_level = SOL_SOCKET;
+    pControl->cmsg_type = SCM_RIGHTS;
+    pControl->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(pControl), fds, sizeof(fds));
+
+    sendmsg(connectionFd, &header, MSG_NOSIGNAL);
+    close(connectionFd);
+}
+
+bool ShmTransport_peekRecord(const char** ppText, size_t* pLength, bool* pIsShutdownMessage)
+{
+    if (s_pReceiverRing == NULL) {
+        return false;
+    }
+    char* pData = getRingData(s_pReceiverRing);
+    uint64_t capacity = s_pReceiverRing->capacity;
+    while (1) {
+        // Only this thread moves the head.
+        uint64_t head = atomic_load_explicit(&s_pReceiverRing->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&s_pReceiverRing->tail, memory_order_acquire);
+        if (head == tail) {
+            return false;
+        }
+        const RecordHeader* pRecord = (const RecordHeader*) (pData + head % capacity);
+        if (pRecord->length > capacity - head % capacity - sizeof(RecordHeader)) {
+            // The producer is another process, so don't trust it to stay in bounds.
+            // Everything written so far is discarded.
+            atomic_store_explicit(&s_pReceiverRing->head, tail, memory_order_release);
+            return false;
+        }
+        if (pRecord->flags & RECORD_FLAG_PADDING) {
+            atomic_store_explicit(&s_pReceiverRing->head,
+                                  head + sizeof(RecordHeader) + pRecord->length,
+                                  memory_order_release);
+            continue;
+        }
+        *ppText = (const char*) (pRecord + 1);
+        *pLength = pRecord->length;
+        *pIsShutdownMessage = (pRecord->flags & RECORD_FLAG_SHUTDOWN) != 0;
+        s_pendingRecordSize = getRecordSize(pRecord->length);
+        return true;
+    }
+}
+
+void ShmTransport_releaseRecord()
+{
+    uint64_t head = atomic_load_explicit(&s_pReceiverRing->head, memory_order_relaxed);
+    // Release so that the producer doesn't overwrite the record before we're done with it.
+    atomic_store_explicit(&s_pReceiverRing->head, head + s_pendingRecordSize,
+                          memory_order_release);
+    s_pendingRecordSize = 0;
+    s_numReceived++;
+}
+
+bool ShmTransport_prepareToSleep()
+{
+    if (s_pReceiverRing == NULL) {
+        return true;
+    }
+    // Sequentially consistent on both sides: either the producer sees the flag and
+    // writes the eventfd, or we see its new tail here and don't sleep.
+    atomic_store(&s_pReceiverRing->isConsumerWaiting, 1);
+    if (atomic_load(&s_pReceiverRing->tail) != atomic_load(&s_pReceiverRing->head)) {
+        atomic_store(&s_pReceiverRing->isConsumerWaiting, 0);
+        return false;
+    }
+    return true;
+}
+
+void ShmTransport_clearWakeup()
+{
+    if (s_pReceiverRing == NULL) {
+        return;
+    }
+    atomic_store(&s_pReceiverRing->isConsumerWaiting, 0);
+    uint64_t count;
+    while (read(s_eventFd, &count, sizeof(count)) > 0) {
+    }
+}
+
+bool ShmTransport_isPeerLocal(in_addr_t addr)
+{
+    if ((addr >> 24) == 127) {
+        return true;
+    }
+    struct ifaddrs* pInterfaces;
+    if (getifaddrs(&pInterfaces) == -1) {
+        return false;
+    }
+    bool isLocal = false;
+    struct ifaddrs* pInterface;
+    for (pInterface = pInterfaces; pInterface != NULL; pInterface = pInterface->ifa_next) {
+        if (pInterface->ifa_addr != NULL && pInterface->ifa_addr->sa_family == AF_INET) {
+            struct sockaddr_in* pAddress = (struct sockaddr_in*) pInterface->ifa_addr;
+            if (ntohl(pAddress->sin_addr.s_addr) == addr) {
+                isLocal = true;
+                break;
+            }
+        }
+    }
+    freeifaddrs(pInterfaces);
+    return isLocal;
+}
+
+/*
+ * Receives the ring's memfd and eventfd from the peer. Returns false on failure.
+ */
+static bool receiveRingFds(int connectionFd, int* pMemFd, int* pEventFd, uint64_t* pMapSize)
+{
+    int fds[2];
+    struct iovec ioVector = {
+        .iov_base = pMapSize,
+        .iov_len = sizeof(*pMapSize)
+    };
+    char controlBuffer[CMSG_SPACE(sizeof(fds))];
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &ioVector;
+    header.msg_iovlen = 1;
+    header.msg_control = controlBuffer;
+    header.msg_controllen = sizeof(controlBuffer);
+
+    if (recvmsg(connectionFd, &header, MSG_CMSG_CLOEXEC) != sizeof(*pMapSize)) {
+        return false;
+    }
+    struct cmsghdr* pControl = CMSG_FIRSTHDR(&header);
+    if (pControl == NULL || pControl->cmsg_type != SCM_RIGHTS
+        || pControl->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(pControl), sizeof(fds));
+    *pMemFd = fds[0];
+    *pEventFd = fds[1];
+    return true;
+}
+
+bool ShmTransport_attachProducer(in_port_t remotePort)
+{
+    int connectionFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (connectionFd == -1) {
+        return false;
+    }
+    struct timeval timeout = {
+        .tv_sec = ATTACH_TIMEOUT_SEC
+    };
+    setsockopt(connectionFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_un address;
+    socklen_t addressLength = makeSocketAddress(remotePort, &address);
+    int memFd = -1;
+    int eventFd = -1;
+    uint64_t mapSize = 0;
+    bool isReceived = connect(connectionFd, (struct sockaddr*) &address, addressLength) == 0
+                      && receiveRingFds(connectionFd, &memFd, &eventFd, &mapSize);
+    close(connectionFd);
+    if (!isReceived) {
+        return false;
+    }
+
+    void* pMapping = mapSize > RING_DATA_OFFSET
+                     ? mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0)
+                     : MAP_FAILED;
+    close(memFd);
+    if (pMapping == MAP_FAILED) {
+        close(eventFd);
+        return false;
+    }
+    RingHeader* pRing = pMapping;
+    int32_t noProducer = 0;
+    if (pRing->magic != RING_MAGIC || pRing->version != RING_VERSION
+        || pRing->capacity + RING_DATA_OFFSET != mapSize
+        || !atomic_compare_exchange_strong(&pRing->producerPid, &noProducer,
+                                           (int32_t) getpid())) {
+        munmap(pMapping, mapSize);
+        close(eventFd);
+        return false;
+    }
+
+    s_pProducerRing = pRing;
+    s_producerMapSize = mapSize;
+    s_producerEventFd = eventFd;
+    return true;
+}
+
+bool ShmTransport_isProducerAttached()
+{
+    return s_pProducerRing != NULL;
+}
+
+/*
+ * Waits until `needed` bytes are free in the ring. Returns false if the consumer
+ * died while we were waiting.
+ */
+static bool waitForRingSpace(uint64_t tail, size_t needed)
+{
+    uint64_t capacity = s_pProducerRing->capacity;
+    uint64_t nextLivenessCheckNs = 0;
+    while (capacity - (tail - atomic_load_explicit(&s_pProducerRing->head,
+                                                   memory_order_acquire)) < needed) {
+        uint64_t nowNs = getMonotonicTimeNs();
+        if (nextLivenessCheckNs == 0) {
+            nextLivenessCheckNs = nowNs + FULL_RING_LIVENESS_CHECK_NS;
+        } else if (nowNs >= nextLivenessCheckNs) {
+            if (!isProcessAlive(s_pProducerRing->consumerPid)) {
+                return false;
+            }
+            nextLivenessCheckNs = nowNs + FULL_RING_LIVENESS_CHECK_NS;
+        }
+        // Make sure the consumer is awake to drain the ring.
+        uint64_t wakeup = 1;
+        if (write(s_producerEventFd, &wakeup, sizeof(wakeup)) == -1) {
+            return false;
+        }
+        struct timespec pollInterval = {
+            .tv_nsec = FULL_RING_POLL_NS
+        };
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        nanosleep(&pollInterval, NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    }
+    return true;
+}
+
+bool ShmTransport_write(const char* pText, size_t length, bool isShutdownMessage)
+{
+    if (s_pProducerRing == NULL) {
+        return false;
+    }
+    char* pData = getRingData(s_pProducerRing);
+    uint64_t capacity = s_pProducerRing->capacity;
+    size_t recordSize = getRecordSize(length);
+
+    uint64_t tail = atomic_load_explicit(&s_pProducerRing->tail, memory_order_relaxed);
+    size_t contiguous = (size_t) (capacity - tail % capacity);
+    bool isWrapping = recordSize > contiguous;
+    if (!waitForRingSpace(tail, isWrapping ? contiguous + recordSize : recordSize)) {
+        ShmTransport_detachProducer();
+        return false;
+    }
+
+    if (isWrapping) {
+        RecordHeader* pPadding = (RecordHeader*) (pData + tail % capacity);
+        pPadding->length = (uint32_t) (contiguous - sizeof(RecordHeader));
+        pPadding->flags = RECORD_FLAG_PADDING;
+        tail += contiguous;
+    }
+    RecordHeader* pRecord = (RecordHeader*) (pData + tail % capacity);
+    pRecord->length = (uint32_t) length;
+    pRecord->flags = isShutdownMessage ? RECORD_FLAG_SHUTDOWN : 0;
+    memcpy(pRecord + 1, pText, length);
+
+    // Publishes the record. See ShmTransport_prepareToSleep for why this is
+    // sequentially consistent.
+    atomic_store(&s_pProducerRing->tail, tail + recordSize);
+    if (atomic_load(&s_pProducerRing->isConsumerWaiting)) {
+        uint64_t wakeup = 1;
+        write(s_producerEventFd, &wakeup, sizeof(wakeup));
+    }
+    s_numSent++;
+    return true;
+}
+
+void ShmTransport_detachProducer()
+{
+    if (s_pProducerRing == NULL) {
+        return;
+    }
+    int32_t ourPid = (int32_t) getpid();
+    atomic_compare_exchange_strong(&s_pProducerRing->producerPid, &ourPid, 0);
+    munmap(s_pProducerRing, s_producerMapSize);
+    close(s_producerEventFd);
+    s_pProducerRing = NULL;
+    s_producerEventFd = -1;
+}
+
+void ShmTransport_printStats()
+{
+    if (s_numSent > 0 || s_numReceived > 0) {
+        printf("Shared memory transport: %lu messages sent, %lu received\n",
+               s_numSent, s_numReceived);
+    }
+}
+
+void ShmTransport_destroy()
+{
+    ShmTransport_detachProducer();
+    if (s_listenFd != -1) {
+        close(s_listenFd);
+        s_listenFd = -1;
+    }
+    if (s_eventFd != -1) {
+        close(s_eventFd);
+        s_eventFd = -1;
+    }
+    if (s_pReceiverRing != NULL) {
+        munmap(s_pReceiverRing, s_receiverMapSize);
+        s_pReceiverRing = NULL;
+    }
+    if (s_receiverMemFd != -1) {
+        close(s_receiverMemFd);
+        s_receiverMemFd = -1;
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef _SHM_TRANSPORT_H
+#define _SHM_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netdb.h>
+
+/*
+ * Transport for peers on the same host.
+ *
+ * Each listener offers a single-producer/single-consumer ring in a memfd. The ring
+ * and an eventfd used for wakeups are handed out over an abstract Unix socket named
+ * after the listener's UDP port. A sender whose peer is local attaches to the peer's
+ * ring and writes each message straight into it, so that the peer's listener can
+ * read it in place. The eventfd is only written when the listener is about to sleep,
+ * so there are no syscalls on the data path while messages keep coming.
+ */
+
+/*
+ * Creates the ring and starts offering it. Returns false (after printing why)
+ * if it can't, in which case only UDP is used.
+ */
+bool ShmTransport_initReceiver(in_port_t ourPort);
+
+/*
+ * The Unix socket to poll for producers wanting to attach, and the eventfd to
+ * poll for wakeups. -1 if the receiver isn't initialized.
+ */
+int ShmTransport_getListenFd();
+int ShmTransport_getEventFd();
+
+/*
+ * Hands the ring to a producer waiting on the listen socket.
+ */
+void ShmTransport_acceptProducer();
+
+/*
+ * Points *ppText at the oldest message in the ring without copying it.
+ * Returns false if the ring is empty. The message stays valid until
+ * ShmTransport_releaseRecord is called.
+ */
+bool ShmTransport_peekRecord(const char** ppText, size_t* pLength, bool* pIsShutdownMessage);
+
+void ShmTransport_releaseRecord();
+
+/*
+ * Tells producers to write the eventfd for the next message.
+ * Returns false if the ring isn't empty, in which case the caller shouldn't sleep.
+ */
+bool ShmTransport_prepareToSleep();
+
+/*
+ * Called after waking up to stop producers from writing the eventfd.
+ */
+void ShmTransport_clearWakeup();
+
+/*
+ * Returns true if addr (in host byte order) is a loopback address or one of
+ * this host's interface addresses.
+ */
+bool ShmTransport_isPeerLocal(in_addr_t addr);
+
+/*
+ * Tries to attach to the ring of the local peer listening on remotePort.
+ * Returns false if the peer doesn't offer one, or another producer already has it.
+ */
+bool ShmTransport_attachProducer(in_port_t remotePort);
+
+bool ShmTransport_isProducerAttached();
+
+/*
+ * Copies the message into the peer's ring, waiting for room if it is full.
+ * The calling thread can be cancelled while it waits, so it should have a cleanup
+ * handler for anything it owns.
+ * Returns false if the peer has gone away, after detaching from its ring.
+ */
+bool ShmTransport_write(const char* pText, size_t length, bool isShutdownMessage);
+
+void ShmTransport_detachProducer();
+
+void ShmTransport_printStats();
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void ShmTransport_destroy();
+
+#endif // _SHM_TRANSPORT_H
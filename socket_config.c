@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <asm/socket.h>
+#include <linux/net_tstamp.h>
+
+#include "socket_config.h"
+#include "options.h"
+
+static bool s_isGsoAvailable = false;
+
+static void setIntOptionOrWarn(int socketFd, int level, int optionName, int value,
+                               const char* pDescription)
+{
+    errno = 0;
+    if (setsockopt(socketFd, level, optionName, &value, sizeof(value)) == -1) {
+        printf("Warning: failed to set %s to %d: %s\n", pDescription, value, strerror(errno));
+    }
+}
+
+/*
+ * The *FORCE variants can go past net.core.{r,w}mem_max but need CAP_NET_ADMIN,
+ * so fall back to the capped option without it.
+ */
+static void setBufferSize(int socketFd, int forceOptionName, int optionName, int bytes,
+                          const char* pDescription)
+{
+    if (setsockopt(socketFd, SOL_SOCKET, forceOptionName, &bytes, sizeof(bytes)) == 0) {
+        return;
+    }
+    setIntOptionOrWarn(socketFd, SOL_SOCKET, optionName, bytes, pDescription);
+}
+
+void SocketConfig_apply(int socketFd)
+{
+    const SocketTuning* pTuning = &Options_get()->socketTuning;
+
+    if (pTuning->receiveBufferBytes > 0) {
+        setBufferSize(socketFd, SO_RCVBUFFORCE, SO_RCVBUF, pTuning->receiveBufferBytes,
+                      "SO_RCVBUF");
+    }
+    if (pTuning->sendBufferBytes > 0) {
+        setBufferSize(socketFd, SO_SNDBUFFORCE, SO_SNDBUF, pTuning->sendBufferBytes,
+                      "SO_SNDBUF");
+    }
+    if (pTuning->busyPollUsec > 0) {
+        setIntOptionOrWarn(socketFd, SOL_SOCKET, SO_BUSY_POLL, pTuning->busyPollUsec,
+                           "SO_BUSY_POLL");
+    }
+    if (pTuning->isTimestampingEnabled) {
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        setIntOptionOrWarn(socketFd, SOL_SOCKET, SO_TIMESTAMPING, flags, "SO_TIMESTAMPING");
+    }
+    if (pTuning->typeOfService >= 0) {
+        setIntOptionOrWarn(socketFd, IPPROTO_IP, IP_TOS, pTuning->typeOfService, "IP_TOS");
+    }
+
+    if (pTuning->gsoSegmentBytes > 0) {
+        // The segment size is passed with each send, so this only checks that the
+        // kernel knows about UDP_SEGMENT (Linux 4.18 and later).
+        int segmentBytes = 0;
+        socklen_t length = sizeof(segmentBytes);
+        s_isGsoAvailable = getsockopt(socketFd, IPPROTO_UDP, UDP_SEGMENT, &segmentBytes,
+                                      &length) == 0;
+        if (!s_isGsoAvailable) {
+            printf("Warning: UDP_SEGMENT isn't supported: %s\n", strerror(errno));
+        }
+    }
+    if (pTuning->isGroEnabled) {
+        setIntOptionOrWarn(socketFd, IPPROTO_UDP, UDP_GRO, 1, "UDP_GRO");
+    }
+
+    // Always ask for the count of datagrams dropped because the receive buffer was
+    // full. It costs nothing unless there are drops.
+    setIntOptionOrWarn(socketFd, SOL_SOCKET, SO_RXQ_OVFL, 1, "SO_RXQ_OVFL");
+}
+
+bool SocketConfig_isGsoAvailable()
+{
+    return s_isGsoAvailable;
+}
+
+static int getIntOption(int socketFd, int level, int optionName)
+{
+    int value = -1;
+    socklen_t length = sizeof(value);
+    if (getsockopt(socketFd, level, optionName, &value, &length) == -1) {
+        return -1;
+    }
+    return value;
+}
+
+void SocketConfig_printEffective(int socketFd)
+{
+    const SocketTuning* pTuning = &Options_get()->socketTuning;
+
+    printf("Socket: SO_RCVBUF %d, SO_SNDBUF %d, SO_BUSY_POLL %d us, IP_TOS 0x%02x",
+           getIntOption(socketFd, SOL_SOCKET, SO_RCVBUF),
+           getIntOption(socketFd, SOL_SOCKET, SO_SNDBUF),
+           getIntOption(socketFd, SOL_SOCKET, SO_BUSY_POLL),
+           getIntOption(socketFd, IPPROTO_IP, IP_TOS));
+    if (pTuning->isTimestampingEnabled) {
+        printf(", timestamping %s",
+               getIntOption(socketFd, SOL_SOCKET, SO_TIMESTAMPING) > 0 ? "on" : "off");
+    }
+    if (pTuning->gsoSegmentBytes > 0) {
+        if (s_isGsoAvailable) {
+            printf(", GSO %d byte segments", pTuning->gsoSegmentBytes);
+        } else {
+            printf(", GSO off");
+        }
+    }
+    if (pTuning->isGroEnabled) {
+        printf(", GRO %s", getIntOption(socketFd, IPPROTO_UDP, UDP_GRO) > 0 ? "on" : "off");
+    }
+    if (pTuning->spinUsec > 0) {
+        printf(", spin %ld us", pTuning->spinUsec);
+    }
+    printf("\n");
+}
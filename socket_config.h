@@ -0,0 +1,44 @@
+#ifndef _SOCKET_CONFIG_H
+#define _SOCKET_CONFIG_H
+
+#include <stdbool.h>
+
+typedef struct SocketTuning_s SocketTuning;
+struct SocketTuning_s {
+    // 0 keeps the kernel default for the buffer sizes.
+    int receiveBufferBytes;
+    int sendBufferBytes;
+    // 0 disables busy polling.
+    int busyPollUsec;
+    // Ask the kernel for software receive timestamps.
+    bool isTimestampingEnabled;
+    // The IP_TOS byte. -1 keeps the kernel default.
+    int typeOfService;
+    // How long the listener spins on a non-blocking receive before blocking.
+    // 0 always blocks.
+    long spinUsec;
+    // Size of the datagrams that messages longer than one datagram are split into
+    // with UDP_SEGMENT. 0 disables it.
+    int gsoSegmentBytes;
+    // Let the kernel coalesce datagrams with UDP_GRO.
+    bool isGroEnabled;
+};
+
+/*
+ * Applies the socket tuning from the command line to a freshly bound socket.
+ * All of the options are optional, so refused options only print a warning.
+ */
+void SocketConfig_apply(int socketFd);
+
+/*
+ * Returns true if the kernel accepted UDP_SEGMENT on the socket and --gso asked for it.
+ */
+bool SocketConfig_isGsoAvailable();
+
+/*
+ * Prints the values the kernel actually uses for the socket, which can differ
+ * from the requested ones (e.g. buffer sizes are doubled and capped).
+ */
+void SocketConfig_printEffective(int socketFd);
+
+#endif // _SOCKET_CONFIG_H
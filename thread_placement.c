@@ -0,0 +1,168 @@
+// For CPU_SET and pthread_attr_setaffinity_np.
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "thread_placement.h"
+#include "options.h"
+
+static const char* s_roleNames[NUM_THREAD_ROLES] = {
+    "keyboard reader",
+    "screen printer",
+    "sender",
+    "listener"
+};
+
+/*
+ * The thread on the other end of the role's queue.
+ */
+static ThreadRole getQueuePartner(ThreadRole role)
+{
+    switch (role) {
+        case THREAD_KEYBOARD_READER:
+            return THREAD_SENDER;
+        case THREAD_SENDER:
+            return THREAD_KEYBOARD_READER;
+        case THREAD_SCREEN_PRINTER:
+            return THREAD_LISTENER;
+        case THREAD_LISTENER:
+        default:
+            return THREAD_SCREEN_PRINTER;
+    }
+}
+
+/*
+ * Returns a hyperthread sibling of cpu from sysfs, or cpu itself if it has none.
+ */
+static int getSiblingCpu(int cpu)
+{
+    char path[128];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    FILE* pFile = fopen(path, "r");
+    if (pFile == NULL) {
+        return cpu;
+    }
+    // The list looks like "0,4" or "0-1".
+    int sibling = cpu;
+    int first;
+    char separator;
+    int second;
+    int numParsed = fscanf(pFile, "%d%c%d", &first, &separator, &second);
+    if (numParsed == 3 && (separator == ',' || separator == '-')) {
+        if (first != cpu) {
+            sibling = first;
+        } else if (separator == '-') {
+            sibling = first + 1;
+        } else {
+            sibling = second;
+        }
+    }
+    fclose(pFile);
+    return sibling;
+}
+
+/*
+ * Returns the CPU the role's thread should be pinned to, or -1 for none.
+ */
+static int getCpuForRole(ThreadRole role)
+{
+    const ThreadPlacementOptions* pPlacement = &Options_get()->threadPlacement;
+    if (pPlacement->cpuForRole[role] >= 0) {
+        return pPlacement->cpuForRole[role];
+    }
+    int partnerCpu = pPlacement->cpuForRole[getQueuePartner(role)];
+    if (pPlacement->isColocatingPairs && partnerCpu >= 0) {
+        // Siblings share the L1 and L2 caches, so the message the producer just
+        // wrote is still in cache when the consumer reads it.
+        return getSiblingCpu(partnerCpu);
+    }
+    return -1;
+}
+
+static bool isRealTimeRole(ThreadRole role)
+{
+    return role == THREAD_SENDER || role == THREAD_LISTENER;
+}
+
+static void initAttr(ThreadRole role, pthread_attr_t* pAttr, bool isRealTimeAllowed)
+{
+    const ThreadPlacementOptions* pPlacement = &Options_get()->threadPlacement;
+    pthread_attr_init(pAttr);
+
+    // Each worker keeps a MSG_MAX_LEN buffer on its stack, so it needs far less
+    // than the default 8 MB but more than the minimum.
+    if (pPlacement->stackSizeBytes > 0) {
+        pthread_attr_setstacksize(pAttr, pPlacement->stackSizeBytes);
+    }
+
+    int cpu = getCpuForRole(role);
+    if (cpu >= 0) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        pthread_attr_setaffinity_np(pAttr, sizeof(cpuSet), &cpuSet);
+    }
+
+    if (isRealTimeAllowed && pPlacement->fifoPriority > 0 && isRealTimeRole(role)) {
+        struct sched_param schedParam;
+        memset(&schedParam, 0, sizeof(schedParam));
+        schedParam.sched_priority = pPlacement->fifoPriority;
+        pthread_attr_setinheritsched(pAttr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(pAttr, SCHED_FIFO);
+        pthread_attr_setschedparam(pAttr, &schedParam);
+    }
+}
+
+int ThreadPlacement_createThread(ThreadRole role, pthread_t* pThreadPid,
+                                 void* (*pStartRoutine)(void*))
+{
+    pthread_attr_t attr;
+    initAttr(role, &attr, true);
+    int status = pthread_create(pThreadPid, &attr, pStartRoutine, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (status == EPERM) {
+        printf("Warning: not permitted to use SCHED_FIFO for the %s thread, "
+               "using the default policy\n", s_roleNames[role]);
+        initAttr(role, &attr, false);
+        status = pthread_create(pThreadPid, &attr, pStartRoutine, NULL);
+        pthread_attr_destroy(&attr);
+    }
+    if (status == EINVAL && getCpuForRole(role) >= 0) {
+        printf("Warning: can't pin the %s thread to CPU %d\n", s_roleNames[role],
+               getCpuForRole(role));
+    }
+    return status;
+}
+
+void ThreadPlacement_printPlan()
+{
+    const ThreadPlacementOptions* pPlacement = &Options_get()->threadPlacement;
+    bool isAnyPinned = false;
+    int role;
+    for (role = 0; role < NUM_THREAD_ROLES; role++) {
+        isAnyPinned = isAnyPinned || getCpuForRole(role) >= 0;
+    }
+    if (!isAnyPinned && pPlacement->fifoPriority == 0) {
+        return;
+    }
+
+    printf("Threads:");
+    for (role = 0; role < NUM_THREAD_ROLES; role++) {
+        int cpu = getCpuForRole(role);
+        printf(" %s", s_roleNames[role]);
+        if (cpu >= 0) {
+            printf(" on CPU %d", cpu);
+        } else {
+            printf(" unpinned");
+        }
+        if (pPlacement->fifoPriority > 0 && isRealTimeRole(role)) {
+            printf(" (SCHED_FIFO %d)", pPlacement->fifoPriority);
+        }
+        printf(role + 1 < NUM_THREAD_ROLES ? "," : "\n");
+    }
+}
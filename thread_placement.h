@@ -0,0 +1,41 @@
+#ifndef _THREAD_PLACEMENT_H
+#define _THREAD_PLACEMENT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef enum {
+    THREAD_KEYBOARD_READER,
+    THREAD_SCREEN_PRINTER,
+    THREAD_SENDER,
+    THREAD_LISTENER,
+    NUM_THREAD_ROLES
+} ThreadRole;
+
+typedef struct ThreadPlacementOptions_s ThreadPlacementOptions;
+struct ThreadPlacementOptions_s {
+    // CPU to pin each thread to, or -1 to let the scheduler choose.
+    int cpuForRole[NUM_THREAD_ROLES];
+    // Put each producer on the sibling hyperthread of its consumer (reader with
+    // sender, listener with printer) when only one of the pair is pinned.
+    bool isColocatingPairs;
+    // SCHED_FIFO priority for the sender and listener, or 0 for the default policy.
+    int fifoPriority;
+    size_t stackSizeBytes;
+};
+
+/*
+ * Creates a worker thread with the stack size, CPU affinity and scheduling
+ * policy chosen for its role. If the real-time policy isn't permitted, the thread
+ * is created with the default policy instead.
+ * Returns 0 on success or an error number like pthread_create.
+ */
+int ThreadPlacement_createThread(ThreadRole role, pthread_t* pThreadPid,
+                                 void* (*pStartRoutine)(void*));
+
+/*
+ * Prints where each thread will be placed, if anything was configured.
+ */
+void ThreadPlacement_printPlan();
+
+#endif // _THREAD_PLACEMENT_H
@@ -0,0 +1,323 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "common.h"
+#include "timer_wheel.h"
+
+#define SLOTS_PER_LEVEL 64
+#define SLOT_BITS 6
+#define SLOT_MASK (SLOTS_PER_LEVEL - 1)
+
+static pthread_t s_threadPid;
+static bool s_isRunning = false;
+static int s_timerFd = -1;
+
+// Protects everything below, including the fields of every pending timer.
+static pthread_mutex_t s_syncWheelMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t s_startNs;
+// All timers due at or before this tick have been run.
+static uint64_t s_currentTick = 0;
+static Timer* s_pSlots[TIMER_WHEEL_LEVELS][SLOTS_PER_LEVEL];
+// Bit n is set when slot n of the level has a timer in it.
+static uint64_t s_occupiedSlots[TIMER_WHEEL_LEVELS];
+// The tick the timerfd is armed for, or UINT64_MAX when it is disarmed.
+static uint64_t s_armedTick = UINT64_MAX;
+
+static unsigned long s_numFired = 0;
+static unsigned long s_numCascaded = 0;
+static uint64_t s_maxLateNs = 0;
+
+static uint64_t getCurrentTick()
+{
+    return (getMonotonicTimeNs() - s_startNs) / TIMER_TICK_NS;
+}
+
+static uint64_t rotateRight(uint64_t bits, unsigned int count)
+{
+    count &= SLOT_MASK;
+    return count == 0 ? bits : (bits >> count) | (bits << (SLOTS_PER_LEVEL - count));
+}
+
+/*
+ * Must hold s_syncWheelMutex. Puts the timer in the lowest level whose slot for the
+ * expiry comes up before the level above wraps around. Timers too far out for the
+ * top level go in the top level's last slot of this rotation and are placed again
+ * when it comes up.
+ */
+static void placeTimer(Timer* pTimer)
+{
+    int level;
+    int slot = 0;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned int shift = SLOT_BITS * (level + 1);
+        if (pTimer->expiryTick >> shift == s_currentTick >> shift) {
+            slot = (int) ((pTimer->expiryTick >> (SLOT_BITS * level)) & SLOT_MASK);
+            break;
+        }
+    }
+    if (level == TIMER_WHEEL_LEVELS) {
+        level = TIMER_WHEEL_LEVELS - 1;
+        slot = (int) (((s_currentTick >> (SLOT_BITS * level)) + SLOT_MASK) & SLOT_MASK);
+    }
+
+    pTimer->level = level;
+    pTimer->slot = slot;
+    pTimer->pPrev = NULL;
+    pTimer->pNext = s_pSlots[level][slot];
+    if (pTimer->pNext != NULL) {
+        pTimer->pNext->pPrev = pTimer;
+    }
+    s_pSlots[level][slot] = pTimer;
+    s_occupiedSlots[level] |= 1ULL << slot;
+    pTimer->isPending = true;
+}
+
+/*
+ * Must hold s_syncWheelMutex.
+ */
+static void unlinkTimer(Timer* pTimer)
+{
+    if (pTimer->pPrev != NULL) {
+        pTimer->pPrev->pNext = pTimer->pNext;
+    } else {
+        s_pSlots[pTimer->level][pTimer->slot] = pTimer->pNext;
+        if (pTimer->pNext == NULL) {
+            s_occupiedSlots[pTimer->level] &= ~(1ULL << pTimer->slot);
+        }
+    }
+    if (pTimer->pNext != NULL) {
+        pTimer->pNext->pPrev = pTimer->pPrev;
+    }
+    pTimer->pNext = NULL;
+    pTimer->pPrev = NULL;
+    pTimer->isPending = false;
+}
+
+/*
+ * Must hold s_syncWheelMutex. Finds the first tick after s_currentTick at which
+ * an occupied slot comes up: level 0 slots come up every tick, and a slot of a
+ * higher level comes up when the level below wraps around into it.
+ * Returns false if there are no timers.
+ */
+static bool findNextEventTick(uint64_t* pTick)
+{
+    bool isFound = false;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (s_occupiedSlots[level] == 0) {
+            continue;
+        }
+        unsigned int shift = SLOT_BITS * level;
+        uint64_t nextIndex = (s_currentTick >> shift) + 1;
+        uint64_t rotated = rotateRight(s_occupiedSlots[level], (unsigned int) nextIndex);
+        uint64_t tick = (nextIndex + (uint64_t) __builtin_ctzll(rotated)) << shift;
+        if (!isFound || tick < *pTick) {
+            *pTick = tick;
+            isFound = true;
+        }
+    }
+    return isFound;
+}
+
+/*
+ * Must hold s_syncWheelMutex.
+ */
+static void armTimerFd(uint64_t tick)
+{
+    if (tick == s_armedTick) {
+        return;
+    }
+    s_armedTick = tick;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (tick != UINT64_MAX) {
+        uint64_t deadlineNs = s_startNs + tick * TIMER_TICK_NS;
+        spec.it_value.tv_sec = (time_t) (deadlineNs / 1000000000ULL);
+        spec.it_value.tv_nsec = (long) (deadlineNs % 1000000000ULL);
+    }
+    if (timerfd_settime(s_timerFd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        printf("Failed to arm timer: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * Must hold s_syncWheelMutex. Moves the timers of the slot that comes up at
+ * s_currentTick down to the levels below.
+ */
+static void cascadeSlot(int level)
+{
+    int slot = (int) ((s_currentTick >> (SLOT_BITS * level)) & SLOT_MASK);
+    Timer* pTimer = s_pSlots[level][slot];
+    s_pSlots[level][slot] = NULL;
+    s_occupiedSlots[level] &= ~(1ULL << slot);
+    while (pTimer != NULL) {
+        Timer* pNext = pTimer->pNext;
+        placeTimer(pTimer);
+        s_numCascaded++;
+        pTimer = pNext;
+    }
+}
+
+/*
+ * Must hold s_syncWheelMutex. Runs every timer due at s_currentTick, releasing the
+ * mutex around each callback so that it can schedule timers, including itself.
+ */
+static void runDueTimers()
+{
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+        uint64_t mask = (1ULL << (SLOT_BITS * level)) - 1;
+        if ((s_currentTick & mask) == 0) {
+            cascadeSlot(level);
+        }
+    }
+
+    int slot = (int) (s_currentTick & SLOT_MASK);
+    uint64_t dueNs = s_startNs + s_currentTick * TIMER_TICK_NS;
+    while (s_pSlots[0][slot] != NULL) {
+        Timer* pTimer = s_pSlots[0][slot];
+        unlinkTimer(pTimer);
+        TimerFn callback = pTimer->callback;
+        void* pArg = pTimer->pArg;
+        s_numFired++;
+        uint64_t nowNs = getMonotonicTimeNs();
+        if (nowNs > dueNs && nowNs - dueNs > s_maxLateNs) {
+            s_maxLateNs = nowNs - dueNs;
+        }
+
+        pthread_mutex_unlock(&s_syncWheelMutex);
+        callback(pArg);
+        pthread_mutex_lock(&s_syncWheelMutex);
+    }
+}
+
+static void* TimerWheel_run(void* stub)
+{
+    // Only the wait for the timerfd is a place where the thread can be cancelled,
+    // so it is never cancelled holding the mutex or in the middle of a callback.
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (1) {
+        pthread_mutex_lock(&s_syncWheelMutex);
+        {
+            uint64_t nowTick = getCurrentTick();
+            uint64_t nextTick;
+            // Jump straight from one occupied slot to the next instead of ticking
+            // through the empty ones in between.
+            while (findNextEventTick(&nextTick) && nextTick <= nowTick) {
+                s_currentTick = nextTick;
+                runDueTimers();
+            }
+            if (nowTick > s_currentTick) {
+                s_currentTick = nowTick;
+            }
+            armTimerFd(findNextEventTick(&nextTick) ? nextTick : UINT64_MAX);
+        }
+        pthread_mutex_unlock(&s_syncWheelMutex);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        uint64_t numExpirations;
+        ssize_t status = read(s_timerFd, &numExpirations, sizeof(numExpirations));
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (status == -1 && errno != EINTR) {
+            printf("Failed to wait for timer: %s\n", strerror(errno));
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            requestShutdownOfAllThreadsForProgram();
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+void Timer_init(Timer* pTimer, TimerFn callback, void* pArg)
+{
+    memset(pTimer, 0, sizeof(*pTimer));
+    pTimer->callback = callback;
+    pTimer->pArg = pArg;
+}
+
+void Timer_schedule(Timer* pTimer, uint64_t delayMs)
+{
+    pthread_mutex_lock(&s_syncWheelMutex);
+    {
+        if (pTimer->isPending) {
+            unlinkTimer(pTimer);
+        }
+        // The timer thread may not have caught up to the clock yet, and slots at
+        // or before s_currentTick have already been run.
+        uint64_t expiryTick = getCurrentTick() + delayMs;
+        pTimer->expiryTick = expiryTick > s_currentTick ? expiryTick : s_currentTick + 1;
+        placeTimer(pTimer);
+
+        uint64_t nextTick;
+        if (s_isRunning && findNextEventTick(&nextTick) && nextTick < s_armedTick) {
+            armTimerFd(nextTick);
+        }
+    }
+    pthread_mutex_unlock(&s_syncWheelMutex);
+}
+
+void Timer_cancel(Timer* pTimer)
+{
+    pthread_mutex_lock(&s_syncWheelMutex);
+    {
+        if (pTimer->isPending) {
+            unlinkTimer(pTimer);
+        }
+    }
+    pthread_mutex_unlock(&s_syncWheelMutex);
+}
+
+bool TimerWheel_init()
+{
+    s_startNs = getMonotonicTimeNs();
+    s_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (s_timerFd == -1) {
+        printf("Failed to create timer: %s\n", strerror(errno));
+        return false;
+    }
+    // Nothing can be cancelled yet, so plain pthread_create is enough. The thread
+    // doesn't wait on the ready barrier; it is started before any worker thread,
+    // so there is no shutdown to race with.
+    s_isRunning = true;
+    int status = pthread_create(&s_threadPid, NULL, TimerWheel_run, NULL);
+    if (status != 0) {
+        printf("Failed to create timer thread: %s\n", strerror(status));
+        s_isRunning = false;
+        close(s_timerFd);
+        s_timerFd = -1;
+        return false;
+    }
+    return true;
+}
+
+ShutdownStatus TimerWheel_shutdown()
+{
+    if (!s_isRunning) {
+        return SUCCESSFUL_JOIN;
+    }
+    return shutdownThreadWithPid(s_threadPid);
+}
+
+void TimerWheel_printStats()
+{
+    if (s_numFired == 0) {
+        return;
+    }
+    printf("Timers: %lu fired, %lu moved down a level, up to %.2f ms late\n",
+           s_numFired, s_numCascaded, (double) s_maxLateNs / 1e6);
+}
+
+void TimerWheel_destroy()
+{
+    if (s_timerFd != -1) {
+        close(s_timerFd);
+        s_timerFd = -1;
+    }
+    s_isRunning = false;
+    pthread_mutex_destroy(&s_syncWheelMutex);
+}
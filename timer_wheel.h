@@ -0,0 +1,71 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Timers for heartbeats, timeouts and retransmits, all run by one timer thread.
+ *
+ * Timers live in a hierarchical hashed timer wheel: TIMER_WHEEL_LEVELS wheels of 64
+ * slots each, where each slot of a level spans all 64 slots of the level below.
+ * Starting and cancelling a timer is O(1), and a timer in a higher level moves down
+ * when the wheel below it wraps around. The thread sleeps on a timerfd armed for the
+ * next occupied slot, which is found from per-level occupancy bitmaps instead of by
+ * scanning, so idle timers cost nothing.
+ */
+
+#define TIMER_WHEEL_LEVELS 4
+// 1 ms ticks. The four levels cover 64^4 ms (about 4.6 hours); later timers cascade
+// down through the top level more than once.
+#define TIMER_TICK_NS 1000000ULL
+
+typedef void (*TimerFn)(void* pArg);
+
+/*
+ * A timer is embedded in (or allocated by) its owner, so the wheel never allocates.
+ * Only touch its fields through the functions below.
+ */
+typedef struct Timer_s Timer;
+struct Timer_s {
+    Timer* pNext;
+    Timer* pPrev;
+    uint64_t expiryTick;
+    int level;
+    int slot;
+    bool isPending;
+    TimerFn callback;
+    void* pArg;
+};
+
+void Timer_init(Timer* pTimer, TimerFn callback, void* pArg);
+
+/*
+ * Schedules the timer to run its callback on the timer thread after delayMs,
+ * rescheduling it if it is already pending. Can be called from any thread,
+ * including from a callback.
+ */
+void Timer_schedule(Timer* pTimer, uint64_t delayMs);
+
+/*
+ * Stops the timer if it is pending. A callback that the timer thread has already
+ * started still runs to the end.
+ */
+void Timer_cancel(Timer* pTimer);
+
+/*
+ * Starts the timer thread. Returns false (after printing why) if it can't.
+ */
+bool TimerWheel_init();
+
+ShutdownStatus TimerWheel_shutdown();
+
+void TimerWheel_printStats();
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void TimerWheel_destroy();
+
+#endif // _TIMER_WHEEL_H
@@ -0,0 +1,199 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "message.h"
+#include "trace.h"
+
+#define TRACE_MAX_THREAD_NAME_LEN 32
+
+typedef struct TraceEvent_s TraceEvent;
+struct TraceEvent_s {
+    const char* pName;
+    uint64_t startNs;
+    uint64_t durationNs;
+    uint64_t messageId;
+    TraceFlow flow;
+};
+
+/*
+ * Only written by the thread it belongs to, and only read once all threads are done.
+ */
+typedef struct TraceBuffer_s TraceBuffer;
+struct TraceBuffer_s {
+    TraceBuffer* pNext;
+    int threadId;
+    char threadName[TRACE_MAX_THREAD_NAME_LEN];
+    size_t numEvents;
+    unsigned long numDropped;
+    // Only the pages that get written are backed by memory.
+    TraceEvent events[];
+};
+
+static bool s_isEnabled = false;
+static const char* s_pPath = NULL;
+static size_t s_maxEventsPerThread = 0;
+static uint64_t s_startNs = 0;
+static atomic_uint_fast64_t s_nextMessageId = 1;
+
+// Protects the list of buffers, which only changes when a thread records its first event.
+static pthread_mutex_t s_syncBuffersMutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer* s_pFirstBuffer = NULL;
+static int s_numBuffers = 0;
+static _Thread_local TraceBuffer* s_pThreadBuffer = NULL;
+// Set if a thread couldn't get a buffer, so that it doesn't try for every event.
+static _Thread_local bool s_hasNoBuffer = false;
+
+void Trace_init(const char* pPath, size_t maxEventsPerThread)
+{
+    s_pPath = pPath;
+    s_maxEventsPerThread = maxEventsPerThread;
+    s_startNs = getMonotonicTimeNs();
+    s_isEnabled = true;
+}
+
+/*
+ * Returns the calling thread's buffer, creating it on first use, or NULL if there
+ * isn't memory for one.
+ */
+static TraceBuffer* getThreadBuffer()
+{
+    if (s_pThreadBuffer != NULL || s_hasNoBuffer) {
+        return s_pThreadBuffer;
+    }
+    TraceBuffer* pBuffer = malloc(sizeof(TraceBuffer) + s_maxEventsPerThread * sizeof(TraceEvent));
+    if (pBuffer == NULL) {
+        s_hasNoBuffer = true;
+        return NULL;
+    }
+    pBuffer->numEvents = 0;
+    pBuffer->numDropped = 0;
+    pthread_mutex_lock(&s_syncBuffersMutex);
+    pBuffer->threadId = ++s_numBuffers;
+    snprintf(pBuffer->threadName, sizeof(pBuffer->threadName), "thread %d", pBuffer->threadId);
+    pBuffer->pNext = s_pFirstBuffer;
+    s_pFirstBuffer = pBuffer;
+    pthread_mutex_unlock(&s_syncBuffersMutex);
+    s_pThreadBuffer = pBuffer;
+    return pBuffer;
+}
+
+void Trace_setThreadName(const char* pName)
+{
+    if (!s_isEnabled) {
+        return;
+    }
+    TraceBuffer* pBuffer = getThreadBuffer();
+    if (pBuffer != NULL) {
+        snprintf(pBuffer->threadName, sizeof(pBuffer->threadName), "%s", pName);
+    }
+}
+
+uint64_t Trace_begin()
+{
+    return s_isEnabled ? getMonotonicTimeNs() : 0;
+}
+
+void Trace_end(const char* pName, uint64_t startNs, uint64_t messageId, TraceFlow flow)
+{
+    if (startNs == 0) {
+        return;
+    }
+    uint64_t endNs = getMonotonicTimeNs();
+    TraceBuffer* pBuffer = getThreadBuffer();
+    if (pBuffer == NULL) {
+        return;
+    }
+    if (pBuffer->numEvents == s_maxEventsPerThread) {
+        pBuffer->numDropped++;
+        return;
+    }
+    TraceEvent* pEvent = &pBuffer->events[pBuffer->numEvents++];
+    pEvent->pName = pName;
+    pEvent->startNs = startNs;
+    pEvent->durationNs = endNs - startNs;
+    pEvent->messageId = messageId;
+    pEvent->flow = messageId != 0 ? flow : TRACE_FLOW_NONE;
+}
+
+uint64_t Trace_newMessageId()
+{
+    if (!s_isEnabled) {
+        return 0;
+    }
+    return atomic_fetch_add_explicit(&s_nextMessageId, 1, memory_order_relaxed);
+}
+
+static void writeEvent(FILE* pFile, int processId, int threadId, const TraceEvent* pEvent)
+{
+    double timestampUs = (double) (pEvent->startNs - s_startNs) / 1e3;
+    fprintf(pFile, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                   "\"dur\":%.3f",
+            pEvent->pName, processId, threadId, timestampUs, (double) pEvent->durationNs / 1e3);
+    if (pEvent->messageId != 0) {
+        fprintf(pFile, ",\"args\":{\"message\":%llu}", (unsigned long long) pEvent->messageId);
+    }
+    fputs("}", pFile);
+    if (pEvent->flow != TRACE_FLOW_NONE) {
+        // Both ends bind to the span they start in.
+        fprintf(pFile, ",\n{\"name\":\"message\",\"cat\":\"message\",\"ph\":\"%s\",\"bp\":\"e\","
+                       "\"id\":%llu,\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+                pEvent->flow == TRACE_FLOW_START ? "s" : "f",
+                (unsigned long long) pEvent->messageId, processId, threadId, timestampUs);
+    }
+}
+
+void Trace_write()
+{
+    if (!s_isEnabled) {
+        return;
+    }
+    FILE* pFile = fopen(s_pPath, "w");
+    if (pFile == NULL) {
+        printf("Failed to open the trace file %s: %s\n", s_pPath, strerror(errno));
+        return;
+    }
+    int processId = (int) getpid();
+    fprintf(pFile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                   "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"two-chat\"}}",
+            processId);
+    size_t numEvents = 0;
+    unsigned long numDropped = 0;
+    const TraceBuffer* pBuffer;
+    for (pBuffer = s_pFirstBuffer; pBuffer != NULL; pBuffer = pBuffer->pNext) {
+        fprintf(pFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                       "\"args\":{\"name\":\"%s\"}}",
+                processId, pBuffer->threadId, pBuffer->threadName);
+        size_t i;
+        for (i = 0; i < pBuffer->numEvents; i++) {
+            writeEvent(pFile, processId, pBuffer->threadId, &pBuffer->events[i]);
+        }
+        numEvents += pBuffer->numEvents;
+        numDropped += pBuffer->numDropped;
+    }
+    fputs("\n]}\n", pFile);
+    if (fclose(pFile) != 0) {
+        printf("Failed to write the trace file %s: %s\n", s_pPath, strerror(errno));
+        return;
+    }
+    printf("Trace: %zu spans written to %s", numEvents, s_pPath);
+    if (numDropped > 0) {
+        printf(", %lu dropped after the buffers filled up", numDropped);
+    }
+    fputs("\n", stdout);
+}
+
+void Trace_destroy()
+{
+    while (s_pFirstBuffer != NULL) {
+        TraceBuffer* pBuffer = s_pFirstBuffer;
+        s_pFirstBuffer = pBuffer->pNext;
+        free(pBuffer);
+    }
+    s_numBuffers = 0;
+    s_isEnabled = false;
+}
@@ -0,0 +1,67 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Opt-in tracing of where each message spends its time, written at shutdown in the
+ * Chrome trace event format for chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Each thread records spans into its own buffer, so recording takes no locks and
+ * costs two clock reads per span. Messages get an ID when they are created, and the
+ * spans that put a message on a queue and take it off are joined by flow arrows.
+ * A thread whose buffer is full stops recording and the dropped spans are counted.
+ */
+
+/*
+ * How a span takes part in a message's flow arrow.
+ */
+typedef enum {
+    TRACE_FLOW_NONE,
+    // The span hands the message to another thread.
+    TRACE_FLOW_START,
+    // The span takes the message from another thread.
+    TRACE_FLOW_END
+} TraceFlow;
+
+/*
+ * Turns tracing on, keeping up to maxEventsPerThread spans for each thread. The
+ * trace is written to pPath by Trace_write.
+ */
+void Trace_init(const char* pPath, size_t maxEventsPerThread);
+
+/*
+ * Names the calling thread in the trace.
+ */
+void Trace_setThreadName(const char* pName);
+
+/*
+ * Returns the start time of a span, or 0 if tracing is off.
+ */
+uint64_t Trace_begin();
+
+/*
+ * Records a span of the calling thread from startNs until now. pName must be a
+ * string literal. messageId is 0 for spans that aren't about one message.
+ * Does nothing if startNs is 0.
+ */
+void Trace_end(const char* pName, uint64_t startNs, uint64_t messageId, TraceFlow flow);
+
+/*
+ * Returns an ID for a new message, or 0 if tracing is off.
+ */
+uint64_t Trace_newMessageId();
+
+/*
+ * Writes the trace file. Only called when all threads are shutdown.
+ */
+void Trace_write();
+
+/*
+ * Only called when all threads are shutdown.
+ */
+void Trace_destroy();
+
+#endif // _TRACE_H
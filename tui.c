@@ -0,0 +1,695 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#include "common.h"
+#include "options.h"
+#include "timer_wheel.h"
+#include "tui.h"
+
+#define TUI_SCROLLBACK_LINES 1024
+// Longer lines are cut off; the rest of the text still shows on the next line.
+#define TUI_MAX_LINE_LEN 8192
+#define TUI_MAX_INPUT_LEN 4096
+#define TUI_MAX_ROWS 500
+#define TUI_MAX_COLUMNS 1000
+#define TUI_MIN_ROWS 3
+#define TUI_MIN_COLUMNS 20
+// UTF-8 takes up to 4 bytes per column.
+#define TUI_MAX_ROW_LEN (TUI_MAX_COLUMNS * 4)
+// The longest escape sequence a frame is built from.
+#define TUI_MAX_SEQUENCE_LEN 64
+// At most, a frame moves the cursor to every row, rewrites it and clears the rest
+// of it, with a few more sequences around the rows.
+#define TUI_MAX_FRAME_LEN (TUI_MAX_ROWS * (TUI_MAX_SEQUENCE_LEN + TUI_MAX_ROW_LEN + 3) \
+                           + 4 * TUI_MAX_SEQUENCE_LEN)
+#define TUI_PROMPT "> "
+#define TUI_PROMPT_COLUMNS 2
+
+#define TUI_KEY_CTRL_C 0x03
+#define TUI_KEY_CTRL_D 0x04
+#define TUI_KEY_BACKSPACE 0x08
+#define TUI_KEY_CTRL_U 0x15
+#define TUI_KEY_ESCAPE 0x1b
+#define TUI_KEY_DELETE 0x7f
+
+typedef struct TuiLine_s TuiLine;
+struct TuiLine_s {
+    // TUI_MAX_LINE_LEN bytes of s_pLineTexts.
+    char* pText;
+    size_t length;
+};
+
+/*
+ * A row of the screen, pointing into the text it shows.
+ */
+typedef struct TuiRow_s TuiRow;
+struct TuiRow_s {
+    const char* pText;
+    size_t length;
+};
+
+typedef enum {
+    ESCAPE_NONE,
+    ESCAPE_STARTED,
+    ESCAPE_IN_SEQUENCE
+} EscapeState;
+
+static bool s_isActive = false;
+static struct termios s_savedTerminalSettings;
+
+// Protects the model: the scrollback and the input line.
+static pthread_mutex_t s_syncTuiMutex = PTHREAD_MUTEX_INITIALIZER;
+static TuiLine s_lines[TUI_SCROLLBACK_LINES];
+// The text of every line of the scrollback, set aside at the start so that lines
+// don't grow while messages come in. Pages the scrollback hasn't reached yet are
+// never touched.
+static char* s_pLineTexts = NULL;
+static size_t s_newestLine = 0;
+static size_t s_numLines = 0;
+// The newest line is still being received and more text may go on it.
+static bool s_isNewestLineOpen = false;
+static char s_input[TUI_MAX_INPUT_LEN];
+static size_t s_inputLength = 0;
+static EscapeState s_escapeState = ESCAPE_NONE;
+static Timer s_frameTimer;
+static bool s_isFramePending = false;
+static uint64_t s_lastFrameNs = 0;
+static uint64_t s_frameIntervalNs;
+
+// What the terminal shows as of the last frame. Only touched by the timer thread
+// while active. 0 rows means the screen must be redrawn from scratch.
+static int s_numRows = 0;
+static int s_numColumns = 0;
+static char* s_pShownRows[TUI_MAX_ROWS];
+static size_t s_shownLengths[TUI_MAX_ROWS];
+static TuiRow s_targetRows[TUI_MAX_ROWS];
+static char s_statusRow[TUI_MAX_ROW_LEN];
+static char s_inputRow[TUI_MAX_ROW_LEN];
+// TUI_MAX_FRAME_LEN bytes.
+static char* s_pFrame = NULL;
+static size_t s_frameLength = 0;
+
+static unsigned long s_numLinesReceived = 0;
+static unsigned long s_numFrames = 0;
+static unsigned long s_numRowsScrolled = 0;
+static unsigned long long s_numBytesWritten = 0;
+static size_t s_maxFrameLength = 0;
+
+static bool isContinuationByte(char c)
+{
+    return ((unsigned char) c & 0xc0) == 0x80;
+}
+
+/*
+ * Counts the columns of UTF-8 text, taking every character as one column wide.
+ */
+static size_t countColumns(const char* pText, size_t length)
+{
+    size_t numColumns = 0;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (!isContinuationByte(pText[i])) {
+            numColumns++;
+        }
+    }
+    return numColumns;
+}
+
+/*
+ * Returns how many bytes of the text fit in one row of numColumns. Stray
+ * continuation bytes take no columns, so a row also ends at TUI_MAX_ROW_LEN bytes.
+ */
+static size_t takeRow(const char* pText, size_t length, size_t numColumns)
+{
+    size_t columns = 0;
+    size_t i;
+    for (i = 0; i < length && i < TUI_MAX_ROW_LEN; i++) {
+        if (!isContinuationByte(pText[i])) {
+            if (columns == numColumns) {
+                break;
+            }
+            columns++;
+        }
+    }
+    return i;
+}
+
+static size_t countRows(const char* pText, size_t length, size_t numColumns)
+{
+    size_t numRows = 0;
+    size_t offset = 0;
+    do {
+        offset += takeRow(pText + offset, length - offset, numColumns);
+        numRows++;
+    } while (offset < length);
+    return numRows;
+}
+
+/*
+ * Must hold s_syncTuiMutex. Starts a new, empty newest line, reusing the oldest
+ * one's memory when the scrollback is full.
+ */
+static TuiLine* startLine()
+{
+    s_newestLine = (s_newestLine + 1) % TUI_SCROLLBACK_LINES;
+    if (s_numLines < TUI_SCROLLBACK_LINES) {
+        s_numLines++;
+    }
+    TuiLine* pLine = &s_lines[s_newestLine];
+    pLine->length = 0;
+    return pLine;
+}
+
+/*
+ * Must hold s_syncTuiMutex. Returns the newest line if received text can still go
+ * on it, or starts a new one. A line is only started once there is text for it, so
+ * that text ending in \n doesn't leave an empty line behind.
+ */
+static TuiLine* getOpenLine()
+{
+    if (s_isNewestLineOpen) {
+        return &s_lines[s_newestLine];
+    }
+    s_isNewestLineOpen = true;
+    return startLine();
+}
+
+/*
+ * Must hold s_syncTuiMutex. Bytes past TUI_MAX_LINE_LEN are dropped.
+ */
+static void appendToLine(TuiLine* pLine, const char* pText, size_t length)
+{
+    if (pLine->length + length > TUI_MAX_LINE_LEN) {
+        length = TUI_MAX_LINE_LEN - pLine->length;
+    }
+    memcpy(pLine->pText + pLine->length, pText, length);
+    pLine->length += length;
+}
+
+static void appendToFrame(const char* pText, size_t length)
+{
+    // Can't happen with TUI_MAX_FRAME_LEN, but a frame cut short is better than an
+    // overrun.
+    if (s_frameLength + length > TUI_MAX_FRAME_LEN) {
+        return;
+    }
+    memcpy(s_pFrame + s_frameLength, pText, length);
+    s_frameLength += length;
+}
+
+static void appendFormatToFrame(const char* pFormat, ...)
+{
+    char sequence[TUI_MAX_SEQUENCE_LEN];
+    va_list args;
+    va_start(args, pFormat);
+    int length = vsnprintf(sequence, sizeof(sequence), pFormat, args);
+    va_end(args);
+    if (length > 0) {
+        appendToFrame(sequence, (size_t) length < sizeof(sequence) ? (size_t) length
+                                                                    : sizeof(sequence) - 1);
+    }
+}
+
+static void writeToTerminal(const char* pText, size_t length)
+{
+    while (length > 0) {
+        ssize_t numWritten = write(STDOUT_FILENO, pText, length);
+        if (numWritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        pText += numWritten;
+        length -= (size_t) numWritten;
+        s_numBytesWritten += (unsigned long long) numWritten;
+    }
+}
+
+/*
+ * Reads the terminal size, clamped to what the UI can draw.
+ */
+static void getTerminalSize(int* pNumRows, int* pNumColumns)
+{
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1 || size.ws_row == 0 || size.ws_col == 0) {
+        size.ws_row = 24;
+        size.ws_col = 80;
+    }
+    *pNumRows = size.ws_row < TUI_MIN_ROWS ? TUI_MIN_ROWS
+                : size.ws_row > TUI_MAX_ROWS ? TUI_MAX_ROWS : size.ws_row;
+    *pNumColumns = size.ws_col < TUI_MIN_COLUMNS ? TUI_MIN_COLUMNS
+                   : size.ws_col > TUI_MAX_COLUMNS ? TUI_MAX_COLUMNS : size.ws_col;
+}
+
+/*
+ * Must hold s_syncTuiMutex. Lays out the scrollback region from the newest line up,
+ * only wrapping the lines that end up on screen.
+ */
+static void layOutScrollback(int numRegionRows)
+{
+    int row = numRegionRows;
+    size_t numColumns = (size_t) s_numColumns;
+    size_t i;
+    for (i = 0; i < s_numLines && row > 0; i++) {
+        const TuiLine* pLine = &s_lines[(s_newestLine + TUI_SCROLLBACK_LINES - i) % TUI_SCROLLBACK_LINES];
+        size_t numRowsOfLine = countRows(pLine->pText, pLine->length, numColumns);
+        size_t numShown = numRowsOfLine < (size_t) row ? numRowsOfLine : (size_t) row;
+        row -= (int) numShown;
+        size_t offset = 0;
+        size_t lineRow;
+        for (lineRow = 0; lineRow < numRowsOfLine; lineRow++) {
+            size_t rowLength = takeRow(pLine->pText + offset, pLine->length - offset, numColumns);
+            if (lineRow >= numRowsOfLine - numShown) {
+                TuiRow* pRow = &s_targetRows[row + (int) (lineRow - (numRowsOfLine - numShown))];
+                pRow->pText = pLine->pText + offset;
+                pRow->length = rowLength;
+            }
+            offset += rowLength;
+        }
+    }
+    while (row > 0) {
+        row--;
+        s_targetRows[row].pText = "";
+        s_targetRows[row].length = 0;
+    }
+}
+
+/*
+ * Must hold s_syncTuiMutex. Lays out the status and input rows, and returns the
+ * column the cursor goes in.
+ */
+static int layOutBottomRows()
+{
+    const Options* pOptions = Options_get();
+    size_t numColumns = (size_t) s_numColumns;
+    int statusLength = snprintf(s_statusRow, sizeof(s_statusRow), "-- two-chat: %s:%u ",
+                                pOptions->pRemoteHostname, pOptions->remotePort);
+    size_t length = takeRow(s_statusRow, (size_t) statusLength < sizeof(s_statusRow)
+                                         ? (size_t) statusLength : sizeof(s_statusRow) - 1,
+                            numColumns);
+    size_t numColumnsUsed = countColumns(s_statusRow, length);
+    while (numColumnsUsed < numColumns && length < sizeof(s_statusRow)) {
+        s_statusRow[length++] = '-';
+        numColumnsUsed++;
+    }
+    s_targetRows[s_numRows - 2].pText = s_statusRow;
+    s_targetRows[s_numRows - 2].length = length;
+
+    // Show the end of the input, leaving a column for the cursor, and no more of it
+    // than fits in the row's bytes.
+    size_t numInputColumns = numColumns - TUI_PROMPT_COLUMNS - 1;
+    size_t start = 0;
+    size_t numColumnsOfInput = countColumns(s_input, s_inputLength);
+    while (start < s_inputLength
+           && (numColumnsOfInput > numInputColumns
+               || s_inputLength - start > TUI_MAX_ROW_LEN - TUI_PROMPT_COLUMNS)) {
+        if (!isContinuationByte(s_input[start])) {
+            numColumnsOfInput--;
+        }
+        start++;
+        while (start < s_inputLength && isContinuationByte(s_input[start])) {
+            start++;
+        }
+    }
+    memcpy(s_inputRow, TUI_PROMPT, TUI_PROMPT_COLUMNS);
+    memcpy(s_inputRow + TUI_PROMPT_COLUMNS, s_input + start, s_inputLength - start);
+    s_targetRows[s_numRows - 1].pText = s_inputRow;
+    s_targetRows[s_numRows - 1].length = TUI_PROMPT_COLUMNS + s_inputLength - start;
+    return TUI_PROMPT_COLUMNS + (int) numColumnsOfInput + 1;
+}
+
+static bool isRowShown(int row, const TuiRow* pTarget)
+{
+    return s_shownLengths[row] == pTarget->length
+           && memcmp(s_pShownRows[row], pTarget->pText, pTarget->length) == 0;
+}
+
+/*
+ * Finds how far the scrollback region moved up since the last frame: the smallest
+ * shift that lines up every row still on screen. Returns 0 if there is none.
+ */
+static int findScrollDistance(int numRegionRows)
+{
+    int distance;
+    for (distance = 1; distance < numRegionRows; distance++) {
+        int row;
+        for (row = 0; row + distance < numRegionRows; row++) {
+            if (!isRowShown(row + distance, &s_targetRows[row])) {
+                break;
+            }
+        }
+        if (row + distance == numRegionRows) {
+            return distance;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Scrolls the region up on the terminal, and the shown rows to match. The rows that
+ * come in at the bottom are blank.
+ */
+static void scrollRegion(int numRegionRows, int distance)
+{
+    appendFormatToFrame("\x1b[%dS", distance);
+    char* pScrolledOut[TUI_MAX_ROWS];
+    memcpy(pScrolledOut, s_pShownRows, (size_t) distance * sizeof(char*));
+    memmove(s_pShownRows, s_pShownRows + distance,
+            (size_t) (numRegionRows - distance) * sizeof(char*));
+    memmove(s_shownLengths, s_shownLengths + distance,
+            (size_t) (numRegionRows - distance) * sizeof(size_t));
+    int row;
+    for (row = numRegionRows - distance; row < numRegionRows; row++) {
+        s_pShownRows[row] = pScrolledOut[row - (numRegionRows - distance)];
+        s_shownLengths[row] = 0;
+    }
+    s_numRowsScrolled += (unsigned long) distance;
+}
+
+/*
+ * Rewrites the row from the first byte that differs from what is shown, and clears
+ * what is left of the old row past the new one.
+ */
+static bool drawRowChanges(int row)
+{
+    const TuiRow* pTarget = &s_targetRows[row];
+    if (isRowShown(row, pTarget)) {
+        return false;
+    }
+    const char* pShown = s_pShownRows[row];
+    size_t shownLength = s_shownLengths[row];
+    size_t start = 0;
+    while (start < shownLength && start < pTarget->length && pShown[start] == pTarget->pText[start]) {
+        start++;
+    }
+    while (start > 0 && start < pTarget->length && isContinuationByte(pTarget->pText[start])) {
+        start--;
+    }
+    appendFormatToFrame("\x1b[%d;%zuH", row + 1, countColumns(pTarget->pText, start) + 1);
+    appendToFrame(pTarget->pText + start, pTarget->length - start);
+    if (countColumns(pShown, shownLength) > countColumns(pTarget->pText, pTarget->length)) {
+        appendToFrame("\x1b[K", 3);
+    }
+    memcpy(s_pShownRows[row], pTarget->pText, pTarget->length);
+    s_shownLengths[row] = pTarget->length;
+    return true;
+}
+
+/*
+ * Must hold s_syncTuiMutex. Builds the escape sequences that bring the terminal
+ * from the last frame to the current model into s_pFrame.
+ */
+static void buildFrame()
+{
+    s_frameLength = 0;
+    int numRows;
+    int numColumns;
+    getTerminalSize(&numRows, &numColumns);
+    bool isRedrawing = numRows != s_numRows || numColumns != s_numColumns;
+    if (isRedrawing) {
+        s_numRows = numRows;
+        s_numColumns = numColumns;
+        // Clear the screen and keep the bottom two rows out of the scrolling region.
+        appendFormatToFrame("\x1b[2J\x1b[1;%dr", numRows - 2);
+        memset(s_shownLengths, 0, sizeof(s_shownLengths));
+    }
+
+    int numRegionRows = numRows - 2;
+    layOutScrollback(numRegionRows);
+    int cursorColumn = layOutBottomRows();
+
+    appendToFrame("\x1b[?25l", 6);
+    size_t lengthBeforeRows = s_frameLength;
+    bool isRegionShown = true;
+    int row;
+    for (row = 0; row < numRegionRows && isRegionShown; row++) {
+        isRegionShown = isRowShown(row, &s_targetRows[row]);
+    }
+    if (!isRegionShown && !isRedrawing) {
+        int distance = findScrollDistance(numRegionRows);
+        if (distance > 0) {
+            scrollRegion(numRegionRows, distance);
+        }
+    }
+    bool hasChanges = false;
+    for (row = 0; row < numRows; row++) {
+        hasChanges |= drawRowChanges(row);
+    }
+    if (!hasChanges && !isRedrawing && s_frameLength == lengthBeforeRows) {
+        // Nothing moved, so there is nothing to write.
+        s_frameLength = 0;
+        return;
+    }
+    appendFormatToFrame("\x1b[%d;%dH\x1b[?25h", numRows, cursorColumn);
+}
+
+static void onFrameTimer(void* unused)
+{
+    pthread_mutex_lock(&s_syncTuiMutex);
+    s_isFramePending = false;
+    s_lastFrameNs = getMonotonicTimeNs();
+    buildFrame();
+    pthread_mutex_unlock(&s_syncTuiMutex);
+
+    // Only the timer thread touches the frame, so it can be written without
+    // holding up the printer and the reader on a slow terminal.
+    if (s_frameLength > 0) {
+        writeToTerminal(s_pFrame, s_frameLength);
+        s_numFrames++;
+        if (s_frameLength > s_maxFrameLength) {
+            s_maxFrameLength = s_frameLength;
+        }
+    }
+}
+
+/*
+ * Must hold s_syncTuiMutex. Schedules a frame for when the frame interval since the
+ * last one is up, unless one is already coming.
+ */
+static void requestFrame()
+{
+    if (s_isFramePending) {
+        return;
+    }
+    s_isFramePending = true;
+    uint64_t nowNs = getMonotonicTimeNs();
+    uint64_t nextFrameNs = s_lastFrameNs + s_frameIntervalNs;
+    Timer_schedule(&s_frameTimer, nextFrameNs > nowNs ? (nextFrameNs - nowNs + 999999) / 1000000 : 0);
+}
+
+bool Tui_init()
+{
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+        fputs("--tui needs a terminal; using plain output.\n", stdout);
+        return false;
+    }
+    if (tcgetattr(STDIN_FILENO, &s_savedTerminalSettings) == -1) {
+        printf("Failed to read the terminal settings: %s\n", strerror(errno));
+        return false;
+    }
+    // Everything the UI draws with is allocated now, so that nothing is while
+    // messages come in.
+    bool isAllocated = true;
+    int row;
+    for (row = 0; row < TUI_MAX_ROWS && isAllocated; row++) {
+        s_pShownRows[row] = malloc(TUI_MAX_ROW_LEN);
+        isAllocated = s_pShownRows[row] != NULL;
+    }
+    s_pLineTexts = malloc((size_t) TUI_SCROLLBACK_LINES * TUI_MAX_LINE_LEN);
+    s_pFrame = malloc(TUI_MAX_FRAME_LEN);
+    if (!isAllocated || s_pLineTexts == NULL || s_pFrame == NULL) {
+        fputs("Not enough memory for the terminal UI; using plain output.\n", stdout);
+        Tui_destroy();
+        return false;
+    }
+    size_t i;
+    for (i = 0; i < TUI_SCROLLBACK_LINES; i++) {
+        s_lines[i].pText = s_pLineTexts + i * TUI_MAX_LINE_LEN;
+    }
+
+    // Raw input, one key at a time. Ctrl-C is handled as a key, so that the
+    // terminal is always restored on the way out.
+    struct termios rawSettings = s_savedTerminalSettings;
+    rawSettings.c_iflag &= (tcflag_t) ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    rawSettings.c_lflag &= (tcflag_t) ~(ECHO | ICANON | IEXTEN | ISIG);
+    rawSettings.c_cc[VMIN] = 1;
+    rawSettings.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &rawSettings) == -1) {
+        printf("Failed to put the terminal in raw mode: %s\n", strerror(errno));
+        Tui_destroy();
+        return false;
+    }
+    fflush(stdout);
+    // Switch to the alternate screen, so that the scrollback of the shell is left alone.
+    const char alternateScreen[] = "\x1b[?1049h";
+    writeToTerminal(alternateScreen, sizeof(alternateScreen) - 1);
+
+    s_frameIntervalNs = 1000000000ULL / (uint64_t) Options_get()->tuiFramesPerSec;
+    Timer_init(&s_frameTimer, onFrameTimer, NULL);
+    s_isActive = true;
+    pthread_mutex_lock(&s_syncTuiMutex);
+    requestFrame();
+    pthread_mutex_unlock(&s_syncTuiMutex);
+    return true;
+}
+
+bool Tui_isActive()
+{
+    return s_isActive;
+}
+
+void Tui_appendText(const char* pText, size_t length)
+{
+    pthread_mutex_lock(&s_syncTuiMutex);
+    size_t start = 0;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) pText[i];
+        if (c >= 0x20 && c != TUI_KEY_DELETE) {
+            continue;
+        }
+        TuiLine* pLine = getOpenLine();
+        appendToLine(pLine, pText + start, i - start);
+        start = i + 1;
+        if (c == '\n') {
+            s_numLinesReceived++;
+            s_isNewestLineOpen = false;
+        } else if (c == '\t') {
+            appendToLine(pLine, " ", 1);
+        } else if (c != '\r') {
+            // Control characters could move the cursor or change the terminal.
+            appendToLine(pLine, "?", 1);
+        }
+    }
+    if (start < length) {
+        appendToLine(getOpenLine(), pText + start, length - start);
+    }
+    requestFrame();
+    pthread_mutex_unlock(&s_syncTuiMutex);
+}
+
+/*
+ * Must hold s_syncTuiMutex. Adds the input line to the message and the scrollback,
+ * and clears it. Returns false if it doesn't fit in the message.
+ */
+static bool submitInputLine(char* pMessage, size_t* pSizeOfMessage)
+{
+    // Leave room for the \0 characters the termination line scan relies on.
+    if (*pSizeOfMessage + s_inputLength + 1 > MSG_MAX_LEN - 2) {
+        return false;
+    }
+    memcpy(pMessage + *pSizeOfMessage, s_input, s_inputLength);
+    pMessage[*pSizeOfMessage + s_inputLength] = '\n';
+    *pSizeOfMessage += s_inputLength + 1;
+
+    s_isNewestLineOpen = false;
+    TuiLine* pLine = startLine();
+    appendToLine(pLine, TUI_PROMPT, TUI_PROMPT_COLUMNS);
+    appendToLine(pLine, s_input, s_inputLength);
+    s_inputLength = 0;
+    return true;
+}
+
+size_t Tui_handleInput(const char* pKeys, size_t length, char* pMessage, bool* pIsEndOfInput)
+{
+    size_t sizeOfMessage = 0;
+    *pIsEndOfInput = false;
+    pthread_mutex_lock(&s_syncTuiMutex);
+    size_t i;
+    for (i = 0; i < length && !*pIsEndOfInput; i++) {
+        char key = pKeys[i];
+        if (s_escapeState == ESCAPE_STARTED) {
+            // Arrow and function keys send ESC [ ... or ESC O ..., which are skipped.
+            s_escapeState = key == '[' || key == 'O' ? ESCAPE_IN_SEQUENCE : ESCAPE_NONE;
+            continue;
+        }
+        if (s_escapeState == ESCAPE_IN_SEQUENCE) {
+            if (key >= 0x40 && key <= 0x7e) {
+                s_escapeState = ESCAPE_NONE;
+            }
+            continue;
+        }
+        switch (key) {
+            case '\r':
+            case '\n':
+                if (!submitInputLine(pMessage, &sizeOfMessage)) {
+                    // Only possible when pasting far more than a read of keys; the
+                    // line is dropped rather than overflow the message.
+                    s_inputLength = 0;
+                }
+                break;
+            case TUI_KEY_BACKSPACE:
+            case TUI_KEY_DELETE:
+                while (s_inputLength > 0 && isContinuationByte(s_input[--s_inputLength])) {
+                }
+                break;
+            case TUI_KEY_CTRL_U:
+                s_inputLength = 0;
+                break;
+            case TUI_KEY_CTRL_C:
+                *pIsEndOfInput = true;
+                break;
+            case TUI_KEY_CTRL_D:
+                *pIsEndOfInput = s_inputLength == 0;
+                break;
+            case TUI_KEY_ESCAPE:
+                s_escapeState = ESCAPE_STARTED;
+                break;
+            case '\t':
+                key = ' ';
+                // Pass through
+            default:
+                if ((unsigned char) key >= 0x20 && s_inputLength < TUI_MAX_INPUT_LEN) {
+                    s_input[s_inputLength++] = key;
+                }
+                break;
+        }
+    }
+    requestFrame();
+    pthread_mutex_unlock(&s_syncTuiMutex);
+    // Lines finished in the same read as the end of input aren't sent.
+    return *pIsEndOfInput ? 0 : sizeOfMessage;
+}
+
+void Tui_destroy()
+{
+    if (s_isActive) {
+        // Reset the scrolling region, show the cursor and leave the alternate screen.
+        const char restore[] = "\x1b[r\x1b[?25h\x1b[?1049l";
+        writeToTerminal(restore, sizeof(restore) - 1);
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &s_savedTerminalSettings);
+        s_isActive = false;
+    }
+    int row;
+    for (row = 0; row < TUI_MAX_ROWS; row++) {
+        free(s_pShownRows[row]);
+        s_pShownRows[row] = NULL;
+    }
+    size_t i;
+    for (i = 0; i < TUI_SCROLLBACK_LINES; i++) {
+        s_lines[i].pText = NULL;
+    }
+    free(s_pLineTexts);
+    s_pLineTexts = NULL;
+    free(s_pFrame);
+    s_pFrame = NULL;
+}
+
+void Tui_printStats()
+{
+    if (s_numFrames == 0) {
+        return;
+    }
+    printf("TUI: %lu lines received, %lu frames drawn, %llu bytes written "
+           "(largest frame %zu bytes), %lu rows scrolled\n",
+           s_numLinesReceived, s_numFrames, s_numBytesWritten, s_maxFrameLength,
+           s_numRowsScrolled);
+}
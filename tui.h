@@ -0,0 +1,51 @@
+#ifndef _TUI_H
+#define _TUI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Optional full-screen terminal UI: incoming and sent lines scroll in the region
+ * at the top, with a status line and the line being typed fixed at the bottom.
+ *
+ * The screen printer and keyboard reader only change the model under a mutex and
+ * ask for a frame. Frames are drawn on the timer thread at most --tui-fps times a
+ * second, each one only rewriting the parts of rows that differ from what is on the
+ * terminal, and scrolling the region instead of redrawing it when lines were added.
+ * A flood of incoming lines costs at most one screenful of output per frame.
+ */
+
+/*
+ * Puts the terminal in raw mode on the alternate screen. Needs the timer wheel.
+ * Returns false (after printing why) if stdin or stdout isn't a terminal.
+ */
+bool Tui_init();
+
+/*
+ * Returns true if the UI was started and is in use.
+ */
+bool Tui_isActive();
+
+/*
+ * Adds received text to the scrollback. Only called by the screen printer.
+ */
+void Tui_appendText(const char* pText, size_t length);
+
+/*
+ * Applies keys typed by the user to the input line. Completed lines are added to
+ * the scrollback and written to pMessage, which must have room for MSG_MAX_LEN
+ * bytes, so that they can be sent together as one message.
+ * Returns the length of the message, 0 if no line was completed yet.
+ * Sets *pIsEndOfInput when the user pressed Ctrl-C, or Ctrl-D on an empty line.
+ * Only called by the keyboard reader.
+ */
+size_t Tui_handleInput(const char* pKeys, size_t length, char* pMessage, bool* pIsEndOfInput);
+
+/*
+ * Restores the terminal. Only called when all threads are shutdown.
+ */
+void Tui_destroy();
+
+void Tui_printStats();
+
+#endif // _TUI_H
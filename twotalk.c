@@ -0,0 +1,578 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "message.h"
+#include "message_queue.h"
+#include "message_pool.h"
+#include "sanitizer.h"
+#include "wire.h"
+#include "twotalk.h"
+
+_Static_assert(TWOTALK_MAX_MESSAGE_LEN == MSG_MAX_LEN, "sessions send the same datagrams as two-chat");
+
+// The longest text a received message can have once it is sanitized.
+#define SESSION_MAX_TEXT_LEN (SANITIZER_MAX_EXPANSION * MSG_MAX_LEN)
+// As two-chat's --queue-max-bytes, for the texts waiting to be taken.
+#define SESSION_RECEIVE_MAX_BYTES (16 * 1024 * 1024)
+
+struct TwoTalkSession_s {
+    int socketFd;
+    struct sockaddr_in remoteAddr;
+    TwoTalkReceiveFn receiveFn;
+    void* pUserData;
+    bool isSanitizeEnabled;
+    size_t maxQueuedMessages;
+    // Written to stop the receiver thread.
+    int stopEventFd;
+    // Readable while pReceiveQueue has messages. -1 with a receive callback.
+    int receiveEventFd;
+
+    // Shared by the two threads, as two-chat's sender and listener share theirs.
+    Wire wire;
+    // Submitted messages, which borrow the caller's text.
+    MessagePool* pSendPool;
+    MessageQueue* pSendQueue;
+    // Received messages waiting to be taken. NULL with a receive callback.
+    MessagePool* pReceivePool;
+    MessageQueue* pReceiveQueue;
+    // The message TwoTalk_receive returned last, freed by the next call.
+    Message* pTakenMessage;
+    // Only used by the receiver thread. The receive buffer has room for the two \0
+    // characters that the scan for the termination line stops at.
+    char* pReceiveBuffer;
+    char* pSanitizedBuffer;
+
+    // Also keeps the receive eventfd in step with the receive queue.
+    pthread_mutex_t syncSessionMutex;
+    // Set once the termination line was submitted, or the session is closing.
+    bool isSubmitClosed;
+    // Submitted messages that the sender hasn't finished with. Kept within
+    // maxQueuedMessages, so that putting one on the send queue never drops it.
+    size_t numUnsent;
+    TwoTalkStats stats;
+
+    bool isSyncInitialized;
+    bool isSenderStarted;
+    bool isReceiverStarted;
+    pthread_t senderThread;
+    pthread_t receiverThread;
+};
+
+/*
+ * Adds to the count of an eventfd, which makes it readable. This only fails when
+ * the count is at its most, and so readable already.
+ */
+static void signalEventFd(int eventFd)
+{
+    uint64_t one = 1;
+    if (write(eventFd, &one, sizeof(one)) != sizeof(one)) {
+        assert(errno == EAGAIN);
+    }
+}
+
+/*
+ * Takes the count of an eventfd, so that it isn't readable until it is signalled
+ * again. This only fails when the count is 0, and so not readable already.
+ */
+static void clearEventFd(int eventFd)
+{
+    uint64_t count;
+    if (read(eventFd, &count, sizeof(count)) != sizeof(count)) {
+        assert(errno == EAGAIN);
+    }
+}
+
+/*
+ * For a submitted buffer that outlives the session.
+ */
+static void keepText(void* pReleaseArg, const char* pText)
+{
+}
+
+static void countStat(TwoTalkSession* pSession, unsigned long* pStat)
+{
+    pthread_mutex_lock(&pSession->syncSessionMutex);
+    (*pStat)++;
+    pthread_mutex_unlock(&pSession->syncSessionMutex);
+}
+
+static bool sendDatagram(TwoTalkSession* pSession, const char* pDatagram, size_t length)
+{
+    return sendto(pSession->socketFd, pDatagram, length, 0,
+                  (struct sockaddr*) &pSession->remoteAddr, sizeof(pSession->remoteAddr)) != -1;
+}
+
+static void sendHello(TwoTalkSession* pSession, bool isReply)
+{
+    char datagram[WIRE_MAX_HEADER_LEN];
+    size_t length = WireEncoder_writeHello(&pSession->wire, datagram, isReply);
+    if (!sendDatagram(pSession, datagram, length)) {
+        countStat(pSession, &pSession->stats.numSendErrors);
+    }
+}
+
+/*
+ * Sends the message straight from its text, behind a frame header once the peer
+ * speaks frames. Longer messages go as plain text, as two-chat sends them.
+ */
+static bool sendMessage(TwoTalkSession* pSession, const Message* pMessage)
+{
+    char header[WIRE_MAX_HEADER_LEN];
+    struct iovec parts[2] = {
+        {.iov_base = header, .iov_len = 0},
+        {.iov_base = pMessage->pText, .iov_len = pMessage->length}
+    };
+    if (Wire_isSendingFramed(&pSession->wire) && pMessage->length <= WIRE_MAX_PAYLOAD_LEN) {
+        // The header is written in front of where the text would be, without
+        // touching the text.
+        char* pHeaderEnd = header + sizeof(header);
+        char* pFrame = WireEncoder_prependHeader(&pSession->wire, pHeaderEnd, pMessage->length,
+                                                 WIRE_TYPE_TEXT, pMessage->isShutdownMessage
+                                                 ? WIRE_FLAG_SHUTDOWN : 0);
+        parts[0].iov_base = pFrame;
+        parts[0].iov_len = (size_t) (pHeaderEnd - pFrame);
+    }
+    struct msghdr messageHeader;
+    memset(&messageHeader, 0, sizeof(messageHeader));
+    messageHeader.msg_name = &pSession->remoteAddr;
+    messageHeader.msg_namelen = sizeof(pSession->remoteAddr);
+    messageHeader.msg_iov = parts;
+    messageHeader.msg_iovlen = 2;
+    return sendmsg(pSession->socketFd, &messageHeader, 0) != -1;
+}
+
+static void* runSender(void* pArg)
+{
+    TwoTalkSession* pSession = pArg;
+    if (Wire_isHelloEnabled(&pSession->wire)) {
+        sendHello(pSession, false);
+    }
+    // Returns NULL once TwoTalk_close closed the queue and it is drained.
+    Message* pMessage;
+    while ((pMessage = MessageQueue_take(pSession->pSendQueue)) != NULL) {
+        bool isSent = sendMessage(pSession, pMessage);
+        // Hands the text back to the caller.
+        freeMessageFn(pMessage);
+
+        pthread_mutex_lock(&pSession->syncSessionMutex);
+        {
+            pSession->numUnsent--;
+            if (isSent) {
+                pSession->stats.numSent++;
+            } else {
+                pSession->stats.numSendErrors++;
+            }
+        }
+        pthread_mutex_unlock(&pSession->syncSessionMutex);
+    }
+    return NULL;
+}
+
+/*
+ * Sanitizes the text and hands it to the callback, or queues it for
+ * TwoTalk_receive, dropping it if the queue is full.
+ */
+static void deliverMessage(TwoTalkSession* pSession, const char* pText, size_t length,
+                           bool isShutdownMessage)
+{
+    if (pSession->isSanitizeEnabled) {
+        size_t numReplaced;
+        length = Sanitizer_sanitize(pText, length, pSession->pSanitizedBuffer, &numReplaced);
+        pText = pSession->pSanitizedBuffer;
+        if (numReplaced > 0) {
+            countStat(pSession, &pSession->stats.numSanitized);
+        }
+    }
+    if (pSession->receiveFn != NULL) {
+        countStat(pSession, &pSession->stats.numReceived);
+        pSession->receiveFn(pSession->pUserData, pText, length, isShutdownMessage);
+        return;
+    }
+
+    Message* pMessage = MessagePool_createMessage(pSession->pReceivePool, pText, length,
+                                                  isShutdownMessage);
+    pthread_mutex_lock(&pSession->syncSessionMutex);
+    {
+        // This drops pMessage if the queue is full.
+        if (pMessage != NULL && MessageQueue_put(pSession->pReceiveQueue, pMessage)) {
+            pSession->stats.numReceived++;
+            signalEventFd(pSession->receiveEventFd);
+        } else {
+            pSession->stats.numDropped++;
+        }
+    }
+    pthread_mutex_unlock(&pSession->syncSessionMutex);
+}
+
+/*
+ * Parses a framed datagram and answers the peer's hellos and pings, as two-chat's
+ * listener does. Returns false if there is no message to deliver.
+ */
+static bool receiveFrame(TwoTalkSession* pSession, const char* pDatagram, size_t length,
+                         WireFrame* pFrame)
+{
+    if (!WireDecoder_receive(&pSession->wire, pDatagram, length, pFrame)) {
+        countStat(pSession, &pSession->stats.numIgnored);
+        return false;
+    }
+    switch (pFrame->type) {
+        case WIRE_TYPE_TEXT:
+            return true;
+        case WIRE_TYPE_HELLO:
+            if (!(pFrame->flags & WIRE_FLAG_REPLY) && Wire_isHelloEnabled(&pSession->wire)) {
+                sendHello(pSession, true);
+            }
+            return false;
+        case WIRE_TYPE_PING:
+            if (pFrame->payloadLength <= WIRE_MAX_PING_PAYLOAD_LEN) {
+                char pong[WIRE_MAX_HEADER_LEN + WIRE_MAX_PING_PAYLOAD_LEN];
+                size_t sizeOfPong = WireEncoder_writeControl(pong, WIRE_TYPE_PONG,
+                                                             pFrame->sequence, pFrame->pPayload,
+                                                             pFrame->payloadLength);
+                if (!sendDatagram(pSession, pong, sizeOfPong)) {
+                    countStat(pSession, &pSession->stats.numSendErrors);
+                }
+            }
+            return false;
+        default:
+            // Dedup frames, and pongs, as a session doesn't ping.
+            countStat(pSession, &pSession->stats.numIgnored);
+            return false;
+    }
+}
+
+/*
+ * Delivers the message in the datagram that was just received, if it has one.
+ * Returns true if it was the termination message, after which nothing more is
+ * received.
+ */
+static bool receiveDatagram(TwoTalkSession* pSession, size_t length)
+{
+    char* pDatagram = pSession->pReceiveBuffer;
+    if (Wire_isFramedDatagram(pDatagram, length)) {
+        WireFrame frame;
+        if (!receiveFrame(pSession, pDatagram, length, &frame)) {
+            return false;
+        }
+        // The header says if it is the termination message, so the text isn't scanned.
+        bool isShutdownMessage = (frame.flags & WIRE_FLAG_SHUTDOWN) != 0;
+        deliverMessage(pSession, frame.pPayload, frame.payloadLength, isShutdownMessage);
+        return isShutdownMessage;
+    }
+    if (length == 0 || pDatagram[0] == '\0') {
+        // Heartbeats, and FEC or dedup datagrams.
+        countStat(pSession, &pSession->stats.numIgnored);
+        return false;
+    }
+    // The scan for the termination line stops at the first \0 after the text.
+    pDatagram[length] = '\0';
+    pDatagram[length + 1] = '\0';
+    bool isShutdownMessage = checkAndDiscardRestIfMessageHasTerminationLine(pDatagram, NULL);
+    deliverMessage(pSession, pDatagram, strnlen(pDatagram, length), isShutdownMessage);
+    return isShutdownMessage;
+}
+
+static void* runReceiver(void* pArg)
+{
+    TwoTalkSession* pSession = pArg;
+    struct pollfd pollFds[2] = {
+        {.fd = pSession->socketFd, .events = POLLIN},
+        {.fd = pSession->stopEventFd, .events = POLLIN}
+    };
+    bool isPeerShutDown = false;
+    while (!isPeerShutDown) {
+        if (poll(pollFds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pollFds[1].revents != 0) {
+            break;
+        }
+        // Drain the socket before polling again.
+        ssize_t bytesRx;
+        while (!isPeerShutDown
+               && (bytesRx = recv(pSession->socketFd, pSession->pReceiveBuffer, MSG_MAX_LEN,
+                                  MSG_DONTWAIT)) >= 0) {
+            isPeerShutDown = receiveDatagram(pSession, (size_t) bytesRx);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Stops the threads that were started and frees everything the session holds,
+ * however far TwoTalk_open got.
+ */
+static void destroySession(TwoTalkSession* pSession)
+{
+    if (pSession->isSyncInitialized) {
+        pthread_mutex_lock(&pSession->syncSessionMutex);
+        pSession->isSubmitClosed = true;
+        pthread_mutex_unlock(&pSession->syncSessionMutex);
+    }
+    // The sender finishes what is queued first.
+    MessageQueue_close(pSession->pSendQueue);
+    if (pSession->isSenderStarted) {
+        pthread_join(pSession->senderThread, NULL);
+    }
+    if (pSession->isReceiverStarted) {
+        signalEventFd(pSession->stopEventFd);
+        pthread_join(pSession->receiverThread, NULL);
+    }
+
+    freeMessageFn(pSession->pTakenMessage);
+    MessageQueue_destroy(pSession->pReceiveQueue);
+    MessageQueue_destroy(pSession->pSendQueue);
+    MessagePool_destroy(pSession->pReceivePool);
+    MessagePool_destroy(pSession->pSendPool);
+    free(pSession->pSanitizedBuffer);
+    free(pSession->pReceiveBuffer);
+    if (pSession->isSyncInitialized) {
+        pthread_mutex_destroy(&pSession->syncSessionMutex);
+    }
+    if (pSession->receiveEventFd != -1) {
+        close(pSession->receiveEventFd);
+    }
+    if (pSession->stopEventFd != -1) {
+        close(pSession->stopEventFd);
+    }
+    if (pSession->socketFd != -1) {
+        close(pSession->socketFd);
+    }
+    free(pSession);
+}
+
+/*
+ * Fills in the session's remote address. Returns false with errno set if the
+ * hostname has no IPv4 address.
+ */
+static bool resolveRemote(TwoTalkSession* pSession, const char* pHostname, in_port_t port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo* pAddressList = NULL;
+    if (getaddrinfo(pHostname, NULL, &hints, &pAddressList) != 0 || pAddressList == NULL) {
+        errno = ENOENT;
+        return false;
+    }
+    memcpy(&pSession->remoteAddr, pAddressList->ai_addr, sizeof(pSession->remoteAddr));
+    pSession->remoteAddr.sin_port = htons(port);
+    freeaddrinfo(pAddressList);
+    return true;
+}
+
+/*
+ * Returns false with errno set if the socket can't be created or bound.
+ */
+static bool bindSocket(TwoTalkSession* pSession, in_port_t port)
+{
+    pSession->socketFd = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (pSession->socketFd == -1) {
+        return false;
+    }
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+    return bind(pSession->socketFd, (struct sockaddr*) &sin, sizeof(sin)) != -1;
+}
+
+/*
+ * Creates the session's buffers, and its pools and queues, sized like two-chat's
+ * defaults but for maxQueuedMessages. Returns false with errno set if out of memory.
+ */
+static bool createPipelines(TwoTalkSession* pSession)
+{
+    QueueLimits limits = {
+        .maxMessages = pSession->maxQueuedMessages,
+        // Bounded by the number of messages alone, since the texts are the caller's.
+        .maxBytes = SIZE_MAX,
+        .policy = OVERFLOW_DROP_NEWEST,
+        // Every message but the termination one stays in order in the interactive lane.
+        .interactiveMaxBytes = SIZE_MAX,
+        .laneWeights = {1, 1, 1}
+    };
+    pSession->pSendQueue = MessageQueue_create("Sending", &limits);
+    // Texts are borrowed, so the pool only sets aside its spare blocks for them.
+    QueueLimits sendPoolLimits = limits;
+    sendPoolLimits.maxBytes = 0;
+    pSession->pSendPool = MessagePool_create("Sending", &sendPoolLimits, MSG_MAX_LEN);
+    pSession->pReceiveBuffer = malloc(MSG_MAX_LEN + 2);
+    bool isCreated = pSession->pSendQueue != NULL && pSession->pSendPool != NULL
+                     && pSession->pReceiveBuffer != NULL;
+    if (isCreated && pSession->isSanitizeEnabled) {
+        pSession->pSanitizedBuffer = malloc(SESSION_MAX_TEXT_LEN);
+        isCreated = pSession->pSanitizedBuffer != NULL;
+    }
+    if (isCreated && pSession->receiveFn == NULL) {
+        limits.maxBytes = SESSION_RECEIVE_MAX_BYTES;
+        pSession->pReceiveQueue = MessageQueue_create("Receiving", &limits);
+        pSession->pReceivePool = MessagePool_create("Receiving", &limits,
+                                                    pSession->isSanitizeEnabled
+                                                    ? SESSION_MAX_TEXT_LEN : MSG_MAX_LEN);
+        isCreated = pSession->pReceiveQueue != NULL && pSession->pReceivePool != NULL;
+    }
+    if (!isCreated) {
+        errno = ENOMEM;
+    }
+    return isCreated;
+}
+
+TwoTalkSession* TwoTalk_open(const TwoTalkConfig* pConfig)
+{
+    if (pConfig == NULL || pConfig->pRemoteHostname == NULL || pConfig->ourPort == 0
+        || pConfig->remotePort == 0 || pConfig->maxQueuedMessages > MESSAGE_QUEUE_MAX_MESSAGES) {
+        errno = EINVAL;
+        return NULL;
+    }
+    TwoTalkSession* pSession = calloc(1, sizeof(TwoTalkSession));
+    if (pSession == NULL) {
+        return NULL;
+    }
+    pSession->socketFd = -1;
+    pSession->stopEventFd = -1;
+    pSession->receiveEventFd = -1;
+    pSession->receiveFn = pConfig->receiveFn;
+    pSession->pUserData = pConfig->pUserData;
+    pSession->isSanitizeEnabled = !pConfig->isRawText;
+    pSession->maxQueuedMessages = pConfig->maxQueuedMessages != 0 ? pConfig->maxQueuedMessages
+                                                                  : MESSAGE_QUEUE_MAX_MESSAGES;
+    Wire_init(&pSession->wire, WIRE_MODE_AUTO);
+
+    bool isOpen = resolveRemote(pSession, pConfig->pRemoteHostname, pConfig->remotePort)
+                  && bindSocket(pSession, pConfig->ourPort)
+                  && createPipelines(pSession);
+    if (isOpen) {
+        pSession->stopEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        isOpen = pSession->stopEventFd != -1;
+    }
+    if (isOpen && pSession->receiveFn == NULL) {
+        pSession->receiveEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        isOpen = pSession->receiveEventFd != -1;
+    }
+    if (isOpen) {
+        int status = pthread_mutex_init(&pSession->syncSessionMutex, NULL);
+        pSession->isSyncInitialized = status == 0;
+        if (status == 0) {
+            status = pthread_create(&pSession->senderThread, NULL, runSender, pSession);
+            pSession->isSenderStarted = status == 0;
+        }
+        if (status == 0) {
+            status = pthread_create(&pSession->receiverThread, NULL, runReceiver, pSession);
+            pSession->isReceiverStarted = status == 0;
+        }
+        if (status != 0) {
+            errno = status;
+            isOpen = false;
+        }
+    }
+    if (!isOpen) {
+        int error = errno;
+        destroySession(pSession);
+        errno = error;
+        return NULL;
+    }
+    return pSession;
+}
+
+bool TwoTalk_submit(TwoTalkSession* pSession, const char* pText, size_t length,
+                    TwoTalkReleaseFn releaseFn, void* pReleaseArg)
+{
+    if (length > TWOTALK_MAX_MESSAGE_LEN) {
+        return false;
+    }
+    // What comes after the termination line isn't sent, as two-chat discards it.
+    size_t lengthThroughTerminationLine = findTerminationLine(pText, length);
+    bool isShutdownMessage = lengthThroughTerminationLine > 0;
+    if (isShutdownMessage) {
+        length = lengthThroughTerminationLine;
+    }
+
+    bool isQueued = false;
+    pthread_mutex_lock(&pSession->syncSessionMutex);
+    if (!pSession->isSubmitClosed && pSession->numUnsent < pSession->maxQueuedMessages) {
+        Message* pMessage = MessagePool_borrowText(pSession->pSendPool, pText, length,
+                                                   isShutdownMessage,
+                                                   releaseFn != NULL ? releaseFn : keepText,
+                                                   pReleaseArg);
+        // The queue isn't closed before isSubmitClosed is set, and has room for
+        // every unsent message, so it takes this one.
+        isQueued = pMessage != NULL && MessageQueue_put(pSession->pSendQueue, pMessage);
+        if (isQueued) {
+            pSession->numUnsent++;
+            pSession->isSubmitClosed = isShutdownMessage;
+        }
+    }
+    pthread_mutex_unlock(&pSession->syncSessionMutex);
+    return isQueued;
+}
+
+int TwoTalk_getReceiveFd(TwoTalkSession* pSession)
+{
+    return pSession->receiveEventFd;
+}
+
+const char* TwoTalk_receive(TwoTalkSession* pSession, size_t* pLength, bool* pIsShutdown)
+{
+    // The caller is done with the message taken last.
+    freeMessageFn(pSession->pTakenMessage);
+    pSession->pTakenMessage = NULL;
+    if (pSession->pReceiveQueue == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pSession->syncSessionMutex);
+    if (MessageQueue_hasMessages(pSession->pReceiveQueue)) {
+        // Taking a message leaves the thread not cancellable, as the pipeline's
+        // consumers are while they hold one, so the caller's state is put back.
+        int cancelState;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelState);
+        pSession->pTakenMessage = MessageQueue_take(pSession->pReceiveQueue);
+        pthread_setcancelstate(cancelState, NULL);
+        if (!MessageQueue_hasMessages(pSession->pReceiveQueue)) {
+            // Nothing is waiting anymore, so the fd stops being readable.
+            clearEventFd(pSession->receiveEventFd);
+        }
+    }
+    pthread_mutex_unlock(&pSession->syncSessionMutex);
+
+    Message* pMessage = pSession->pTakenMessage;
+    if (pMessage == NULL) {
+        return NULL;
+    }
+    *pLength = pMessage->length;
+    if (pIsShutdown != NULL) {
+        *pIsShutdown = pMessage->isShutdownMessage;
+    }
+    return pMessage->pText;
+}
+
+void TwoTalk_getStats(TwoTalkSession* pSession, TwoTalkStats* pStats)
+{
+    pthread_mutex_lock(&pSession->syncSessionMutex);
+    *pStats = pSession->stats;
+    pthread_mutex_unlock(&pSession->syncSessionMutex);
+}
+
+void TwoTalk_close(TwoTalkSession* pSession)
+{
+    if (pSession != NULL) {
+        destroySession(pSession);
+    }
+}
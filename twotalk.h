@@ -0,0 +1,120 @@
+#ifndef _TWOTALK_H
+#define _TWOTALK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+/*
+ * libtwotalk: two-chat sessions embedded in a program instead of run as a process.
+ *
+ * Each session owns its UDP socket, a sender thread and a receiver thread, and
+ * nothing is shared between sessions, so a program can open as many as it needs.
+ * A session runs the same message queues, pools, wire format and sanitizer as
+ * two-chat: it sends a hello when it opens and frames its messages once the peer
+ * answers, and takes plain text and frames alike. A line that is just "!" ends the
+ * conversation either way. Heartbeats are ignored, as are the optional formats
+ * (--fec, --dedup), which a session doesn't decode; the shared memory transport
+ * isn't offered, so a local two-chat peer falls back to UDP.
+ *
+ * Submitted text is sent straight from the caller's buffer, and received text is
+ * either handed to a callback straight from the receive buffer, or queued for the
+ * program to take when an eventfd it can poll becomes readable. Everything a session
+ * needs is allocated when it opens.
+ */
+
+// The largest message that fits in one UDP datagram.
+#define TWOTALK_MAX_MESSAGE_LEN 65507
+
+typedef struct TwoTalkSession_s TwoTalkSession;
+
+/*
+ * Called on the session's receiver thread for every message. pText is only valid
+ * until the callback returns, and isn't \0 terminated. Sanitized text can be up to
+ * 3 times as long as the message was. isShutdown is set for the message with the
+ * peer's termination line, which is the last one received.
+ */
+typedef void (*TwoTalkReceiveFn)(void* pUserData, const char* pText, size_t length,
+                                 bool isShutdown);
+
+/*
+ * Called once the session no longer needs a submitted buffer, after it was sent.
+ */
+typedef void (*TwoTalkReleaseFn)(void* pReleaseArg, const char* pText);
+
+typedef struct TwoTalkConfig_s TwoTalkConfig;
+struct TwoTalkConfig_s {
+    // Ports in host byte order.
+    in_port_t ourPort;
+    const char* pRemoteHostname;
+    in_port_t remotePort;
+    // NULL queues received messages for TwoTalk_receive instead.
+    TwoTalkReceiveFn receiveFn;
+    void* pUserData;
+    // Messages waiting to be sent, and received messages waiting to be taken.
+    // 0 uses the default of 500, which is also the most.
+    size_t maxQueuedMessages;
+    // Received text is passed on as it came, instead of made safe to write to a
+    // terminal as with --sanitize=off.
+    bool isRawText;
+};
+
+typedef struct TwoTalkStats_s TwoTalkStats;
+struct TwoTalkStats_s {
+    unsigned long numSent;
+    unsigned long numSendErrors;
+    unsigned long numReceived;
+    // Heartbeats, copies of frames and malformed ones, and datagrams in formats the
+    // session doesn't decode.
+    unsigned long numIgnored;
+    // Received messages dropped because the receive queue was full.
+    unsigned long numDropped;
+    // Received messages with characters the sanitizer replaced.
+    unsigned long numSanitized;
+};
+
+/*
+ * Binds the socket and starts the session's threads.
+ * Returns NULL with errno set if it can't: EINVAL for a bad config, ENOENT if the
+ * hostname has no IPv4 address, or the error of the call that failed.
+ */
+TwoTalkSession* TwoTalk_open(const TwoTalkConfig* pConfig);
+
+/*
+ * Queues the text to be sent as one message without copying it. The buffer must
+ * stay valid and unchanged until releaseFn is called with pReleaseArg; releaseFn
+ * can be NULL if the buffer outlives the session. If the text has the termination
+ * line, it is sent only up to the end of that line, as the session's last message.
+ * As in two-chat, it goes ahead of the messages still waiting to be sent, which the
+ * peer stops listening for.
+ * Returns false, without calling releaseFn, if the text is longer than
+ * TWOTALK_MAX_MESSAGE_LEN, the send queue is full, or the session is closing or has
+ * sent its termination line.
+ */
+bool TwoTalk_submit(TwoTalkSession* pSession, const char* pText, size_t length,
+                    TwoTalkReleaseFn releaseFn, void* pReleaseArg);
+
+/*
+ * An eventfd that is readable while received messages are waiting. Only for
+ * sessions without a receive callback; -1 otherwise. Don't read or close it.
+ */
+int TwoTalk_getReceiveFd(TwoTalkSession* pSession);
+
+/*
+ * Takes the oldest received message without blocking, though the termination
+ * message goes ahead of any still waiting, as in two-chat. The text is \0 terminated
+ * and stays valid until the next call or TwoTalk_close. pIsShutdown is set as for
+ * TwoTalkReceiveFn, and can be NULL.
+ * Returns NULL if no message is waiting.
+ */
+const char* TwoTalk_receive(TwoTalkSession* pSession, size_t* pLength, bool* pIsShutdown);
+
+void TwoTalk_getStats(TwoTalkSession* pSession, TwoTalkStats* pStats);
+
+/*
+ * Sends what was already submitted, stops the threads and frees the session.
+ * Must not be called from the receive callback.
+ */
+void TwoTalk_close(TwoTalkSession* pSession);
+
+#endif // _TWOTALK_H
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "wire.h"
+
+/*
+ * Layout of every frame:
+ *   0     \0
+ *   1     version
+ *   2     type in the high 4 bits, flags in the low 4 bits
+ *   3-    sequence number, varint
+ *         payload length, varint
+ *         the payload
+ * Varints are little-endian base 128: 7 bits per byte, with the top bit set on
+ * every byte but the last.
+ */
+
+#define WIRE_MAX_SEQUENCE_VARINT_LEN 10
+#define WIRE_MAX_LENGTH_VARINT_LEN 3
+
+static size_t getVarintLength(uint64_t value)
+{
+    size_t length = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        length++;
+    }
+    return length;
+}
+
+static void writeVarint(char* pOut, uint64_t value)
+{
+    while (value >= 0x80) {
+        *pOut++ = (char) ((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    *pOut = (char) value;
+}
+
+/*
+ * Reads a varint of at most maxLength bytes that ends before pEnd. Returns the
+ * byte after it, or NULL if it doesn't end in time.
+ */
+static const char* readVarint(const char* pIn, const char* pEnd, size_t maxLength,
+                              uint64_t* pValue)
+{
+    uint64_t value = 0;
+    size_t i;
+    for (i = 0; i < maxLength && pIn + i < pEnd; i++) {
+        uint8_t byte = (uint8_t) pIn[i];
+        value |= (uint64_t) (byte & 0x7f) << (7 * i);
+        if ((byte & 0x80) == 0) {
+            *pValue = value;
+            return pIn + i + 1;
+        }
+    }
+    return NULL;
+}
+
+static size_t writeHeader(char* pHeader, WireType type, unsigned int flags, uint64_t sequence,
+                          size_t payloadLength)
+{
+    pHeader[0] = '\0';
+    pHeader[1] = WIRE_VERSION;
+    pHeader[2] = (char) (((unsigned int) type << 4) | (flags & 0xf));
+    size_t sequenceLength = getVarintLength(sequence);
+    writeVarint(pHeader + 3, sequence);
+    writeVarint(pHeader + 3 + sequenceLength, payloadLength);
+    return 3 + sequenceLength + getVarintLength(payloadLength);
+}
+
+void Wire_init(Wire* pWire, WireMode mode)
+{
+    memset(pWire, 0, sizeof(Wire));
+    pWire->mode = mode;
+    atomic_init(&pWire->isSendingFramed, mode == WIRE_MODE_FRAMED);
+    atomic_init(&pWire->nextSequence, 0);
+}
+
+bool Wire_isSendingFramed(Wire* pWire)
+{
+    return atomic_load_explicit(&pWire->isSendingFramed, memory_order_relaxed);
+}
+
+bool Wire_isHelloEnabled(Wire* pWire)
+{
+    return pWire->mode != WIRE_MODE_LEGACY;
+}
+
+bool Wire_isFramedDatagram(const char* pDatagram, size_t length)
+{
+    // Any version is taken as a frame here, so that a newer one is dropped
+    // instead of shown as text.
+    return length >= 3 && pDatagram[0] == '\0' && pDatagram[1] >= 1 && pDatagram[1] <= 9;
+}
+
+bool Wire_isProbeDatagram(const char* pDatagram, size_t length)
+{
+    if (length < 3 || pDatagram[0] != '\0' || pDatagram[1] != WIRE_VERSION) {
+        return false;
+    }
+    unsigned int type = (uint8_t) pDatagram[2] >> 4;
+    return type == WIRE_TYPE_PING || type == WIRE_TYPE_PONG;
+}
+
+char* WireEncoder_prependHeader(Wire* pWire, char* pPayload, size_t payloadLength,
+                                WireType type, unsigned int flags)
+{
+    uint64_t sequence = atomic_fetch_add_explicit(&pWire->nextSequence, 1, memory_order_relaxed);
+    size_t headerLength = 3 + getVarintLength(sequence) + getVarintLength(payloadLength);
+    char* pFrame = pPayload - headerLength;
+    writeHeader(pFrame, type, flags, sequence, payloadLength);
+    pWire->numFramesSent++;
+    return pFrame;
+}
+
+size_t WireEncoder_writeHello(Wire* pWire, char* pDatagram, bool isReply)
+{
+    uint64_t sequence = atomic_load_explicit(&pWire->nextSequence, memory_order_relaxed);
+    return writeHeader(pDatagram, WIRE_TYPE_HELLO, isReply ? WIRE_FLAG_REPLY : 0, sequence, 0);
+}
+
+size_t WireEncoder_writeControl(char* pDatagram, WireType type, uint64_t sequence,
+                                const char* pPayload, size_t payloadLength)
+{
+    size_t headerLength = writeHeader(pDatagram, type, 0, sequence, payloadLength);
+    memcpy(pDatagram + headerLength, pPayload, payloadLength);
+    return headerLength + payloadLength;
+}
+
+static void startWindow(Wire* pWire, uint64_t sequence)
+{
+    memset(pWire->windowBits, 0, sizeof(pWire->windowBits));
+    pWire->windowEnd = sequence;
+    pWire->hasWindow = true;
+}
+
+/*
+ * Marks the sequence number as received. Numbers skipped over are counted as
+ * missing until they turn up late. Returns false if it was already received.
+ */
+static bool trackSequence(Wire* pWire, uint64_t sequence)
+{
+    if (!pWire->hasWindow) {
+        startWindow(pWire, sequence);
+    } else if (sequence < pWire->windowEnd && pWire->windowEnd - sequence > WIRE_DUPLICATE_WINDOW) {
+        // Too far back to be a late copy: the peer restarted and its hello was lost,
+        // so its sequence starts over here.
+        pWire->numRestarts++;
+        startWindow(pWire, sequence);
+    }
+    bool isNewest = sequence >= pWire->windowEnd;
+    if (isNewest) {
+        pWire->numMissing += (unsigned long) (sequence - pWire->windowEnd);
+        // The numbers slid out of the window make room for the ones slid in.
+        if (sequence - pWire->windowEnd >= WIRE_DUPLICATE_WINDOW) {
+            memset(pWire->windowBits, 0, sizeof(pWire->windowBits));
+        } else {
+            uint64_t i;
+            for (i = pWire->windowEnd; i < sequence; i++) {
+                pWire->windowBits[i / 64 % WIRE_WINDOW_WORDS] &= ~(1ULL << (i % 64));
+            }
+        }
+        pWire->windowEnd = sequence + 1;
+    }
+    uint64_t* pWord = &pWire->windowBits[sequence / 64 % WIRE_WINDOW_WORDS];
+    uint64_t bit = 1ULL << (sequence % 64);
+    if (!isNewest) {
+        if (*pWord & bit) {
+            pWire->numDuplicates++;
+            return false;
+        }
+        pWire->numLate++;
+        if (pWire->numMissing > 0) {
+            pWire->numMissing--;
+        }
+    }
+    *pWord |= bit;
+    return true;
+}
+
+bool WireDecoder_receive(Wire* pWire, const char* pDatagram, size_t length, WireFrame* pFrame)
+{
+    if (pDatagram[1] != WIRE_VERSION) {
+        pWire->numNewerVersion++;
+        return false;
+    }
+    const char* pEnd = pDatagram + length;
+    uint64_t payloadLength;
+    const char* pIn = readVarint(pDatagram + 3, pEnd, WIRE_MAX_SEQUENCE_VARINT_LEN, &pFrame->sequence);
+    if (pIn != NULL) {
+        pIn = readVarint(pIn, pEnd, WIRE_MAX_LENGTH_VARINT_LEN, &payloadLength);
+    }
+    unsigned int type = (uint8_t) pDatagram[2] >> 4;
+    if (pIn == NULL || payloadLength != (uint64_t) (pEnd - pIn) || type > WIRE_TYPE_PONG) {
+        pWire->numMalformed++;
+        return false;
+    }
+    pFrame->type = (WireType) type;
+    pFrame->flags = (uint8_t) pDatagram[2] & 0xf;
+    pFrame->pPayload = pIn;
+    pFrame->payloadLength = (size_t) payloadLength;
+
+    if (pWire->mode == WIRE_MODE_AUTO) {
+        atomic_store_explicit(&pWire->isSendingFramed, true, memory_order_relaxed);
+    }
+    switch (pFrame->type) {
+        case WIRE_TYPE_TEXT:
+        case WIRE_TYPE_DEDUP:
+            pWire->numFramesReceived++;
+            return trackSequence(pWire, pFrame->sequence);
+        case WIRE_TYPE_HELLO:
+            pWire->numHellosReceived++;
+            // A peer that (re)started sends its hello before any message, so its
+            // sequence starts over there. An answer may come after messages that
+            // were sent after it, so it only starts the window if there is none.
+            if (!(pFrame->flags & WIRE_FLAG_REPLY) || !pWire->hasWindow) {
+                startWindow(pWire, pFrame->sequence);
+            }
+            return true;
+        default:
+            return true;
+    }
+}
+
+void Wire_printStats(Wire* pWire)
+{
+    if (pWire->numFramesSent > 0) {
+        printf("Wire: %lu frames sent\n", pWire->numFramesSent);
+    }
+    if (pWire->numFramesReceived == 0 && pWire->numHellosReceived == 0
+        && pWire->numMalformed == 0 && pWire->numNewerVersion == 0) {
+        return;
+    }
+    printf("Wire: %lu frames and %lu hellos received, %lu missing, %lu late",
+           pWire->numFramesReceived, pWire->numHellosReceived, pWire->numMissing, pWire->numLate);
+    if (pWire->numDuplicates > 0) {
+        printf(", %lu duplicates dropped", pWire->numDuplicates);
+    }
+    if (pWire->numRestarts > 0) {
+        printf(", %lu restarts without a hello", pWire->numRestarts);
+    }
+    if (pWire->numMalformed > 0) {
+        printf(", %lu malformed", pWire->numMalformed);
+    }
+    if (pWire->numNewerVersion > 0) {
+        printf(", %lu from a newer version", pWire->numNewerVersion);
+    }
+    printf("\n");
+}
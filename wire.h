@@ -0,0 +1,157 @@
+#ifndef _WIRE_H
+#define _WIRE_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "message.h"
+
+/*
+ * Framed wire format: a small versioned header in front of each message sent over
+ * UDP, so that the listener knows what a datagram holds without looking at the text.
+ *
+ * A frame starts with a \0 byte and the format version, which tells it apart from
+ * plain text (never starts with \0) and from FEC and dedup datagrams (a letter after
+ * the \0). Then come the frame type and flags in one byte, and the sequence number
+ * and payload length as varints, so the header of a short message is 5 bytes. The
+ * shutdown flag replaces the scan of every payload for the termination line, and
+ * the listener drops copies of a frame it already has by their sequence numbers.
+ *
+ * Peers from before frames only send plain text, so by default a peer sends a hello
+ * frame when it starts and only frames its messages once it hears a frame back.
+ * Decoding is always on, and plain text datagrams are always accepted.
+ *
+ * The state of both directions is kept in a Wire, which the sender and the listener
+ * of one peer share: two-chat has one, and each libtwotalk session its own.
+ */
+
+#define WIRE_VERSION 1
+// \0, version, type and flags, then up to 10 bytes of sequence and 3 of length.
+#define WIRE_MAX_HEADER_LEN 16
+// Longer messages are sent as plain text.
+#define WIRE_MAX_PAYLOAD_LEN (MSG_MAX_LEN - WIRE_MAX_HEADER_LEN)
+// Most payload a ping can have for its pong to echo.
+#define WIRE_MAX_PING_PAYLOAD_LEN 16
+// Sequence numbers remembered to drop copies of a frame, such as the ones sent on
+// the other paths with --multipath. A frame further back than that means the peer
+// restarted without its hello getting through, and starts the window over.
+#define WIRE_DUPLICATE_WINDOW 1024
+#define WIRE_WINDOW_WORDS (WIRE_DUPLICATE_WINDOW / 64)
+
+// The message is the termination line.
+#define WIRE_FLAG_SHUTDOWN 0x1
+// A hello sent in answer to the peer's hello, which isn't answered again.
+#define WIRE_FLAG_REPLY 0x2
+
+typedef enum {
+    WIRE_MODE_AUTO,
+    WIRE_MODE_LEGACY,
+    WIRE_MODE_FRAMED
+} WireMode;
+
+typedef enum {
+    // The payload is the text of a message.
+    WIRE_TYPE_TEXT,
+    // The payload is a dedup datagram.
+    WIRE_TYPE_DEDUP,
+    // No payload. The peer speaks frames, and its sequence starts here.
+    WIRE_TYPE_HELLO,
+    // Asks the peer to send the payload back in a pong. Its sequence number is
+    // its own, apart from the sequence of the messages.
+    WIRE_TYPE_PING,
+    WIRE_TYPE_PONG
+} WireType;
+
+typedef struct WireFrame_s WireFrame;
+struct WireFrame_s {
+    WireType type;
+    unsigned int flags;
+    uint64_t sequence;
+    // Points into the datagram the frame was parsed from.
+    const char* pPayload;
+    size_t payloadLength;
+};
+
+typedef struct Wire_s Wire;
+struct Wire_s {
+    WireMode mode;
+    // Set by the listener when the peer turns out to speak frames.
+    atomic_bool isSendingFramed;
+    // Read by the listener when it answers a hello.
+    atomic_uint_fast64_t nextSequence;
+
+    // Only written by the sender.
+    unsigned long numFramesSent;
+
+    // Only written by the listener. The window covers the WIRE_DUPLICATE_WINDOW
+    // sequence numbers before windowEnd, with a bit set for each one received.
+    bool hasWindow;
+    uint64_t windowEnd;
+    uint64_t windowBits[WIRE_WINDOW_WORDS];
+    unsigned long numFramesReceived;
+    unsigned long numHellosReceived;
+    unsigned long numMissing;
+    unsigned long numLate;
+    unsigned long numDuplicates;
+    unsigned long numRestarts;
+    unsigned long numMalformed;
+    unsigned long numNewerVersion;
+};
+
+void Wire_init(Wire* pWire, WireMode mode);
+
+/*
+ * Returns true if messages should go out as frames: always with --wire=framed,
+ * never with --wire=legacy, and once the peer has sent a frame otherwise.
+ */
+bool Wire_isSendingFramed(Wire* pWire);
+
+/*
+ * Returns true unless frames are turned off, in which case no hello is sent either.
+ */
+bool Wire_isHelloEnabled(Wire* pWire);
+
+bool Wire_isFramedDatagram(const char* pDatagram, size_t length);
+
+/*
+ * Returns true if the datagram is a ping or a pong frame.
+ */
+bool Wire_isProbeDatagram(const char* pDatagram, size_t length);
+
+/*
+ * Writes the header of a frame right in front of its payload, which must have
+ * WIRE_MAX_HEADER_LEN bytes of room before it, and gives it the next sequence
+ * number. Returns where the frame starts; it ends where the payload does.
+ * Only called by the sender.
+ */
+char* WireEncoder_prependHeader(Wire* pWire, char* pPayload, size_t payloadLength,
+                                WireType type, unsigned int flags);
+
+/*
+ * Writes a hello frame into pDatagram, which must have room for WIRE_MAX_HEADER_LEN
+ * bytes. It carries the next sequence number without using it up.
+ * Returns the length of the frame.
+ */
+size_t WireEncoder_writeHello(Wire* pWire, char* pDatagram, bool isReply);
+
+/*
+ * Writes a frame with the given sequence number and payload into pDatagram, which
+ * must have room for WIRE_MAX_HEADER_LEN bytes more than the payload. Used for
+ * pings and pongs, which don't take part in the sequence of the messages.
+ * Returns the length of the frame.
+ */
+size_t WireEncoder_writeControl(char* pDatagram, WireType type, uint64_t sequence,
+                                const char* pPayload, size_t payloadLength);
+
+/*
+ * Parses the frame header in place and counts the peer's sequence numbers, and in
+ * the default mode switches the sender to frames. Returns false if the frame should
+ * be dropped: it is malformed, from a newer version, or a copy of one already
+ * received. Only called by the listener.
+ */
+bool WireDecoder_receive(Wire* pWire, const char* pDatagram, size_t length, WireFrame* pFrame);
+
+void Wire_printStats(Wire* pWire);
+
+#endif // _WIRE_H